@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+
+namespace synxpo {
+
+enum class BackupMethod {
+    kRename,     // the file itself was moved into the store
+    kHardlink,   // a second name for the same inode
+    kReflink,    // copy-on-write clone sharing the original blocks
+    kCopyRange,  // in-kernel copy_file_range()
+    kCopy,       // read()/write()
+};
+
+const char* BackupMethodName(BackupMethod method);
+
+// A saved version of a file, kept until it is restored or released
+struct Backup {
+    std::string path;  // relative to the synchronized directory
+    std::filesystem::path location;
+    BackupMethod method = BackupMethod::kCopy;
+    uint64_t size = 0;
+};
+
+struct BackupStoreStats {
+    uint64_t renames = 0;
+    uint64_t hardlinks = 0;
+    uint64_t reflinks = 0;
+    uint64_t range_copies = 0;
+    uint64_t plain_copies = 0;
+    // Bytes that had to be copied; renames, links and reflinks copy none
+    uint64_t bytes_copied = 0;
+    uint64_t restores = 0;
+    uint64_t releases = 0;
+};
+
+// The "safe place" of the spec for one synchronized directory. Backups are
+// made as cheaply as the situation allows:
+//   - Take() renames a file that is about to be deleted into the store;
+//   - Preserve() hardlinks a file that is about to be replaced by a rename,
+//     since the replacement gets a new inode and leaves this one intact;
+//   - Snapshot() clones a file that stays in place and may be modified, with
+//     a FICLONE reflink on btrfs/XFS and copy_file_range() elsewhere.
+// The first three cost O(1) when the store is on the same filesystem as the
+// directory; otherwise every method falls back to copying.
+class BackupStore {
+public:
+    // Backups of `root` are kept in `path`, created if needed. Leftovers of a
+    // previous run are removed: backups only have to survive an operation.
+    static absl::StatusOr<std::unique_ptr<BackupStore>> Open(
+        const std::filesystem::path& path, const std::filesystem::path& root);
+
+    BackupStore(const BackupStore&) = delete;
+    BackupStore& operator=(const BackupStore&) = delete;
+
+    absl::StatusOr<Backup> Snapshot(const std::string& path);
+    // Only for files replaced by rename: an in-place write to the original
+    // would change the backup too
+    absl::StatusOr<Backup> Preserve(const std::string& path);
+    // Removes the file from the synchronized directory
+    absl::StatusOr<Backup> Take(const std::string& path);
+
+    // Put the backup back in place of whatever is at its path now
+    absl::Status Restore(const Backup& backup);
+    // Drop a backup that is no longer needed for rollback
+    absl::Status Release(const Backup& backup);
+
+    BackupStoreStats GetStats() const;
+
+private:
+    BackupStore(std::filesystem::path path, std::filesystem::path root);
+
+    std::filesystem::path NextLocation(const std::string& path);
+    absl::StatusOr<Backup> Copy(const std::string& path);
+    absl::Status CopyContent(int from, int to, Backup& backup);
+    void Count(BackupMethod method, uint64_t bytes_copied);
+
+    std::filesystem::path path_;
+    std::filesystem::path root_;
+    std::atomic<uint64_t> next_id_{0};
+    // Cleared after the first failure that means "never on this filesystem"
+    std::atomic<bool> reflink_supported_{true};
+    std::atomic<bool> copy_range_supported_{true};
+
+    mutable std::mutex stats_mutex_;
+    BackupStoreStats stats_;
+};
+
+}  // namespace synxpo
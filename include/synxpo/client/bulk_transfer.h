@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+
+#include <grpcpp/grpcpp.h>
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+
+#include "synxpo.grpc.pb.h"
+#include "synxpo/client/file_write_sink.h"
+#include "synxpo/client/rate_limiter.h"
+#include "synxpo/client/raw_stream.h"
+#include "synxpo/common/compression.h"
+
+namespace synxpo {
+
+// One BulkTransfer call carrying the content of a single upload or download.
+// The server names the transfer in VERSION_INCREASE_ALLOW or
+// FILE_CONTENT_REQUEST_ALLOW; replies such as VERSION_INCREASED still arrive
+// on the control stream. Created by GRPCClient::OpenBulkTransfer and must not
+// outlive the client.
+class BulkTransfer {
+public:
+    ~BulkTransfer();
+
+    BulkTransfer(const BulkTransfer&) = delete;
+    BulkTransfer& operator=(const BulkTransfer&) = delete;
+
+    const std::string& GetTransferId() const { return transfer_id_; }
+
+    // Upload side. Chunks share the client's upload gate and rate limit
+    // with the control stream; `reclaim` works as in
+    // GRPCClient::WriteFileChunk.
+    absl::Status WriteFileChunk(FileChunk chunk, std::string* reclaim = nullptr);
+    absl::Status WriteFileDelta(FileDelta delta);
+    // Send FILE_WRITE_END and half-close the call
+    absl::Status WriteFileEnd();
+
+    // Download side. Returns the next chunk, or nullopt once FILE_WRITE_END arrived.
+    absl::StatusOr<std::optional<FileChunk>> ReadFileChunk();
+
+    // Download side. Writes every chunk straight into the descriptor `sink`
+    // gives for it until FILE_WRITE_END; chunks without a descriptor are
+    // dropped, as the sink already knows it has no file for them.
+    absl::Status ReceiveInto(FileWriteSink& sink);
+
+    // Wait for the server to close the call and return its status
+    absl::Status Finish();
+
+    // Abort the call; blocked reads and writes return with an error
+    void Cancel();
+
+    uint64_t GetBytesSent() const { return bytes_sent_.load(std::memory_order_relaxed); }
+    uint64_t GetBytesReceived() const { return bytes_received_.load(std::memory_order_relaxed); }
+
+private:
+    friend class GRPCClient;
+
+    // `on_write_end` runs as FILE_WRITE_END is sent, so the client can time
+    // the reply that arrives on the control stream
+    BulkTransfer(std::shared_ptr<grpc::Channel> channel, std::string transfer_id,
+                 RateLimiter* upload_limiter, RateLimiter* download_limiter,
+                 CompressionPolicy* compression_policy,
+                 std::function<void()> on_write_end);
+
+    // Start the call and send BulkOpen
+    absl::Status Open(grpc_compression_algorithm algorithm);
+
+    // Read one message as raw slices; false at end of stream
+    bool ReadRaw(std::vector<grpc::Slice>* slices);
+
+    std::shared_ptr<grpc::Channel> channel_;
+    std::string transfer_id_;
+    RateLimiter* upload_limiter_;
+    RateLimiter* download_limiter_;
+    CompressionPolicy* compression_policy_;
+    std::function<void()> on_write_end_;
+
+    grpc::ClientContext context_;
+    // Replies are read as raw buffers, like the control stream, so downloads
+    // can be written to disk without parsing them into messages
+    std::unique_ptr<RawStream<BulkMessage>> stream_;
+    std::mutex write_mutex_;
+    bool writes_done_ = false;
+    bool finished_ = false;
+
+    std::atomic<uint64_t> bytes_sent_{0};
+    std::atomic<uint64_t> bytes_received_{0};
+};
+
+}  // namespace synxpo
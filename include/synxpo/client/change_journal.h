@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+
+#include "synxpo.pb.h"
+
+namespace synxpo {
+
+// The latest local change of one path not yet confirmed by the server
+struct JournalEntry {
+    std::string path;
+    std::string id;  // empty for files the server has not seen
+    FileType type = FileType::FILE;
+    bool deleted = false;
+    bool content_changed = false;
+    uint64_t first_try_time = 0;
+    // From Reserve, or assigned by Put when 0
+    uint64_t sequence = 0;
+};
+
+struct ChangeJournalOptions {
+    // Appends are written at once, so a crash of the client loses nothing;
+    // they are synced to disk at most this often, so a crash of the machine
+    // loses at most this much
+    std::chrono::milliseconds sync_interval{1000};
+    // The file is rewritten with only the live entries once it is this many
+    // times their size and at least compact_min_bytes
+    size_t compact_ratio = 4;
+    uint64_t compact_min_bytes = 1024 * 1024;
+};
+
+struct ChangeJournalStats {
+    size_t entries = 0;
+    uint64_t file_bytes = 0;
+    uint64_t appends = 0;
+    uint64_t compactions = 0;
+    // Records read when the journal was opened
+    uint64_t replayed = 0;
+};
+
+// Append-only log of local changes waiting for the upload engine, so that
+// changes made while the server is unreachable survive a restart and do
+// not have to be found again by scanning. Every record replaces the
+// previous one of its path, and the file is compacted to one record per
+// path, so after any outage it is as large as the number of distinct files
+// changed.
+class ChangeJournal {
+public:
+    static absl::StatusOr<std::unique_ptr<ChangeJournal>> Open(
+        const std::filesystem::path& file, ChangeJournalOptions options = {});
+
+    // Syncs the file
+    ~ChangeJournal();
+
+    ChangeJournal(const ChangeJournal&) = delete;
+    ChangeJournal& operator=(const ChangeJournal&) = delete;
+
+    // Live entries, in no particular order
+    std::vector<JournalEntry> Entries() const;
+
+    // Number a change without touching the file, so callers can do it under
+    // their own lock and Put the entry later. Puts of one path must come in
+    // the order of their numbers.
+    uint64_t Reserve();
+
+    // Record the latest change of `entry.path`; returns its sequence number.
+    // Fails for good once a compaction could not make its file durable.
+    absl::StatusOr<uint64_t> Put(JournalEntry entry);
+    // Forget the change of `path` if it is still the one numbered `sequence`;
+    // a newer change of the path stays
+    absl::Status Remove(const std::string& path, uint64_t sequence);
+
+    absl::Status Sync();
+
+    ChangeJournalStats GetStats() const;
+
+private:
+    ChangeJournal(std::filesystem::path file, ChangeJournalOptions options);
+
+    absl::Status Replay();
+    // Callers hold mutex_
+    absl::Status Append(const std::string& record);
+    absl::Status MaybeCompact();
+    absl::Status SyncLocked();
+    absl::Status BrokenError() const;
+
+    const std::filesystem::path file_;
+    const ChangeJournalOptions options_;
+
+    mutable std::mutex mutex_;
+    int fd_ = -1;
+    std::unordered_map<std::string, JournalEntry> entries_;
+    // Size of the records a compacted file would hold
+    uint64_t live_bytes_ = 0;
+    uint64_t file_bytes_ = 0;
+    std::atomic<uint64_t> next_sequence_{1};
+    bool dirty_ = false;
+    // Set when appends can no longer be made durable
+    bool broken_ = false;
+    std::chrono::steady_clock::time_point last_sync_;
+    ChangeJournalStats stats_;
+};
+
+}  // namespace synxpo
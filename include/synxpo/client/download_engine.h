@@ -0,0 +1,145 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+
+#include "synxpo.pb.h"
+#include "synxpo/client/file_write_sink.h"
+#include "synxpo/client/transfer_scheduler.h"
+
+namespace synxpo {
+
+// A file the next FILE_WRITE stream is expected to carry
+struct DownloadTarget {
+    std::string id;
+    std::string path;   // relative to the synchronized directory
+    uint64_t size = 0;  // expected size, used to preallocate; 0 if unknown
+};
+
+struct DownloadEngineOptions {
+    // Reserve the expected size up front so the file is laid out contiguously
+    // and writes never fail half way with ENOSPC
+    bool preallocate = true;
+    // Transfers with at least this many files are made durable with one
+    // syncfs(); smaller ones fdatasync() each file
+    size_t syncfs_min_files = 16;
+};
+
+struct DownloadEngineStats {
+    uint64_t transfers = 0;
+    uint64_t aborted_transfers = 0;
+    uint64_t files_committed = 0;
+    uint64_t chunks = 0;
+    uint64_t bytes_written = 0;
+    // Chunks for files that were not part of the transfer
+    uint64_t unknown_chunks = 0;
+    uint64_t syncfs_calls = 0;
+    uint64_t fdatasync_calls = 0;
+    std::chrono::microseconds commit_time{0};
+};
+
+// Applies downloaded content of one synchronized directory. Each file of a
+// transfer is written into a temporary file next to its target and renamed
+// over it only once the whole transfer has arrived and reached the disk, so
+// a crash leaves either the old or the new version, never a mix.
+//
+// Install it with GRPCClient::SetFileWriteSink for its directory so chunks
+// are written straight from the receive buffer; chunks that still arrive as
+// messages go through Write().
+class DownloadEngine : public FileWriteSink {
+public:
+    DownloadEngine(std::filesystem::path root, std::string directory_id,
+                   DownloadEngineOptions options = {});
+    // Drops an unfinished transfer
+    ~DownloadEngine() override;
+
+    DownloadEngine(const DownloadEngine&) = delete;
+    DownloadEngine& operator=(const DownloadEngine&) = delete;
+
+    // Create the temporary files of a transfer. Call before sending
+    // REQUEST_FILE_CONTENT so no chunk arrives before its file is ready.
+    // With a scheduler this first waits for a slot, held until Commit() or
+    // Abort().
+    absl::Status Begin(const std::vector<DownloadTarget>& targets);
+
+    int TargetFd(const FileChunkHeader& header) override;
+    void OnChunkWritten(const FileChunkHeader& header, const absl::Status& status) override;
+
+    absl::Status Write(const FileChunk& chunk);
+
+    // On FILE_WRITE_END: make the data durable, rename every file into place
+    // and sync the directories. Returns the ids of the committed files.
+    absl::StatusOr<std::vector<std::string>> Commit();
+
+    // Remove the temporary files, e.g. when FILE_WRITE stalled for 30 seconds.
+    // Waits for chunks being written, like Commit().
+    void Abort();
+
+    bool Active() const;
+
+    // Downloads are classified by their total size; the server sends no
+    // modification times
+    void SetScheduler(TransferScheduler* scheduler);
+
+    // Delete temporary files a crash left behind; returns how many
+    size_t RemoveStaleTemporaryFiles();
+
+    DownloadEngineStats GetStats() const;
+
+private:
+    struct File {
+        DownloadTarget target;
+        int fd = -1;
+        int dir_fd = -1;
+        std::string temp_name;
+        std::string name;
+        // Replacing an existing file; otherwise a file created locally in the
+        // meantime is not overwritten
+        bool replace = false;
+        bool received = false;
+        uint64_t written_end = 0;
+    };
+
+    absl::Status Prepare(File& file);
+    // Also ends the write TargetFd started
+    absl::Status NoteWritten(const std::string& id, uint64_t offset, size_t size,
+                             const absl::Status& status);
+    void WaitForWritesLocked(std::unique_lock<std::mutex>& lock);
+    absl::Status SyncData();
+    absl::Status SyncDirectories();
+    // Closes everything and removes temporary files that were not renamed
+    void CloseLocked();
+    int DirectoryFd(const std::filesystem::path& directory);
+
+    std::filesystem::path root_;
+    std::string directory_id_;
+    DownloadEngineOptions options_;
+
+    mutable std::mutex mutex_;
+    std::vector<File> files_;
+    std::unordered_map<std::string, size_t> by_id_;
+    // One descriptor per directory touched by the transfer
+    std::unordered_map<std::string, int> dir_fds_;
+    absl::Status error_;
+    // Descriptors handed out by TargetFd and not yet written; they stay open
+    // until NoteWritten
+    size_t writing_ = 0;
+    std::condition_variable written_cv_;
+    bool active_ = false;
+    TransferScheduler* scheduler_ = nullptr;
+    TransferScheduler::Ticket ticket_;
+
+    DownloadEngineStats stats_;
+};
+
+}  // namespace synxpo
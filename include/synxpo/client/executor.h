@@ -0,0 +1,80 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+namespace synxpo {
+
+// Small fixed-size thread pool with delayed tasks. Coroutines awaiting
+// GRPCClient operations are resumed here instead of blocking a thread each.
+class Executor {
+public:
+    explicit Executor(size_t thread_count = 4);
+    ~Executor();
+
+    Executor(const Executor&) = delete;
+    Executor& operator=(const Executor&) = delete;
+    Executor(Executor&&) = delete;
+    Executor& operator=(Executor&&) = delete;
+
+    // Identifies a delayed task for Cancel()
+    struct TimerId {
+        std::chrono::steady_clock::time_point deadline;
+        uint64_t sequence = 0;
+    };
+
+    // Once Shutdown() has begun, tasks run on the calling thread instead
+    // (delayed ones without the delay), so a coroutine waiting to be resumed
+    // is never lost
+    void Post(std::function<void()> task);
+    TimerId PostAfter(std::chrono::steady_clock::duration delay, std::function<void()> task);
+
+    // Drop a delayed task that is still waiting for its deadline. Returns
+    // false if it already ran or is about to.
+    bool Cancel(const TimerId& timer);
+
+    // Run every queued task, delayed ones at once, and join all threads
+    void Shutdown();
+
+    // `co_await executor.Schedule();` continues the coroutine on this executor
+    auto Schedule() {
+        struct ScheduleAwaitable {
+            Executor* executor;
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> handle) {
+                executor->Post([handle]() { handle.resume(); });
+            }
+            void await_resume() const noexcept {}
+        };
+        return ScheduleAwaitable{this};
+    }
+
+private:
+    void WorkerLoop();
+    void TimerLoop();
+
+    std::vector<std::thread> workers_;
+    std::queue<std::function<void()>> tasks_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopping_ = false;
+
+    std::thread timer_thread_;
+    // By deadline, then in the order they were posted
+    std::map<std::pair<std::chrono::steady_clock::time_point, uint64_t>, std::function<void()>>
+        timers_;
+    uint64_t timer_sequence_ = 1;
+    std::mutex timer_mutex_;
+    std::condition_variable timer_cv_;
+};
+
+}  // namespace synxpo
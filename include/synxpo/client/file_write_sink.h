@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <grpcpp/support/slice.h>
+#include <absl/status/status.h>
+
+namespace synxpo {
+
+// FileChunk fields of a FileWrite, everything except the payload
+struct FileChunkHeader {
+    std::string id;
+    std::string directory_id;
+    uint64_t offset = 0;
+    size_t size = 0;
+};
+
+// Receives downloaded FileWrite chunks straight from the gRPC receive buffer.
+// Chunks accepted by the sink are written with pwritev() at chunk.offset and
+// never reach the message callback; everything else takes the normal path.
+// Both methods run on a receive thread, so they should be quick.
+class FileWriteSink {
+public:
+    virtual ~FileWriteSink() = default;
+
+    // Descriptor to write this chunk into, or -1 to deliver it as a ServerMessage
+    virtual int TargetFd(const FileChunkHeader& header) = 0;
+
+    // Called once the chunk has been written, or with the error that stopped
+    // it; exactly once for every descriptor TargetFd returned, and only then
+    virtual void OnChunkWritten(const FileChunkHeader& header, const absl::Status& status) = 0;
+};
+
+// Location of FileWrite.chunk.data inside a serialized ServerMessage
+struct RawFileChunk {
+    FileChunkHeader header;
+    size_t data_slice = 0;
+    size_t data_offset = 0;
+};
+
+// Parse just enough of a serialized ServerMessage (or BulkMessage, which
+// numbers its fields the same) to tell whether it is a FileWrite and where
+// its payload lives. Returns nullopt for any other
+// message, or for one the fast path does not handle.
+std::optional<RawFileChunk> ParseRawFileWrite(const std::vector<grpc::Slice>& slices);
+
+// Write the chunk payload to `fd` at header.offset without copying it
+absl::Status WriteRawFileChunk(int fd, const std::vector<grpc::Slice>& slices,
+                               const RawFileChunk& chunk);
+
+}  // namespace synxpo
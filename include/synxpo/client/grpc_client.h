@@ -1,15 +1,21 @@
 #pragma once
 
+#include <array>
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <coroutine>
+#include <deque>
 #include <functional>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <optional>
 #include <queue>
+#include <set>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include <grpcpp/grpcpp.h>
@@ -17,12 +23,134 @@
 #include <absl/status/statusor.h>
 
 #include "synxpo.grpc.pb.h"
+#include "synxpo/common/compression.h"
+#include "synxpo/client/bulk_transfer.h"
+#include "synxpo/client/executor.h"
+#include "synxpo/client/file_write_sink.h"
+#include "synxpo/client/latency_histogram.h"
+#include "synxpo/client/message_dispatcher.h"
+#include "synxpo/client/rate_limiter.h"
+#include "synxpo/client/raw_stream.h"
+#include "synxpo/client/throughput_meter.h"
 
 namespace synxpo {
 
+struct WriteCoalescingOptions {
+    bool enabled = true;
+    // Messages larger than this are never buffered
+    size_t max_message_bytes = 4 * 1024;
+    // Flush as soon as this many bytes are buffered
+    size_t flush_threshold_bytes = 64 * 1024;
+    // Flush when no new message has been buffered for this long
+    std::chrono::microseconds idle_flush_delay{200};
+    // Upper bound on how long a message may stay in the buffer
+    std::chrono::microseconds max_flush_delay{2000};
+};
+
+struct ReconnectOptions {
+    bool enabled = true;
+    std::chrono::milliseconds initial_backoff{250};
+    std::chrono::milliseconds max_backoff{15000};
+    double backoff_multiplier = 2.0;
+    // Each delay is randomized by +-jitter (fraction of the delay)
+    double jitter = 0.2;
+    std::chrono::milliseconds connect_timeout{5000};
+    // HTTP/2 keepalive pings detect a dead peer without waiting for TCP timeouts
+    std::chrono::milliseconds keepalive_time{10000};
+    std::chrono::milliseconds keepalive_timeout{5000};
+};
+
+// Limits on server messages received but not yet handed to the message
+// callback. Once either is reached the client stops reading from the stream.
+struct CallbackQueueOptions {
+    size_t max_messages = 1024;
+    size_t max_bytes = 64 * 1024 * 1024;
+};
+
+struct GRPCClientOptions {
+    WriteCoalescingOptions write_coalescing;
+    ReconnectOptions reconnect;
+    // Caps on file content sent and received over all connections, shared
+    // between directories by weight; 0 is unlimited. Can be changed later
+    // with SetRateLimits().
+    uint64_t upload_bytes_per_second = 0;
+    uint64_t download_bytes_per_second = 0;
+    // Number of independent channels (TCP connections) with one stream each.
+    // Every directory is pinned to one of them, which keeps its messages ordered.
+    size_t connection_count = 1;
+    CallbackQueueOptions callback_queue;
+    // Log a latency summary to std::clog this often; zero disables it
+    std::chrono::seconds latency_log_interval{0};
+    // Stream compression; each message is checked against the policy before it is written
+    CompressionOptions compression;
+    // Run BulkTransfer calls over their own TCP connection, so file content
+    // never queues in front of control messages
+    bool separate_bulk_channel = true;
+};
+
+struct BandwidthStats {
+    RateLimiterStats upload;
+    RateLimiterStats download;
+};
+
+struct WriteCoalescingStats {
+    uint64_t buffered_messages = 0;
+    uint64_t buffered_bytes = 0;
+    uint64_t flushes = 0;
+    // Buffered messages lost with a broken stream
+    uint64_t dropped_messages = 0;
+
+    double MessagesPerFlush() const {
+        return flushes == 0 ? 0.0 : static_cast<double>(buffered_messages) / flushes;
+    }
+};
+
+struct ConnectionStats {
+    size_t index = 0;
+    bool connected = false;
+    size_t subscribed_directories = 0;
+    uint64_t reconnects = 0;
+    uint64_t messages_sent = 0;
+    uint64_t messages_received = 0;
+    uint64_t bytes_sent = 0;
+    uint64_t bytes_received = 0;
+    double send_bytes_per_sec = 0.0;
+    double receive_bytes_per_sec = 0.0;
+    // FILE_WRITE chunks written straight to disk by the FileWriteSink
+    uint64_t direct_write_chunks = 0;
+    uint64_t direct_write_bytes = 0;
+};
+
+// Round-trip latencies of protocol exchanges, measured from the moment the
+// request is written until the matching reply is read
+struct LatencyReport {
+    // ASK_VERSION_INCREASE -> VERSION_INCREASE_ALLOW / DENY / VERSION_INCREASED
+    LatencySnapshot ask_version_increase;
+    // REQUEST_FILE_CONTENT -> FILE_CONTENT_REQUEST_ALLOW / DENY
+    LatencySnapshot request_file_content;
+    // DIRECTORY_SUBSCRIBE -> OK_SUBSCRIBED
+    LatencySnapshot directory_subscribe;
+    // FILE_WRITE_END -> VERSION_INCREASED
+    LatencySnapshot file_write_commit;
+    // Time server messages spend in the callback queue before dispatch
+    LatencySnapshot callback_queue;
+
+    std::string ToString() const;
+};
+
+struct CallbackQueueStats {
+    size_t messages = 0;
+    size_t bytes = 0;
+    size_t high_water_messages = 0;
+    size_t high_water_bytes = 0;
+    // Times the receive loop had to wait for space, and for how long in total
+    uint64_t stalls = 0;
+    std::chrono::microseconds stalled_time{0};
+};
+
 class GRPCClient {
 public:
-    explicit GRPCClient(const std::string& server_address);
+    explicit GRPCClient(const std::string& server_address, GRPCClientOptions options = {});
     ~GRPCClient();
 
     GRPCClient(const GRPCClient&) = delete;
@@ -34,11 +162,94 @@ public:
     void Disconnect();
     bool IsConnected() const;
 
-    // Send message and wait for confirmation
+    // Number of times a stream was re-established after breaking
+    uint64_t GetReconnectCount() const;
+
+    // Send message and wait for confirmation.
+    // The message goes to the connection owning the directory it refers to.
     absl::Status SendMessage(const ClientMessage& message);
+
+    // Send on the connection owning `directory_id`. Needed for messages that
+    // do not name a directory themselves, such as FileWriteEnd.
+    absl::Status SendMessage(const ClientMessage& message, const std::string& directory_id);
+
+    // Queue a small message to be written together with its neighbours.
+    // Falls back to SendMessage for large messages or when coalescing is disabled.
+    // If the stream breaks before the message is written, it is dropped and
+    // every waiter fails with UnavailableError, as when the stream breaks
+    // under a sent message.
+    absl::Status SendMessageBuffered(const ClientMessage& message);
+
+    // Write out all buffered messages
+    absl::Status Flush();
+
+    WriteCoalescingStats GetWriteCoalescingStats() const;
+
+    // Send one FILE_WRITE chunk. Blocks until gRPC has room for it, so HTTP/2
+    // flow control bounds what is queued for the stream, and the caller's own
+    // buffers bound the rest. If `reclaim` is set, the chunk's data buffer is
+    // handed back there once written so it can be reused.
+    absl::Status WriteFileChunk(FileChunk chunk, std::string* reclaim = nullptr);
+
+    // Send one FILE_DELTA message; its literal bytes count against the
+    // upload rate limit like chunk data
+    absl::Status WriteFileDelta(FileDelta delta);
+
+    // Finish the FILE_WRITE sequence of `directory_id`
+    absl::Status WriteFileEnd(const std::string& directory_id);
+
+    // Takes effect immediately, including for transfers waiting for bandwidth
+    void SetRateLimits(uint64_t upload_bytes_per_second, uint64_t download_bytes_per_second);
+    // While several directories transfer at once, each gets a share of the
+    // limits proportional to its weight; the default weight is 1
+    void SetDirectoryWeight(const std::string& directory_id, uint32_t weight);
+    BandwidthStats GetBandwidthStats() const;
+
+    // Start the content transfer named by VERSION_INCREASE_ALLOW or
+    // FILE_CONTENT_REQUEST_ALLOW. It runs on a separate call next to the
+    // connection `directory_id` is routed to.
+    absl::StatusOr<std::unique_ptr<BulkTransfer>> OpenBulkTransfer(
+        const std::string& transfer_id, const std::string& directory_id);
+
+    std::vector<ConnectionStats> GetConnectionStats() const;
+
+    LatencyReport GetLatencyReport() const;
+    void ResetLatencyStats();
     
     using ServerMessageCallback = std::function<void(const ServerMessage& message)>;
+    // The callback runs on a single worker fed by a bounded queue. It must not
+    // block waiting for further server messages, as reading pauses while the
+    // queue is full.
     void SetMessageCallback(ServerMessageCallback callback);
+
+    // Handle one message type with a typed handler, e.g.
+    //   client.On<CheckVersion>([](const CheckVersion& check) { ... });
+    // Typed handlers take precedence over the message callback, which keeps
+    // receiving the types nobody registered for. Without an executor the
+    // handler runs on the callback worker; with one it is posted there and no
+    // longer counts against the callback queue limits. Register handlers
+    // before StartReceiving().
+    template <typename Message, typename Handler>
+    void On(Handler&& handler) {
+        std::lock_guard<std::mutex> lock(waiters_mutex_);
+        dispatcher_.On<Message>(std::forward<Handler>(handler));
+    }
+
+    template <typename Message, typename Handler>
+    void On(Handler&& handler, Executor& executor) {
+        std::lock_guard<std::mutex> lock(waiters_mutex_);
+        dispatcher_.On<Message>(std::forward<Handler>(handler), &executor);
+    }
+
+    CallbackQueueStats GetCallbackQueueStats() const;
+
+    CompressionStats GetCompressionStats() const;
+
+    // Route incoming FILE_WRITE chunks of `directory_id` to `sink` instead of
+    // the message callback. The payload is written from the receive buffer
+    // without being parsed into a ServerMessage. Pass nullptr to go back to
+    // the callback.
+    void SetFileWriteSink(const std::string& directory_id, std::shared_ptr<FileWriteSink> sink);
     
     // Manage recieveing messages from server
     void StartReceiving();
@@ -47,48 +258,287 @@ public:
 
     using MessagePredicate = std::function<bool(const ServerMessage&)>;
     
-    // Block until a message matching predicate is received
+    // Block until a message matching predicate is received.
+    // Returns UnavailableError if the stream breaks while waiting; the request
+    // may be retried once the client has reconnected.
     absl::StatusOr<ServerMessage> WaitForMessage(
         MessagePredicate predicate,
         std::chrono::milliseconds timeout = std::chrono::seconds(30));
 
+    // Blocking send-and-wait. The waiter is registered before the message is
+    // sent, so a reply that arrives right away is not missed.
+    absl::StatusOr<ServerMessage> SendAndWait(
+        const ClientMessage& message,
+        MessagePredicate predicate,
+        std::chrono::milliseconds timeout = std::chrono::seconds(30));
+
+    // Same, for replies triggered by something other than a single message,
+    // e.g. FILE_WRITE_END sent over a BulkTransfer
+    absl::StatusOr<ServerMessage> SendAndWait(
+        const std::function<absl::Status()>& send,
+        MessagePredicate predicate,
+        std::chrono::milliseconds timeout = std::chrono::seconds(30));
+
+    // What a collector does with a reply: leave it to other waiters, take
+    // it and wait for more, or take it as the last one
+    enum class Collect { kSkip, kTake, kDone };
+    using MessageCollector = std::function<Collect(ServerMessage&)>;
+
+    // Send `message` and hand every reply `collect` takes to it until it
+    // returns kDone, e.g. one BLOCK_SIGNATURES per file of a single
+    // REQUEST_BLOCK_SIGNATURES. `collect` runs on a receive thread, one
+    // reply at a time, and is not called once this returns.
+    absl::Status SendAndCollect(
+        const ClientMessage& message,
+        MessageCollector collect,
+        std::chrono::milliseconds timeout = std::chrono::seconds(30));
+
+    class RequestAwaitable;
+    class SendAwaitable;
+
+    // Awaitable send-and-wait for coroutines:
+    //     auto reply = co_await client.Request(message, predicate, executor);
+    // No thread is blocked while waiting; the coroutine is resumed on
+    // `executor` when a matching message arrives, the timeout expires or the
+    // stream breaks. The waiter is registered before the message is sent.
+    // GCC before 13 destroys temporaries in a co_await operand twice
+    // (PR 99576): bind capturing predicates to a named variable first.
+    RequestAwaitable Request(
+        ClientMessage message,
+        MessagePredicate predicate,
+        Executor& executor,
+        std::chrono::milliseconds timeout = std::chrono::seconds(30));
+
+    // Awaitable SendMessage; the write is performed on `executor`
+    SendAwaitable Send(ClientMessage message, Executor& executor);
+
 private:
-    void ReceiveLoop();
-    void ProcessMessage(const ServerMessage& message);
+    enum LatencyMetric {
+        kAskVersionIncreaseLatency,
+        kRequestFileContentLatency,
+        kDirectorySubscribeLatency,
+        kFileWriteCommitLatency,
+        kCallbackQueueLatency,
+        kLatencyMetricCount
+    };
+
+    // A request awaiting its reply, for the latency histograms
+    struct PendingExchange {
+        std::chrono::steady_clock::time_point sent;
+        std::vector<std::string> file_ids;
+    };
+
+    // One channel with its bidirectional stream. The receive thread of a
+    // connection also supervises it and is the only one replacing `stream`.
+    struct Connection {
+        size_t index = 0;
+        std::shared_ptr<grpc::Channel> channel;
+        std::unique_ptr<SyncService::Stub> stub;
+        // Same as `channel` unless separate_bulk_channel is set
+        std::shared_ptr<grpc::Channel> bulk_channel;
+
+        std::unique_ptr<grpc::ClientContext> stream_context;
+        // Server messages are read as raw buffers so FILE_WRITE payloads can
+        // skip protobuf parsing; see ReceiveLoop
+        std::unique_ptr<RawStream<ClientMessage>> stream;
+        std::atomic<bool> connected{false};
+
+        std::mutex stream_mutex;
+        // Guards stream_context so it can be cancelled without waiting for a blocked writer
+        std::mutex context_mutex;
+
+        std::thread receive_thread;
+
+        std::mutex subscriptions_mutex;
+        std::set<std::string> subscribed_directories;
+
+        std::thread flush_thread;
+        std::vector<ClientMessage> pending_writes;
+        size_t pending_bytes = 0;
+        std::chrono::steady_clock::time_point first_pending_time;
+        std::chrono::steady_clock::time_point last_pending_time;
+        bool flush_stop = false;
+        std::mutex pending_mutex;
+        std::condition_variable pending_cv;
+
+        // Requests awaiting a reply, by directory and exchange. Replies name
+        // their directory, and a directory answers its requests of one kind
+        // in order, so a FIFO per key pairs them up even when directories
+        // share the stream.
+        std::mutex exchanges_mutex;
+        std::map<std::pair<std::string, LatencyMetric>, std::deque<PendingExchange>>
+            pending_exchanges;
+
+        std::atomic<uint64_t> reconnects{0};
+        std::atomic<uint64_t> messages_sent{0};
+        std::atomic<uint64_t> messages_received{0};
+        ThroughputMeter sent;
+        ThroughputMeter received;
+        std::atomic<uint64_t> direct_write_chunks{0};
+        std::atomic<uint64_t> direct_write_bytes{0};
+    };
+
+    absl::Status CreateConnection(Connection& connection);
+    absl::Status OpenStream(Connection& connection);
+    void CloseConnection(Connection& connection);
+    void ReceiveLoop(Connection& connection);
+    bool TryWriteDirect(Connection& connection, const std::vector<grpc::Slice>& slices);
+    void CloseBrokenStream(Connection& connection);
+    bool Reconnect(Connection& connection);
+    void ReplaySubscriptions(Connection& connection);
+    void TrackSubscription(Connection& connection, const ClientMessage& message);
+    absl::Status SendOn(Connection& connection, const ClientMessage& message);
+    absl::Status FlushOn(Connection& connection);
+    absl::Status FlushLocked(Connection& connection);
+    void FlushLoop(Connection& connection);
+    void DiscardPendingWrites(Connection& connection);
+    void LoseBufferedWrites(Connection& connection);
+    Connection& Route(const std::string& directory_id);
+    absl::Status NotConnectedError() const;
+    void FailWaiters(const absl::Status& status);
+    void BeginRequest(RequestAwaitable& request, std::coroutine_handle<> handle);
+    void ProcessMessage(ServerMessage message, size_t bytes);
     void CallbackWorkerLoop();
+    void NoteSent(Connection& connection, const ClientMessage& message,
+                  std::chrono::steady_clock::time_point time);
+    void NoteReceived(Connection& connection, const ServerMessage& message);
+    grpc::WriteOptions WriteOptionsFor(const ClientMessage& message, size_t bytes);
+    void LatencyLogLoop();
+
+    // Directory a message belongs to, or an empty string if it names none
+    static std::string RoutingDirectory(const ClientMessage& message);
 
     struct Waiter {
         MessagePredicate predicate;
+        // Used instead of predicate by SendAndCollect
+        MessageCollector collect;
         std::condition_variable cv;
         std::mutex mutex;
         std::optional<ServerMessage> result;
+        absl::Status status;
+        // Guarded by mutex
         bool done = false;
-        bool cancelled = false;
+        // Set for coroutine waiters; runs once the waiter completes
+        std::function<void()> on_done;
+        // Timeout of a coroutine waiter, cancelled when it completes first.
+        // Guarded by mutex.
+        Executor* timer_executor = nullptr;
+        Executor::TimerId timer;
+    };
+
+    // Waiters for a reply. Shared with the timeout timers of Request(), which
+    // may fire after the client is gone.
+    struct WaiterList {
+        std::mutex mutex;
+        std::vector<std::shared_ptr<Waiter>> waiters;
     };
 
+    // Returns false if the waiter had already completed. With `deferred`,
+    // the waiter's on_done is appended there instead of being run, for
+    // callers that hold the waiter list lock: a resumed coroutine may send
+    // its next Request() at once.
+    static bool CompleteWaiter(const std::shared_ptr<Waiter>& waiter,
+                               absl::Status status,
+                               std::optional<ServerMessage> result = std::nullopt,
+                               std::vector<std::function<void()>>* deferred = nullptr);
+    absl::StatusOr<ServerMessage> AwaitWaiter(const std::shared_ptr<Waiter>& waiter,
+                                              std::chrono::milliseconds timeout);
+    static void RemoveWaiter(WaiterList& list, const std::shared_ptr<Waiter>& waiter);
+
     std::string server_address_;
-    std::shared_ptr<grpc::Channel> channel_;
-    std::unique_ptr<SyncService::Stub> stub_;
-    
-    std::unique_ptr<grpc::ClientContext> stream_context_;
-    std::unique_ptr<grpc::ClientReaderWriter<ClientMessage, ServerMessage>> stream_;
+    GRPCClientOptions options_;
+    std::vector<std::unique_ptr<Connection>> connections_;
     
-    std::atomic<bool> connected_{false};
+    // started_ spans Connect()..Disconnect(); each connection tracks its own stream
+    std::atomic<bool> started_{false};
     
-    std::thread receive_thread_;
     std::atomic<bool> receiving_{false};
     std::atomic<bool> should_stop_{false};
     
-    std::mutex stream_mutex_;
+    std::mutex reconnect_mutex_;
+    std::condition_variable reconnect_cv_;
+    // Guards the message callback and typed handlers
     std::mutex waiters_mutex_;
-    std::vector<std::shared_ptr<Waiter>> waiters_;
+    std::shared_ptr<WaiterList> waiters_ = std::make_shared<WaiterList>();
     
     ServerMessageCallback message_callback_;
+    MessageDispatcher dispatcher_;
+
+    // By directory id
+    std::mutex file_write_sinks_mutex_;
+    std::unordered_map<std::string, std::shared_ptr<FileWriteSink>> file_write_sinks_;
     
     std::thread callback_worker_;
-    std::queue<ServerMessage> callback_queue_;
-    std::mutex callback_mutex_;
+    struct QueuedMessage {
+        ServerMessage message;
+        size_t bytes;
+        std::chrono::steady_clock::time_point enqueued;
+    };
+    std::queue<QueuedMessage> callback_queue_;
+    size_t callback_queue_bytes_ = 0;
+    CallbackQueueStats callback_queue_stats_;
+    mutable std::mutex callback_mutex_;
     std::condition_variable callback_cv_;
+    std::condition_variable callback_space_cv_;
+
+    std::atomic<uint64_t> coalesced_messages_{0};
+    std::atomic<uint64_t> coalesced_bytes_{0};
+    std::atomic<uint64_t> coalesced_flushes_{0};
+    std::atomic<uint64_t> dropped_messages_{0};
+
+    RateLimiter upload_limiter_;
+    RateLimiter download_limiter_;
+    CompressionPolicy compression_policy_;
+
+    std::array<LatencyHistogram, kLatencyMetricCount> latency_;
+
+    std::thread latency_log_thread_;
+    bool latency_log_stop_ = false;
+    std::mutex latency_log_mutex_;
+    std::condition_variable latency_log_cv_;
+};
+
+class GRPCClient::RequestAwaitable {
+public:
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle);
+    absl::StatusOr<ServerMessage> await_resume();
+
+private:
+    friend class GRPCClient;
+
+    RequestAwaitable(GRPCClient* client, ClientMessage message, MessagePredicate predicate,
+                     Executor* executor, std::chrono::milliseconds timeout)
+        : client_(client),
+          message_(std::move(message)),
+          predicate_(std::move(predicate)),
+          executor_(executor),
+          timeout_(timeout) {}
+
+    GRPCClient* client_;
+    ClientMessage message_;
+    MessagePredicate predicate_;
+    Executor* executor_;
+    std::chrono::milliseconds timeout_;
+    std::shared_ptr<Waiter> waiter_;
+};
+
+class GRPCClient::SendAwaitable {
+public:
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle);
+    absl::Status await_resume() { return std::move(status_); }
+
+private:
+    friend class GRPCClient;
+
+    SendAwaitable(GRPCClient* client, ClientMessage message, Executor* executor)
+        : client_(client), message_(std::move(message)), executor_(executor) {}
+
+    GRPCClient* client_;
+    ClientMessage message_;
+    Executor* executor_;
+    absl::Status status_;
 };
 
 }  // namespace synxpo
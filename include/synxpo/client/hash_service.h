@@ -0,0 +1,125 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+
+#include "synxpo/client/executor.h"
+
+namespace synxpo {
+
+// What stat() says about a file; if none of it changed, neither did the content
+struct FileFingerprint {
+    uint64_t device = 0;
+    uint64_t inode = 0;
+    uint64_t size = 0;
+    int64_t mtime_ns = 0;
+    int64_t ctime_ns = 0;
+
+    bool operator==(const FileFingerprint&) const = default;
+};
+
+struct FileHash {
+    uint64_t hash = 0;
+    FileFingerprint fingerprint;
+    bool cached = false;  // taken from the cache without reading the file
+};
+
+struct HashServiceOptions {
+    size_t threads = 4;
+    size_t read_buffer_bytes = 1024 * 1024;
+    // Files changed this recently are hashed but not cached: a second write
+    // within the same timestamp tick would leave the fingerprint unchanged
+    std::chrono::milliseconds racy_window{1000};
+    // Files at least this large are dropped from the page cache as they are
+    // hashed (see CacheTrimmer); 0 leaves the cache alone
+    uint64_t drop_cache_min_bytes = 256 * 1024 * 1024;
+};
+
+struct HashServiceStats {
+    uint64_t files_hashed = 0;
+    uint64_t cache_hits = 0;
+    uint64_t bytes_hashed = 0;
+    // Summed over workers, including reads
+    std::chrono::microseconds hash_time{0};
+    size_t cache_entries = 0;
+
+    double GigabytesPerSecond() const;
+    std::string ToString() const;
+};
+
+// Content hashes (ContentHasher, XXH3) of local files, computed on a worker
+// pool and cached across runs by device, inode, size, mtime and ctime.
+// Touches and rewrites with identical content can then be told apart from
+// real changes without reading unchanged files again.
+class HashService {
+public:
+    using Callback = std::function<void(absl::StatusOr<FileHash>)>;
+
+    // Load the cache from `cache_file` if it exists
+    static absl::StatusOr<std::unique_ptr<HashService>> Open(
+        const std::filesystem::path& cache_file, HashServiceOptions options = {});
+
+    // Finishes queued hashes, then saves the cache
+    ~HashService();
+
+    HashService(const HashService&) = delete;
+    HashService& operator=(const HashService&) = delete;
+
+    // On the calling thread
+    absl::StatusOr<FileHash> Hash(const std::filesystem::path& path);
+
+    // On the pool; `done` runs on a worker
+    void HashAsync(std::filesystem::path path, Callback done);
+
+    // Spread over the pool and wait for all; results are in input order
+    std::vector<absl::StatusOr<FileHash>> HashAll(const std::vector<std::filesystem::path>& paths);
+
+    // Written to a temporary file and renamed over the old one
+    absl::Status Save();
+
+    HashServiceStats GetStats() const;
+
+private:
+    struct Key {
+        uint64_t device;
+        uint64_t inode;
+        bool operator==(const Key&) const = default;
+    };
+    struct KeyHash {
+        size_t operator()(const Key& key) const {
+            return std::hash<uint64_t>{}(key.inode * 0x9E3779B97F4A7C15ULL ^ key.device);
+        }
+    };
+    struct Entry {
+        FileFingerprint fingerprint;
+        uint64_t hash;
+    };
+
+    HashService(std::filesystem::path cache_file, HashServiceOptions options);
+
+    absl::Status Load();
+
+    std::filesystem::path cache_file_;
+    HashServiceOptions options_;
+
+    mutable std::mutex mutex_;
+    std::unordered_map<Key, Entry, KeyHash> cache_;
+    bool dirty_ = false;
+    HashServiceStats stats_;
+
+    // Last, so workers stop before the state they use goes away
+    Executor executor_;
+};
+
+}  // namespace synxpo
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace synxpo {
+
+struct LatencySnapshot {
+    uint64_t count = 0;
+    std::chrono::microseconds min{0};
+    std::chrono::microseconds max{0};
+    std::chrono::microseconds mean{0};
+    std::chrono::microseconds p50{0};
+    std::chrono::microseconds p90{0};
+    std::chrono::microseconds p99{0};
+    std::chrono::microseconds p999{0};
+
+    std::string ToString() const;
+};
+
+// Lock-free log-linear (HDR-style) histogram of microsecond latencies.
+// Every power of two is split into 16 linear buckets, which bounds the
+// relative error of reported percentiles to about 6%.
+class LatencyHistogram {
+public:
+    LatencyHistogram();
+
+    void Record(std::chrono::microseconds latency);
+    void Record(std::chrono::steady_clock::duration latency) {
+        Record(std::chrono::duration_cast<std::chrono::microseconds>(latency));
+    }
+
+    LatencySnapshot Snapshot() const;
+    void Reset();
+
+private:
+    static constexpr size_t kSubBucketBits = 5;
+    static constexpr size_t kSubBucketCount = size_t{1} << kSubBucketBits;
+    static constexpr size_t kSubBucketHalf = kSubBucketCount / 2;
+    // Covers latencies up to 2^40 us (about 12 days)
+    static constexpr size_t kMaxShift = 40 - kSubBucketBits;
+    static constexpr size_t kBucketCount = kSubBucketCount + kMaxShift * kSubBucketHalf;
+
+    static size_t BucketIndex(uint64_t value);
+    static uint64_t BucketMidpoint(size_t index);
+
+    std::array<std::atomic<uint64_t>, kBucketCount> buckets_;
+    std::atomic<uint64_t> sum_{0};
+    std::atomic<uint64_t> min_{UINT64_MAX};
+    std::atomic<uint64_t> max_{0};
+};
+
+}  // namespace synxpo
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "synxpo.pb.h"
+#include "synxpo/client/executor.h"
+
+namespace synxpo {
+
+// Maps a ServerMessage submessage type to its oneof case and accessor
+template <typename Message>
+struct ServerMessageTraits;
+
+#define SYNXPO_SERVER_MESSAGE_TRAITS(Type, field, Case)                   \
+    template <>                                                           \
+    struct ServerMessageTraits<Type> {                                    \
+        static constexpr ServerMessage::MessageCase kCase = ServerMessage::Case; \
+        static const Type& Get(const ServerMessage& message) {            \
+            return message.field();                                       \
+        }                                                                 \
+    };
+
+SYNXPO_SERVER_MESSAGE_TRAITS(OkDirectoryCreated, ok_directory_created, kOkDirectoryCreated)
+SYNXPO_SERVER_MESSAGE_TRAITS(OkSubscribed, ok_subscribed, kOkSubscribed)
+SYNXPO_SERVER_MESSAGE_TRAITS(OkUnsubscribed, ok_unsubscribed, kOkUnsubscribed)
+SYNXPO_SERVER_MESSAGE_TRAITS(VersionIncreaseAllow, version_increase_allow, kVersionIncreaseAllow)
+SYNXPO_SERVER_MESSAGE_TRAITS(VersionIncreaseDeny, version_increase_deny, kVersionIncreaseDeny)
+SYNXPO_SERVER_MESSAGE_TRAITS(VersionIncreased, version_increased, kVersionIncreased)
+SYNXPO_SERVER_MESSAGE_TRAITS(CheckVersion, check_version, kCheckVersion)
+SYNXPO_SERVER_MESSAGE_TRAITS(FileContentRequestAllow, file_content_request_allow, kFileContentRequestAllow)
+SYNXPO_SERVER_MESSAGE_TRAITS(FileContentRequestDeny, file_content_request_deny, kFileContentRequestDeny)
+SYNXPO_SERVER_MESSAGE_TRAITS(FileWrite, file_write, kFileWrite)
+SYNXPO_SERVER_MESSAGE_TRAITS(FileWriteEnd, file_write_end, kFileWriteEnd)
+SYNXPO_SERVER_MESSAGE_TRAITS(Error, error, kError)
+SYNXPO_SERVER_MESSAGE_TRAITS(BlockSignatures, block_signatures, kBlockSignatures)
+SYNXPO_SERVER_MESSAGE_TRAITS(MissingChunks, missing_chunks, kMissingChunks)
+
+#undef SYNXPO_SERVER_MESSAGE_TRAITS
+
+// Table of typed handlers indexed by ServerMessage::MessageCase. Dispatching
+// a message is one lookup and one call; handlers get the concrete submessage.
+class MessageDispatcher {
+public:
+    MessageDispatcher();
+
+    // Register `handler` for messages of type `Message`, replacing any
+    // previous one. With an executor the handler runs there instead of on
+    // the dispatching thread.
+    template <typename Message, typename Handler>
+    void On(Handler&& handler, Executor* executor = nullptr) {
+        static_assert(std::is_invocable_v<Handler&, const Message&>,
+                      "handler must accept const Message&");
+        auto& entry = handlers_[ServerMessageTraits<Message>::kCase];
+        entry.call = std::make_shared<Call>(
+            [handler = std::forward<Handler>(handler)](const ServerMessage& message) mutable {
+                handler(ServerMessageTraits<Message>::Get(message));
+            });
+        entry.executor = executor;
+    }
+
+    template <typename Message>
+    void Remove() {
+        handlers_[ServerMessageTraits<Message>::kCase] = {};
+    }
+
+    bool HasHandler(ServerMessage::MessageCase message_case) const;
+
+    // Returns false if no handler is registered for this message type
+    bool Dispatch(ServerMessage&& message);
+
+private:
+    using Call = std::function<void(const ServerMessage&)>;
+
+    struct Entry {
+        // Shared with tasks posted to the executor, so the handler and its
+        // state are not copied per message and outlive a replacement
+        std::shared_ptr<Call> call;
+        Executor* executor = nullptr;
+    };
+
+    // Indexed by oneof case, which is the proto field number; sized from
+    // ServerMessage's descriptor so new message types fit
+    std::vector<Entry> handlers_;
+};
+
+}  // namespace synxpo
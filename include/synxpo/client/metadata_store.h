@@ -0,0 +1,182 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+
+#include "synxpo.pb.h"
+
+namespace synxpo {
+
+// Local state of one file in a synchronized directory
+struct FileRecord {
+    std::string id;  // empty until the server assigned one
+    uint64_t version = 0;
+    uint64_t content_changed_version = 0;
+    FileType type = FileType::FILE;
+    std::string current_path;
+    // FIRST_TRY_TIME of a local change not yet accepted by the server, 0 if none
+    uint64_t first_try_time = 0;
+    // ContentHasher digest of the content at content_changed_version, 0 if unknown
+    uint64_t content_hash = 0;
+};
+
+struct MetadataStoreOptions {
+    // Checkpoint once the write-ahead log grows past this size...
+    size_t checkpoint_wal_bytes = 64 * 1024 * 1024;
+    // ...or this long after the previous checkpoint, whichever comes first
+    std::chrono::seconds checkpoint_interval{300};
+    // fdatasync the log once per batch; without it a crash may lose the last batches
+    bool sync_wal = true;
+};
+
+struct MetadataStoreStats {
+    size_t records = 0;
+    size_t capacity = 0;
+    uint64_t wal_bytes = 0;
+    uint64_t batches = 0;
+    uint64_t checkpoints = 0;
+    // Log entries replayed when the store was opened
+    uint64_t replayed_entries = 0;
+    std::chrono::microseconds open_time{0};
+};
+
+// Per-directory store of FileRecords. Records live in a memory-mapped table
+// of fixed-size slots; each batch of changes is appended to a write-ahead log
+// before it touches the table, and checkpoints flush the table and truncate
+// the log. Lookups by file id and by path go through in-memory indexes that
+// are rebuilt from the table on open.
+class MetadataStore {
+public:
+    class Batch {
+    public:
+        // Insert or replace the record with the same id, or with the same
+        // path if the record has no id yet
+        void Put(FileRecord record);
+        void RemoveById(std::string id);
+        void RemoveByPath(std::string path);
+
+        bool Empty() const { return operations_.empty(); }
+        size_t Size() const { return operations_.size(); }
+
+    private:
+        friend class MetadataStore;
+
+        enum class Kind { kPut, kRemoveById, kRemoveByPath };
+        struct Operation {
+            Kind kind;
+            FileRecord record;
+            std::string key;
+        };
+        std::vector<Operation> operations_;
+    };
+
+    // Open the store of `directory_id` kept in the `path` directory, creating
+    // it if needed, and replay whatever the log holds past the last checkpoint
+    static absl::StatusOr<std::unique_ptr<MetadataStore>> Open(
+        const std::filesystem::path& path, const std::string& directory_id,
+        MetadataStoreOptions options = {});
+
+    // Checkpoints on the way out
+    ~MetadataStore();
+
+    MetadataStore(const MetadataStore&) = delete;
+    MetadataStore& operator=(const MetadataStore&) = delete;
+
+    std::optional<FileRecord> FindById(const std::string& id) const;
+    std::optional<FileRecord> FindByPath(const std::string& path) const;
+    size_t Size() const;
+    void ForEach(const std::function<void(const FileRecord&)>& visitor) const;
+
+    // Durable once this returns: one log write and at most one fdatasync
+    absl::Status Apply(const Batch& batch);
+
+    // Record the server metadata of an accepted change. Clears FIRST_TRY_TIME
+    // of these files and drops the ones marked deleted. Files of other
+    // directories are ignored by both methods.
+    absl::Status ApplyVersionIncreased(const VersionIncreased& message);
+
+    // Record server metadata announced by CHECK_VERSION, after the local copy
+    // was brought up to date. Pending local changes keep their FIRST_TRY_TIME.
+    absl::Status ApplyCheckVersion(const CheckVersion& message);
+
+    absl::Status Checkpoint();
+
+    MetadataStoreStats GetStats() const;
+
+private:
+    struct Header;
+    struct Slot;
+    class KeyIndex;
+
+    MetadataStore(std::filesystem::path path, std::string directory_id,
+                  MetadataStoreOptions options);
+
+    absl::Status OpenFiles();
+    absl::Status MapTable(size_t capacity);
+    absl::Status GrowTable();
+    absl::Status ReplayLog();
+    absl::Status LoadLongPaths();
+    void RebuildIndexes();
+
+    absl::Status ApplyServerFiles(
+        const google::protobuf::RepeatedPtrField<FileMetadata>& files, bool accepted);
+    absl::Status ApplyLocked(const Batch& batch);
+    absl::Status AppendLog(const std::string& entry);
+    absl::Status CheckpointLocked();
+
+    // Slot updates; both are also used to replay the log
+    absl::Status WriteSlot(uint32_t index, const FileRecord& record, uint64_t path_offset);
+    void ClearSlot(uint32_t index);
+    FileRecord ReadSlot(uint32_t index) const;
+    std::string_view SlotId(uint32_t index) const;
+    std::string_view SlotPath(uint32_t index) const;
+    size_t Capacity() const;
+
+    std::optional<uint32_t> FindSlotById(std::string_view id) const;
+    std::optional<uint32_t> FindSlotByPath(std::string_view path) const;
+    absl::StatusOr<uint32_t> AllocateSlot();
+
+    std::filesystem::path path_;
+    std::string directory_id_;
+    MetadataStoreOptions options_;
+
+    int table_fd_ = -1;
+    int paths_fd_ = -1;
+    int wal_fd_ = -1;
+
+    void* mapping_ = nullptr;
+    size_t mapping_size_ = 0;
+    Header* header_ = nullptr;
+    Slot* slots_ = nullptr;
+
+    uint64_t next_lsn_ = 1;
+    uint64_t paths_size_ = 0;
+    uint64_t wal_size_ = 0;
+    std::chrono::steady_clock::time_point last_checkpoint_;
+
+    // Indexes hold slot numbers only and read keys from the table, so opening
+    // a large store does not allocate per file
+    std::unique_ptr<KeyIndex> by_id_;
+    std::unique_ptr<KeyIndex> by_path_;
+    // Paths too long for their slot, by slot number
+    std::unordered_map<uint32_t, std::string> long_paths_;
+    std::vector<uint32_t> free_slots_;
+
+    MetadataStoreStats stats_;
+    mutable std::shared_mutex mutex_;
+};
+
+}  // namespace synxpo
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+
+namespace synxpo {
+
+// Reads that stream through a large file once leave it in the page cache,
+// where it evicts what other processes on the host are working with. This
+// drops the pages a reader is done with, in steps, behind its cursor.
+//
+// The file descriptor stays owned by the caller.
+class CacheTrimmer {
+public:
+    // Pages are dropped only if the file is at least `min_bytes`; 0 never
+    // drops them
+    CacheTrimmer(int fd, uint64_t file_size, uint64_t min_bytes);
+
+    CacheTrimmer(const CacheTrimmer&) = delete;
+    CacheTrimmer& operator=(const CacheTrimmer&) = delete;
+
+    bool enabled() const { return enabled_; }
+
+    // Everything before `offset` has been read and used
+    void Advance(uint64_t offset);
+    // Drop the rest of what was read; call before closing the file
+    void Finish();
+
+    uint64_t dropped_bytes() const { return dropped_; }
+
+private:
+    void Drop(uint64_t end);
+
+    int fd_;
+    bool enabled_;
+    // Pages before this offset were dropped
+    uint64_t dropped_ = 0;
+    uint64_t retry_from_ = 0;
+    uint64_t cursor_ = 0;
+};
+
+}  // namespace synxpo
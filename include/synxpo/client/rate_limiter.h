@@ -0,0 +1,111 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "synxpo/client/throughput_meter.h"
+
+namespace synxpo {
+
+struct RateLimiterStats {
+    // 0 is unlimited
+    uint64_t target_bytes_per_second = 0;
+    double bytes_per_second = 0.0;
+    uint64_t bytes = 0;
+    // Acquires that had to wait for tokens, and how long they waited in total
+    uint64_t throttled = 0;
+    std::chrono::microseconds throttled_time{0};
+    size_t waiting = 0;
+
+    struct Directory {
+        std::string directory_id;
+        uint32_t weight = 1;
+        uint64_t bytes = 0;
+        double bytes_per_second = 0.0;
+    };
+    std::vector<Directory> directories;
+};
+
+// Token bucket for one direction of file content, shared by every
+// directory. While several directories wait, the bandwidth is split between
+// them by weight (start-time fair queueing); a directory with nothing to send
+// leaves its share to the others and gets no credit for the time it was idle.
+//
+// Chunks are admitted while the bucket is not empty and may take it below
+// zero, so a chunk larger than the burst still goes and the next one waits
+// longer.
+class RateLimiter {
+public:
+    // `burst` is how much unused bandwidth may be saved up
+    explicit RateLimiter(uint64_t bytes_per_second = 0,
+                         std::chrono::milliseconds burst = std::chrono::milliseconds(100));
+
+    RateLimiter(const RateLimiter&) = delete;
+    RateLimiter& operator=(const RateLimiter&) = delete;
+
+    // Block until `bytes` of `directory_id` may be sent or, after they were
+    // received, until the next chunk may be read. Returns false if the
+    // limiter was closed while waiting.
+    bool Acquire(const std::string& directory_id, size_t bytes);
+
+    // Takes effect for waiting transfers too; 0 lifts the limit
+    void SetRate(uint64_t bytes_per_second);
+    // Directories have weight 1 until set
+    void SetWeight(const std::string& directory_id, uint32_t weight);
+
+    // Wake up all waiters; subsequent Acquire calls fail
+    void Close();
+    void Reopen();
+
+    RateLimiterStats GetStats() const;
+
+private:
+    struct Directory {
+        uint32_t weight = 1;
+        // Virtual time at which the last queued chunk of the directory ends
+        double finish = 0.0;
+        uint64_t bytes = 0;
+        ThroughputMeter meter;
+    };
+
+    struct Waiter {
+        Directory* directory;
+        size_t bytes;
+        double start;
+        bool granted = false;
+    };
+
+    // Callers hold mutex_
+    void Refill(std::chrono::steady_clock::time_point now);
+    void Dispatch();
+    double BurstBytes() const;
+
+    const std::chrono::milliseconds burst_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    uint64_t rate_;
+    double tokens_;
+    std::chrono::steady_clock::time_point refilled_;
+    // Start tag of the chunk granted last
+    double virtual_time_ = 0.0;
+    // Node-based, so waiters can point into it
+    std::unordered_map<std::string, Directory> directories_;
+    // In arrival order
+    std::list<Waiter> waiters_;
+    bool closed_ = false;
+
+    uint64_t bytes_ = 0;
+    uint64_t throttled_ = 0;
+    std::chrono::microseconds throttled_time_{0};
+    ThroughputMeter meter_;
+};
+
+}  // namespace synxpo
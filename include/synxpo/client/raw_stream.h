@@ -0,0 +1,123 @@
+#pragma once
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <grpcpp/generic/generic_stub.h>
+#include <grpcpp/grpcpp.h>
+
+namespace synxpo {
+
+// Blocking bidirectional stream whose replies are left serialized, so they
+// can be inspected or written to disk before (or instead of) being parsed.
+// Built on the public generic stub and callback API; the calls mirror
+// grpc::ClientReaderWriter. One Write and one Read may be in progress at a
+// time, from different threads.
+template <typename Request>
+class RawStream : private grpc::ClientBidiReactor<Request, grpc::ByteBuffer> {
+public:
+    // Start `method` (e.g. "/synxpo.SyncService/Stream") on `channel`.
+    // `context` must outlive the stream.
+    static std::unique_ptr<RawStream> Open(const std::shared_ptr<grpc::Channel>& channel,
+                                           const std::string& method,
+                                           grpc::ClientContext* context) {
+        std::unique_ptr<RawStream> stream(new RawStream());
+        grpc::TemplatedGenericStub<Request, grpc::ByteBuffer> stub(channel);
+        stub.PrepareBidiStreamingCall(context, method, grpc::StubOptions(), stream.get());
+        // Reads and writes are started from our threads, not from reactions
+        stream->AddHold();
+        stream->StartCall();
+        return stream;
+    }
+
+    // Waits for the call to end like Finish; cancel it through its context
+    // first if the server may keep it open
+    ~RawStream() {
+        if (!finished_) {
+            Finish();
+        }
+    }
+
+    RawStream(const RawStream&) = delete;
+    RawStream& operator=(const RawStream&) = delete;
+
+    // False once the stream is broken or closed
+    bool Write(const Request& message, grpc::WriteOptions options = grpc::WriteOptions()) {
+        Reset(&write_done_);
+        this->StartWrite(&message, options);
+        return Wait(&write_done_, &write_ok_);
+    }
+
+    // False at the end of the stream
+    bool Read(grpc::ByteBuffer* buffer) {
+        Reset(&read_done_);
+        this->StartRead(buffer);
+        return Wait(&read_done_, &read_ok_);
+    }
+
+    bool WritesDone() {
+        Reset(&write_done_);
+        this->StartWritesDone();
+        return Wait(&write_done_, &write_ok_);
+    }
+
+    // Wait for the server's status. No Read or Write may be in progress,
+    // unless the call was cancelled.
+    grpc::Status Finish() {
+        if (!finished_) {
+            finished_ = true;
+            this->RemoveHold();
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return done_; });
+        return status_;
+    }
+
+private:
+    RawStream() = default;
+
+    void OnWriteDone(bool ok) override { Complete(&write_done_, &write_ok_, ok); }
+    void OnWritesDoneDone(bool ok) override { Complete(&write_done_, &write_ok_, ok); }
+    void OnReadDone(bool ok) override { Complete(&read_done_, &read_ok_, ok); }
+
+    void OnDone(const grpc::Status& status) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        status_ = status;
+        done_ = true;
+        cv_.notify_all();
+    }
+
+    // The reaction may run on the calling thread before Start* returns, so
+    // mutex_ is not held across it
+    void Reset(bool* done) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        *done = false;
+    }
+
+    bool Wait(bool* done, bool* result) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [done] { return *done; });
+        return *result;
+    }
+
+    void Complete(bool* done, bool* result, bool ok) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        *result = ok;
+        *done = true;
+        cv_.notify_all();
+    }
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool write_done_ = false;
+    bool write_ok_ = false;
+    bool read_done_ = false;
+    bool read_ok_ = false;
+    bool finished_ = false;
+    bool done_ = false;
+    grpc::Status status_;
+};
+
+}  // namespace synxpo
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include <absl/status/statusor.h>
+
+#include "synxpo.pb.h"
+#include "synxpo/client/hash_service.h"
+#include "synxpo/client/metadata_store.h"
+
+namespace synxpo {
+
+// In the order the spec runs them: renames and deletions first, then
+// downloads, then uploads of what is left
+enum class ReconcileActionType {
+    // Move the local file to where the server has it
+    kRename,
+    // Delete the local file, the server deleted it
+    kDelete,
+    // REQUEST_FILE_CONTENT for content newer on the server, or a file the
+    // client does not have; a missing folder is just created
+    kDownload,
+    // Send a new version: a new file, changed content, or a rename or
+    // deletion made while the client was not running
+    kUpload,
+};
+
+struct ReconcileAction {
+    ReconcileActionType type;
+    std::string id;  // empty for files the server has not seen
+    FileType file_type = FileType::FILE;
+    // Local path; for kDownload the server's path
+    std::string path;
+    // kRename: the server's path. kUpload of a local rename: the new path.
+    std::string new_path;
+    // kUpload only
+    bool deleted = false;
+    bool content_changed = false;
+};
+
+struct ReconcilerOptions {
+    // Workers scanning and diffing; 0 uses every core
+    size_t threads = 0;
+    // More partitions than workers even out uneven folders
+    size_t partitions_per_thread = 8;
+};
+
+struct ReconcileStats {
+    size_t server_files = 0;
+    size_t local_records = 0;
+    size_t local_entries = 0;
+    size_t partitions = 0;
+    size_t uploads = 0;
+    size_t downloads = 0;
+    size_t renames = 0;
+    size_t deletes = 0;
+    // Local renames recognized by content instead of a deletion and a new file
+    size_t paired_renames = 0;
+    // Phases in order: walking the local tree, loading the server listing
+    // and the metadata store, joining them by file id, joining the result
+    // with the local tree by path (including content hashes), and pairing
+    // files that moved between partitions
+    std::chrono::microseconds scan_time{0};
+    std::chrono::microseconds load_time{0};
+    std::chrono::microseconds join_time{0};
+    std::chrono::microseconds diff_time{0};
+    std::chrono::microseconds pair_time{0};
+    std::chrono::microseconds total_time{0};
+
+    std::string ToString() const;
+};
+
+struct ReconcilePlan {
+    // Sorted by type, then path
+    std::vector<ReconcileAction> actions;
+    ReconcileStats stats;
+};
+
+// Brings one synchronized directory in line with the server at startup, as
+// the spec's "update data" after REQUEST_VERSION. The server listing, the
+// metadata store and a walk of the local tree are split into partitions by
+// path prefix and compared on a pool of workers, so a directory with a
+// million files takes seconds rather than minutes.
+//
+// The plan only says what to do; the caller runs it through the upload and
+// download engines.
+class Reconciler {
+public:
+    Reconciler(MetadataStore& store, std::filesystem::path root, std::string directory_id,
+               ReconcilerOptions options = {});
+
+    Reconciler(const Reconciler&) = delete;
+    Reconciler& operator=(const Reconciler&) = delete;
+
+    // With a hash service, content edited while the client was not running
+    // is noticed, and local renames are told apart from a deletion and a
+    // new file. Without one only changes with a FIRST_TRY_TIME are uploaded.
+    void SetHashService(HashService* hashes);
+
+    // `listing` is the CHECK_VERSION answering REQUEST_VERSION, possibly
+    // split over several messages; files of other directories are ignored
+    absl::StatusOr<ReconcilePlan> Reconcile(const std::vector<CheckVersion>& listing);
+
+private:
+    MetadataStore& store_;
+    std::filesystem::path root_;
+    std::string directory_id_;
+    ReconcilerOptions options_;
+    HashService* hashes_ = nullptr;
+};
+
+}  // namespace synxpo
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace synxpo {
+
+struct RetryOptions {
+    // A FREE file is asked again after a delay that doubles with every
+    // retry from base_delay up to max_delay. The actual delay is drawn from
+    // its upper half, so files denied together do not all come back at once.
+    std::chrono::milliseconds base_delay{50};
+    std::chrono::milliseconds max_delay{10000};
+};
+
+struct RetryStats {
+    // Scheduled FREE retries and parked BLOCKED files right now
+    size_t scheduled = 0;
+    size_t parked = 0;
+    uint64_t free_retries = 0;
+    uint64_t blocked = 0;
+    // Parked files a CHECK_VERSION let go
+    uint64_t woken = 0;
+    uint64_t denied = 0;
+    // Most retries of one file before it went through
+    uint32_t max_attempts = 0;
+    // Backoff handed out to FREE retries, and time BLOCKED files waited for
+    // their CHECK_VERSION
+    std::chrono::microseconds free_wait{0};
+    std::chrono::microseconds blocked_wait{0};
+    std::chrono::microseconds max_blocked_wait{0};
+};
+
+// Jittered exponential backoff shared by every RetryManager instantiation
+class RetryBackoff {
+public:
+    explicit RetryBackoff(RetryOptions options);
+
+    // Delay before retry number `attempt`, counting from 1
+    std::chrono::microseconds Delay(uint32_t attempt);
+
+private:
+    RetryOptions options_;
+    std::mt19937_64 random_;
+};
+
+// What to do with files of a VERSION_INCREASE_DENY, by file id: FREE files
+// are retried after a backoff, BLOCKED files are parked until a
+// CHECK_VERSION names them, and DENIED files only count. Every lookup is by
+// key, so a CHECK_VERSION costs one hash lookup per file it lists however
+// much is parked.
+//
+// Not thread-safe; the owner's lock covers it.
+template <typename Item>
+class RetryManager {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit RetryManager(RetryOptions options = {}) : backoff_(options) {}
+
+    // FREE: hand `item` back from TakeDue() after the key's next backoff
+    void Retry(const std::string& key, Item item) {
+        auto& entry = entries_[key];
+        Unlink(entry);
+        ++entry.attempts;
+        auto delay = backoff_.Delay(entry.attempts);
+        entry.item.emplace(std::move(item));
+        entry.due = schedule_.emplace(Clock::now() + delay, key);
+        entry.scheduled = true;
+        ++stats_.free_retries;
+        stats_.free_wait += delay;
+    }
+
+    // BLOCKED: hold `item` until Wake(key)
+    void Park(const std::string& key, Item item) {
+        auto& entry = entries_[key];
+        Unlink(entry);
+        entry.item.emplace(std::move(item));
+        entry.parked_at = Clock::now();
+        entry.parked = true;
+        ++parked_;
+        ++stats_.blocked;
+    }
+
+    // The item parked under `key`, if any
+    std::optional<Item> Wake(const std::string& key) {
+        auto it = entries_.find(key);
+        if (it == entries_.end() || !it->second.parked) {
+            return std::nullopt;
+        }
+        auto waited = std::chrono::duration_cast<std::chrono::microseconds>(
+            Clock::now() - it->second.parked_at);
+        stats_.blocked_wait += waited;
+        stats_.max_blocked_wait = std::max(stats_.max_blocked_wait, waited);
+        ++stats_.woken;
+        return Take(it->second);
+    }
+
+    // FREE retries whose backoff is over, earliest first
+    std::vector<Item> TakeDue() {
+        std::vector<Item> due;
+        auto now = Clock::now();
+        while (!schedule_.empty() && schedule_.begin()->first <= now) {
+            auto& entry = entries_.at(schedule_.begin()->second);
+            due.push_back(Take(entry));
+        }
+        return due;
+    }
+
+    std::optional<Clock::time_point> NextDue() const {
+        if (schedule_.empty()) {
+            return std::nullopt;
+        }
+        return schedule_.begin()->first;
+    }
+
+    bool HasScheduled() const { return !schedule_.empty(); }
+
+    // A newer change of the file replaces whatever waits under `key`; the
+    // retry count stays
+    void Cancel(const std::string& key) {
+        auto it = entries_.find(key);
+        if (it != entries_.end()) {
+            Unlink(it->second);
+        }
+    }
+
+    // The file went through; its next denial starts from base_delay again
+    void Succeeded(const std::string& key) {
+        auto it = entries_.find(key);
+        if (it == entries_.end()) {
+            return;
+        }
+        Unlink(it->second);
+        stats_.max_attempts = std::max(stats_.max_attempts, it->second.attempts);
+        entries_.erase(it);
+    }
+
+    // DENIED: the file is brought up to date instead of being retried
+    void Denied(const std::string& key) {
+        ++stats_.denied;
+        auto it = entries_.find(key);
+        if (it != entries_.end()) {
+            Unlink(it->second);
+            entries_.erase(it);
+        }
+    }
+
+    RetryStats GetStats() const {
+        auto stats = stats_;
+        stats.scheduled = schedule_.size();
+        stats.parked = parked_;
+        return stats;
+    }
+
+private:
+    using Schedule = std::multimap<Clock::time_point, std::string>;
+
+    struct Entry {
+        uint32_t attempts = 0;
+        std::optional<Item> item;
+        bool scheduled = false;
+        typename Schedule::iterator due;
+        bool parked = false;
+        Clock::time_point parked_at;
+    };
+
+    // Drop the waiting item, if any
+    void Unlink(Entry& entry) {
+        if (entry.scheduled) {
+            schedule_.erase(entry.due);
+            entry.scheduled = false;
+        }
+        if (entry.parked) {
+            --parked_;
+            entry.parked = false;
+        }
+        entry.item.reset();
+    }
+
+    Item Take(Entry& entry) {
+        Item item = std::move(*entry.item);
+        Unlink(entry);
+        return item;
+    }
+
+    RetryBackoff backoff_;
+    // Entries stay after their item is taken, to remember the retry count
+    std::unordered_map<std::string, Entry> entries_;
+    Schedule schedule_;
+    size_t parked_ = 0;
+    RetryStats stats_;
+};
+
+}  // namespace synxpo
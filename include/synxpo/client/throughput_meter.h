@@ -0,0 +1,30 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+namespace synxpo {
+
+// Exponentially smoothed bytes-per-second rate, sampled in short intervals.
+// Idle periods decay the rate the next time it is read.
+class ThroughputMeter {
+public:
+    ThroughputMeter();
+
+    void Record(uint64_t bytes);
+
+    uint64_t TotalBytes() const;
+    double BytesPerSecond() const;
+
+private:
+    void Roll(std::chrono::steady_clock::time_point now) const;
+
+    mutable std::mutex mutex_;
+    uint64_t total_bytes_ = 0;
+    mutable uint64_t interval_bytes_ = 0;
+    mutable std::chrono::steady_clock::time_point interval_start_;
+    mutable double rate_ = 0.0;
+};
+
+}  // namespace synxpo
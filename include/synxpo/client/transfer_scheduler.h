@@ -0,0 +1,129 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <optional>
+
+namespace synxpo {
+
+// Lower is more urgent
+enum class TransferClass {
+    kInteractive = 0,
+    kNormal = 1,
+    kBulk = 2,
+};
+
+struct TransferSchedulerOptions {
+    // Transfers allowed to run at once, over all directories and both
+    // directions...
+    size_t max_active = 2;
+    // ...of which this many are kept for interactive ones, so a fresh edit
+    // never waits for a bulk transfer to finish
+    size_t reserved_interactive = 1;
+    // Small transfers, and files modified less than recent_age ago that are
+    // not bulk-sized, are interactive; transfers of bulk_bytes or more are
+    // bulk
+    uint64_t small_bytes = 1024 * 1024;
+    uint64_t bulk_bytes = 64 * 1024 * 1024;
+    std::chrono::seconds recent_age{300};
+    // Waiting moves a transfer up one class per aging_interval, so bulk
+    // transfers are delayed but never starved
+    std::chrono::milliseconds aging_interval{30000};
+};
+
+struct TransferSchedulerStats {
+    size_t active = 0;
+    size_t waiting = 0;
+    // Grants by the class the transfer asked for
+    uint64_t granted_interactive = 0;
+    uint64_t granted_normal = 0;
+    uint64_t granted_bulk = 0;
+    // Grants that happened in a better class thanks to aging
+    uint64_t promoted = 0;
+    std::chrono::microseconds max_wait{0};
+};
+
+// Orders transfers of the upload and download engines by priority class.
+// An engine classifies what it is about to send or fetch, asks for a slot
+// and holds the returned Ticket for the whole transfer. Waiting transfers
+// are granted in order of class after aging, then of arrival.
+class TransferScheduler {
+public:
+    // Holds a slot until destroyed
+    class Ticket {
+    public:
+        Ticket() = default;
+        Ticket(Ticket&& other) noexcept;
+        Ticket& operator=(Ticket&& other) noexcept;
+        ~Ticket();
+
+        explicit operator bool() const { return scheduler_ != nullptr; }
+        void Release();
+
+    private:
+        friend class TransferScheduler;
+        Ticket(TransferScheduler* scheduler, bool reserved)
+            : scheduler_(scheduler), reserved_(reserved) {}
+
+        TransferScheduler* scheduler_ = nullptr;
+        // Holds one of the reserved_interactive slots
+        bool reserved_ = false;
+    };
+
+    explicit TransferScheduler(TransferSchedulerOptions options = {});
+
+    TransferScheduler(const TransferScheduler&) = delete;
+    TransferScheduler& operator=(const TransferScheduler&) = delete;
+
+    // `modified` is the file's modification time, if known
+    TransferClass Classify(uint64_t bytes,
+                           std::optional<std::chrono::system_clock::time_point> modified) const;
+    // The class after aging of something queued since `queued_at`
+    TransferClass Effective(TransferClass priority,
+                            std::chrono::steady_clock::time_point queued_at) const;
+
+    // Block until the transfer may start. `queued_at` is when the work was
+    // first queued, so time spent in an engine's own queue counts towards
+    // aging. Returns an empty ticket if the scheduler was closed or
+    // `cancelled` returned true after a Wake().
+    Ticket Acquire(TransferClass priority, std::chrono::steady_clock::time_point queued_at,
+                   const std::function<bool()>& cancelled = nullptr);
+
+    // Make waiters check their `cancelled` again
+    void Wake();
+    // Wake up all waiters; subsequent Acquire calls fail
+    void Close();
+    void Reopen();
+
+    TransferSchedulerStats GetStats() const;
+
+private:
+    struct Waiter {
+        TransferClass priority;
+        std::chrono::steady_clock::time_point queued_at;
+        bool granted = false;
+        bool reserved = false;
+    };
+
+    // Callers hold mutex_
+    void Dispatch();
+    void Release(bool reserved);
+
+    const TransferSchedulerOptions options_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    // In arrival order
+    std::list<Waiter> waiters_;
+    size_t active_ = 0;
+    size_t active_reserved_ = 0;
+    bool closed_ = false;
+    TransferSchedulerStats stats_;
+};
+
+}  // namespace synxpo
@@ -0,0 +1,321 @@
+#pragma once
+
+#include <chrono>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+
+#include "synxpo.pb.h"
+#include "synxpo/client/change_journal.h"
+#include "synxpo/client/file_watcher.h"
+#include "synxpo/client/grpc_client.h"
+#include "synxpo/client/hash_service.h"
+#include "synxpo/client/metadata_store.h"
+#include "synxpo/client/page_cache.h"
+#include "synxpo/client/retry_manager.h"
+#include "synxpo/client/throughput_meter.h"
+#include "synxpo/client/transfer_scheduler.h"
+
+namespace synxpo {
+
+struct UploadEngineOptions {
+    // Changes are collected for this long after the first one before asking...
+    std::chrono::milliseconds batch_delay{200};
+    // ...unless this many files or this much content are already waiting.
+    // A batch holds server locks on all of its files until it is written.
+    size_t max_batch_files = 256;
+    uint64_t max_batch_bytes = 64 * 1024 * 1024;
+    // ASK_VERSION_INCREASE messages are split to stay under this size; the
+    // VERSION_INCREASED reply repeats every file, and gRPC rejects messages
+    // over 4 MB by default
+    size_t max_ask_bytes = 1024 * 1024;
+    // The spec caps FILE_WRITE chunks at 1 MB
+    size_t chunk_bytes = 1024 * 1024;
+    // Threads reading chunks ahead of the one being sent
+    size_t read_threads = 2;
+    // Reusable chunk buffers; read-ahead memory is read_buffers * chunk_bytes
+    size_t read_buffers = 8;
+    // Modified files at least this large are sent as FILE_DELTA against the
+    // server's version; 0 sends every file in full
+    uint64_t delta_min_bytes = 4 * 1024 * 1024;
+    // Other files at least this large are offered as content-defined chunks
+    // and only the chunks the server does not store are sent; 0 sends them
+    // whole
+    uint64_t dedup_min_bytes = 64 * 1024;
+    // Files at least this large are dropped from the page cache behind the
+    // reader, so uploading one bigger than RAM does not evict the rest of
+    // the host's working set; 0 leaves the cache alone
+    uint64_t drop_cache_min_bytes = 256 * 1024 * 1024;
+    std::chrono::milliseconds reply_timeout{30000};
+    // Backoff of files the server denied as FREE
+    RetryOptions retry;
+    // While the client is disconnected changes only pile up, and the
+    // connection is checked this often...
+    std::chrono::milliseconds offline_poll{1000};
+    // ...then the backlog goes in batches of up to this many files
+    size_t drain_batch_files = 4096;
+};
+
+struct UploadEngineStats {
+    uint64_t batches = 0;
+    uint64_t failed_batches = 0;
+    // What closed each batch: the file count, the content size or ASK
+    // message size, or batch_delay running out
+    uint64_t batches_full_count = 0;
+    uint64_t batches_full_bytes = 0;
+    uint64_t batches_delayed = 0;
+    // Batches that failed because the client was disconnected, and batches
+    // cut from the backlog after it reconnected
+    uint64_t offline_failures = 0;
+    uint64_t drain_batches = 0;
+    uint64_t files_asked = 0;
+    uint64_t files_uploaded = 0;
+    uint64_t bytes_uploaded = 0;
+    // Files sent as FILE_DELTA, and the bytes of them the server already had
+    uint64_t delta_files = 0;
+    uint64_t delta_matched_bytes = 0;
+    // Files offered as chunks, and the bytes of them the server already had
+    uint64_t dedup_files = 0;
+    uint64_t dedup_skipped_bytes = 0;
+    // Modified files whose content hash matched the last upload
+    uint64_t files_unchanged = 0;
+    // Bytes read and then dropped from the page cache
+    uint64_t cache_dropped_bytes = 0;
+    // VERSION_INCREASE_DENY statuses by kind
+    uint64_t denied_free = 0;
+    uint64_t denied_blocked = 0;
+    uint64_t denied = 0;
+    // Retry state of denied files; filled in by GetStats()
+    RetryStats retries;
+    // Time the sender waited for the disk, and readers waited for the network.
+    // Whichever dominates is the bottleneck.
+    std::chrono::microseconds send_stall{0};
+    std::chrono::microseconds read_stall{0};
+    double bytes_per_second = 0.0;
+};
+
+// Runs the "send new version" algorithm of the spec for one synchronized
+// directory: FileWatcher events are coalesced per path and batched into
+// ASK_VERSION_INCREASE by count, size and age; on VERSION_INCREASE_ALLOW
+// the content is streamed in chunks while reader threads fill a fixed pool
+// of buffers ahead of the sender, so disk reads overlap with chunks on the
+// wire.
+class UploadEngine {
+public:
+    // Called with the ids of files marked DENIED. The caller should bring them
+    // up to date with REQUEST_VERSION.
+    using DeniedCallback = std::function<void(const std::vector<std::string>& file_ids)>;
+
+    UploadEngine(GRPCClient& client, MetadataStore& store, std::filesystem::path root,
+                 std::string directory_id, UploadEngineOptions options = {});
+    ~UploadEngine();
+
+    UploadEngine(const UploadEngine&) = delete;
+    UploadEngine& operator=(const UploadEngine&) = delete;
+
+    void Start();
+    void Stop();
+
+    // Feed with FileWatcher events; paths outside the root are ignored
+    void OnFileEvent(const FileEvent& event);
+
+    // Ask again for BLOCKED files touched by this CHECK_VERSION
+    void OnCheckVersion(const CheckVersion& message);
+
+    void SetDeniedCallback(DeniedCallback callback);
+
+    // With a hash service, files whose content hash still matches the last
+    // uploaded version are not uploaded again. Set before Start().
+    void SetHashService(HashService* hashes);
+
+    // With a scheduler, the most urgent waiting changes go first and every
+    // batch waits for a slot before it is asked for. Without one, batches go
+    // in path order as soon as they are cut. Set before Start().
+    void SetScheduler(TransferScheduler* scheduler);
+
+    // With a journal, every change is recorded until the server confirms it,
+    // and the first Start() queues whatever an earlier run left unconfirmed.
+    // Set before Start().
+    void SetJournal(ChangeJournal* journal);
+
+    // Wait until no change is pending, being uploaded or waiting out a FREE
+    // backoff. BLOCKED files do not count, they wait for CHECK_VERSION.
+    bool WaitIdle(std::chrono::milliseconds timeout);
+
+    UploadEngineStats GetStats() const;
+
+private:
+    struct Change {
+        std::string path;
+        std::string id;  // empty for files the server has not seen yet
+        FileType type = FileType::FILE;
+        bool deleted = false;
+        bool content_changed = false;
+        uint64_t first_try_time = 0;
+        // Content to send and its mtime, as of the event
+        uint64_t size = 0;
+        std::optional<std::chrono::system_clock::time_point> modified;
+        // When the path started waiting; kept across retries for aging
+        std::chrono::steady_clock::time_point queued_at;
+        // Of the journal record, 0 if not journaled
+        uint64_t journal_sequence = 0;
+    };
+
+    // What to send of a file after OFFER_CHUNKS: runs of whole missing
+    // chunks, each at most chunk_bytes
+    struct ChunkPlan {
+        struct Range {
+            uint64_t offset;
+            size_t length;
+        };
+        std::vector<Range> ranges;
+        uint64_t content_hash = 0;
+        uint64_t skipped_bytes = 0;
+    };
+    // By the id the file goes under in FileChunk
+    using ChunkPlans = std::unordered_map<std::string, ChunkPlan>;
+
+    struct ReadTask {
+        uint64_t sequence;
+        int fd;
+        uint64_t offset;
+        size_t length;
+    };
+
+    struct ReadResult {
+        std::string buffer;
+        absl::Status status;
+    };
+
+    void Run();
+    void ProcessBatch(std::vector<Change> batch);
+    std::vector<Change> DropUnchanged(std::vector<Change> batch);
+    absl::Status RememberFirstTry(const std::vector<Change>& batch);
+    absl::StatusOr<ServerMessage> Ask(const std::vector<Change>& batch);
+    // `hashes` receives the content hash of every file sent, by path
+    using ContentHashes = std::unordered_map<std::string, uint64_t>;
+    absl::StatusOr<ServerMessage> Upload(const std::vector<Change>& batch,
+                                         const std::string& transfer_id, ContentHashes& hashes);
+    // BLOCK_SIGNATURES of the files in `batch` worth sending as a delta, by
+    // id, asked for in a single request
+    absl::StatusOr<std::unordered_map<std::string, BlockSignatures>> RequestSignatures(
+        const std::vector<Change>& batch);
+    // Chunk plans for the files in `files` worth offering
+    absl::StatusOr<ChunkPlans> PlanChunks(const std::vector<const Change*>& files);
+    absl::Status StreamContent(const std::vector<const Change*>& files, const ChunkPlans& plans,
+                               const std::function<absl::Status(FileChunk, std::string*)>& write,
+                               ContentHashes& hashes);
+    absl::Status StreamDelta(const Change& change, const BlockSignatures& base,
+                             const std::function<absl::Status(FileDelta)>& write,
+                             ContentHashes& hashes);
+    absl::Status RememberHashes(const VersionIncreased& message, const ContentHashes& hashes);
+    void HandleDeny(std::vector<Change> batch, const VersionIncreaseDeny& deny);
+    void Requeue(std::vector<Change> changes);
+    // Callers hold mutex_. Moves FREE retries whose backoff is over to
+    // pending_.
+    void ReleaseRetries();
+
+    // Callers hold mutex_. A change added to an empty queue starts the
+    // batch_delay clock; `replace` decides whether it overrides a change
+    // already waiting for the path.
+    void PutPending(Change change, bool replace);
+    Change TakePending(std::map<std::string, Change>::iterator it);
+    std::vector<Change> TakeBatch();
+    size_t BatchFiles() const;
+    void RestoreJournal();
+    void FillFileInfo(const Change& change, AskVersionIncrease::FileInfo* file) const;
+
+    void ReaderLoop();
+    void DrainReads();
+    void RecordDropped(const CacheTrimmer& trimmer);
+    // Callers hold mutex_. Queue the journal write; FlushJournal does it
+    // once mutex_ is released, so file events never wait for the disk.
+    void Journal(Change& change);
+    void Unjournal(const Change& change);
+    void FlushJournal();
+
+    // The protocol has no id for a file created by this request; the server
+    // matches its FileChunk and OfferChunks by CURRENT_PATH
+    static const std::string& WireId(const Change& change) {
+        return change.id.empty() ? change.path : change.id;
+    }
+    bool IsOurs(const google::protobuf::RepeatedPtrField<FileMetadata>& files) const;
+    std::optional<std::string> RelativePath(const std::filesystem::path& path) const;
+
+    GRPCClient& client_;
+    MetadataStore& store_;
+    std::filesystem::path root_;
+    std::string directory_id_;
+    UploadEngineOptions options_;
+
+    // Changes waiting for the next batch, by path
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::map<std::string, Change> pending_;
+    uint64_t pending_bytes_ = 0;
+    std::chrono::steady_clock::time_point pending_deadline_;
+    // Denied files waiting for a FREE retry or a CHECK_VERSION, by WireId
+    RetryManager<Change> retries_;
+    bool busy_ = false;
+    bool running_ = false;
+    DeniedCallback denied_callback_;
+    HashService* hashes_ = nullptr;
+    TransferScheduler* scheduler_ = nullptr;
+    ChangeJournal* journal_ = nullptr;
+    bool journal_restored_ = false;
+    // Journal writes in the order they were queued, done by one thread at a
+    // time
+    struct JournalWrite {
+        JournalEntry entry;
+        bool remove = false;
+    };
+    std::vector<JournalWrite> journal_writes_;
+    bool journal_flushing_ = false;
+    // Set when a batch failed for want of a connection; cleared once the
+    // client is connected again, when draining_ lets the backlog go in
+    // drain_batch_files batches until pending_ is empty
+    bool offline_ = false;
+    bool draining_ = false;
+    // Class of the batch waiting for a scheduler slot. A more urgent change
+    // or Stop() interrupts the wait and the batch goes back to pending_.
+    std::optional<TransferClass> acquiring_;
+    std::atomic<bool> interrupt_acquire_{false};
+    // Files whose delta or chunk offer the server rejected, by WireId; they
+    // go in full next time
+    std::set<std::string> send_full_;
+    std::thread worker_;
+
+    // Read-ahead: a reader takes a task and a free buffer together, so the
+    // buffers are always held by the lowest outstanding sequence numbers and
+    // the sender can never wait on a chunk that has no buffer
+    std::mutex read_mutex_;
+    std::condition_variable read_cv_;
+    std::condition_variable ready_cv_;
+    std::deque<ReadTask> read_tasks_;
+    std::vector<std::string> free_buffers_;
+    std::map<uint64_t, ReadResult> ready_;
+    size_t reads_in_flight_ = 0;
+    bool readers_stop_ = false;
+    std::vector<std::thread> readers_;
+
+    mutable std::mutex stats_mutex_;
+    UploadEngineStats stats_;
+    ThroughputMeter throughput_;
+};
+
+}  // namespace synxpo
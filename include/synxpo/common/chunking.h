@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "synxpo/common/content_hash.h"
+
+namespace synxpo {
+
+// Content-defined chunking in the manner of FastCDC. Cut points depend only
+// on the bytes around them, so an insertion moves the boundaries next to it
+// and leaves every other chunk intact; copies of the same data cut the same
+// way wherever they are. Chunks are named by their XXH3-64 and size.
+//
+// The cut test is a gear hash h = (h << 1) + GEAR[byte] over 32-bit words,
+// which covers the last 32 bytes. A chunk ends where the top bits of h are
+// zero: 15 bits while it is shorter than kNormalSize, 11 bits after, which
+// keeps most chunks close to the average. Every client must cut the same way
+// for the server to see their chunks as the same.
+struct ContentChunk {
+    uint64_t offset = 0;
+    uint32_t size = 0;
+    uint64_t hash = 0;
+};
+
+class Chunker {
+public:
+    static constexpr uint32_t kMinSize = 2 * 1024;
+    static constexpr uint32_t kNormalSize = 8 * 1024;
+    static constexpr uint32_t kMaxSize = 64 * 1024;
+
+    using Emit = std::function<void(const ContentChunk&)>;
+
+    // Content is fed in pieces of any size; chunks come out in order
+    void Update(const void* data, size_t size, const Emit& emit);
+    // Emits the last, possibly short, chunk
+    void Finish(const Emit& emit);
+
+private:
+    void Cut(uint64_t end, const uint8_t* data, const Emit& emit);
+
+    // Gear hash at the last byte fed
+    uint32_t gear_ = 0;
+    uint64_t offset_ = 0;
+    uint64_t chunk_start_ = 0;
+    // Bytes of the current chunk before this position are in the hasher
+    uint64_t hashed_ = 0;
+    ContentHasher hasher_;
+    // Possible chunk ends in the piece being fed
+    std::vector<uint64_t> candidates_;
+};
+
+// "avx512" or "scalar"
+const char* ChunkerImplementation();
+
+}  // namespace synxpo
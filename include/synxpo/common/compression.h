@@ -0,0 +1,101 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include <grpc/compression.h>
+#include <grpcpp/support/config.h>
+#include <grpcpp/support/sync_stream.h>
+
+namespace synxpo {
+
+// Per-message compression settings shared by the client and the server
+struct CompressionOptions {
+    // Algorithm for messages the policy lets through; GRPC_COMPRESS_NONE turns compression off
+    grpc_compression_algorithm algorithm = GRPC_COMPRESS_GZIP;
+    // Smaller messages are sent raw, the framing overhead would eat the saving
+    size_t min_message_bytes = 256;
+    // Payloads with a higher sampled entropy (bits per byte) are treated as
+    // already compressed: media, archives, encrypted files
+    double max_entropy_bits_per_byte = 7.2;
+    // Payload bytes inspected per message to estimate entropy
+    size_t entropy_sample_bytes = 4096;
+    // One in this many compressed payloads is also deflated here, the way
+    // gRPC does it, to measure the ratio actually achieved; 0 turns it off
+    size_t measure_every = 16;
+};
+
+struct CompressionStats {
+    uint64_t compressed_messages = 0;
+    uint64_t compressed_bytes = 0;
+    uint64_t raw_messages = 0;
+    uint64_t raw_bytes = 0;
+    // Payloads sent raw because their sample looked incompressible
+    uint64_t incompressible_payloads = 0;
+    // gRPC does not report the size of a message on the wire, so sampled
+    // payloads (see measure_every) are compressed again to count it: their
+    // size before and after
+    uint64_t measured_payloads = 0;
+    uint64_t measured_bytes = 0;
+    uint64_t measured_compressed_bytes = 0;
+
+    double MeasuredRatio() const {
+        return measured_compressed_bytes == 0
+                   ? 1.0
+                   : static_cast<double>(measured_bytes) / measured_compressed_bytes;
+    }
+
+    std::string ToString() const;
+};
+
+// Size of `data` once compressed by gRPC with `algorithm`. gRPC sends a
+// message raw when compression does not shrink it, so this is at most
+// data.size().
+size_t CompressedSize(std::string_view data, grpc_compression_algorithm algorithm);
+
+// Order-0 entropy in bits per byte of up to `sample_bytes` of `data`, taken
+// as a few blocks spread over the whole buffer
+double SampleEntropy(std::string_view data, size_t sample_bytes);
+
+std::string CompressionAlgorithmName(grpc_compression_algorithm algorithm);
+
+// Accepts the gRPC names: "identity", "deflate", "gzip"
+std::optional<grpc_compression_algorithm> ParseCompressionAlgorithm(std::string_view name);
+
+// Decides per message whether the stream's compression algorithm should be
+// applied. Control messages are compressed once they are big enough; file
+// payloads only when a sample of them looks compressible.
+class CompressionPolicy {
+public:
+    explicit CompressionPolicy(CompressionOptions options = {});
+
+    const CompressionOptions& GetOptions() const { return options_; }
+
+    // `payload` is the file data carried by the message, empty for control messages
+    bool ShouldCompress(size_t message_bytes, std::string_view payload);
+
+    // Write options for the message, with compression disabled when the policy declines
+    grpc::WriteOptions WriteOptionsFor(size_t message_bytes, std::string_view payload);
+
+    CompressionStats GetStats() const;
+    void ResetStats();
+
+private:
+    CompressionOptions options_;
+
+    std::atomic<uint64_t> compressed_messages_{0};
+    std::atomic<uint64_t> compressed_bytes_{0};
+    std::atomic<uint64_t> raw_messages_{0};
+    std::atomic<uint64_t> raw_bytes_{0};
+    std::atomic<uint64_t> incompressible_payloads_{0};
+    std::atomic<uint64_t> compressed_payloads_{0};
+    std::atomic<uint64_t> measured_payloads_{0};
+    std::atomic<uint64_t> measured_bytes_{0};
+    std::atomic<uint64_t> measured_compressed_bytes_{0};
+};
+
+}  // namespace synxpo
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace synxpo {
+
+// Incremental XXH3-64 (seed 0, default secret). Produces the same values as
+// the reference xxHash implementation, so hashes can be checked with stock
+// tools. The stripe loop runs with AVX-512 or AVX2 when the CPU has it;
+// every implementation gives the same result.
+class ContentHasher {
+public:
+    ContentHasher();
+
+    void Update(const void* data, size_t size);
+    void Update(std::string_view data) { Update(data.data(), data.size()); }
+
+    // Hash of everything passed to Update so far; the hasher stays usable
+    uint64_t Digest() const;
+
+    void Reset();
+
+private:
+    static constexpr size_t kStripeBytes = 64;
+    static constexpr size_t kShortInputBytes = 240;
+
+    void SwitchToLong();
+    void Consume(const uint8_t* data, size_t size);
+
+    alignas(64) std::array<uint64_t, 8> acc_;
+    uint64_t total_ = 0;
+    size_t stripes_in_block_ = 0;
+    bool long_ = false;
+    // Inputs up to 240 bytes are hashed in one go with the short-input paths
+    std::array<uint8_t, kShortInputBytes> short_;
+    // Bytes not consumed yet. A stripe is consumed only once more input
+    // follows it, since the stripe holding the last byte is treated specially.
+    std::array<uint8_t, kStripeBytes> pending_;
+    size_t pending_size_ = 0;
+    // The last consumed stripe, for a final stripe that starts inside it
+    std::array<uint8_t, kStripeBytes> previous_;
+};
+
+uint64_t HashContent(const void* data, size_t size);
+
+// "avx512", "avx2" or "scalar"
+const char* ContentHashImplementation();
+
+}  // namespace synxpo
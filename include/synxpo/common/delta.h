@@ -0,0 +1,140 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "synxpo.pb.h"
+
+namespace synxpo {
+
+// rsync-style delta encoding. The receiver describes the version it has as
+// signatures of fixed-size blocks; the sender finds those blocks anywhere in
+// its new content with a rolling checksum and sends only what is not there.
+
+struct BlockSignature {
+    uint32_t weak = 0;    // WeakChecksum of the block
+    uint64_t strong = 0;  // HashContent of the block
+};
+
+// Block size for signing a file of `file_size` bytes: about sqrt(file_size),
+// which balances the signature count against the literal data around an
+// edit, raised for huge files so BLOCK_SIGNATURES stays well under 4 MB
+uint32_t DeltaBlockSize(uint64_t file_size);
+
+// Rolling checksum of rsync: a = sum of bytes, b = sum of a over every
+// prefix, both mod 2^16; the result is a | b << 16
+uint32_t WeakChecksum(const void* data, size_t size);
+
+// Signatures of consecutive blocks of a stream; the last block may be short
+class SignatureBuilder {
+public:
+    explicit SignatureBuilder(uint32_t block_size);
+
+    void Update(const void* data, size_t size);
+    std::vector<BlockSignature> Finish();
+
+private:
+    uint32_t block_size_;
+    std::string block_;
+    std::vector<BlockSignature> signatures_;
+};
+
+struct DeltaOp {
+    // Literal bytes when non-empty, otherwise `block_count` blocks of the old
+    // version starting at `first_block`
+    std::string literal;
+    uint64_t first_block = 0;
+    uint64_t block_count = 0;
+};
+
+// Encodes new content against the signatures of an old version. Content is
+// fed in pieces of any size; ops come out in order through `emit`.
+// Consecutive matched blocks are merged into one op, literals are cut at
+// `max_literal` bytes.
+class DeltaEncoder {
+public:
+    using Emit = std::function<void(DeltaOp)>;
+
+    DeltaEncoder(uint32_t block_size, uint64_t base_size, std::vector<BlockSignature> signatures,
+                 size_t max_literal = 1024 * 1024);
+
+    void Update(const void* data, size_t size, const Emit& emit);
+    void Finish(const Emit& emit);
+
+    // Bytes covered by block references and sent as literals so far
+    uint64_t GetMatchedBytes() const { return matched_bytes_; }
+    uint64_t GetLiteralBytes() const { return literal_bytes_; }
+
+private:
+    struct Entry {
+        uint32_t weak;
+        uint32_t block;
+    };
+
+    size_t Bucket(uint32_t weak) const { return (weak * 0x9E3779B1U) >> bucket_shift_; }
+    // Two bits of one filter word, from a second, independent hash
+    size_t FilterWord(uint32_t weak) const { return (weak * 0x85EBCA77U) >> filter_shift_; }
+    static uint64_t FilterMask(uint32_t weak) {
+        uint32_t bits = weak * 0xC2B2AE3DU;
+        return (uint64_t{1} << (bits >> 26)) | (uint64_t{1} << ((bits >> 20) & 63));
+    }
+    bool MayMatch(uint32_t weak) const {
+        uint64_t mask = FilterMask(weak);
+        return (filter_[FilterWord(weak)] & mask) == mask;
+    }
+    // Index of an old block with this content, preferring the one after the
+    // last match so runs merge; -1 if none
+    int64_t Find(uint32_t weak, const uint8_t* window, size_t length) const;
+
+    void Scan(const Emit& emit);
+    void EmitLiteral(size_t end, const Emit& emit);
+    void EmitBlock(uint64_t block, const Emit& emit);
+    void FlushBlocks(const Emit& emit);
+
+    uint32_t block_size_;
+    size_t max_literal_;
+    std::vector<BlockSignature> signatures_;
+    // Length of a short last block of the old version, 0 if it is full
+    size_t tail_size_ = 0;
+
+    // Full blocks grouped by bucket of their weak checksum, behind a Bloom
+    // filter of 32 bits per block. Most positions match nothing; the filter
+    // rejects all but a fraction of a percent of them with one cached load.
+    int bucket_shift_ = 32;
+    int filter_shift_ = 32;
+    std::vector<uint64_t> filter_;
+    std::vector<uint32_t> bucket_start_;
+    std::vector<Entry> entries_;
+
+    // Unprocessed content. The window being checked starts at position_,
+    // literal data not emitted yet at literal_start_.
+    std::vector<uint8_t> buffer_;
+    size_t position_ = 0;
+    size_t literal_start_ = 0;
+    bool rolling_ = false;
+    uint32_t a_ = 0;
+    uint32_t b_ = 0;
+
+    // Matched blocks not emitted yet
+    uint64_t run_first_ = 0;
+    uint64_t run_count_ = 0;
+
+    uint64_t matched_bytes_ = 0;
+    uint64_t literal_bytes_ = 0;
+};
+
+// Append `op` to a FILE_DELTA message
+void AddDeltaOp(DeltaOp op, FileDelta* delta);
+
+// Literal bytes carried by a FILE_DELTA message
+size_t DeltaLiteralBytes(const FileDelta& delta);
+
+// The first literal of the message, for the compression policy to sample;
+// empty if the message only references blocks
+std::string_view DeltaPayload(const FileDelta& delta);
+
+}  // namespace synxpo
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+
+namespace synxpo {
+
+// A content-defined chunk, named by its XXH3-64 and size as in OFFER_CHUNKS
+struct ChunkRef {
+    uint64_t hash = 0;
+    uint32_t size = 0;
+
+    bool operator==(const ChunkRef& other) const = default;
+};
+
+struct ChunkRefHash {
+    size_t operator()(const ChunkRef& ref) const { return ref.hash ^ ref.size; }
+};
+
+struct ChunkStoreStats {
+    uint64_t chunks = 0;
+    uint64_t manifests = 0;
+    // Bytes on disk, and what the manifests would take stored whole
+    uint64_t stored_bytes = 0;
+    uint64_t referenced_bytes = 0;
+    // Chunks asked for by Acquire, and how many of them were already stored
+    uint64_t chunks_offered = 0;
+    uint64_t chunks_found = 0;
+};
+
+// Content of every file version on the server, shared by all directories. A
+// file version is a manifest, the list of its chunks; a chunk is stored
+// once however many manifests in whichever directories name it.
+//
+// Chunks live as long as a manifest refers to them. Between MISSING_CHUNKS
+// and FILE_WRITE_END an upload relies on chunks it did not send, so it pins
+// them with Acquire until its manifest is written or dropped.
+class ChunkStore {
+public:
+    // Opens the store at `path`, created if needed. Reference counts are
+    // rebuilt from the manifests; chunks that no manifest names are
+    // leftovers of interrupted uploads and are removed.
+    static absl::StatusOr<std::unique_ptr<ChunkStore>> Open(const std::filesystem::path& path);
+
+    ChunkStore(const ChunkStore&) = delete;
+    ChunkStore& operator=(const ChunkStore&) = delete;
+
+    // Pins every chunk of `refs` and returns the indices of those not
+    // stored, which the client has to send. A chunk that repeats is asked
+    // for once.
+    std::vector<uint32_t> Acquire(const std::vector<ChunkRef>& refs);
+    // Stores a chunk the client sent, after checking it against its name.
+    // The chunk must stay pinned until this returns.
+    absl::Status Put(const ChunkRef& ref, std::string_view data);
+    // Drops the pins of Acquire; unreferenced chunks are removed
+    void Release(const std::vector<ChunkRef>& refs);
+
+    absl::Status Read(const ChunkRef& ref, std::string* data) const;
+
+    // Manifests are keyed by the file they describe, e.g. its id. Every
+    // chunk must be stored; the previous manifest of the key is replaced.
+    absl::Status PutManifest(const std::string& key, const std::vector<ChunkRef>& refs);
+    absl::StatusOr<std::vector<ChunkRef>> GetManifest(const std::string& key) const;
+    absl::Status RemoveManifest(const std::string& key);
+
+    ChunkStoreStats GetStats() const;
+
+private:
+    struct Entry {
+        uint32_t references = 0;
+        uint32_t pins = 0;
+        // False while a pinned chunk is on its way, or if a manifest names a
+        // chunk that was lost
+        bool stored = false;
+    };
+
+    explicit ChunkStore(std::filesystem::path path);
+
+    absl::Status Load();
+    std::filesystem::path ChunkPath(const ChunkRef& ref) const;
+    absl::StatusOr<std::filesystem::path> ManifestPath(const std::string& key) const;
+    absl::StatusOr<std::vector<ChunkRef>> ReadManifest(const std::filesystem::path& path) const;
+    // Callers hold mutex_
+    void Unreference(const std::vector<ChunkRef>& refs);
+    void RemoveIfUnused(const ChunkRef& ref);
+
+    std::filesystem::path path_;
+
+    // Serializes manifest writers, so a key is never replaced twice at once
+    std::mutex manifest_mutex_;
+    mutable std::mutex mutex_;
+    std::unordered_map<ChunkRef, Entry, ChunkRefHash> chunks_;
+    ChunkStoreStats stats_;
+};
+
+}  // namespace synxpo
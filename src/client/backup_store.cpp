@@ -0,0 +1,289 @@
+#include "synxpo/client/backup_store.h"
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <absl/strings/str_cat.h>
+
+namespace synxpo {
+
+namespace {
+
+constexpr size_t kCopyBufferBytes = 1024 * 1024;
+
+absl::Status ErrnoError(const char* what, const std::filesystem::path& path) {
+    return absl::InternalError(
+        absl::StrCat(what, " ", path.string(), ": ", std::strerror(errno)));
+}
+
+// Errors after which the faster method will not work for this pair of
+// filesystems at all, as opposed to a failure of this particular file
+bool IsUnsupported(int error) {
+    return error == EOPNOTSUPP || error == ENOTTY || error == ENOSYS ||
+           error == EXDEV || error == EINVAL;
+}
+
+class FileDescriptor {
+public:
+    explicit FileDescriptor(int fd) : fd_(fd) {}
+    ~FileDescriptor() {
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+    }
+    FileDescriptor(const FileDescriptor&) = delete;
+    FileDescriptor& operator=(const FileDescriptor&) = delete;
+
+    int get() const { return fd_; }
+
+private:
+    int fd_;
+};
+
+}  // namespace
+
+const char* BackupMethodName(BackupMethod method) {
+    switch (method) {
+        case BackupMethod::kRename: return "rename";
+        case BackupMethod::kHardlink: return "hardlink";
+        case BackupMethod::kReflink: return "reflink";
+        case BackupMethod::kCopyRange: return "copy_file_range";
+        case BackupMethod::kCopy: return "copy";
+    }
+    return "unknown";
+}
+
+absl::StatusOr<std::unique_ptr<BackupStore>> BackupStore::Open(
+    const std::filesystem::path& path, const std::filesystem::path& root) {
+    std::error_code error;
+    std::filesystem::remove_all(path, error);
+    if (!error) {
+        std::filesystem::create_directories(path, error);
+    }
+    if (error) {
+        return absl::InternalError(
+            absl::StrCat("Failed to prepare backup store ", path.string(), ": ", error.message()));
+    }
+    return std::unique_ptr<BackupStore>(new BackupStore(path, root));
+}
+
+BackupStore::BackupStore(std::filesystem::path path, std::filesystem::path root)
+    : path_(std::move(path)), root_(std::move(root)) {}
+
+std::filesystem::path BackupStore::NextLocation(const std::string& path) {
+    // Flat and unique; the file name is kept only to make the store readable
+    char prefix[32];
+    std::snprintf(prefix, sizeof(prefix), "%016llx-",
+                  static_cast<unsigned long long>(next_id_.fetch_add(1)));
+    auto name = std::filesystem::path(path).filename().string();
+    return path_ / absl::StrCat(prefix, name.substr(0, 200));
+}
+
+absl::StatusOr<Backup> BackupStore::Snapshot(const std::string& path) {
+    return Copy(path);
+}
+
+absl::StatusOr<Backup> BackupStore::Preserve(const std::string& path) {
+    auto source = root_ / path;
+    struct stat st;
+    if (::lstat(source.c_str(), &st) != 0) {
+        return ErrnoError("Failed to back up", source);
+    }
+
+    Backup backup{path, NextLocation(path), BackupMethod::kHardlink,
+                  static_cast<uint64_t>(st.st_size)};
+    if (S_ISREG(st.st_mode) && ::link(source.c_str(), backup.location.c_str()) == 0) {
+        Count(backup.method, 0);
+        return backup;
+    }
+    // Other filesystem, or one without hard links
+    return Copy(path);
+}
+
+absl::StatusOr<Backup> BackupStore::Take(const std::string& path) {
+    auto source = root_ / path;
+    struct stat st;
+    if (::lstat(source.c_str(), &st) != 0) {
+        return ErrnoError("Failed to back up", source);
+    }
+
+    Backup backup{path, NextLocation(path), BackupMethod::kRename,
+                  static_cast<uint64_t>(st.st_size)};
+    if (::rename(source.c_str(), backup.location.c_str()) == 0) {
+        Count(backup.method, 0);
+        return backup;
+    }
+    if (errno != EXDEV) {
+        return ErrnoError("Failed to back up", source);
+    }
+
+    auto copied = Copy(path);
+    if (!copied.ok()) {
+        return copied;
+    }
+    if (::unlink(source.c_str()) != 0) {
+        auto status = ErrnoError("Failed to remove", source);
+        Release(*copied).IgnoreError();
+        return status;
+    }
+    return copied;
+}
+
+absl::StatusOr<Backup> BackupStore::Copy(const std::string& path) {
+    auto source = root_ / path;
+    FileDescriptor from(::open(source.c_str(), O_RDONLY | O_CLOEXEC));
+    struct stat st;
+    if (from.get() < 0 || ::fstat(from.get(), &st) != 0) {
+        return ErrnoError("Failed to back up", source);
+    }
+
+    Backup backup{path, NextLocation(path), BackupMethod::kCopy,
+                  static_cast<uint64_t>(st.st_size)};
+    FileDescriptor to(::open(backup.location.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                             (st.st_mode & 07777) | S_IRUSR | S_IWUSR));
+    if (to.get() < 0) {
+        return ErrnoError("Failed to create backup", backup.location);
+    }
+
+    auto status = CopyContent(from.get(), to.get(), backup);
+    if (!status.ok()) {
+        ::unlink(backup.location.c_str());
+        return status;
+    }
+    // Not synced: a backup only has to outlive the operation it protects, and
+    // after a crash the store is cleared anyway
+    return backup;
+}
+
+absl::Status BackupStore::CopyContent(int from, int to, Backup& backup) {
+    if (reflink_supported_.load(std::memory_order_relaxed)) {
+        if (::ioctl(to, FICLONE, from) == 0) {
+            backup.method = BackupMethod::kReflink;
+            Count(backup.method, 0);
+            return absl::OkStatus();
+        }
+        if (IsUnsupported(errno)) {
+            reflink_supported_.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    // Copy until EOF rather than up to the size seen by fstat, so a file
+    // that grows meanwhile is copied as far as it got
+    uint64_t copied = 0;
+    if (copy_range_supported_.load(std::memory_order_relaxed)) {
+        while (true) {
+            ssize_t n = ::copy_file_range(from, nullptr, to, nullptr, kCopyBufferBytes, 0);
+            if (n > 0) {
+                copied += static_cast<uint64_t>(n);
+                continue;
+            }
+            if (n == 0) {
+                backup.method = BackupMethod::kCopyRange;
+                backup.size = copied;
+                Count(backup.method, copied);
+                return absl::OkStatus();
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (copied == 0 && IsUnsupported(errno)) {
+                copy_range_supported_.store(false, std::memory_order_relaxed);
+                break;
+            }
+            return ErrnoError("Failed to copy", backup.path);
+        }
+    }
+
+    std::vector<char> buffer(kCopyBufferBytes);
+    while (true) {
+        ssize_t n = ::read(from, buffer.data(), buffer.size());
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return ErrnoError("Failed to read", backup.path);
+        }
+        if (n == 0) {
+            break;
+        }
+        ssize_t written = 0;
+        while (written < n) {
+            ssize_t w = ::write(to, buffer.data() + written, static_cast<size_t>(n - written));
+            if (w < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return ErrnoError("Failed to write", backup.location);
+            }
+            written += w;
+        }
+        copied += static_cast<uint64_t>(n);
+    }
+    backup.method = BackupMethod::kCopy;
+    backup.size = copied;
+    Count(backup.method, copied);
+    return absl::OkStatus();
+}
+
+absl::Status BackupStore::Restore(const Backup& backup) {
+    auto target = root_ / backup.path;
+    std::error_code error;
+    std::filesystem::create_directories(target.parent_path(), error);
+
+    // Atomic: readers see either the current file or the restored one
+    if (::rename(backup.location.c_str(), target.c_str()) != 0) {
+        if (errno != EXDEV) {
+            return ErrnoError("Failed to restore", target);
+        }
+        // The store is on another filesystem: copy next to the target first
+        auto temp = target;
+        temp += ".synxpo-restore";
+        std::filesystem::copy_file(backup.location, temp,
+                                   std::filesystem::copy_options::overwrite_existing, error);
+        if (error || ::rename(temp.c_str(), target.c_str()) != 0) {
+            std::filesystem::remove(temp, error);
+            return absl::InternalError(absl::StrCat("Failed to restore ", target.string()));
+        }
+        std::filesystem::remove(backup.location, error);
+    }
+
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    ++stats_.restores;
+    return absl::OkStatus();
+}
+
+absl::Status BackupStore::Release(const Backup& backup) {
+    if (::unlink(backup.location.c_str()) != 0 && errno != ENOENT) {
+        return ErrnoError("Failed to release backup", backup.location);
+    }
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    ++stats_.releases;
+    return absl::OkStatus();
+}
+
+void BackupStore::Count(BackupMethod method, uint64_t bytes_copied) {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    switch (method) {
+        case BackupMethod::kRename: ++stats_.renames; break;
+        case BackupMethod::kHardlink: ++stats_.hardlinks; break;
+        case BackupMethod::kReflink: ++stats_.reflinks; break;
+        case BackupMethod::kCopyRange: ++stats_.range_copies; break;
+        case BackupMethod::kCopy: ++stats_.plain_copies; break;
+    }
+    stats_.bytes_copied += bytes_copied;
+}
+
+BackupStoreStats BackupStore::GetStats() const {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    return stats_;
+}
+
+}  // namespace synxpo
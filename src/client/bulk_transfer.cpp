@@ -0,0 +1,217 @@
+#include "synxpo/client/bulk_transfer.h"
+
+#include "synxpo/common/delta.h"
+
+namespace synxpo {
+
+BulkTransfer::BulkTransfer(std::shared_ptr<grpc::Channel> channel, std::string transfer_id,
+                           RateLimiter* upload_limiter, RateLimiter* download_limiter,
+                           CompressionPolicy* compression_policy,
+                           std::function<void()> on_write_end)
+    : channel_(std::move(channel)),
+      transfer_id_(std::move(transfer_id)),
+      upload_limiter_(upload_limiter),
+      download_limiter_(download_limiter),
+      compression_policy_(compression_policy),
+      on_write_end_(std::move(on_write_end)) {}
+
+BulkTransfer::~BulkTransfer() {
+    if (stream_ && !finished_) {
+        Cancel();
+        stream_->Finish();
+    }
+}
+
+absl::Status BulkTransfer::Open(grpc_compression_algorithm algorithm) {
+    if (algorithm != GRPC_COMPRESS_NONE) {
+        context_.set_compression_algorithm(algorithm);
+    }
+    // Same method as SyncService::Stub::BulkTransfer, but replies are left serialized
+    stream_ = RawStream<BulkMessage>::Open(channel_, "/synxpo.SyncService/BulkTransfer", &context_);
+    if (!stream_) {
+        return absl::InternalError("Failed to create bulk transfer stream");
+    }
+
+    BulkMessage message;
+    message.mutable_open()->set_transfer_id(transfer_id_);
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    if (!stream_->Write(message)) {
+        return absl::UnavailableError("Failed to open bulk transfer");
+    }
+    return absl::OkStatus();
+}
+
+absl::Status BulkTransfer::WriteFileChunk(FileChunk chunk, std::string* reclaim) {
+    if (!upload_limiter_->Acquire(chunk.directory_id(), chunk.data().size())) {
+        return absl::CancelledError("Client is disconnecting");
+    }
+
+    BulkMessage message;
+    *message.mutable_file_write()->mutable_chunk() = std::move(chunk);
+    size_t message_bytes = message.ByteSizeLong();
+    auto write_options = compression_policy_->WriteOptionsFor(
+        message_bytes, message.file_write().chunk().data());
+
+    absl::Status status;
+    {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        if (writes_done_) {
+            status = absl::FailedPreconditionError("FILE_WRITE_END was already sent");
+        } else if (!stream_->Write(message, write_options)) {
+            status = absl::UnavailableError("Failed to write to bulk transfer stream");
+        } else {
+            bytes_sent_.fetch_add(message_bytes, std::memory_order_relaxed);
+        }
+    }
+
+    if (reclaim) {
+        reclaim->swap(*message.mutable_file_write()->mutable_chunk()->mutable_data());
+    }
+    return status;
+}
+
+absl::Status BulkTransfer::WriteFileDelta(FileDelta delta) {
+    if (!upload_limiter_->Acquire(delta.directory_id(), DeltaLiteralBytes(delta))) {
+        return absl::CancelledError("Client is disconnecting");
+    }
+
+    BulkMessage message;
+    *message.mutable_file_delta() = std::move(delta);
+    size_t message_bytes = message.ByteSizeLong();
+    auto write_options =
+        compression_policy_->WriteOptionsFor(message_bytes, DeltaPayload(message.file_delta()));
+
+    absl::Status status;
+    {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        if (writes_done_) {
+            status = absl::FailedPreconditionError("FILE_WRITE_END was already sent");
+        } else if (!stream_->Write(message, write_options)) {
+            status = absl::UnavailableError("Failed to write to bulk transfer stream");
+        } else {
+            bytes_sent_.fetch_add(message_bytes, std::memory_order_relaxed);
+        }
+    }
+
+    return status;
+}
+
+absl::Status BulkTransfer::WriteFileEnd() {
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    if (writes_done_) {
+        return absl::OkStatus();
+    }
+
+    BulkMessage message;
+    message.mutable_file_write_end();
+    grpc::WriteOptions write_options;
+    write_options.set_last_message();
+    writes_done_ = true;
+    if (on_write_end_) {
+        on_write_end_();
+    }
+    if (!stream_->Write(message, write_options)) {
+        return absl::UnavailableError("Failed to write to bulk transfer stream");
+    }
+    return absl::OkStatus();
+}
+
+bool BulkTransfer::ReadRaw(std::vector<grpc::Slice>* slices) {
+    grpc::ByteBuffer buffer;
+    if (!stream_->Read(&buffer)) {
+        return false;
+    }
+    bytes_received_.fetch_add(buffer.Length(), std::memory_order_relaxed);
+    slices->clear();
+    return buffer.Dump(slices).ok();
+}
+
+absl::StatusOr<std::optional<FileChunk>> BulkTransfer::ReadFileChunk() {
+    std::vector<grpc::Slice> slices;
+    if (!ReadRaw(&slices)) {
+        auto status = Finish();
+        return status.ok() ? absl::DataLossError("Bulk transfer ended before FILE_WRITE_END")
+                           : status;
+    }
+
+    BulkMessage message;
+    grpc::ByteBuffer buffer(slices.data(), slices.size());
+    if (!grpc::SerializationTraits<BulkMessage>::Deserialize(&buffer, &message).ok()) {
+        return absl::InternalError("Failed to parse bulk transfer message");
+    }
+
+    switch (message.message_case()) {
+        case BulkMessage::kFileWrite: {
+            const auto& chunk = message.file_write().chunk();
+            download_limiter_->Acquire(chunk.directory_id(), chunk.data().size());
+            return std::optional<FileChunk>(std::move(*message.mutable_file_write()->mutable_chunk()));
+        }
+        case BulkMessage::kFileWriteEnd:
+            return std::optional<FileChunk>();
+        default:
+            return absl::InternalError("Unexpected message on bulk transfer stream");
+    }
+}
+
+absl::Status BulkTransfer::ReceiveInto(FileWriteSink& sink) {
+    std::vector<grpc::Slice> slices;
+    while (ReadRaw(&slices)) {
+        auto chunk = ParseRawFileWrite(slices);
+        if (!chunk) {
+            // Anything but a chunk has to be FILE_WRITE_END
+            BulkMessage message;
+            grpc::ByteBuffer buffer(slices.data(), slices.size());
+            if (grpc::SerializationTraits<BulkMessage>::Deserialize(&buffer, &message).ok() &&
+                message.has_file_write_end()) {
+                return absl::OkStatus();
+            }
+            return absl::InternalError("Unexpected message on bulk transfer stream");
+        }
+
+        // Charged before the write, like ReadFileChunk, so the limit paces
+        // the disk as well as the stream
+        download_limiter_->Acquire(chunk->header.directory_id, chunk->header.size);
+        int fd = sink.TargetFd(chunk->header);
+        if (fd < 0) {
+            continue;
+        }
+        // The sink keeps the descriptor open until it hears back
+        sink.OnChunkWritten(chunk->header, WriteRawFileChunk(fd, slices, *chunk));
+    }
+
+    auto status = Finish();
+    return status.ok() ? absl::DataLossError("Bulk transfer ended before FILE_WRITE_END") : status;
+}
+
+absl::Status BulkTransfer::Finish() {
+    if (finished_) {
+        return absl::OkStatus();
+    }
+    {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        if (!writes_done_) {
+            stream_->WritesDone();
+            writes_done_ = true;
+        }
+    }
+
+    // Drain whatever the server still sends so Finish does not block on it
+    grpc::ByteBuffer buffer;
+    while (stream_->Read(&buffer)) {
+        bytes_received_.fetch_add(buffer.Length(), std::memory_order_relaxed);
+    }
+
+    finished_ = true;
+    auto status = stream_->Finish();
+    if (!status.ok()) {
+        return absl::Status(static_cast<absl::StatusCode>(status.error_code()),
+                            status.error_message());
+    }
+    return absl::OkStatus();
+}
+
+void BulkTransfer::Cancel() {
+    context_.TryCancel();
+}
+
+}  // namespace synxpo
@@ -0,0 +1,446 @@
+#include "synxpo/client/change_journal.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <absl/strings/str_cat.h>
+
+#include "synxpo/common/content_hash.h"
+
+namespace synxpo {
+
+namespace {
+
+constexpr char kMagic[8] = {'S', 'X', 'P', 'O', 'J', 'R', 'N', 'L'};
+constexpr uint32_t kFormatVersion = 1;
+constexpr size_t kHeaderBytes = sizeof(kMagic) + sizeof(uint32_t);
+// Record size and XXH3 of the payload
+constexpr size_t kFrameBytes = sizeof(uint32_t) + sizeof(uint64_t);
+
+constexpr uint8_t kRecordPut = 1;
+constexpr uint8_t kRecordRemove = 2;
+
+constexpr uint8_t kFlagFolder = 1;
+constexpr uint8_t kFlagDeleted = 2;
+constexpr uint8_t kFlagContentChanged = 4;
+
+absl::Status ErrnoError(const char* what, const std::filesystem::path& path) {
+    return absl::InternalError(
+        absl::StrCat(what, " ", path.string(), ": ", std::strerror(errno)));
+}
+
+// The journal is only read back on the same machine, so integers are stored
+// in host byte order
+template <typename T>
+void AppendValue(std::string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void AppendString(std::string& out, const std::string& value) {
+    AppendValue(out, static_cast<uint16_t>(value.size()));
+    out += value;
+}
+
+class RecordReader {
+public:
+    RecordReader(const char* data, size_t size) : data_(data), left_(size) {}
+
+    template <typename T>
+    bool Read(T* value) {
+        if (left_ < sizeof(T)) {
+            return false;
+        }
+        std::memcpy(value, data_, sizeof(T));
+        data_ += sizeof(T);
+        left_ -= sizeof(T);
+        return true;
+    }
+
+    bool ReadString(std::string* value) {
+        uint16_t size;
+        if (!Read(&size) || left_ < size) {
+            return false;
+        }
+        value->assign(data_, size);
+        data_ += size;
+        left_ -= size;
+        return true;
+    }
+
+private:
+    const char* data_;
+    size_t left_;
+};
+
+std::string Frame(const std::string& payload) {
+    std::string record;
+    AppendValue(record, static_cast<uint32_t>(payload.size()));
+    AppendValue(record, HashContent(payload.data(), payload.size()));
+    record += payload;
+    return record;
+}
+
+std::string PutRecord(const JournalEntry& entry) {
+    std::string payload;
+    AppendValue(payload, kRecordPut);
+    AppendValue(payload, entry.sequence);
+    uint8_t flags = (entry.type == FileType::FOLDER ? kFlagFolder : 0) |
+                    (entry.deleted ? kFlagDeleted : 0) |
+                    (entry.content_changed ? kFlagContentChanged : 0);
+    AppendValue(payload, flags);
+    AppendValue(payload, entry.first_try_time);
+    AppendString(payload, entry.id);
+    AppendString(payload, entry.path);
+    return Frame(payload);
+}
+
+std::string RemoveRecord(const std::string& path, uint64_t sequence) {
+    std::string payload;
+    AppendValue(payload, kRecordRemove);
+    AppendValue(payload, sequence);
+    AppendString(payload, path);
+    return Frame(payload);
+}
+
+std::string Header() {
+    std::string header(kMagic, sizeof(kMagic));
+    AppendValue(header, kFormatVersion);
+    return header;
+}
+
+absl::Status WriteAll(int fd, const std::string& data, const std::filesystem::path& path) {
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return ErrnoError("Failed to write", path);
+        }
+        done += static_cast<size_t>(n);
+    }
+    return absl::OkStatus();
+}
+
+absl::Status SyncDirectory(const std::filesystem::path& file) {
+    auto dir = file.parent_path().empty() ? std::filesystem::path(".") : file.parent_path();
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return ErrnoError("Failed to open", dir);
+    }
+    auto status = ::fsync(fd) == 0 ? absl::OkStatus() : ErrnoError("Failed to sync", dir);
+    ::close(fd);
+    return status;
+}
+
+}  // namespace
+
+ChangeJournal::ChangeJournal(std::filesystem::path file, ChangeJournalOptions options)
+    : file_(std::move(file)), options_(options), last_sync_(std::chrono::steady_clock::now()) {}
+
+absl::StatusOr<std::unique_ptr<ChangeJournal>> ChangeJournal::Open(
+    const std::filesystem::path& file, ChangeJournalOptions options) {
+    std::unique_ptr<ChangeJournal> journal(new ChangeJournal(file, options));
+    journal->fd_ = ::open(file.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (journal->fd_ < 0) {
+        return ErrnoError("Failed to open", file);
+    }
+    auto status = journal->Replay();
+    if (!status.ok()) {
+        return status;
+    }
+    return journal;
+}
+
+ChangeJournal::~ChangeJournal() {
+    if (fd_ < 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto status = SyncLocked();
+    if (!status.ok()) {
+        std::cerr << "Failed to sync change journal: " << status.message() << std::endl;
+    }
+    ::close(fd_);
+}
+
+absl::Status ChangeJournal::Replay() {
+    struct stat info;
+    if (::fstat(fd_, &info) != 0) {
+        return ErrnoError("Failed to stat", file_);
+    }
+
+    std::string data(static_cast<size_t>(info.st_size), '\0');
+    size_t read_total = 0;
+    while (read_total < data.size()) {
+        ssize_t n = ::pread(fd_, data.data() + read_total, data.size() - read_total,
+                            static_cast<off_t>(read_total));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return ErrnoError("Failed to read", file_);
+        }
+        read_total += static_cast<size_t>(n);
+    }
+
+    if (data.empty()) {
+        auto header = Header();
+        auto status = WriteAll(fd_, header, file_);
+        if (!status.ok()) {
+            return status;
+        }
+        file_bytes_ = header.size();
+        return absl::OkStatus();
+    }
+    if (data.size() < kHeaderBytes || std::memcmp(data.data(), kMagic, sizeof(kMagic)) != 0) {
+        return absl::DataLossError(absl::StrCat(file_.string(), " is not a change journal"));
+    }
+    uint32_t version;
+    std::memcpy(&version, data.data() + sizeof(kMagic), sizeof(version));
+    if (version != kFormatVersion) {
+        return absl::FailedPreconditionError(
+            absl::StrCat("Unsupported change journal version ", version));
+    }
+
+    size_t offset = kHeaderBytes;
+    while (offset + kFrameBytes <= data.size()) {
+        uint32_t size;
+        uint64_t hash;
+        std::memcpy(&size, data.data() + offset, sizeof(size));
+        std::memcpy(&hash, data.data() + offset + sizeof(size), sizeof(hash));
+        const char* payload = data.data() + offset + kFrameBytes;
+        if (offset + kFrameBytes + size > data.size() || HashContent(payload, size) != hash) {
+            break;  // torn tail of an interrupted append
+        }
+
+        RecordReader reader(payload, size);
+        uint8_t kind;
+        uint64_t sequence;
+        if (!reader.Read(&kind) || !reader.Read(&sequence)) {
+            return absl::DataLossError("Corrupted change journal record");
+        }
+        if (kind == kRecordPut) {
+            JournalEntry entry;
+            uint8_t flags;
+            if (!reader.Read(&flags) || !reader.Read(&entry.first_try_time) ||
+                !reader.ReadString(&entry.id) || !reader.ReadString(&entry.path)) {
+                return absl::DataLossError("Corrupted change journal record");
+            }
+            entry.type = (flags & kFlagFolder) ? FileType::FOLDER : FileType::FILE;
+            entry.deleted = flags & kFlagDeleted;
+            entry.content_changed = flags & kFlagContentChanged;
+            entry.sequence = sequence;
+            auto path = entry.path;
+            entries_[path] = std::move(entry);
+        } else if (kind == kRecordRemove) {
+            std::string path;
+            if (!reader.ReadString(&path)) {
+                return absl::DataLossError("Corrupted change journal record");
+            }
+            auto it = entries_.find(path);
+            if (it != entries_.end() && it->second.sequence == sequence) {
+                entries_.erase(it);
+            }
+        } else {
+            return absl::DataLossError("Unknown change journal record");
+        }
+
+        next_sequence_ = std::max(next_sequence_.load(), sequence + 1);
+        ++stats_.replayed;
+        offset += kFrameBytes + size;
+    }
+
+    if (offset < data.size() && ::ftruncate(fd_, static_cast<off_t>(offset)) != 0) {
+        return ErrnoError("Failed to truncate", file_);
+    }
+    file_bytes_ = offset;
+    for (const auto& [path, entry] : entries_) {
+        live_bytes_ += PutRecord(entry).size();
+    }
+    // An earlier run may have drained the journal without appending since
+    return MaybeCompact();
+}
+
+std::vector<JournalEntry> ChangeJournal::Entries() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<JournalEntry> entries;
+    entries.reserve(entries_.size());
+    for (const auto& [path, entry] : entries_) {
+        entries.push_back(entry);
+    }
+    return entries;
+}
+
+uint64_t ChangeJournal::Reserve() {
+    return next_sequence_.fetch_add(1, std::memory_order_relaxed);
+}
+
+absl::StatusOr<uint64_t> ChangeJournal::Put(JournalEntry entry) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (broken_) {
+        return BrokenError();
+    }
+    if (entry.sequence == 0) {
+        entry.sequence = Reserve();
+    }
+    auto record = PutRecord(entry);
+    auto status = Append(record);
+    if (!status.ok()) {
+        return status;
+    }
+
+    auto [it, inserted] = entries_.try_emplace(entry.path);
+    if (!inserted) {
+        live_bytes_ -= PutRecord(it->second).size();
+    }
+    live_bytes_ += record.size();
+    it->second = std::move(entry);
+    uint64_t sequence = it->second.sequence;
+
+    status = MaybeCompact();
+    if (broken_) {
+        return status;
+    }
+    if (!status.ok()) {
+        // The appended record already holds the change
+        std::cerr << "Failed to compact change journal: " << status.message() << std::endl;
+    }
+    return sequence;
+}
+
+absl::Status ChangeJournal::Remove(const std::string& path, uint64_t sequence) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (broken_) {
+        return BrokenError();
+    }
+    auto it = entries_.find(path);
+    if (it == entries_.end() || it->second.sequence != sequence) {
+        return absl::OkStatus();
+    }
+    auto status = Append(RemoveRecord(path, sequence));
+    if (!status.ok()) {
+        return status;
+    }
+    live_bytes_ -= PutRecord(it->second).size();
+    entries_.erase(it);
+
+    status = MaybeCompact();
+    if (broken_) {
+        return status;
+    }
+    if (!status.ok()) {
+        std::cerr << "Failed to compact change journal: " << status.message() << std::endl;
+    }
+    return absl::OkStatus();
+}
+
+absl::Status ChangeJournal::Sync() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return SyncLocked();
+}
+
+absl::Status ChangeJournal::BrokenError() const {
+    return absl::FailedPreconditionError(
+        absl::StrCat("Change journal ", file_.string(), " is unusable after a failed compaction"));
+}
+
+absl::Status ChangeJournal::Append(const std::string& record) {
+    auto status = WriteAll(fd_, record, file_);
+    if (!status.ok()) {
+        // Drop the partial record so the next one does not follow garbage
+        if (::ftruncate(fd_, static_cast<off_t>(file_bytes_)) != 0) {
+            std::cerr << "Failed to truncate change journal" << std::endl;
+        }
+        return status;
+    }
+    file_bytes_ += record.size();
+    ++stats_.appends;
+    dirty_ = true;
+
+    if (std::chrono::steady_clock::now() - last_sync_ >= options_.sync_interval) {
+        return SyncLocked();
+    }
+    return absl::OkStatus();
+}
+
+absl::Status ChangeJournal::SyncLocked() {
+    if (!dirty_) {
+        return absl::OkStatus();
+    }
+    if (::fdatasync(fd_) != 0) {
+        return ErrnoError("Failed to sync", file_);
+    }
+    dirty_ = false;
+    last_sync_ = std::chrono::steady_clock::now();
+    return absl::OkStatus();
+}
+
+absl::Status ChangeJournal::MaybeCompact() {
+    uint64_t compacted = kHeaderBytes + live_bytes_;
+    if (file_bytes_ < options_.compact_min_bytes ||
+        file_bytes_ < compacted * std::max<size_t>(options_.compact_ratio, 2)) {
+        return absl::OkStatus();
+    }
+
+    std::string data = Header();
+    data.reserve(compacted);
+    for (const auto& [path, entry] : entries_) {
+        data += PutRecord(entry);
+    }
+
+    // Opened for appending up front, so the new file never has to be
+    // reopened by name after the rename
+    auto temp = file_;
+    temp += ".tmp";
+    int fd = ::open(temp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return ErrnoError("Failed to create", temp);
+    }
+    auto status = WriteAll(fd, data, temp);
+    if (status.ok() && ::fdatasync(fd) != 0) {
+        status = ErrnoError("Failed to sync", temp);
+    }
+    if (status.ok() && ::rename(temp.c_str(), file_.c_str()) != 0) {
+        status = ErrnoError("Failed to rename", temp);
+    }
+    if (!status.ok()) {
+        ::close(fd);
+        ::unlink(temp.c_str());
+        return status;
+    }
+
+    // Appends go to the new file from here on
+    ::close(fd_);
+    fd_ = fd;
+    file_bytes_ = data.size();
+    dirty_ = false;
+    last_sync_ = std::chrono::steady_clock::now();
+    ++stats_.compactions;
+
+    // Until the rename is on disk a crash brings back the old file, without
+    // anything appended to the new one
+    status = SyncDirectory(file_);
+    if (!status.ok()) {
+        broken_ = true;
+        return status;
+    }
+    return absl::OkStatus();
+}
+
+ChangeJournalStats ChangeJournal::GetStats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto stats = stats_;
+    stats.entries = entries_.size();
+    stats.file_bytes = file_bytes_;
+    return stats;
+}
+
+}  // namespace synxpo
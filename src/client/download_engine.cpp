@@ -0,0 +1,423 @@
+#include "synxpo/client/download_engine.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <random>
+
+#include <absl/strings/str_cat.h>
+
+namespace synxpo {
+
+namespace {
+
+// Temporary files are hidden and recognizable, so the ones a crash left
+// behind can be found again
+constexpr char kTempPrefix[] = ".synxpo-part-";
+
+absl::Status ErrnoError(const char* what, const std::string& name) {
+    return absl::InternalError(absl::StrCat(what, " ", name, ": ", std::strerror(errno)));
+}
+
+std::string TempName() {
+    thread_local std::mt19937_64 random(std::random_device{}());
+    char suffix[17];
+    std::snprintf(suffix, sizeof(suffix), "%016llx",
+                  static_cast<unsigned long long>(random()));
+    return absl::StrCat(kTempPrefix, suffix);
+}
+
+bool IsSafeRelativePath(const std::filesystem::path& path) {
+    if (path.empty() || path.is_absolute()) {
+        return false;
+    }
+    for (const auto& part : path) {
+        if (part == ".." || part == ".") {
+            return false;
+        }
+    }
+    return path.has_filename();
+}
+
+}  // namespace
+
+DownloadEngine::DownloadEngine(std::filesystem::path root, std::string directory_id,
+                               DownloadEngineOptions options)
+    : root_(std::move(root)),
+      directory_id_(std::move(directory_id)),
+      options_(options) {}
+
+DownloadEngine::~DownloadEngine() {
+    Abort();
+}
+
+absl::Status DownloadEngine::Begin(const std::vector<DownloadTarget>& targets) {
+    TransferScheduler* scheduler;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (active_) {
+            return absl::FailedPreconditionError("A download is already in progress");
+        }
+        scheduler = scheduler_;
+    }
+
+    TransferScheduler::Ticket ticket;
+    if (scheduler) {
+        uint64_t bytes = 0;
+        for (const auto& target : targets) {
+            bytes += target.size;
+        }
+        ticket = scheduler->Acquire(scheduler->Classify(bytes, std::nullopt),
+                                    std::chrono::steady_clock::now());
+        if (!ticket) {
+            return absl::CancelledError("Transfer scheduler closed");
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (active_) {
+        return absl::FailedPreconditionError("A download is already in progress");
+    }
+
+    files_.clear();
+    by_id_.clear();
+    error_ = absl::OkStatus();
+    files_.reserve(targets.size());
+    for (const auto& target : targets) {
+        if (by_id_.count(target.id)) {
+            continue;
+        }
+        File file;
+        file.target = target;
+        auto status = Prepare(file);
+        if (!status.ok()) {
+            if (file.fd >= 0) {
+                ::close(file.fd);
+                ::unlinkat(file.dir_fd, file.temp_name.c_str(), 0);
+            }
+            CloseLocked();
+            return status;
+        }
+        by_id_.emplace(target.id, files_.size());
+        files_.push_back(std::move(file));
+    }
+
+    active_ = true;
+    ticket_ = std::move(ticket);
+    ++stats_.transfers;
+    return absl::OkStatus();
+}
+
+absl::Status DownloadEngine::Prepare(File& file) {
+    std::filesystem::path relative(file.target.path);
+    if (!IsSafeRelativePath(relative)) {
+        return absl::InvalidArgumentError(absl::StrCat("Bad file path: ", file.target.path));
+    }
+
+    auto directory = (root_ / relative).parent_path();
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+    if (error) {
+        return absl::InternalError(
+            absl::StrCat("Failed to create ", directory.string(), ": ", error.message()));
+    }
+    file.dir_fd = DirectoryFd(directory);
+    if (file.dir_fd < 0) {
+        return ErrnoError("Failed to open directory", directory.string());
+    }
+    file.name = relative.filename().string();
+
+    struct stat existing;
+    file.replace = ::fstatat(file.dir_fd, file.name.c_str(), &existing, AT_SYMLINK_NOFOLLOW) == 0;
+
+    file.temp_name = TempName();
+    file.fd = ::openat(file.dir_fd, file.temp_name.c_str(),
+                       O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (file.fd < 0) {
+        return ErrnoError("Failed to create temporary file for", file.target.path);
+    }
+    // The new version keeps the permissions of the one it replaces
+    if (file.replace && S_ISREG(existing.st_mode)) {
+        ::fchmod(file.fd, existing.st_mode & 07777);
+    }
+
+    if (options_.preallocate && file.target.size > 0 &&
+        ::fallocate(file.fd, 0, 0, static_cast<off_t>(file.target.size)) != 0) {
+        // Not every filesystem supports it; the writes allocate as they go
+        if (errno != EOPNOTSUPP && errno != ENOSYS) {
+            return ErrnoError("Failed to preallocate", file.target.path);
+        }
+    }
+    return absl::OkStatus();
+}
+
+int DownloadEngine::DirectoryFd(const std::filesystem::path& directory) {
+    auto key = directory.string();
+    auto it = dir_fds_.find(key);
+    if (it != dir_fds_.end()) {
+        return it->second;
+    }
+    int fd = ::open(key.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        dir_fds_.emplace(std::move(key), fd);
+    }
+    return fd;
+}
+
+int DownloadEngine::TargetFd(const FileChunkHeader& header) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = by_id_.find(header.id);
+    if (!active_ || header.directory_id != directory_id_ || it == by_id_.end()) {
+        ++stats_.unknown_chunks;
+        return -1;
+    }
+    ++writing_;
+    return files_[it->second].fd;
+}
+
+void DownloadEngine::OnChunkWritten(const FileChunkHeader& header, const absl::Status& status) {
+    NoteWritten(header.id, header.offset, header.size, status).IgnoreError();
+}
+
+absl::Status DownloadEngine::Write(const FileChunk& chunk) {
+    FileChunkHeader header{chunk.id(), chunk.directory_id(), chunk.offset(), chunk.data().size()};
+    int fd = TargetFd(header);
+    if (fd < 0) {
+        return absl::NotFoundError(absl::StrCat("File ", chunk.id(), " is not being downloaded"));
+    }
+
+    // TargetFd pinned the descriptor; Commit and Abort wait for NoteWritten
+    absl::Status status;
+    const char* data = chunk.data().data();
+    size_t done = 0;
+    while (done < chunk.data().size()) {
+        ssize_t n = ::pwrite(fd, data + done, chunk.data().size() - done,
+                             static_cast<off_t>(chunk.offset() + done));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            status = ErrnoError("Failed to write", chunk.id());
+            break;
+        }
+        done += static_cast<size_t>(n);
+    }
+    return NoteWritten(chunk.id(), chunk.offset(), chunk.data().size(), status);
+}
+
+absl::Status DownloadEngine::NoteWritten(const std::string& id, uint64_t offset, size_t size,
+                                         const absl::Status& status) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--writing_ == 0) {
+        written_cv_.notify_all();
+    }
+    if (!status.ok()) {
+        // The transfer can no longer be committed; the caller asks again
+        if (error_.ok()) {
+            error_ = status;
+        }
+        return status;
+    }
+    auto it = by_id_.find(id);
+    if (it != by_id_.end()) {
+        auto& file = files_[it->second];
+        file.received = true;
+        file.written_end = std::max(file.written_end, offset + size);
+    }
+    ++stats_.chunks;
+    stats_.bytes_written += size;
+    return absl::OkStatus();
+}
+
+absl::StatusOr<std::vector<std::string>> DownloadEngine::Commit() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    WaitForWritesLocked(lock);
+    if (!active_) {
+        return absl::FailedPreconditionError("No download in progress");
+    }
+    if (!error_.ok()) {
+        auto status = error_;
+        CloseLocked();
+        ++stats_.aborted_transfers;
+        return status;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    // Drop whatever preallocated space the content did not fill
+    for (auto& file : files_) {
+        if (::ftruncate(file.fd, static_cast<off_t>(file.written_end)) != 0) {
+            auto status = ErrnoError("Failed to truncate", file.target.path);
+            CloseLocked();
+            ++stats_.aborted_transfers;
+            return status;
+        }
+    }
+
+    // Content must be on disk before any rename is, or a crash could expose
+    // a renamed file whose blocks were never written
+    auto status = SyncData();
+    if (!status.ok()) {
+        CloseLocked();
+        ++stats_.aborted_transfers;
+        return status;
+    }
+
+    std::vector<std::string> committed;
+    for (auto& file : files_) {
+        if (!file.received && file.target.size > 0) {
+            // Never sent; an empty file must not replace real content
+            continue;
+        }
+        const char* from = file.temp_name.c_str();
+        const char* to = file.name.c_str();
+        int result = ::renameat2(file.dir_fd, from, file.dir_fd, to,
+                                 file.replace ? 0 : RENAME_NOREPLACE);
+        if (result != 0 && errno == EINVAL && !file.replace) {
+            // No RENAME_NOREPLACE on this filesystem; link() fails the same way
+            result = ::linkat(file.dir_fd, from, file.dir_fd, to, 0);
+            if (result == 0) {
+                ::unlinkat(file.dir_fd, from, 0);
+            }
+        }
+        if (result != 0) {
+            if (errno == EEXIST) {
+                // Created locally during the download; the local file wins and
+                // goes to the server as a new version
+                std::cerr << "Keeping local " << file.target.path << " created during download"
+                          << std::endl;
+            } else {
+                std::cerr << "Failed to move " << file.target.path << " into place: "
+                          << std::strerror(errno) << std::endl;
+            }
+            ::unlinkat(file.dir_fd, from, 0);
+            continue;
+        }
+        file.temp_name.clear();
+        committed.push_back(file.target.id);
+    }
+
+    status = SyncDirectories();
+    if (!status.ok()) {
+        std::cerr << "Failed to sync directories: " << status.message() << std::endl;
+    }
+
+    CloseLocked();
+    stats_.files_committed += committed.size();
+    stats_.commit_time += std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start);
+    return committed;
+}
+
+absl::Status DownloadEngine::SyncData() {
+    if (files_.empty()) {
+        return absl::OkStatus();
+    }
+    // One syncfs flushes the whole transfer in a single journal commit. The
+    // root and everything below it are assumed to be on one filesystem.
+    if (files_.size() >= options_.syncfs_min_files) {
+        ++stats_.syncfs_calls;
+        if (::syncfs(files_.front().fd) != 0) {
+            return ErrnoError("Failed to sync", root_.string());
+        }
+        return absl::OkStatus();
+    }
+    for (auto& file : files_) {
+        ++stats_.fdatasync_calls;
+        if (::fdatasync(file.fd) != 0) {
+            return ErrnoError("Failed to sync", file.target.path);
+        }
+    }
+    return absl::OkStatus();
+}
+
+absl::Status DownloadEngine::SyncDirectories() {
+    if (files_.size() >= options_.syncfs_min_files) {
+        ++stats_.syncfs_calls;
+        if (::syncfs(files_.front().dir_fd) != 0) {
+            return ErrnoError("Failed to sync", root_.string());
+        }
+        return absl::OkStatus();
+    }
+    for (const auto& [path, fd] : dir_fds_) {
+        if (::fsync(fd) != 0) {
+            return ErrnoError("Failed to sync", path);
+        }
+    }
+    return absl::OkStatus();
+}
+
+void DownloadEngine::Abort() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    WaitForWritesLocked(lock);
+    if (active_) {
+        ++stats_.aborted_transfers;
+    }
+    CloseLocked();
+}
+
+void DownloadEngine::WaitForWritesLocked(std::unique_lock<std::mutex>& lock) {
+    // A stall timer may abort while a receive thread still writes; closing
+    // the descriptor under it could send the bytes to a reused one
+    written_cv_.wait(lock, [this]() { return writing_ == 0; });
+}
+
+void DownloadEngine::CloseLocked() {
+    for (auto& file : files_) {
+        if (file.fd >= 0) {
+            ::close(file.fd);
+        }
+        if (!file.temp_name.empty() && file.dir_fd >= 0) {
+            ::unlinkat(file.dir_fd, file.temp_name.c_str(), 0);
+        }
+    }
+    for (const auto& [path, fd] : dir_fds_) {
+        ::close(fd);
+    }
+    files_.clear();
+    by_id_.clear();
+    dir_fds_.clear();
+    active_ = false;
+    ticket_.Release();
+}
+
+bool DownloadEngine::Active() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return active_;
+}
+
+void DownloadEngine::SetScheduler(TransferScheduler* scheduler) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    scheduler_ = scheduler;
+}
+
+size_t DownloadEngine::RemoveStaleTemporaryFiles() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (active_) {
+        return 0;
+    }
+
+    size_t removed = 0;
+    std::error_code error;
+    std::filesystem::recursive_directory_iterator it(root_, error), end;
+    for (; !error && it != end; it.increment(error)) {
+        if (it->is_regular_file(error) &&
+            it->path().filename().string().rfind(kTempPrefix, 0) == 0 &&
+            std::filesystem::remove(it->path(), error)) {
+            ++removed;
+        }
+    }
+    return removed;
+}
+
+DownloadEngineStats DownloadEngine::GetStats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+}  // namespace synxpo
@@ -0,0 +1,134 @@
+#include "synxpo/client/executor.h"
+
+namespace synxpo {
+
+Executor::Executor(size_t thread_count) {
+    if (thread_count == 0) {
+        thread_count = 1;
+    }
+    workers_.reserve(thread_count);
+    for (size_t i = 0; i < thread_count; ++i) {
+        workers_.emplace_back([this]() { WorkerLoop(); });
+    }
+    timer_thread_ = std::thread([this]() { TimerLoop(); });
+}
+
+Executor::~Executor() {
+    Shutdown();
+}
+
+void Executor::Post(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!stopping_) {
+            tasks_.push(std::move(task));
+            task = nullptr;
+        }
+    }
+    if (task) {
+        task();
+        return;
+    }
+    cv_.notify_one();
+}
+
+Executor::TimerId Executor::PostAfter(std::chrono::steady_clock::duration delay,
+                                      std::function<void()> task) {
+    TimerId timer;
+    {
+        std::lock_guard<std::mutex> lock(timer_mutex_);
+        // stopping_ is written while holding both mutexes
+        if (!stopping_) {
+            timer.deadline = std::chrono::steady_clock::now() + delay;
+            timer.sequence = timer_sequence_++;
+            timers_.emplace(std::make_pair(timer.deadline, timer.sequence), std::move(task));
+            task = nullptr;
+        }
+    }
+    if (task) {
+        task();
+        return timer;
+    }
+    timer_cv_.notify_one();
+    return timer;
+}
+
+bool Executor::Cancel(const TimerId& timer) {
+    // The timer thread sleeps until the earliest deadline it saw; waking up
+    // for a cancelled one is harmless
+    std::lock_guard<std::mutex> lock(timer_mutex_);
+    return timers_.erase(std::make_pair(timer.deadline, timer.sequence)) != 0;
+}
+
+void Executor::Shutdown() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::lock_guard<std::mutex> timer_lock(timer_mutex_);
+        if (stopping_) {
+            return;
+        }
+        stopping_ = true;
+        // Workers drain these before they exit
+        for (auto& [key, task] : timers_) {
+            tasks_.push(std::move(task));
+        }
+        timers_.clear();
+    }
+    cv_.notify_all();
+    timer_cv_.notify_all();
+
+    for (auto& worker : workers_) {
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+    if (timer_thread_.joinable()) {
+        timer_thread_.join();
+    }
+}
+
+void Executor::WorkerLoop() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+            if (tasks_.empty()) {
+                return;
+            }
+            task = std::move(tasks_.front());
+            tasks_.pop();
+        }
+        task();
+    }
+}
+
+void Executor::TimerLoop() {
+    std::unique_lock<std::mutex> lock(timer_mutex_);
+    while (true) {
+        // stopping_ is written while holding both mutexes
+        if (stopping_) {
+            return;
+        }
+
+        if (timers_.empty()) {
+            timer_cv_.wait(lock);
+            continue;
+        }
+
+        auto first = timers_.begin();
+        auto deadline = first->first.first;
+        if (std::chrono::steady_clock::now() < deadline) {
+            timer_cv_.wait_until(lock, deadline);
+            continue;
+        }
+
+        auto task = std::move(first->second);
+        timers_.erase(first);
+        lock.unlock();
+        Post(std::move(task));
+        lock.lock();
+    }
+}
+
+}  // namespace synxpo
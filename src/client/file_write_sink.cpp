@@ -0,0 +1,281 @@
+#include "synxpo/client/file_write_sink.h"
+
+#include <sys/uio.h>
+#include <climits>
+#include <cerrno>
+#include <cstring>
+
+#include <absl/strings/str_cat.h>
+
+namespace synxpo {
+
+namespace {
+
+// Field numbers from synxpo.proto
+constexpr uint32_t kServerMessageFileWrite = 10;
+constexpr uint32_t kFileWriteChunk = 1;
+constexpr uint32_t kFileChunkId = 1;
+constexpr uint32_t kFileChunkDirectoryId = 2;
+constexpr uint32_t kFileChunkData = 3;
+constexpr uint32_t kFileChunkOffset = 4;
+
+constexpr uint32_t kWireVarint = 0;
+constexpr uint32_t kWireFixed64 = 1;
+constexpr uint32_t kWireLengthDelimited = 2;
+constexpr uint32_t kWireFixed32 = 5;
+
+// Sequential reader over a list of slices without flattening them
+class SliceReader {
+public:
+    explicit SliceReader(const std::vector<grpc::Slice>& slices) : slices_(slices) {
+        SkipEmptySlices();
+    }
+
+    size_t Position() const { return position_; }
+    size_t SliceIndex() const { return slice_; }
+    size_t SliceOffset() const { return offset_; }
+
+    bool ReadVarint(uint64_t* value) {
+        *value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            uint8_t byte;
+            if (!ReadByte(&byte)) {
+                return false;
+            }
+            *value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool ReadString(size_t size, std::string* out) {
+        out->clear();
+        out->reserve(size);
+        while (size > 0) {
+            if (slice_ >= slices_.size()) {
+                return false;
+            }
+            const auto& slice = slices_[slice_];
+            size_t take = std::min(size, slice.size() - offset_);
+            out->append(reinterpret_cast<const char*>(slice.begin()) + offset_, take);
+            Advance(take);
+            size -= take;
+        }
+        return true;
+    }
+
+    bool Skip(size_t size) {
+        while (size > 0) {
+            if (slice_ >= slices_.size()) {
+                return false;
+            }
+            size_t take = std::min(size, slices_[slice_].size() - offset_);
+            Advance(take);
+            size -= take;
+        }
+        return true;
+    }
+
+    bool SkipField(uint32_t wire_type) {
+        uint64_t value;
+        switch (wire_type) {
+            case kWireVarint:
+                return ReadVarint(&value);
+            case kWireFixed64:
+                return Skip(8);
+            case kWireLengthDelimited:
+                return ReadVarint(&value) && Skip(value);
+            case kWireFixed32:
+                return Skip(4);
+            default:
+                return false;
+        }
+    }
+
+private:
+    bool ReadByte(uint8_t* byte) {
+        if (slice_ >= slices_.size()) {
+            return false;
+        }
+        *byte = slices_[slice_].begin()[offset_];
+        Advance(1);
+        return true;
+    }
+
+    void Advance(size_t size) {
+        offset_ += size;
+        position_ += size;
+        if (offset_ == slices_[slice_].size()) {
+            ++slice_;
+            offset_ = 0;
+            SkipEmptySlices();
+        }
+    }
+
+    void SkipEmptySlices() {
+        while (slice_ < slices_.size() && slices_[slice_].size() == 0) {
+            ++slice_;
+        }
+    }
+
+    const std::vector<grpc::Slice>& slices_;
+    size_t slice_ = 0;
+    size_t offset_ = 0;
+    size_t position_ = 0;
+};
+
+// Read a tag and, for length-delimited fields, the length
+bool ReadTag(SliceReader& reader, uint32_t* field, uint32_t* wire_type) {
+    uint64_t tag;
+    if (!reader.ReadVarint(&tag)) {
+        return false;
+    }
+    *field = static_cast<uint32_t>(tag >> 3);
+    *wire_type = static_cast<uint32_t>(tag & 7);
+    return true;
+}
+
+bool ParseFileChunk(SliceReader& reader, size_t end, RawFileChunk* chunk) {
+    bool has_data = false;
+    while (reader.Position() < end) {
+        uint32_t field;
+        uint32_t wire_type;
+        if (!ReadTag(reader, &field, &wire_type)) {
+            return false;
+        }
+
+        uint64_t value;
+        if (field == kFileChunkId && wire_type == kWireLengthDelimited) {
+            if (!reader.ReadVarint(&value) || !reader.ReadString(value, &chunk->header.id)) {
+                return false;
+            }
+        } else if (field == kFileChunkDirectoryId && wire_type == kWireLengthDelimited) {
+            if (!reader.ReadVarint(&value) || !reader.ReadString(value, &chunk->header.directory_id)) {
+                return false;
+            }
+        } else if (field == kFileChunkData && wire_type == kWireLengthDelimited) {
+            // A repeated data field would replace the first one; not worth handling here
+            if (has_data || !reader.ReadVarint(&value)) {
+                return false;
+            }
+            has_data = true;
+            chunk->header.size = value;
+            chunk->data_slice = reader.SliceIndex();
+            chunk->data_offset = reader.SliceOffset();
+            if (!reader.Skip(value)) {
+                return false;
+            }
+        } else if (field == kFileChunkOffset && wire_type == kWireVarint) {
+            if (!reader.ReadVarint(&chunk->header.offset)) {
+                return false;
+            }
+        } else if (!reader.SkipField(wire_type)) {
+            return false;
+        }
+    }
+    return reader.Position() == end;
+}
+
+}  // namespace
+
+std::optional<RawFileChunk> ParseRawFileWrite(const std::vector<grpc::Slice>& slices) {
+    SliceReader reader(slices);
+    size_t total = 0;
+    for (const auto& slice : slices) {
+        total += slice.size();
+    }
+
+    std::optional<RawFileChunk> result;
+    while (reader.Position() < total) {
+        uint32_t field;
+        uint32_t wire_type;
+        if (!ReadTag(reader, &field, &wire_type)) {
+            return std::nullopt;
+        }
+        // Anything but a single FileWrite goes through regular parsing
+        if (field != kServerMessageFileWrite || wire_type != kWireLengthDelimited || result) {
+            return std::nullopt;
+        }
+
+        uint64_t file_write_size;
+        if (!reader.ReadVarint(&file_write_size)) {
+            return std::nullopt;
+        }
+        size_t file_write_end = reader.Position() + file_write_size;
+
+        RawFileChunk chunk;
+        bool has_chunk = false;
+        while (reader.Position() < file_write_end) {
+            uint32_t inner_field;
+            uint32_t inner_wire_type;
+            if (!ReadTag(reader, &inner_field, &inner_wire_type)) {
+                return std::nullopt;
+            }
+            if (inner_field == kFileWriteChunk && inner_wire_type == kWireLengthDelimited && !has_chunk) {
+                uint64_t chunk_size;
+                if (!reader.ReadVarint(&chunk_size) ||
+                    !ParseFileChunk(reader, reader.Position() + chunk_size, &chunk)) {
+                    return std::nullopt;
+                }
+                has_chunk = true;
+            } else if (!reader.SkipField(inner_wire_type)) {
+                return std::nullopt;
+            }
+        }
+        if (!has_chunk || reader.Position() != file_write_end) {
+            return std::nullopt;
+        }
+        result = std::move(chunk);
+    }
+    return result;
+}
+
+absl::Status WriteRawFileChunk(int fd, const std::vector<grpc::Slice>& slices,
+                               const RawFileChunk& chunk) {
+    std::vector<iovec> iov;
+    size_t remaining = chunk.header.size;
+    size_t offset = chunk.data_offset;
+    for (size_t i = chunk.data_slice; i < slices.size() && remaining > 0; ++i) {
+        size_t take = std::min(remaining, slices[i].size() - offset);
+        if (take > 0) {
+            // pwritev never writes through iov_base, the cast only drops const
+            iov.push_back(iovec{const_cast<uint8_t*>(slices[i].begin()) + offset, take});
+        }
+        remaining -= take;
+        offset = 0;
+    }
+    if (remaining > 0) {
+        return absl::InternalError("FileWrite payload is truncated");
+    }
+
+    off_t file_offset = static_cast<off_t>(chunk.header.offset);
+    size_t first = 0;
+    while (first < iov.size()) {
+        int count = static_cast<int>(std::min<size_t>(iov.size() - first, IOV_MAX));
+        ssize_t written = pwritev(fd, iov.data() + first, count, file_offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return absl::InternalError(
+                absl::StrCat("Failed to write file chunk: ", std::strerror(errno)));
+        }
+
+        file_offset += written;
+        // Drop fully written buffers and trim a partially written one
+        size_t left = static_cast<size_t>(written);
+        while (first < iov.size() && left >= iov[first].iov_len) {
+            left -= iov[first].iov_len;
+            ++first;
+        }
+        if (left > 0) {
+            iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + left;
+            iov[first].iov_len -= left;
+        }
+    }
+    return absl::OkStatus();
+}
+
+}  // namespace synxpo
@@ -1,111 +1,809 @@
 #include "synxpo/client/grpc_client.h"
 
 #include <algorithm>
+#include <iostream>
+#include <random>
+#include <utility>
 #include <absl/strings/str_cat.h>
 
+#include "synxpo/common/delta.h"
+
 namespace synxpo {
 
-GRPCClient::GRPCClient(const std::string& server_address)
-    : server_address_(server_address) {}
+GRPCClient::GRPCClient(const std::string& server_address, GRPCClientOptions options)
+    : server_address_(server_address),
+      options_(std::move(options)),
+      upload_limiter_(options_.upload_bytes_per_second),
+      download_limiter_(options_.download_bytes_per_second),
+      compression_policy_(options_.compression) {}
 
 GRPCClient::~GRPCClient() {
     Disconnect();
 }
 
 absl::Status GRPCClient::Connect() {
-    if (connected_) {
+    if (started_) {
         return absl::OkStatus();
     }
 
-    channel_ = grpc::CreateChannel(server_address_, grpc::InsecureChannelCredentials());
-    if (!channel_) {
+    size_t count = std::max<size_t>(options_.connection_count, 1);
+    for (size_t i = 0; i < count; ++i) {
+        auto connection = std::make_unique<Connection>();
+        connection->index = i;
+
+        auto status = CreateConnection(*connection);
+        if (!status.ok()) {
+            for (auto& created : connections_) {
+                CloseConnection(*created);
+            }
+            connections_.clear();
+            return status;
+        }
+        connections_.push_back(std::move(connection));
+    }
+
+    started_ = true;
+    upload_limiter_.Reopen();
+    download_limiter_.Reopen();
+
+    if (options_.latency_log_interval.count() > 0) {
+        latency_log_stop_ = false;
+        latency_log_thread_ = std::thread([this]() { LatencyLogLoop(); });
+    }
+
+    if (options_.write_coalescing.enabled) {
+        for (auto& connection : connections_) {
+            connection->flush_stop = false;
+            connection->flush_thread = std::thread(
+                [this, conn = connection.get()]() { FlushLoop(*conn); });
+        }
+    }
+
+    return absl::OkStatus();
+}
+
+absl::Status GRPCClient::CreateConnection(Connection& connection) {
+    const auto& reconnect = options_.reconnect;
+    grpc::ChannelArguments args;
+    args.SetInt(GRPC_ARG_KEEPALIVE_TIME_MS, static_cast<int>(reconnect.keepalive_time.count()));
+    args.SetInt(GRPC_ARG_KEEPALIVE_TIMEOUT_MS, static_cast<int>(reconnect.keepalive_timeout.count()));
+    args.SetInt(GRPC_ARG_KEEPALIVE_PERMIT_WITHOUT_CALLS, 1);
+    args.SetInt(GRPC_ARG_HTTP2_MAX_PINGS_WITHOUT_DATA, 0);
+    args.SetInt(GRPC_ARG_INITIAL_RECONNECT_BACKOFF_MS, static_cast<int>(reconnect.initial_backoff.count()));
+    args.SetInt(GRPC_ARG_MAX_RECONNECT_BACKOFF_MS, static_cast<int>(reconnect.max_backoff.count()));
+    // Otherwise channels with equal arguments share one TCP connection
+    args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+
+    connection.channel = grpc::CreateCustomChannel(
+        server_address_, grpc::InsecureChannelCredentials(), args);
+    if (!connection.channel) {
         return absl::InternalError("Failed to create gRPC channel");
     }
 
-    stub_ = SyncService::NewStub(channel_);
-    if (!stub_) {
-        channel_.reset();
+    connection.stub = SyncService::NewStub(connection.channel);
+    if (!connection.stub) {
+        connection.channel.reset();
         return absl::InternalError("Failed to create gRPC stub");
     }
 
-    auto deadline = std::chrono::system_clock::now() + std::chrono::seconds(5);
-    if (!channel_->WaitForConnected(deadline)) {
-        stub_.reset();
-        channel_.reset();
+    // Connects lazily on the first bulk transfer
+    connection.bulk_channel = options_.separate_bulk_channel
+        ? grpc::CreateCustomChannel(server_address_, grpc::InsecureChannelCredentials(), args)
+        : connection.channel;
+
+    auto status = OpenStream(connection);
+    if (!status.ok()) {
+        connection.stub.reset();
+        connection.channel.reset();
+        return status;
+    }
+
+    connection.connected = true;
+    return absl::OkStatus();
+}
+
+absl::Status GRPCClient::OpenStream(Connection& connection) {
+    auto deadline = std::chrono::system_clock::now() + options_.reconnect.connect_timeout;
+    if (!connection.channel->WaitForConnected(deadline)) {
         return absl::UnavailableError(
             absl::StrCat("Failed to connect to server: ", server_address_));
     }
 
-    stream_context_ = std::make_unique<grpc::ClientContext>();
-    stream_ = stub_->Stream(stream_context_.get());
-    if (!stream_) {
-        stub_.reset();
-        channel_.reset();
+    auto context = std::make_unique<grpc::ClientContext>();
+    if (options_.compression.algorithm != GRPC_COMPRESS_NONE) {
+        context->set_compression_algorithm(options_.compression.algorithm);
+    }
+    // Same method as SyncService::Stub::Stream, but replies are left serialized
+    auto stream = RawStream<ClientMessage>::Open(
+        connection.channel, "/synxpo.SyncService/Stream", context.get());
+    if (!stream) {
         return absl::InternalError("Failed to create bidirectional stream");
     }
 
-    connected_ = true;
+    std::lock_guard<std::mutex> lock(connection.stream_mutex);
+    std::lock_guard<std::mutex> context_lock(connection.context_mutex);
+    connection.stream_context = std::move(context);
+    connection.stream = std::move(stream);
     return absl::OkStatus();
 }
 
+void GRPCClient::CloseConnection(Connection& connection) {
+    if (connection.stream) {
+        connection.stream->WritesDone();
+        connection.stream->Finish();
+        connection.stream.reset();
+    }
+    connection.stream_context.reset();
+
+    connection.stub.reset();
+    connection.bulk_channel.reset();
+    connection.channel.reset();
+    connection.connected = false;
+}
+
 void GRPCClient::Disconnect() {
-    if (!connected_) {
+    if (!started_) {
         return;
     }
 
-    if (stream_context_) {
-        stream_context_->TryCancel();
+    for (auto& connection : connections_) {
+        {
+            std::lock_guard<std::mutex> lock(connection->pending_mutex);
+            connection->flush_stop = true;
+        }
+        connection->pending_cv.notify_one();
+        if (connection->flush_thread.joinable()) {
+            connection->flush_thread.join();
+        }
+        // Best effort: the stream is going away anyway
+        FlushOn(*connection).IgnoreError();
     }
-    
+
+    upload_limiter_.Close();
+    download_limiter_.Close();
+
+    {
+        std::lock_guard<std::mutex> lock(latency_log_mutex_);
+        latency_log_stop_ = true;
+    }
+    latency_log_cv_.notify_one();
+    if (latency_log_thread_.joinable()) {
+        latency_log_thread_.join();
+    }
+
+    // Set before cancelling so the receive loops do not treat this as broken streams
+    should_stop_ = true;
+    reconnect_cv_.notify_all();
+    for (auto& connection : connections_) {
+        std::lock_guard<std::mutex> lock(connection->context_mutex);
+        if (connection->stream_context) {
+            connection->stream_context->TryCancel();
+        }
+    }
+
     StopReceiving();
-    
-    if (stream_) {
-        stream_->WritesDone();
-        stream_->Finish();
-        stream_.reset();
+
+    for (auto& connection : connections_) {
+        CloseConnection(*connection);
     }
-    stream_context_.reset();
-    
-    stub_.reset();
-    channel_.reset();
-    connected_ = false;
+    connections_.clear();
+    started_ = false;
 }
 
 bool GRPCClient::IsConnected() const {
-    return connected_;
+    if (!started_) {
+        return false;
+    }
+    return std::all_of(connections_.begin(), connections_.end(),
+                       [](const auto& connection) { return connection->connected.load(); });
+}
+
+uint64_t GRPCClient::GetReconnectCount() const {
+    uint64_t total = 0;
+    for (const auto& connection : connections_) {
+        total += connection->reconnects.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+absl::Status GRPCClient::NotConnectedError() const {
+    if (started_) {
+        return absl::UnavailableError("Connection to server lost, reconnecting");
+    }
+    return absl::FailedPreconditionError("Not connected to server");
+}
+
+std::string GRPCClient::RoutingDirectory(const ClientMessage& message) {
+    switch (message.message_case()) {
+        case ClientMessage::kDirectorySubscribe:
+            return message.directory_subscribe().directory_id();
+        case ClientMessage::kDirectoryUnsubscribe:
+            return message.directory_unsubscribe().directory_id();
+        case ClientMessage::kAskVersionIncrease:
+            if (message.ask_version_increase().files_size() > 0) {
+                return message.ask_version_increase().files(0).directory_id();
+            }
+            return {};
+        case ClientMessage::kRequestVersion:
+            if (message.request_version().requests_size() > 0) {
+                const auto& request = message.request_version().requests(0);
+                return request.has_file_id() ? request.file_id().directory_id()
+                                             : request.directory_id();
+            }
+            return {};
+        case ClientMessage::kRequestFileContent:
+            if (message.request_file_content().files_size() > 0) {
+                return message.request_file_content().files(0).directory_id();
+            }
+            return {};
+        case ClientMessage::kFileWrite:
+            return message.file_write().chunk().directory_id();
+        case ClientMessage::kFileWriteEnd:
+            return message.file_write_end().directory_id();
+        case ClientMessage::kRequestBlockSignatures:
+            if (message.request_block_signatures().files_size() > 0) {
+                return message.request_block_signatures().files(0).directory_id();
+            }
+            return {};
+        case ClientMessage::kFileDelta:
+            return message.file_delta().directory_id();
+        case ClientMessage::kOfferChunks:
+            if (message.offer_chunks().files_size() > 0) {
+                return message.offer_chunks().files(0).directory_id();
+            }
+            return {};
+        default:
+            return {};
+    }
+}
+
+GRPCClient::Connection& GRPCClient::Route(const std::string& directory_id) {
+    if (directory_id.empty() || connections_.size() == 1) {
+        return *connections_.front();
+    }
+    return *connections_[std::hash<std::string>{}(directory_id) % connections_.size()];
+}
+
+void GRPCClient::TrackSubscription(Connection& connection, const ClientMessage& message) {
+    if (message.has_directory_subscribe()) {
+        std::lock_guard<std::mutex> lock(connection.subscriptions_mutex);
+        connection.subscribed_directories.insert(message.directory_subscribe().directory_id());
+    } else if (message.has_directory_unsubscribe()) {
+        std::lock_guard<std::mutex> lock(connection.subscriptions_mutex);
+        connection.subscribed_directories.erase(message.directory_unsubscribe().directory_id());
+    }
 }
 
 absl::Status GRPCClient::SendMessage(const ClientMessage& message) {
-    if (!connected_ || !stream_) {
-        return absl::FailedPreconditionError("Not connected to server");
+    return SendMessage(message, RoutingDirectory(message));
+}
+
+absl::Status GRPCClient::SendMessage(const ClientMessage& message,
+                                     const std::string& directory_id) {
+    if (!started_) {
+        return NotConnectedError();
     }
+    return SendOn(Route(directory_id), message);
+}
 
-    std::lock_guard<std::mutex> lock(stream_mutex_);
-    
-    if (!stream_->Write(message)) {
+absl::Status GRPCClient::SendOn(Connection& connection, const ClientMessage& message) {
+    if (!connection.connected) {
+        return NotConnectedError();
+    }
+
+    std::unique_lock<std::mutex> lock(connection.stream_mutex);
+    if (!connection.stream) {
+        return NotConnectedError();
+    }
+
+    // Buffered messages were queued earlier and must hit the wire first
+    auto status = FlushLocked(connection);
+    if (!status.ok()) {
+        lock.unlock();
+        LoseBufferedWrites(connection);
+        return status;
+    }
+
+    // Noted first: the reply may be read before Write returns
+    size_t bytes = message.ByteSizeLong();
+    NoteSent(connection, message, std::chrono::steady_clock::now());
+    if (!connection.stream->Write(message, WriteOptionsFor(message, bytes))) {
         return absl::UnavailableError("Failed to write message to stream");
     }
 
+    connection.messages_sent.fetch_add(1, std::memory_order_relaxed);
+    connection.sent.Record(bytes);
+    TrackSubscription(connection, message);
+    return absl::OkStatus();
+}
+
+absl::Status GRPCClient::SendMessageBuffered(const ClientMessage& message) {
+    if (!started_) {
+        return NotConnectedError();
+    }
+
+    auto& connection = Route(RoutingDirectory(message));
+    if (!connection.connected) {
+        return NotConnectedError();
+    }
+
+    const auto& coalescing = options_.write_coalescing;
+    size_t size = message.ByteSizeLong();
+    if (!coalescing.enabled || size > coalescing.max_message_bytes) {
+        return SendOn(connection, message);
+    }
+
+    bool flush_now = false;
+    {
+        std::lock_guard<std::mutex> lock(connection.pending_mutex);
+        auto now = std::chrono::steady_clock::now();
+        if (connection.pending_writes.empty()) {
+            connection.first_pending_time = now;
+        }
+        connection.last_pending_time = now;
+        connection.pending_writes.push_back(message);
+        connection.pending_bytes += size;
+        flush_now = connection.pending_bytes >= coalescing.flush_threshold_bytes;
+    }
+
+    TrackSubscription(connection, message);
+    coalesced_messages_.fetch_add(1, std::memory_order_relaxed);
+    coalesced_bytes_.fetch_add(size, std::memory_order_relaxed);
+
+    if (flush_now) {
+        return FlushOn(connection);
+    }
+
+    connection.pending_cv.notify_one();
+    return absl::OkStatus();
+}
+
+absl::Status GRPCClient::Flush() {
+    if (!started_) {
+        return NotConnectedError();
+    }
+
+    absl::Status result;
+    for (auto& connection : connections_) {
+        result.Update(FlushOn(*connection));
+    }
+    return result;
+}
+
+absl::Status GRPCClient::FlushOn(Connection& connection) {
+    if (!connection.connected) {
+        return NotConnectedError();
+    }
+
+    absl::Status status;
+    {
+        std::lock_guard<std::mutex> lock(connection.stream_mutex);
+        if (!connection.stream) {
+            return NotConnectedError();
+        }
+        status = FlushLocked(connection);
+    }
+    if (!status.ok()) {
+        LoseBufferedWrites(connection);
+    }
+    return status;
+}
+
+absl::Status GRPCClient::FlushLocked(Connection& connection) {
+    // Swapping under stream_mutex keeps batches in the order they were queued
+    std::vector<ClientMessage> batch;
+    {
+        std::lock_guard<std::mutex> lock(connection.pending_mutex);
+        batch.swap(connection.pending_writes);
+        connection.pending_bytes = 0;
+    }
+
+    if (batch.empty()) {
+        return absl::OkStatus();
+    }
+
+    coalesced_flushes_.fetch_add(1, std::memory_order_relaxed);
+
+    // Everything except the last message is corked; the last write flushes the batch
+    size_t bytes = 0;
+    for (size_t i = 0; i < batch.size(); ++i) {
+        size_t message_bytes = batch[i].ByteSizeLong();
+        grpc::WriteOptions write_options = WriteOptionsFor(batch[i], message_bytes);
+        if (i + 1 < batch.size()) {
+            write_options.set_buffer_hint();
+        }
+        NoteSent(connection, batch[i], std::chrono::steady_clock::now());
+        if (!connection.stream->Write(batch[i], write_options)) {
+            // The rest of the batch goes with the stream
+            dropped_messages_.fetch_add(batch.size() - i, std::memory_order_relaxed);
+            return absl::UnavailableError("Failed to write buffered messages to stream");
+        }
+        bytes += message_bytes;
+    }
+
+    connection.messages_sent.fetch_add(batch.size(), std::memory_order_relaxed);
+    connection.sent.Record(bytes);
     return absl::OkStatus();
 }
 
+void GRPCClient::FlushLoop(Connection& connection) {
+    const auto& coalescing = options_.write_coalescing;
+    std::unique_lock<std::mutex> lock(connection.pending_mutex);
+
+    while (!connection.flush_stop) {
+        if (connection.pending_writes.empty()) {
+            connection.pending_cv.wait(lock, [&connection] {
+                return connection.flush_stop || !connection.pending_writes.empty();
+            });
+            continue;
+        }
+
+        auto deadline = std::min(connection.last_pending_time + coalescing.idle_flush_delay,
+                                 connection.first_pending_time + coalescing.max_flush_delay);
+        if (std::chrono::steady_clock::now() < deadline) {
+            connection.pending_cv.wait_until(lock, deadline);
+            continue;
+        }
+
+        lock.unlock();
+        // A failure is handled by FlushOn
+        FlushOn(connection).IgnoreError();
+        lock.lock();
+    }
+}
+
+void GRPCClient::DiscardPendingWrites(Connection& connection) {
+    std::lock_guard<std::mutex> lock(connection.pending_mutex);
+    dropped_messages_.fetch_add(connection.pending_writes.size(), std::memory_order_relaxed);
+    connection.pending_writes.clear();
+    connection.pending_bytes = 0;
+}
+
+void GRPCClient::LoseBufferedWrites(Connection& connection) {
+    // A failed write means the stream is gone. Callers were told their
+    // messages were queued, so whoever waits for a reply learns now instead
+    // of timing out; subscriptions are replayed after reconnecting.
+    DiscardPendingWrites(connection);
+    FailWaiters(absl::UnavailableError("Buffered messages were lost with the stream; "
+                                       "retry after reconnect"));
+}
+
+WriteCoalescingStats GRPCClient::GetWriteCoalescingStats() const {
+    WriteCoalescingStats stats;
+    stats.buffered_messages = coalesced_messages_.load(std::memory_order_relaxed);
+    stats.buffered_bytes = coalesced_bytes_.load(std::memory_order_relaxed);
+    stats.flushes = coalesced_flushes_.load(std::memory_order_relaxed);
+    stats.dropped_messages = dropped_messages_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+absl::Status GRPCClient::WriteFileChunk(FileChunk chunk, std::string* reclaim) {
+    if (!upload_limiter_.Acquire(chunk.directory_id(), chunk.data().size())) {
+        return absl::CancelledError("Client is disconnecting");
+    }
+
+    ClientMessage message;
+    *message.mutable_file_write()->mutable_chunk() = std::move(chunk);
+    auto status = SendMessage(message);
+
+    if (reclaim) {
+        reclaim->swap(*message.mutable_file_write()->mutable_chunk()->mutable_data());
+    }
+    return status;
+}
+
+absl::Status GRPCClient::WriteFileDelta(FileDelta delta) {
+    if (!upload_limiter_.Acquire(delta.directory_id(), DeltaLiteralBytes(delta))) {
+        return absl::CancelledError("Client is disconnecting");
+    }
+
+    ClientMessage message;
+    *message.mutable_file_delta() = std::move(delta);
+    return SendMessage(message);
+}
+
+absl::Status GRPCClient::WriteFileEnd(const std::string& directory_id) {
+    ClientMessage message;
+    message.mutable_file_write_end()->set_directory_id(directory_id);
+    return SendMessage(message, directory_id);
+}
+
+absl::StatusOr<std::unique_ptr<BulkTransfer>> GRPCClient::OpenBulkTransfer(
+    const std::string& transfer_id, const std::string& directory_id) {
+    if (!started_) {
+        return NotConnectedError();
+    }
+    if (transfer_id.empty()) {
+        return absl::InvalidArgumentError("Transfer id is empty");
+    }
+
+    auto& connection = Route(directory_id);
+    // Its VERSION_INCREASED comes over the control stream of this connection,
+    // possibly before the write returns
+    auto on_write_end = [this, &connection, directory_id]() {
+        ClientMessage end;
+        end.mutable_file_write_end()->set_directory_id(directory_id);
+        NoteSent(connection, end, std::chrono::steady_clock::now());
+    };
+    std::unique_ptr<BulkTransfer> transfer(new BulkTransfer(
+        connection.bulk_channel, transfer_id, &upload_limiter_,
+        &download_limiter_, &compression_policy_, std::move(on_write_end)));
+    auto status = transfer->Open(options_.compression.algorithm);
+    if (!status.ok()) {
+        return status;
+    }
+    return transfer;
+}
+
+void GRPCClient::SetRateLimits(uint64_t upload_bytes_per_second,
+                               uint64_t download_bytes_per_second) {
+    upload_limiter_.SetRate(upload_bytes_per_second);
+    download_limiter_.SetRate(download_bytes_per_second);
+}
+
+void GRPCClient::SetDirectoryWeight(const std::string& directory_id, uint32_t weight) {
+    upload_limiter_.SetWeight(directory_id, weight);
+    download_limiter_.SetWeight(directory_id, weight);
+}
+
+BandwidthStats GRPCClient::GetBandwidthStats() const {
+    return {upload_limiter_.GetStats(), download_limiter_.GetStats()};
+}
+
+std::vector<ConnectionStats> GRPCClient::GetConnectionStats() const {
+    std::vector<ConnectionStats> result;
+    result.reserve(connections_.size());
+    for (const auto& connection : connections_) {
+        ConnectionStats stats;
+        stats.index = connection->index;
+        stats.connected = connection->connected;
+        {
+            std::lock_guard<std::mutex> lock(connection->subscriptions_mutex);
+            stats.subscribed_directories = connection->subscribed_directories.size();
+        }
+        stats.reconnects = connection->reconnects.load(std::memory_order_relaxed);
+        stats.messages_sent = connection->messages_sent.load(std::memory_order_relaxed);
+        stats.messages_received = connection->messages_received.load(std::memory_order_relaxed);
+        stats.bytes_sent = connection->sent.TotalBytes();
+        stats.bytes_received = connection->received.TotalBytes();
+        stats.send_bytes_per_sec = connection->sent.BytesPerSecond();
+        stats.receive_bytes_per_sec = connection->received.BytesPerSecond();
+        stats.direct_write_chunks = connection->direct_write_chunks.load(std::memory_order_relaxed);
+        stats.direct_write_bytes = connection->direct_write_bytes.load(std::memory_order_relaxed);
+        result.push_back(stats);
+    }
+    return result;
+}
+
+std::string LatencyReport::ToString() const {
+    return absl::StrCat("ask_version_increase{", ask_version_increase.ToString(), "} ",
+                        "request_file_content{", request_file_content.ToString(), "} ",
+                        "directory_subscribe{", directory_subscribe.ToString(), "} ",
+                        "file_write_commit{", file_write_commit.ToString(), "} ",
+                        "callback_queue{", callback_queue.ToString(), "}");
+}
+
+LatencyReport GRPCClient::GetLatencyReport() const {
+    LatencyReport report;
+    report.ask_version_increase = latency_[kAskVersionIncreaseLatency].Snapshot();
+    report.request_file_content = latency_[kRequestFileContentLatency].Snapshot();
+    report.directory_subscribe = latency_[kDirectorySubscribeLatency].Snapshot();
+    report.file_write_commit = latency_[kFileWriteCommitLatency].Snapshot();
+    report.callback_queue = latency_[kCallbackQueueLatency].Snapshot();
+    return report;
+}
+
+void GRPCClient::ResetLatencyStats() {
+    for (auto& histogram : latency_) {
+        histogram.Reset();
+    }
+}
+
+void GRPCClient::NoteSent(Connection& connection, const ClientMessage& message,
+                          std::chrono::steady_clock::time_point time) {
+    PendingExchange exchange{time, {}};
+    std::string directory_id;
+    LatencyMetric metric;
+    switch (message.message_case()) {
+        case ClientMessage::kAskVersionIncrease:
+            for (const auto& file : message.ask_version_increase().files()) {
+                directory_id = file.directory_id();
+                if (file.has_id()) {
+                    exchange.file_ids.push_back(file.id());
+                }
+            }
+            metric = kAskVersionIncreaseLatency;
+            break;
+        case ClientMessage::kRequestFileContent:
+            for (const auto& file : message.request_file_content().files()) {
+                directory_id = file.directory_id();
+                exchange.file_ids.push_back(file.id());
+            }
+            metric = kRequestFileContentLatency;
+            break;
+        case ClientMessage::kFileWriteEnd:
+            directory_id = message.file_write_end().directory_id();
+            metric = kFileWriteCommitLatency;
+            break;
+        case ClientMessage::kDirectorySubscribe:
+            directory_id = message.directory_subscribe().directory_id();
+            metric = kDirectorySubscribeLatency;
+            break;
+        default:
+            return;
+    }
+
+    std::lock_guard<std::mutex> lock(connection.exchanges_mutex);
+    if (metric == kAskVersionIncreaseLatency) {
+        // A directory uploads one batch at a time, so a new ASK means the
+        // earlier exchanges were answered or given up, e.g. after a failed
+        // BulkTransfer
+        connection.pending_exchanges.erase({directory_id, kAskVersionIncreaseLatency});
+        connection.pending_exchanges.erase({directory_id, kFileWriteCommitLatency});
+    }
+    auto& pending = connection.pending_exchanges[{directory_id, metric}];
+    if (metric == kDirectorySubscribeLatency) {
+        // A repeated subscription is answered once
+        pending.clear();
+    }
+    pending.push_back(std::move(exchange));
+}
+
+void GRPCClient::NoteReceived(Connection& connection, const ServerMessage& message) {
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(connection.exchanges_mutex);
+    auto find = [&](const std::string& directory_id,
+                    LatencyMetric metric) -> std::deque<PendingExchange>* {
+        auto it = connection.pending_exchanges.find({directory_id, metric});
+        return it == connection.pending_exchanges.end() || it->second.empty() ? nullptr
+                                                                               : &it->second;
+    };
+    auto complete = [&](std::deque<PendingExchange>* pending, LatencyMetric metric) {
+        if (pending) {
+            latency_[metric].Record(now - pending->front().sent);
+            pending->pop_front();
+        }
+    };
+
+    switch (message.message_case()) {
+        case ServerMessage::kVersionIncreaseAllow: {
+            const auto& directory_id = message.version_increase_allow().directory_id();
+            complete(find(directory_id, kAskVersionIncreaseLatency), kAskVersionIncreaseLatency);
+            break;
+        }
+        case ServerMessage::kVersionIncreaseDeny: {
+            const auto& directory_id = message.version_increase_deny().directory_id();
+            complete(find(directory_id, kAskVersionIncreaseLatency), kAskVersionIncreaseLatency);
+            break;
+        }
+        case ServerMessage::kVersionIncreased: {
+            const auto& files = message.version_increased().files();
+            if (files.empty()) {
+                break;
+            }
+            // After an allowed upload VERSION_INCREASED answers FILE_WRITE_END,
+            // otherwise it answers an ASK without content changes
+            const auto& directory_id = files[0].directory_id();
+            if (auto* commits = find(directory_id, kFileWriteCommitLatency)) {
+                complete(commits, kFileWriteCommitLatency);
+            } else {
+                complete(find(directory_id, kAskVersionIncreaseLatency),
+                         kAskVersionIncreaseLatency);
+            }
+            break;
+        }
+        case ServerMessage::kFileContentRequestAllow: {
+            const auto& directory_id = message.file_content_request_allow().directory_id();
+            complete(find(directory_id, kRequestFileContentLatency), kRequestFileContentLatency);
+            break;
+        }
+        case ServerMessage::kFileContentRequestDeny: {
+            const auto& files = message.file_content_request_deny().files();
+            if (!files.empty()) {
+                complete(find(files[0].directory_id(), kRequestFileContentLatency),
+                         kRequestFileContentLatency);
+            }
+            break;
+        }
+        case ServerMessage::kOkSubscribed: {
+            const auto& directory_id = message.ok_subscribed().directory_id();
+            complete(find(directory_id, kDirectorySubscribeLatency), kDirectorySubscribeLatency);
+            break;
+        }
+        case ServerMessage::kError: {
+            // Errors of requests naming files name some of them. A directory
+            // has one upload at a time, so while FILE_WRITE_END waits its ASK
+            // is already answered.
+            const auto& error = message.error();
+            auto names = [&](std::deque<PendingExchange>* pending) {
+                if (!pending || error.file_ids().empty()) {
+                    return false;
+                }
+                const auto& ids = pending->front().file_ids;
+                return std::any_of(error.file_ids().begin(), error.file_ids().end(),
+                                   [&ids](const std::string& id) {
+                                       return std::find(ids.begin(), ids.end(), id) != ids.end();
+                                   });
+            };
+            auto* content = find(error.directory_id(), kRequestFileContentLatency);
+            auto* asks = find(error.directory_id(), kAskVersionIncreaseLatency);
+            auto* commits = find(error.directory_id(), kFileWriteCommitLatency);
+            if (names(content)) {
+                complete(content, kRequestFileContentLatency);
+            } else if (commits) {
+                complete(commits, kFileWriteCommitLatency);
+            } else if (asks && (error.file_ids().empty() || names(asks))) {
+                complete(asks, kAskVersionIncreaseLatency);
+            } else if (content && error.file_ids().empty()) {
+                complete(content, kRequestFileContentLatency);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+void GRPCClient::LatencyLogLoop() {
+    std::unique_lock<std::mutex> lock(latency_log_mutex_);
+    while (!latency_log_cv_.wait_for(lock, options_.latency_log_interval,
+                                     [this] { return latency_log_stop_; })) {
+        std::clog << "[synxpo] latency " << GetLatencyReport().ToString() << std::endl;
+    }
+}
+
+CallbackQueueStats GRPCClient::GetCallbackQueueStats() const {
+    std::lock_guard<std::mutex> lock(callback_mutex_);
+    CallbackQueueStats stats = callback_queue_stats_;
+    stats.messages = callback_queue_.size();
+    stats.bytes = callback_queue_bytes_;
+    return stats;
+}
+
+CompressionStats GRPCClient::GetCompressionStats() const {
+    return compression_policy_.GetStats();
+}
+
+grpc::WriteOptions GRPCClient::WriteOptionsFor(const ClientMessage& message, size_t bytes) {
+    std::string_view payload;
+    if (message.has_file_write()) {
+        payload = message.file_write().chunk().data();
+    } else if (message.has_file_delta()) {
+        payload = DeltaPayload(message.file_delta());
+    }
+    return compression_policy_.WriteOptionsFor(bytes, payload);
+}
+
 void GRPCClient::SetMessageCallback(ServerMessageCallback callback) {
     std::lock_guard<std::mutex> lock(waiters_mutex_);
     message_callback_ = std::move(callback);
 }
 
+void GRPCClient::SetFileWriteSink(const std::string& directory_id,
+                                  std::shared_ptr<FileWriteSink> sink) {
+    std::lock_guard<std::mutex> lock(file_write_sinks_mutex_);
+    if (sink) {
+        file_write_sinks_[directory_id] = std::move(sink);
+    } else {
+        file_write_sinks_.erase(directory_id);
+    }
+}
+
 void GRPCClient::StartReceiving() {
     if (receiving_) {
         return;
     }
 
-    if (!connected_) {
+    if (!started_) {
         return;
     }
 
     should_stop_ = false;
     receiving_ = true;
-    receive_thread_ = std::thread([this]() { ReceiveLoop(); });
+    for (auto& connection : connections_) {
+        connection->receive_thread = std::thread(
+            [this, conn = connection.get()]() { ReceiveLoop(*conn); });
+    }
     callback_worker_ = std::thread([this]() { CallbackWorkerLoop(); });
 }
 
@@ -115,25 +813,20 @@ void GRPCClient::StopReceiving() {
     }
 
     should_stop_ = true;
+    reconnect_cv_.notify_all();
 
-    {
-        std::lock_guard<std::mutex> lock(waiters_mutex_);
-        for (auto& waiter : waiters_) {
-            std::lock_guard<std::mutex> waiter_lock(waiter->mutex);
-            waiter->cancelled = true;
-            waiter->done = true;
-            waiter->cv.notify_one();
-        }
-        waiters_.clear();
-    }
+    FailWaiters(absl::CancelledError("Receiving stopped"));
 
+    callback_space_cv_.notify_all();
     callback_cv_.notify_one();
     if (callback_worker_.joinable()) {
         callback_worker_.join();
     }
 
-    if (receive_thread_.joinable()) {
-        receive_thread_.join();
+    for (auto& connection : connections_) {
+        if (connection->receive_thread.joinable()) {
+            connection->receive_thread.join();
+        }
     }
 
     receiving_ = false;
@@ -143,6 +836,52 @@ bool GRPCClient::IsReceiving() const {
     return receiving_;
 }
 
+bool GRPCClient::CompleteWaiter(const std::shared_ptr<Waiter>& waiter,
+                                absl::Status status,
+                                std::optional<ServerMessage> result,
+                                std::vector<std::function<void()>>* deferred) {
+    std::function<void()> on_done;
+    Executor* timer_executor;
+    {
+        std::lock_guard<std::mutex> lock(waiter->mutex);
+        if (waiter->done) {
+            return false;
+        }
+        waiter->status = std::move(status);
+        waiter->result = std::move(result);
+        waiter->done = true;
+        on_done = std::move(waiter->on_done);
+        timer_executor = std::exchange(waiter->timer_executor, nullptr);
+    }
+    waiter->cv.notify_one();
+
+    if (timer_executor) {
+        timer_executor->Cancel(waiter->timer);
+    }
+    if (on_done) {
+        if (deferred) {
+            deferred->push_back(std::move(on_done));
+        } else {
+            on_done();
+        }
+    }
+    return true;
+}
+
+void GRPCClient::FailWaiters(const absl::Status& status) {
+    std::vector<std::function<void()>> resume;
+    {
+        std::lock_guard<std::mutex> lock(waiters_->mutex);
+        for (auto& waiter : waiters_->waiters) {
+            CompleteWaiter(waiter, status, std::nullopt, &resume);
+        }
+        waiters_->waiters.clear();
+    }
+    for (auto& on_done : resume) {
+        on_done();
+    }
+}
+
 absl::StatusOr<ServerMessage> GRPCClient::WaitForMessage(
     MessagePredicate predicate,
     std::chrono::milliseconds timeout) {
@@ -155,25 +894,101 @@ absl::StatusOr<ServerMessage> GRPCClient::WaitForMessage(
     waiter->predicate = std::move(predicate);
 
     {
-        std::lock_guard<std::mutex> lock(waiters_mutex_);
-        waiters_.push_back(waiter);
+        std::lock_guard<std::mutex> lock(waiters_->mutex);
+        waiters_->waiters.push_back(waiter);
     }
 
+    return AwaitWaiter(waiter, timeout);
+}
+
+absl::StatusOr<ServerMessage> GRPCClient::SendAndWait(
+    const ClientMessage& message,
+    MessagePredicate predicate,
+    std::chrono::milliseconds timeout) {
+    return SendAndWait([this, &message]() { return SendMessage(message); },
+                       std::move(predicate), timeout);
+}
+
+absl::StatusOr<ServerMessage> GRPCClient::SendAndWait(
+    const std::function<absl::Status()>& send,
+    MessagePredicate predicate,
+    std::chrono::milliseconds timeout) {
+
+    if (!receiving_) {
+        return absl::FailedPreconditionError("Message receiving is not started");
+    }
+
+    auto waiter = std::make_shared<Waiter>();
+    waiter->predicate = std::move(predicate);
+
+    {
+        std::lock_guard<std::mutex> lock(waiters_->mutex);
+        waiters_->waiters.push_back(waiter);
+    }
+
+    auto status = send();
+    if (!status.ok()) {
+        RemoveWaiter(*waiters_, waiter);
+        return status;
+    }
+
+    return AwaitWaiter(waiter, timeout);
+}
+
+absl::Status GRPCClient::SendAndCollect(
+    const ClientMessage& message,
+    MessageCollector collect,
+    std::chrono::milliseconds timeout) {
+
+    if (!receiving_) {
+        return absl::FailedPreconditionError("Message receiving is not started");
+    }
+
+    auto waiter = std::make_shared<Waiter>();
+    waiter->collect = std::move(collect);
+
+    {
+        std::lock_guard<std::mutex> lock(waiters_->mutex);
+        waiters_->waiters.push_back(waiter);
+    }
+
+    auto status = SendMessage(message);
+    if (!status.ok()) {
+        RemoveWaiter(*waiters_, waiter);
+        return status;
+    }
+
+    // Removed from the list on every path, so `collect` is done with
+    return AwaitWaiter(waiter, timeout).status();
+}
+
+void GRPCClient::RemoveWaiter(WaiterList& list, const std::shared_ptr<Waiter>& waiter) {
+    std::lock_guard<std::mutex> lock(list.mutex);
+    list.waiters.erase(std::remove(list.waiters.begin(), list.waiters.end(), waiter),
+                       list.waiters.end());
+}
+
+absl::StatusOr<ServerMessage> GRPCClient::AwaitWaiter(
+    const std::shared_ptr<Waiter>& waiter,
+    std::chrono::milliseconds timeout) {
+
     auto deadline = std::chrono::steady_clock::now() + timeout;
     std::unique_lock<std::mutex> lock(waiter->mutex);
     
     while (!waiter->done) {
         if (waiter->cv.wait_until(lock, deadline) == std::cv_status::timeout) {
-            std::lock_guard<std::mutex> waiters_lock(waiters_mutex_);
-            waiters_.erase(
-                std::remove(waiters_.begin(), waiters_.end(), waiter),
-                waiters_.end());
-            return absl::DeadlineExceededError("Timeout waiting for message");
+            // ProcessMessage locks the waiter list before waiter->mutex
+            lock.unlock();
+            RemoveWaiter(*waiters_, waiter);
+            lock.lock();
+            if (!waiter->done) {
+                return absl::DeadlineExceededError("Timeout waiting for message");
+            }
         }
     }
 
-    if (waiter->cancelled) {
-        return absl::CancelledError("Receiving stopped");
+    if (!waiter->status.ok()) {
+        return waiter->status;
     }
 
     if (!waiter->result) {
@@ -183,43 +998,356 @@ absl::StatusOr<ServerMessage> GRPCClient::WaitForMessage(
     return std::move(*waiter->result);
 }
 
-void GRPCClient::ReceiveLoop() {
-    while (!should_stop_ && connected_ && stream_) {
-        ServerMessage message;
-        
-        if (stream_->Read(&message)) {
-            ProcessMessage(message);
-        } else {
-            // Stream closed or error
+GRPCClient::RequestAwaitable GRPCClient::Request(
+    ClientMessage message,
+    MessagePredicate predicate,
+    Executor& executor,
+    std::chrono::milliseconds timeout) {
+    return RequestAwaitable(this, std::move(message), std::move(predicate), &executor, timeout);
+}
+
+GRPCClient::SendAwaitable GRPCClient::Send(ClientMessage message, Executor& executor) {
+    return SendAwaitable(this, std::move(message), &executor);
+}
+
+void GRPCClient::RequestAwaitable::await_suspend(std::coroutine_handle<> handle) {
+    client_->BeginRequest(*this, handle);
+}
+
+absl::StatusOr<ServerMessage> GRPCClient::RequestAwaitable::await_resume() {
+    if (!waiter_->status.ok()) {
+        return waiter_->status;
+    }
+    if (!waiter_->result) {
+        return absl::InternalError("Waiter completed without result");
+    }
+    return std::move(*waiter_->result);
+}
+
+void GRPCClient::SendAwaitable::await_suspend(std::coroutine_handle<> handle) {
+    executor_->Post([this, handle]() {
+        status_ = client_->SendMessage(message_);
+        handle.resume();
+    });
+}
+
+void GRPCClient::BeginRequest(RequestAwaitable& request, std::coroutine_handle<> handle) {
+    auto waiter = std::make_shared<Waiter>();
+    waiter->predicate = std::move(request.predicate_);
+    // The coroutine, and `request` with it, may be resumed and destroyed as
+    // soon as the waiter is registered, so take everything needed up front.
+    Executor* executor = request.executor_;
+    auto timeout = request.timeout_;
+    auto message = std::move(request.message_);
+    waiter->on_done = [executor, handle]() {
+        executor->Post([handle]() { handle.resume(); });
+    };
+    request.waiter_ = waiter;
+
+    if (!receiving_) {
+        CompleteWaiter(waiter, absl::FailedPreconditionError("Message receiving is not started"));
+        return;
+    }
+
+    // Registered before sending so that a fast reply cannot reach the callback queue
+    {
+        std::lock_guard<std::mutex> lock(waiters_->mutex);
+        waiters_->waiters.push_back(waiter);
+    }
+
+    auto status = SendMessage(message);
+    if (!status.ok()) {
+        RemoveWaiter(*waiters_, waiter);
+        CompleteWaiter(waiter, std::move(status));
+        return;
+    }
+
+    // Only the waiter and the list are touched, so the timer may safely
+    // outlive the client
+    std::weak_ptr<Waiter> weak_waiter = waiter;
+    std::weak_ptr<WaiterList> weak_list = waiters_;
+    auto timer = executor->PostAfter(timeout, [weak_waiter, weak_list]() {
+        auto waiter = weak_waiter.lock();
+        if (!waiter) {
+            return;
+        }
+        if (auto list = weak_list.lock()) {
+            RemoveWaiter(*list, waiter);
+        }
+        CompleteWaiter(waiter, absl::DeadlineExceededError("Timeout waiting for message"));
+    });
+
+    // The reply may already be here; then the timer is not needed either
+    {
+        std::lock_guard<std::mutex> lock(waiter->mutex);
+        if (!waiter->done) {
+            waiter->timer_executor = executor;
+            waiter->timer = timer;
+            return;
+        }
+    }
+    executor->Cancel(timer);
+}
+
+void GRPCClient::ReceiveLoop(Connection& connection) {
+    // The receive thread doubles as the connection supervisor: the stream is
+    // only replaced from here, so reading it without stream_mutex is safe.
+    while (!should_stop_) {
+        grpc::ByteBuffer buffer;
+
+        if (connection.stream && connection.stream->Read(&buffer)) {
+            connection.messages_received.fetch_add(1, std::memory_order_relaxed);
+            size_t bytes = buffer.Length();
+            connection.received.Record(bytes);
+
+            std::vector<grpc::Slice> slices;
+            if (!buffer.Dump(&slices).ok()) {
+                std::cerr << "Failed to read server message buffer" << std::endl;
+                continue;
+            }
+            if (TryWriteDirect(connection, slices)) {
+                continue;
+            }
+
+            ServerMessage message;
+            grpc::ByteBuffer parse_buffer(slices.data(), slices.size());
+            if (!grpc::SerializationTraits<ServerMessage>::Deserialize(&parse_buffer, &message).ok()) {
+                std::cerr << "Failed to parse server message" << std::endl;
+                continue;
+            }
+            NoteReceived(connection, message);
+            std::optional<FileChunkHeader> download;
+            if (message.has_file_write()) {
+                const auto& chunk = message.file_write().chunk();
+                download = FileChunkHeader{chunk.id(), chunk.directory_id(), chunk.offset(),
+                                           chunk.data().size()};
+            }
+            ProcessMessage(std::move(message), bytes);
+            if (download) {
+                // Reading slower makes the server slow down through flow control
+                download_limiter_.Acquire(download->directory_id, download->size);
+            }
+            continue;
+        }
+
+        // Stream closed or error
+        if (should_stop_) {
+            break;
+        }
+
+        CloseBrokenStream(connection);
+        if (!options_.reconnect.enabled || !Reconnect(connection)) {
             break;
         }
     }
 }
 
-void GRPCClient::ProcessMessage(const ServerMessage& message) {
+bool GRPCClient::TryWriteDirect(Connection& connection, const std::vector<grpc::Slice>& slices) {
     {
-        std::lock_guard<std::mutex> lock(waiters_mutex_);
+        std::lock_guard<std::mutex> lock(file_write_sinks_mutex_);
+        if (file_write_sinks_.empty()) {
+            return false;
+        }
+    }
+
+    auto chunk = ParseRawFileWrite(slices);
+    if (!chunk) {
+        return false;
+    }
+    std::shared_ptr<FileWriteSink> sink;
+    {
+        std::lock_guard<std::mutex> lock(file_write_sinks_mutex_);
+        auto it = file_write_sinks_.find(chunk->header.directory_id);
+        if (it == file_write_sinks_.end()) {
+            return false;
+        }
+        sink = it->second;
+    }
+    int fd = sink->TargetFd(chunk->header);
+    if (fd < 0) {
+        return false;
+    }
+
+    // Written on the receive thread: a slow disk slows reading, which in turn
+    // makes the server back off through HTTP/2 flow control. FILE_WRITE_END
+    // is read after this returns, so it never overtakes its chunks.
+    auto status = WriteRawFileChunk(fd, slices, *chunk);
+    if (status.ok()) {
+        connection.direct_write_chunks.fetch_add(1, std::memory_order_relaxed);
+        connection.direct_write_bytes.fetch_add(chunk->header.size, std::memory_order_relaxed);
+    }
+    sink->OnChunkWritten(chunk->header, status);
+    download_limiter_.Acquire(chunk->header.directory_id, chunk->header.size);
+    return true;
+}
+
+void GRPCClient::CloseBrokenStream(Connection& connection) {
+    connection.connected = false;
+    // Waiters do not know which connection their reply would arrive on
+    FailWaiters(absl::UnavailableError("Stream to server broke; retry after reconnect"));
+    DiscardPendingWrites(connection);
+
+    {
+        // Replies to these will never come
+        std::lock_guard<std::mutex> lock(connection.exchanges_mutex);
+        connection.pending_exchanges.clear();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(connection.context_mutex);
+        if (connection.stream_context) {
+            connection.stream_context->TryCancel();
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(connection.stream_mutex);
+    std::lock_guard<std::mutex> context_lock(connection.context_mutex);
+    if (connection.stream) {
+        connection.stream->Finish();
+        connection.stream.reset();
+    }
+    connection.stream_context.reset();
+}
+
+bool GRPCClient::Reconnect(Connection& connection) {
+    const auto& reconnect = options_.reconnect;
+    thread_local std::mt19937 rng(std::random_device{}());
+    std::uniform_real_distribution<double> jitter(1.0 - reconnect.jitter, 1.0 + reconnect.jitter);
+
+    auto backoff = std::chrono::duration<double, std::milli>(reconnect.initial_backoff);
+    while (!should_stop_) {
+        auto delay = std::chrono::duration_cast<std::chrono::milliseconds>(backoff * jitter(rng));
+        {
+            std::unique_lock<std::mutex> lock(reconnect_mutex_);
+            reconnect_cv_.wait_for(lock, delay, [this] { return should_stop_.load(); });
+        }
+        if (should_stop_) {
+            break;
+        }
+
+        if (OpenStream(connection).ok()) {
+            // Anything queued while the old stream was closing belongs to it
+            bool lost;
+            {
+                std::lock_guard<std::mutex> lock(connection.pending_mutex);
+                lost = !connection.pending_writes.empty();
+            }
+            if (lost) {
+                LoseBufferedWrites(connection);
+            }
+            connection.connected = true;
+            connection.reconnects.fetch_add(1, std::memory_order_relaxed);
+            ReplaySubscriptions(connection);
+            return true;
+        }
+
+        backoff = std::min(backoff * reconnect.backoff_multiplier,
+                           std::chrono::duration<double, std::milli>(reconnect.max_backoff));
+    }
+    return false;
+}
+
+void GRPCClient::ReplaySubscriptions(Connection& connection) {
+    std::vector<std::string> directories;
+    {
+        std::lock_guard<std::mutex> lock(connection.subscriptions_mutex);
+        directories.assign(connection.subscribed_directories.begin(),
+                           connection.subscribed_directories.end());
+    }
+    if (directories.empty()) {
+        return;
+    }
+
+    // Subscriptions are bound to the gRPC stream, so the server forgot them.
+    // Directory affinity routes every one of them back to this connection.
+    for (const auto& directory_id : directories) {
+        ClientMessage subscribe;
+        subscribe.mutable_directory_subscribe()->set_directory_id(directory_id);
+        SendMessageBuffered(subscribe).IgnoreError();
+    }
+
+    // Catch up on everything that changed while we were away
+    ClientMessage request;
+    auto* request_version = request.mutable_request_version();
+    for (const auto& directory_id : directories) {
+        request_version->add_requests()->set_directory_id(directory_id);
+    }
+    SendOn(connection, request).IgnoreError();
+}
+
+void GRPCClient::ProcessMessage(ServerMessage message, size_t bytes) {
+    // Coroutines are resumed once the list is unlocked
+    std::vector<std::function<void()>> resume;
+    bool taken = false;
+    {
+        std::lock_guard<std::mutex> lock(waiters_->mutex);
         
-        for (auto it = waiters_.begin(); it != waiters_.end(); ) {
-            auto& waiter = *it;
+        for (auto it = waiters_->waiters.begin(); it != waiters_->waiters.end(); ) {
+            auto waiter = *it;
             
+            if (waiter->collect) {
+                auto collected = waiter->collect(message);
+                if (collected == Collect::kSkip) {
+                    ++it;
+                    continue;
+                }
+                if (collected == Collect::kDone) {
+                    it = waiters_->waiters.erase(it);
+                    CompleteWaiter(waiter, absl::OkStatus(), ServerMessage(), &resume);
+                }
+                taken = true;
+                break;
+            }
+
+            // A waiter that timed out a moment ago is still listed until its
+            // owner removes it; CompleteWaiter checks under its lock
             if (waiter->predicate(message)) {
-                std::lock_guard<std::mutex> waiter_lock(waiter->mutex);
-                waiter->result = message;
-                waiter->done = true;
-                waiter->cv.notify_one();
-                
-                it = waiters_.erase(it);
-                return;
+                it = waiters_->waiters.erase(it);
+                if (CompleteWaiter(waiter, absl::OkStatus(), message, &resume)) {
+                    taken = true;
+                    break;
+                }
             } else {
                 ++it;
             }
         }
     }
+    for (auto& on_done : resume) {
+        on_done();
+    }
+    if (taken) {
+        return;
+    }
 
     {
-        std::lock_guard<std::mutex> lock(callback_mutex_);
-        callback_queue_.push(message);
+        std::unique_lock<std::mutex> lock(callback_mutex_);
+
+        // Blocking here stops the receive loop from reading, so HTTP/2 flow
+        // control pushes back on the server instead of memory growing.
+        // An empty queue always accepts, so oversized messages still pass.
+        const auto& limits = options_.callback_queue;
+        auto has_space = [&] {
+            return callback_queue_.empty() ||
+                   (callback_queue_.size() < limits.max_messages &&
+                    callback_queue_bytes_ + bytes <= limits.max_bytes);
+        };
+        if (!has_space()) {
+            auto stall_start = std::chrono::steady_clock::now();
+            callback_space_cv_.wait(lock, [&] { return should_stop_ || has_space(); });
+            ++callback_queue_stats_.stalls;
+            callback_queue_stats_.stalled_time += std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - stall_start);
+            if (should_stop_) {
+                return;
+            }
+        }
+
+        callback_queue_.push(QueuedMessage{std::move(message), bytes, std::chrono::steady_clock::now()});
+        callback_queue_bytes_ += bytes;
+        callback_queue_stats_.high_water_messages =
+            std::max(callback_queue_stats_.high_water_messages, callback_queue_.size());
+        callback_queue_stats_.high_water_bytes =
+            std::max(callback_queue_stats_.high_water_bytes, callback_queue_bytes_);
     }
     callback_cv_.notify_one();
 }
@@ -235,12 +1363,20 @@ void GRPCClient::CallbackWorkerLoop() {
             break;
         }
         
-        auto message = std::move(callback_queue_.front());
+        auto queued = std::move(callback_queue_.front());
         callback_queue_.pop();
+        callback_queue_bytes_ -= queued.bytes;
         lock.unlock();
+        callback_space_cv_.notify_one();
+
+        latency_[kCallbackQueueLatency].Record(
+            std::chrono::steady_clock::now() - queued.enqueued);
         
+        if (dispatcher_.Dispatch(std::move(queued.message))) {
+            continue;
+        }
         if (message_callback_) {
-            message_callback_(message);
+            message_callback_(queued.message);
         }
     }
 }
@@ -0,0 +1,292 @@
+#include "synxpo/client/hash_service.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <sstream>
+
+#include <absl/strings/str_cat.h>
+
+#include "synxpo/client/page_cache.h"
+#include "synxpo/common/content_hash.h"
+
+namespace synxpo {
+
+namespace {
+
+constexpr char kMagic[8] = {'S', 'X', 'P', 'O', 'H', 'A', 'S', 'H'};
+constexpr uint32_t kFormatVersion = 1;
+
+// On-disk entry; the cache is only read back on the same machine
+struct StoredEntry {
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    uint64_t hash;
+};
+
+struct StoredHeader {
+    char magic[8];
+    uint32_t format_version;
+    uint32_t entry_size;
+    uint64_t count;
+};
+
+int64_t Nanoseconds(const timespec& time) {
+    return static_cast<int64_t>(time.tv_sec) * 1000000000 + time.tv_nsec;
+}
+
+FileFingerprint FingerprintOf(const struct stat& st) {
+    return {static_cast<uint64_t>(st.st_dev), static_cast<uint64_t>(st.st_ino),
+            static_cast<uint64_t>(st.st_size), Nanoseconds(st.st_mtim), Nanoseconds(st.st_ctim)};
+}
+
+}  // namespace
+
+double HashServiceStats::GigabytesPerSecond() const {
+    if (hash_time.count() == 0) {
+        return 0.0;
+    }
+    return static_cast<double>(bytes_hashed) / 1e3 / static_cast<double>(hash_time.count());
+}
+
+std::string HashServiceStats::ToString() const {
+    std::ostringstream out;
+    out.precision(2);
+    out << std::fixed << "hashed " << files_hashed << " files, " << bytes_hashed << " bytes at "
+        << GigabytesPerSecond() << " GB/s per worker (" << ContentHashImplementation() << "), "
+        << cache_hits << " cache hits, " << cache_entries << " cached";
+    return out.str();
+}
+
+absl::StatusOr<std::unique_ptr<HashService>> HashService::Open(
+    const std::filesystem::path& cache_file, HashServiceOptions options) {
+    std::unique_ptr<HashService> service(new HashService(cache_file, options));
+    auto status = service->Load();
+    if (!status.ok()) {
+        // Only an optimization: start empty rather than fail
+        std::cerr << "Ignoring hash cache: " << status.message() << std::endl;
+        service->cache_.clear();
+    }
+    return service;
+}
+
+HashService::HashService(std::filesystem::path cache_file, HashServiceOptions options)
+    : cache_file_(std::move(cache_file)),
+      options_(options),
+      executor_(std::max<size_t>(options.threads, 1)) {}
+
+HashService::~HashService() {
+    executor_.Shutdown();
+    auto status = Save();
+    if (!status.ok()) {
+        std::cerr << "Failed to save hash cache: " << status.message() << std::endl;
+    }
+}
+
+absl::Status HashService::Load() {
+    std::ifstream in(cache_file_, std::ios::binary);
+    if (!in) {
+        return absl::OkStatus();
+    }
+
+    StoredHeader header;
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+        header.format_version != kFormatVersion || header.entry_size != sizeof(StoredEntry)) {
+        return absl::DataLossError(absl::StrCat("Bad header in ", cache_file_.string()));
+    }
+
+    // A corrupt count must not turn into a huge allocation
+    std::error_code error;
+    auto file_size = std::filesystem::file_size(cache_file_, error);
+    if (error || file_size < sizeof(header) ||
+        header.count > (file_size - sizeof(header)) / sizeof(StoredEntry)) {
+        return absl::DataLossError(absl::StrCat("Truncated ", cache_file_.string()));
+    }
+
+    std::vector<StoredEntry> entries(header.count);
+    if (!in.read(reinterpret_cast<char*>(entries.data()),
+                 static_cast<std::streamsize>(entries.size() * sizeof(StoredEntry)))) {
+        return absl::DataLossError(absl::StrCat("Truncated ", cache_file_.string()));
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    cache_.reserve(entries.size());
+    for (const auto& stored : entries) {
+        cache_[Key{stored.device, stored.inode}] = Entry{
+            {stored.device, stored.inode, stored.size, stored.mtime_ns, stored.ctime_ns},
+            stored.hash};
+    }
+    return absl::OkStatus();
+}
+
+absl::Status HashService::Save() {
+    std::vector<StoredEntry> entries;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!dirty_) {
+            return absl::OkStatus();
+        }
+        entries.reserve(cache_.size());
+        for (const auto& [key, entry] : cache_) {
+            const auto& fp = entry.fingerprint;
+            entries.push_back({fp.device, fp.inode, fp.size, fp.mtime_ns, fp.ctime_ns, entry.hash});
+        }
+        dirty_ = false;
+    }
+
+    StoredHeader header{};
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.format_version = kFormatVersion;
+    header.entry_size = sizeof(StoredEntry);
+    header.count = entries.size();
+
+    // Losing the cache only costs rehashing, so it is not synced
+    auto temp = cache_file_;
+    temp += ".tmp";
+    absl::Status status;
+    {
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(entries.data()),
+                  static_cast<std::streamsize>(entries.size() * sizeof(StoredEntry)));
+        if (!out) {
+            status = absl::InternalError(absl::StrCat("Failed to write ", temp.string()));
+        }
+    }
+    if (status.ok()) {
+        std::error_code error;
+        std::filesystem::rename(temp, cache_file_, error);
+        if (error) {
+            status = absl::InternalError(
+                absl::StrCat("Failed to replace ", cache_file_.string(), ": ", error.message()));
+        }
+    }
+    if (!status.ok()) {
+        // So the next Save tries again
+        std::lock_guard<std::mutex> lock(mutex_);
+        dirty_ = true;
+    }
+    return status;
+}
+
+absl::StatusOr<FileHash> HashService::Hash(const std::filesystem::path& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return absl::NotFoundError(absl::StrCat("Failed to open ", path.string(), ": ",
+                                                std::strerror(errno)));
+    }
+
+    struct stat before;
+    if (::fstat(fd, &before) != 0 || !S_ISREG(before.st_mode)) {
+        ::close(fd);
+        return absl::InvalidArgumentError(absl::StrCat(path.string(), " is not a regular file"));
+    }
+
+    FileHash result;
+    result.fingerprint = FingerprintOf(before);
+    Key key{result.fingerprint.device, result.fingerprint.inode};
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = cache_.find(key);
+        if (it != cache_.end() && it->second.fingerprint == result.fingerprint) {
+            ++stats_.cache_hits;
+            ::close(fd);
+            result.hash = it->second.hash;
+            result.cached = true;
+            return result;
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    CacheTrimmer trimmer(fd, result.fingerprint.size, options_.drop_cache_min_bytes);
+    thread_local std::vector<char> buffer;
+    buffer.resize(options_.read_buffer_bytes);
+    ContentHasher hasher;
+    uint64_t bytes = 0;
+    while (true) {
+        ssize_t n = ::read(fd, buffer.data(), buffer.size());
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            auto status = absl::InternalError(
+                absl::StrCat("Failed to read ", path.string(), ": ", std::strerror(errno)));
+            ::close(fd);
+            return status;
+        }
+        if (n == 0) {
+            break;
+        }
+        hasher.Update(buffer.data(), static_cast<size_t>(n));
+        bytes += static_cast<uint64_t>(n);
+        trimmer.Advance(bytes);
+    }
+    trimmer.Finish();
+    result.hash = hasher.Digest();
+
+    struct stat after;
+    bool stable = ::fstat(fd, &after) == 0 && FingerprintOf(after) == result.fingerprint;
+    ::close(fd);
+
+    auto changed_ago = std::chrono::system_clock::now().time_since_epoch() -
+                       std::chrono::nanoseconds(result.fingerprint.ctime_ns);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.files_hashed;
+    stats_.bytes_hashed += bytes;
+    stats_.hash_time += std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start);
+    // A file written while it was read, or too recently to trust its
+    // timestamps, is hashed again next time
+    if (stable && changed_ago > options_.racy_window) {
+        cache_[key] = Entry{result.fingerprint, result.hash};
+        dirty_ = true;
+    }
+    return result;
+}
+
+void HashService::HashAsync(std::filesystem::path path, Callback done) {
+    executor_.Post([this, path = std::move(path), done = std::move(done)]() {
+        done(Hash(path));
+    });
+}
+
+std::vector<absl::StatusOr<FileHash>> HashService::HashAll(
+    const std::vector<std::filesystem::path>& paths) {
+    std::vector<std::future<absl::StatusOr<FileHash>>> futures;
+    futures.reserve(paths.size());
+    for (const auto& path : paths) {
+        auto promise = std::make_shared<std::promise<absl::StatusOr<FileHash>>>();
+        futures.push_back(promise->get_future());
+        HashAsync(path, [promise](absl::StatusOr<FileHash> result) {
+            promise->set_value(std::move(result));
+        });
+    }
+
+    std::vector<absl::StatusOr<FileHash>> results;
+    results.reserve(paths.size());
+    for (auto& future : futures) {
+        results.push_back(future.get());
+    }
+    return results;
+}
+
+HashServiceStats HashService::GetStats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto stats = stats_;
+    stats.cache_entries = cache_.size();
+    return stats;
+}
+
+}  // namespace synxpo
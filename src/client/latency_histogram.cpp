@@ -0,0 +1,109 @@
+#include "synxpo/client/latency_histogram.h"
+
+#include <algorithm>
+#include <bit>
+
+#include <absl/strings/str_cat.h>
+
+namespace synxpo {
+
+std::string LatencySnapshot::ToString() const {
+    return absl::StrCat("n=", count,
+                        " p50=", p50.count(), "us",
+                        " p90=", p90.count(), "us",
+                        " p99=", p99.count(), "us",
+                        " p999=", p999.count(), "us",
+                        " max=", max.count(), "us");
+}
+
+LatencyHistogram::LatencyHistogram() {
+    for (auto& bucket : buckets_) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+}
+
+size_t LatencyHistogram::BucketIndex(uint64_t value) {
+    if (value < kSubBucketCount) {
+        return static_cast<size_t>(value);
+    }
+    size_t shift = std::bit_width(value) - kSubBucketBits;
+    if (shift > kMaxShift) {
+        return kBucketCount - 1;
+    }
+    // value >> shift lies in [kSubBucketHalf, kSubBucketCount)
+    return kSubBucketCount + (shift - 1) * kSubBucketHalf + ((value >> shift) - kSubBucketHalf);
+}
+
+uint64_t LatencyHistogram::BucketMidpoint(size_t index) {
+    if (index < kSubBucketCount) {
+        return index;
+    }
+    size_t shift = (index - kSubBucketCount) / kSubBucketHalf + 1;
+    uint64_t sub_bucket = (index - kSubBucketCount) % kSubBucketHalf + kSubBucketHalf;
+    uint64_t lower = sub_bucket << shift;
+    return lower + (uint64_t{1} << shift) / 2;
+}
+
+void LatencyHistogram::Record(std::chrono::microseconds latency) {
+    uint64_t value = static_cast<uint64_t>(std::max<int64_t>(latency.count(), 0));
+
+    buckets_[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+
+    uint64_t current = min_.load(std::memory_order_relaxed);
+    while (value < current && !min_.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+    }
+    current = max_.load(std::memory_order_relaxed);
+    while (value > current && !max_.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+    }
+}
+
+LatencySnapshot LatencyHistogram::Snapshot() const {
+    std::array<uint64_t, kBucketCount> counts;
+    uint64_t total = 0;
+    for (size_t i = 0; i < kBucketCount; ++i) {
+        counts[i] = buckets_[i].load(std::memory_order_relaxed);
+        total += counts[i];
+    }
+
+    LatencySnapshot snapshot;
+    snapshot.count = total;
+    if (total == 0) {
+        return snapshot;
+    }
+
+    uint64_t min = min_.load(std::memory_order_relaxed);
+    uint64_t max = max_.load(std::memory_order_relaxed);
+    snapshot.min = std::chrono::microseconds(min);
+    snapshot.max = std::chrono::microseconds(max);
+    snapshot.mean = std::chrono::microseconds(sum_.load(std::memory_order_relaxed) / total);
+
+    auto percentile = [&](double fraction) {
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(fraction * total + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kBucketCount; ++i) {
+            seen += counts[i];
+            if (seen >= rank) {
+                return std::chrono::microseconds(std::clamp(BucketMidpoint(i), min, max));
+            }
+        }
+        return std::chrono::microseconds(max);
+    };
+
+    snapshot.p50 = percentile(0.50);
+    snapshot.p90 = percentile(0.90);
+    snapshot.p99 = percentile(0.99);
+    snapshot.p999 = percentile(0.999);
+    return snapshot;
+}
+
+void LatencyHistogram::Reset() {
+    for (auto& bucket : buckets_) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+    sum_.store(0, std::memory_order_relaxed);
+    min_.store(UINT64_MAX, std::memory_order_relaxed);
+    max_.store(0, std::memory_order_relaxed);
+}
+
+}  // namespace synxpo
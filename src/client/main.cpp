@@ -26,21 +26,24 @@ int main(int argc, char** argv) {
     }
     std::cout << "✓ Connected successfully" << std::endl;
 
-    // Set callback for unexpected messages
-    client.SetMessageCallback([](const synxpo::ServerMessage& msg) {
-        std::cout << "[Callback] Received message: ";
-        if (msg.has_check_version()) {
-            std::cout << "CheckVersion with " 
-                      << msg.check_version().files_size() << " files" << std::endl;
-        } else if (msg.has_file_write()) {
-            std::cout << "FileWrite (" << msg.file_write().chunk().data().size() << " bytes)" << std::endl;
-        } else if (msg.has_ok_directory_created()) {
-            std::cout << "OkDirectoryCreated: " << msg.ok_directory_created().directory_id() << std::endl;
-        } else if (msg.has_error()) {
-            std::cout << "Error: " << msg.error().message() << std::endl;
-        } else {
-            std::cout << "Unknown message type" << std::endl;
-        }
+    // Handlers for unexpected messages
+    client.On<synxpo::CheckVersion>([](const synxpo::CheckVersion& check) {
+        std::cout << "[Callback] Received message: CheckVersion with "
+                  << check.files_size() << " files" << std::endl;
+    });
+    client.On<synxpo::FileWrite>([](const synxpo::FileWrite& write) {
+        std::cout << "[Callback] Received message: FileWrite ("
+                  << write.chunk().data().size() << " bytes)" << std::endl;
+    });
+    client.On<synxpo::OkDirectoryCreated>([](const synxpo::OkDirectoryCreated& created) {
+        std::cout << "[Callback] Received message: OkDirectoryCreated: "
+                  << created.directory_id() << std::endl;
+    });
+    client.On<synxpo::Error>([](const synxpo::Error& error) {
+        std::cout << "[Callback] Received message: Error: " << error.message() << std::endl;
+    });
+    client.SetMessageCallback([](const synxpo::ServerMessage&) {
+        std::cout << "[Callback] Received message: Unknown message type" << std::endl;
     });
 
     // Start receiving messages
@@ -0,0 +1,46 @@
+#include "synxpo/client/message_dispatcher.h"
+
+#include <algorithm>
+
+namespace synxpo {
+
+namespace {
+
+// One past the highest field number of the ServerMessage oneof
+size_t CaseCount() {
+    const auto* oneof = ServerMessage::GetDescriptor()->FindOneofByName("message");
+    int highest = 0;
+    for (int i = 0; i < oneof->field_count(); ++i) {
+        highest = std::max(highest, oneof->field(i)->number());
+    }
+    return static_cast<size_t>(highest) + 1;
+}
+
+}  // namespace
+
+MessageDispatcher::MessageDispatcher() : handlers_(CaseCount()) {}
+
+bool MessageDispatcher::HasHandler(ServerMessage::MessageCase message_case) const {
+    auto index = static_cast<size_t>(message_case);
+    return index < handlers_.size() && handlers_[index].call != nullptr;
+}
+
+bool MessageDispatcher::Dispatch(ServerMessage&& message) {
+    auto index = static_cast<size_t>(message.message_case());
+    if (index >= handlers_.size() || !handlers_[index].call) {
+        return false;
+    }
+
+    const auto& entry = handlers_[index];
+    if (!entry.executor) {
+        (*entry.call)(message);
+        return true;
+    }
+
+    // std::function needs a copyable task, so the message travels in a shared_ptr
+    auto shared = std::make_shared<ServerMessage>(std::move(message));
+    entry.executor->Post([call = entry.call, shared]() { (*call)(*shared); });
+    return true;
+}
+
+}  // namespace synxpo
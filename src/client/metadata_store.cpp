@@ -0,0 +1,999 @@
+#include "synxpo/client/metadata_store.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+
+#include <absl/strings/str_cat.h>
+
+namespace synxpo {
+
+namespace {
+
+constexpr char kMagic[8] = {'S', 'X', 'P', 'O', 'M', 'E', 'T', 'A'};
+constexpr uint32_t kFormatVersion = 2;
+constexpr size_t kHeaderBytes = 4096;
+constexpr size_t kInitialCapacity = 1024;
+constexpr size_t kMaxIdBytes = 40;
+constexpr size_t kInlinePathBytes = 168;
+
+constexpr uint32_t kSlotUsed = 1;
+constexpr uint32_t kSlotFolder = 2;
+
+constexpr uint8_t kLogPut = 1;
+constexpr uint8_t kLogClear = 2;
+
+constexpr std::array<uint32_t, 256> MakeCrcTable() {
+    std::array<uint32_t, 256> table{};
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+        }
+        table[i] = crc;
+    }
+    return table;
+}
+
+constexpr auto kCrcTable = MakeCrcTable();
+
+uint32_t Crc32(const char* data, size_t size) {
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; ++i) {
+        crc = kCrcTable[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+absl::Status ErrnoError(const char* what, const std::filesystem::path& path) {
+    return absl::InternalError(
+        absl::StrCat(what, " ", path.string(), ": ", std::strerror(errno)));
+}
+
+// The log is only read back on the same machine, so integers are stored in
+// host byte order
+template <typename T>
+void Append(std::string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+class LogReader {
+public:
+    LogReader(const char* data, size_t size) : data_(data), left_(size) {}
+
+    template <typename T>
+    bool Read(T* value) {
+        if (left_ < sizeof(T)) {
+            return false;
+        }
+        std::memcpy(value, data_, sizeof(T));
+        data_ += sizeof(T);
+        left_ -= sizeof(T);
+        return true;
+    }
+
+    bool ReadString(std::string* value) {
+        uint16_t size;
+        if (!Read(&size) || left_ < size) {
+            return false;
+        }
+        value->assign(data_, size);
+        data_ += size;
+        left_ -= size;
+        return true;
+    }
+
+private:
+    const char* data_;
+    size_t left_;
+};
+
+}  // namespace
+
+struct MetadataStore::Header {
+    char magic[8];
+    uint32_t format_version;
+    uint32_t slot_size;
+    uint64_t checkpoint_lsn;
+    uint64_t paths_size;
+    uint16_t directory_id_length;
+    char directory_id[64];
+};
+
+// 256 bytes so that a million files fit in a 256 MB table. Paths longer than
+// the inline buffer are kept in the `paths` file at path_offset.
+struct MetadataStore::Slot {
+    uint32_t flags;
+    uint16_t id_length;
+    uint16_t path_length;
+    uint64_t version;
+    uint64_t content_changed_version;
+    uint64_t first_try_time;
+    uint64_t content_hash;
+    uint64_t path_offset;
+    char id[kMaxIdBytes];
+    char path[kInlinePathBytes];
+};
+
+// Open-addressing hash set of slot numbers, keyed by the id or path stored
+// in the slot. Slot numbers are kept off by one so zero marks an empty bucket.
+class MetadataStore::KeyIndex {
+public:
+    using KeyOf = std::string_view (MetadataStore::*)(uint32_t) const;
+
+    KeyIndex(const MetadataStore& store, KeyOf key_of) : store_(store), key_of_(key_of) {}
+
+    void Reset(size_t expected) {
+        size_t buckets = 1024;
+        while (buckets < expected * 2) {
+            buckets *= 2;
+        }
+        buckets_.assign(buckets, kEmpty);
+        size_ = 0;
+        tombstones_ = 0;
+    }
+
+    std::optional<uint32_t> Find(std::string_view key) const {
+        if (key.empty()) {
+            return std::nullopt;
+        }
+        size_t mask = buckets_.size() - 1;
+        for (size_t i = Hash(key) & mask;; i = (i + 1) & mask) {
+            uint32_t bucket = buckets_[i];
+            if (bucket == kEmpty) {
+                return std::nullopt;
+            }
+            if (bucket != kTombstone && Key(bucket - 1) == key) {
+                return bucket - 1;
+            }
+        }
+    }
+
+    // Index `slot` under its current key, taking the key over from any other slot
+    void Insert(uint32_t slot) {
+        std::string_view key = Key(slot);
+        if (key.empty()) {
+            return;
+        }
+        if ((size_ + tombstones_ + 1) * 2 > buckets_.size()) {
+            Rehash();
+        }
+
+        size_t mask = buckets_.size() - 1;
+        std::optional<size_t> reuse;
+        for (size_t i = Hash(key) & mask;; i = (i + 1) & mask) {
+            uint32_t bucket = buckets_[i];
+            if (bucket == kTombstone) {
+                if (!reuse) {
+                    reuse = i;
+                }
+                continue;
+            }
+            if (bucket == kEmpty) {
+                if (reuse) {
+                    --tombstones_;
+                    i = *reuse;
+                }
+                buckets_[i] = slot + 1;
+                ++size_;
+                return;
+            }
+            if (Key(bucket - 1) == key) {
+                buckets_[i] = slot + 1;
+                return;
+            }
+        }
+    }
+
+    // Remove `slot` if it is the one indexed under its current key
+    void Erase(uint32_t slot) {
+        std::string_view key = Key(slot);
+        if (key.empty()) {
+            return;
+        }
+        size_t mask = buckets_.size() - 1;
+        for (size_t i = Hash(key) & mask;; i = (i + 1) & mask) {
+            uint32_t bucket = buckets_[i];
+            if (bucket == kEmpty) {
+                return;
+            }
+            if (bucket != kTombstone && Key(bucket - 1) == key) {
+                if (bucket == slot + 1) {
+                    buckets_[i] = kTombstone;
+                    --size_;
+                    ++tombstones_;
+                }
+                return;
+            }
+        }
+    }
+
+private:
+    static constexpr uint32_t kEmpty = 0;
+    static constexpr uint32_t kTombstone = UINT32_MAX;
+
+    static size_t Hash(std::string_view key) { return std::hash<std::string_view>()(key); }
+
+    std::string_view Key(uint32_t slot) const { return (store_.*key_of_)(slot); }
+
+    void Rehash() {
+        std::vector<uint32_t> old;
+        old.swap(buckets_);
+        Reset(std::max<size_t>(size_ * 2, 1));
+        for (uint32_t bucket : old) {
+            if (bucket != kEmpty && bucket != kTombstone) {
+                Insert(bucket - 1);
+            }
+        }
+    }
+
+    const MetadataStore& store_;
+    KeyOf key_of_;
+    std::vector<uint32_t> buckets_;
+    size_t size_ = 0;
+    size_t tombstones_ = 0;
+};
+
+void MetadataStore::Batch::Put(FileRecord record) {
+    operations_.push_back({Kind::kPut, std::move(record), {}});
+}
+
+void MetadataStore::Batch::RemoveById(std::string id) {
+    operations_.push_back({Kind::kRemoveById, {}, std::move(id)});
+}
+
+void MetadataStore::Batch::RemoveByPath(std::string path) {
+    operations_.push_back({Kind::kRemoveByPath, {}, std::move(path)});
+}
+
+MetadataStore::MetadataStore(std::filesystem::path path, std::string directory_id,
+                             MetadataStoreOptions options)
+    : path_(std::move(path)),
+      directory_id_(std::move(directory_id)),
+      options_(std::move(options)),
+      by_id_(std::make_unique<KeyIndex>(*this, &MetadataStore::SlotId)),
+      by_path_(std::make_unique<KeyIndex>(*this, &MetadataStore::SlotPath)) {
+    static_assert(sizeof(Slot) == 256);
+    static_assert(sizeof(Header) <= kHeaderBytes);
+}
+
+absl::StatusOr<std::unique_ptr<MetadataStore>> MetadataStore::Open(
+    const std::filesystem::path& path, const std::string& directory_id,
+    MetadataStoreOptions options) {
+    if (directory_id.size() > sizeof(Header::directory_id)) {
+        return absl::InvalidArgumentError("Directory id is too long");
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::unique_ptr<MetadataStore> store(new MetadataStore(path, directory_id, std::move(options)));
+
+    auto status = store->OpenFiles();
+    if (status.ok()) {
+        status = store->ReplayLog();
+    }
+    if (status.ok()) {
+        status = store->LoadLongPaths();
+    }
+    if (!status.ok()) {
+        // Keep the destructor from checkpointing a table that failed to open
+        store->header_ = nullptr;
+        return status;
+    }
+    store->RebuildIndexes();
+    store->last_checkpoint_ = std::chrono::steady_clock::now();
+
+    // Fold the replayed log into the table so it does not grow across restarts
+    if (store->stats_.replayed_entries > 0) {
+        status = store->CheckpointLocked();
+        if (!status.ok()) {
+            return status;
+        }
+    }
+
+    store->stats_.open_time = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start);
+    return store;
+}
+
+MetadataStore::~MetadataStore() {
+    if (header_) {
+        auto status = CheckpointLocked();
+        if (!status.ok()) {
+            std::cerr << "Failed to checkpoint metadata store: " << status.message() << std::endl;
+        }
+    }
+    if (mapping_) {
+        munmap(mapping_, mapping_size_);
+    }
+    for (int fd : {table_fd_, paths_fd_, wal_fd_}) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+absl::Status MetadataStore::OpenFiles() {
+    std::error_code error;
+    std::filesystem::create_directories(path_, error);
+    if (error) {
+        return absl::InternalError(
+            absl::StrCat("Failed to create ", path_.string(), ": ", error.message()));
+    }
+
+    auto table_path = path_ / "records";
+    table_fd_ = open(table_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (table_fd_ < 0) {
+        return ErrnoError("Failed to open", table_path);
+    }
+    paths_fd_ = open((path_ / "paths").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (paths_fd_ < 0) {
+        return ErrnoError("Failed to open", path_ / "paths");
+    }
+    wal_fd_ = open((path_ / "wal").c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (wal_fd_ < 0) {
+        return ErrnoError("Failed to open", path_ / "wal");
+    }
+
+    struct stat info;
+    if (fstat(table_fd_, &info) != 0) {
+        return ErrnoError("Failed to stat", table_path);
+    }
+
+    if (info.st_size == 0) {
+        auto status = MapTable(kInitialCapacity);
+        if (!status.ok()) {
+            return status;
+        }
+        std::memcpy(header_->magic, kMagic, sizeof(kMagic));
+        header_->format_version = kFormatVersion;
+        header_->slot_size = sizeof(Slot);
+        header_->directory_id_length = static_cast<uint16_t>(directory_id_.size());
+        std::memcpy(header_->directory_id, directory_id_.data(), directory_id_.size());
+        if (msync(mapping_, kHeaderBytes, MS_SYNC) != 0) {
+            return ErrnoError("Failed to sync", table_path);
+        }
+        return absl::OkStatus();
+    }
+
+    if (static_cast<size_t>(info.st_size) < kHeaderBytes) {
+        return absl::DataLossError(absl::StrCat("Truncated metadata table ", table_path.string()));
+    }
+    // A crash while growing may leave a partial slot at the end; it was never used
+    auto status = MapTable((info.st_size - kHeaderBytes) / sizeof(Slot));
+    if (!status.ok()) {
+        return status;
+    }
+
+    if (std::memcmp(header_->magic, kMagic, sizeof(kMagic)) != 0 ||
+        header_->format_version != kFormatVersion || header_->slot_size != sizeof(Slot)) {
+        return absl::DataLossError(
+            absl::StrCat("Unsupported metadata table format in ", table_path.string()));
+    }
+    if (std::string(header_->directory_id, header_->directory_id_length) != directory_id_) {
+        return absl::FailedPreconditionError(
+            absl::StrCat(path_.string(), " belongs to another directory"));
+    }
+    paths_size_ = header_->paths_size;
+    next_lsn_ = header_->checkpoint_lsn + 1;
+    return absl::OkStatus();
+}
+
+absl::Status MetadataStore::MapTable(size_t capacity) {
+    size_t size = kHeaderBytes + capacity * sizeof(Slot);
+    if (ftruncate(table_fd_, static_cast<off_t>(size)) != 0) {
+        return ErrnoError("Failed to resize", path_ / "records");
+    }
+
+    void* mapping = mapping_
+        ? mremap(mapping_, mapping_size_, size, MREMAP_MAYMOVE)
+        : mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, table_fd_, 0);
+    if (mapping == MAP_FAILED) {
+        return ErrnoError("Failed to map", path_ / "records");
+    }
+
+    mapping_ = mapping;
+    mapping_size_ = size;
+    header_ = static_cast<Header*>(mapping_);
+    slots_ = reinterpret_cast<Slot*>(static_cast<char*>(mapping_) + kHeaderBytes);
+    return absl::OkStatus();
+}
+
+absl::Status MetadataStore::GrowTable() {
+    size_t old_capacity = Capacity();
+    auto status = MapTable(std::max(old_capacity * 2, kInitialCapacity));
+    if (!status.ok()) {
+        return status;
+    }
+    // Hand out the lowest new slot first
+    for (size_t i = Capacity(); i > old_capacity; --i) {
+        free_slots_.push_back(static_cast<uint32_t>(i - 1));
+    }
+    return absl::OkStatus();
+}
+
+size_t MetadataStore::Capacity() const {
+    return (mapping_size_ - kHeaderBytes) / sizeof(Slot);
+}
+
+absl::Status MetadataStore::ReplayLog() {
+    struct stat info;
+    if (fstat(wal_fd_, &info) != 0) {
+        return ErrnoError("Failed to stat", path_ / "wal");
+    }
+
+    std::string log(static_cast<size_t>(info.st_size), '\0');
+    size_t read_total = 0;
+    while (read_total < log.size()) {
+        ssize_t n = pread(wal_fd_, log.data() + read_total, log.size() - read_total,
+                          static_cast<off_t>(read_total));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return ErrnoError("Failed to read", path_ / "wal");
+        }
+        read_total += static_cast<size_t>(n);
+    }
+
+    uint64_t checkpoint_lsn = header_->checkpoint_lsn;
+    size_t offset = 0;
+    while (offset + 2 * sizeof(uint32_t) <= log.size()) {
+        uint32_t size;
+        uint32_t crc;
+        std::memcpy(&size, log.data() + offset, sizeof(size));
+        std::memcpy(&crc, log.data() + offset + sizeof(size), sizeof(crc));
+        const char* payload = log.data() + offset + 2 * sizeof(uint32_t);
+        if (offset + 2 * sizeof(uint32_t) + size > log.size() || Crc32(payload, size) != crc) {
+            break;  // torn tail of an unfinished batch
+        }
+
+        LogReader reader(payload, size);
+        uint64_t lsn;
+        uint32_t count;
+        if (!reader.Read(&lsn) || !reader.Read(&count)) {
+            break;
+        }
+
+        for (uint32_t i = 0; lsn > checkpoint_lsn && i < count; ++i) {
+            uint8_t op;
+            uint32_t index;
+            if (!reader.Read(&op) || !reader.Read(&index)) {
+                return absl::DataLossError("Corrupted metadata log entry");
+            }
+            while (index >= Capacity()) {
+                auto status = MapTable(std::max(Capacity() * 2, kInitialCapacity));
+                if (!status.ok()) {
+                    return status;
+                }
+            }
+            if (op == kLogClear) {
+                ClearSlot(index);
+                continue;
+            }
+
+            FileRecord record;
+            uint32_t flags;
+            uint64_t path_offset;
+            if (op != kLogPut || !reader.Read(&flags) || !reader.Read(&record.version) ||
+                !reader.Read(&record.content_changed_version) ||
+                !reader.Read(&record.first_try_time) || !reader.Read(&record.content_hash) ||
+                !reader.Read(&path_offset) ||
+                !reader.ReadString(&record.id) || !reader.ReadString(&record.current_path)) {
+                return absl::DataLossError("Corrupted metadata log entry");
+            }
+            record.type = (flags & kSlotFolder) ? FileType::FOLDER : FileType::FILE;
+            if (record.current_path.size() > kInlinePathBytes) {
+                paths_size_ = std::max<uint64_t>(paths_size_, path_offset + record.current_path.size());
+            }
+            auto status = WriteSlot(index, record, path_offset);
+            if (!status.ok()) {
+                return status;
+            }
+        }
+
+        if (lsn > checkpoint_lsn) {
+            ++stats_.replayed_entries;
+        }
+        next_lsn_ = std::max(next_lsn_, lsn + 1);
+        offset += 2 * sizeof(uint32_t) + size;
+    }
+
+    if (offset < log.size() && ftruncate(wal_fd_, static_cast<off_t>(offset)) != 0) {
+        return ErrnoError("Failed to truncate", path_ / "wal");
+    }
+    wal_size_ = offset;
+    return absl::OkStatus();
+}
+
+void MetadataStore::RebuildIndexes() {
+    free_slots_.clear();
+    size_t capacity = Capacity();
+    size_t used = 0;
+    for (size_t i = 0; i < capacity; ++i) {
+        used += (slots_[i].flags & kSlotUsed) ? 1 : 0;
+    }
+    by_id_->Reset(used);
+    by_path_->Reset(used);
+
+    // Walk backwards so the free list hands out low slots first. Should two
+    // records share a path, the lower slot wins the path index.
+    for (size_t i = capacity; i > 0; --i) {
+        auto index = static_cast<uint32_t>(i - 1);
+        if (slots_[index].flags & kSlotUsed) {
+            by_id_->Insert(index);
+            by_path_->Insert(index);
+        } else {
+            free_slots_.push_back(index);
+        }
+    }
+}
+
+absl::Status MetadataStore::WriteSlot(uint32_t index, const FileRecord& record,
+                                      uint64_t path_offset) {
+    if (record.current_path.size() > kInlinePathBytes) {
+        const auto& path = record.current_path;
+        size_t written = 0;
+        while (written < path.size()) {
+            ssize_t n = pwrite(paths_fd_, path.data() + written, path.size() - written,
+                               static_cast<off_t>(path_offset + written));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                return ErrnoError("Failed to write", path_ / "paths");
+            }
+            written += static_cast<size_t>(n);
+        }
+        long_paths_[index] = path;
+    } else {
+        long_paths_.erase(index);
+    }
+
+    Slot& slot = slots_[index];
+    slot.flags = kSlotUsed | (record.type == FileType::FOLDER ? kSlotFolder : 0);
+    slot.id_length = static_cast<uint16_t>(record.id.size());
+    slot.path_length = static_cast<uint16_t>(record.current_path.size());
+    slot.version = record.version;
+    slot.content_changed_version = record.content_changed_version;
+    slot.first_try_time = record.first_try_time;
+    slot.content_hash = record.content_hash;
+    slot.path_offset = path_offset;
+    std::memcpy(slot.id, record.id.data(), record.id.size());
+    if (record.current_path.size() <= kInlinePathBytes) {
+        std::memcpy(slot.path, record.current_path.data(), record.current_path.size());
+    }
+    return absl::OkStatus();
+}
+
+void MetadataStore::ClearSlot(uint32_t index) {
+    slots_[index].flags = 0;
+    long_paths_.erase(index);
+}
+
+absl::Status MetadataStore::LoadLongPaths() {
+    long_paths_.clear();
+    size_t capacity = Capacity();
+    for (size_t i = 0; i < capacity; ++i) {
+        const Slot& slot = slots_[i];
+        if (!(slot.flags & kSlotUsed) || slot.path_length <= kInlinePathBytes) {
+            continue;
+        }
+        std::string path(slot.path_length, '\0');
+        ssize_t n = pread(paths_fd_, path.data(), path.size(), static_cast<off_t>(slot.path_offset));
+        if (n != static_cast<ssize_t>(path.size())) {
+            return absl::DataLossError(
+                absl::StrCat("Missing long path of metadata slot ", i, " in ", path_.string()));
+        }
+        long_paths_.emplace(static_cast<uint32_t>(i), std::move(path));
+    }
+    return absl::OkStatus();
+}
+
+FileRecord MetadataStore::ReadSlot(uint32_t index) const {
+    const Slot& slot = slots_[index];
+    FileRecord record;
+    record.id = SlotId(index);
+    record.version = slot.version;
+    record.content_changed_version = slot.content_changed_version;
+    record.type = (slot.flags & kSlotFolder) ? FileType::FOLDER : FileType::FILE;
+    record.current_path = SlotPath(index);
+    record.first_try_time = slot.first_try_time;
+    record.content_hash = slot.content_hash;
+    return record;
+}
+
+std::string_view MetadataStore::SlotId(uint32_t index) const {
+    return std::string_view(slots_[index].id, slots_[index].id_length);
+}
+
+std::string_view MetadataStore::SlotPath(uint32_t index) const {
+    const Slot& slot = slots_[index];
+    if (slot.path_length <= kInlinePathBytes) {
+        return std::string_view(slot.path, slot.path_length);
+    }
+    auto it = long_paths_.find(index);
+    return it == long_paths_.end() ? std::string_view() : std::string_view(it->second);
+}
+
+std::optional<uint32_t> MetadataStore::FindSlotById(std::string_view id) const {
+    return by_id_->Find(id);
+}
+
+std::optional<uint32_t> MetadataStore::FindSlotByPath(std::string_view path) const {
+    return by_path_->Find(path);
+}
+
+absl::StatusOr<uint32_t> MetadataStore::AllocateSlot() {
+    if (free_slots_.empty()) {
+        auto status = GrowTable();
+        if (!status.ok()) {
+            return status;
+        }
+    }
+    uint32_t index = free_slots_.back();
+    free_slots_.pop_back();
+    return index;
+}
+
+std::optional<FileRecord> MetadataStore::FindById(const std::string& id) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    auto index = FindSlotById(id);
+    if (!index) {
+        return std::nullopt;
+    }
+    return ReadSlot(*index);
+}
+
+std::optional<FileRecord> MetadataStore::FindByPath(const std::string& path) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    auto index = FindSlotByPath(path);
+    if (!index) {
+        return std::nullopt;
+    }
+    return ReadSlot(*index);
+}
+
+size_t MetadataStore::Size() const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return Capacity() - free_slots_.size();
+}
+
+void MetadataStore::ForEach(const std::function<void(const FileRecord&)>& visitor) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    size_t capacity = Capacity();
+    for (size_t i = 0; i < capacity; ++i) {
+        if (slots_[i].flags & kSlotUsed) {
+            visitor(ReadSlot(static_cast<uint32_t>(i)));
+        }
+    }
+}
+
+absl::Status MetadataStore::Apply(const Batch& batch) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    return ApplyLocked(batch);
+}
+
+absl::Status MetadataStore::ApplyLocked(const Batch& batch) {
+    for (const auto& operation : batch.operations_) {
+        if (operation.kind != Batch::Kind::kPut) {
+            continue;
+        }
+        if (operation.record.id.size() > kMaxIdBytes) {
+            return absl::InvalidArgumentError(absl::StrCat("File id is too long: ", operation.record.id));
+        }
+        if (operation.record.current_path.size() > UINT16_MAX) {
+            return absl::InvalidArgumentError("File path is too long");
+        }
+    }
+
+    // Work out the final state of every touched slot first. Neither the table
+    // nor the indexes change until the whole batch is in the log; lookups
+    // during planning see earlier operations of the batch through overlays.
+    struct Change {
+        uint32_t index;
+        std::optional<FileRecord> record;
+        uint64_t path_offset = 0;
+    };
+    std::vector<Change> changes;
+    std::unordered_map<uint32_t, size_t> change_of_slot;
+    std::unordered_map<std::string, std::optional<uint32_t>> id_overlay;
+    std::unordered_map<std::string, std::optional<uint32_t>> path_overlay;
+    std::vector<uint32_t> freed;
+
+    auto find = [](const auto& overlay, const KeyIndex& index,
+                   const std::string& key) -> std::optional<uint32_t> {
+        auto it = overlay.find(key);
+        return it != overlay.end() ? it->second : index.Find(key);
+    };
+    auto current = [&](uint32_t index) -> std::optional<FileRecord> {
+        auto it = change_of_slot.find(index);
+        if (it != change_of_slot.end()) {
+            return changes[it->second].record;
+        }
+        return ReadSlot(index);
+    };
+    auto stage = [&](uint32_t index, std::optional<FileRecord> record, uint64_t path_offset) {
+        auto [it, inserted] = change_of_slot.emplace(index, changes.size());
+        if (inserted) {
+            changes.push_back({index, std::move(record), path_offset});
+        } else {
+            changes[it->second] = {index, std::move(record), path_offset};
+        }
+    };
+    auto unindex = [&](uint32_t index) {
+        auto record = current(index);
+        if (!record->id.empty() && find(id_overlay, *by_id_, record->id) == index) {
+            id_overlay[record->id] = std::nullopt;
+        }
+        if (find(path_overlay, *by_path_, record->current_path) == index) {
+            path_overlay[record->current_path] = std::nullopt;
+        }
+    };
+    auto remove = [&](std::optional<uint32_t> index) {
+        if (!index) {
+            return;
+        }
+        unindex(*index);
+        stage(*index, std::nullopt, 0);
+        freed.push_back(*index);
+    };
+
+    auto paths_size_before = paths_size_;
+    absl::Status status;
+    for (const auto& operation : batch.operations_) {
+        if (operation.kind == Batch::Kind::kRemoveById) {
+            remove(find(id_overlay, *by_id_, operation.key));
+            continue;
+        }
+        if (operation.kind == Batch::Kind::kRemoveByPath) {
+            remove(find(path_overlay, *by_path_, operation.key));
+            continue;
+        }
+
+        const auto& record = operation.record;
+        std::optional<uint32_t> index;
+        if (!record.id.empty()) {
+            index = find(id_overlay, *by_id_, record.id);
+        }
+        if (!index) {
+            // A new file keeps its path-only record until the server names it
+            auto by_path = find(path_overlay, *by_path_, record.current_path);
+            if (by_path && current(*by_path)->id.empty()) {
+                index = by_path;
+            }
+        }
+
+        if (index) {
+            unindex(*index);
+        } else {
+            auto allocated = AllocateSlot();
+            if (!allocated.ok()) {
+                status = allocated.status();
+                break;
+            }
+            index = *allocated;
+        }
+
+        uint64_t path_offset = 0;
+        if (record.current_path.size() > kInlinePathBytes) {
+            path_offset = paths_size_;
+            paths_size_ += record.current_path.size();
+        }
+        if (!record.id.empty()) {
+            id_overlay[record.id] = index;
+        }
+        path_overlay[record.current_path] = index;
+        stage(*index, record, path_offset);
+    }
+
+    if (status.ok() && changes.empty()) {
+        return absl::OkStatus();
+    }
+
+    std::string entry;
+    if (status.ok()) {
+        std::string payload;
+        Append(payload, next_lsn_);
+        Append(payload, static_cast<uint32_t>(changes.size()));
+        for (const auto& change : changes) {
+            if (!change.record) {
+                Append(payload, kLogClear);
+                Append(payload, change.index);
+                continue;
+            }
+            const auto& record = *change.record;
+            Append(payload, kLogPut);
+            Append(payload, change.index);
+            Append(payload, kSlotUsed | (record.type == FileType::FOLDER ? kSlotFolder : 0));
+            Append(payload, record.version);
+            Append(payload, record.content_changed_version);
+            Append(payload, record.first_try_time);
+            Append(payload, record.content_hash);
+            Append(payload, change.path_offset);
+            Append(payload, static_cast<uint16_t>(record.id.size()));
+            payload += record.id;
+            Append(payload, static_cast<uint16_t>(record.current_path.size()));
+            payload += record.current_path;
+        }
+        Append(entry, static_cast<uint32_t>(payload.size()));
+        Append(entry, Crc32(payload.data(), payload.size()));
+        entry += payload;
+        status = AppendLog(entry);
+    }
+
+    if (!status.ok()) {
+        // Nothing was written, only slots were taken from the free list
+        RebuildIndexes();
+        paths_size_ = paths_size_before;
+        return status;
+    }
+
+    ++next_lsn_;
+    wal_size_ += entry.size();
+    ++stats_.batches;
+
+    for (const auto& change : changes) {
+        // Drop the old keys while the slot still holds them
+        if (slots_[change.index].flags & kSlotUsed) {
+            by_id_->Erase(change.index);
+            by_path_->Erase(change.index);
+        }
+        if (!change.record) {
+            ClearSlot(change.index);
+            continue;
+        }
+        // The log already holds the change; a failure here is repaired by replay
+        auto written = WriteSlot(change.index, *change.record, change.path_offset);
+        if (!written.ok()) {
+            status = written;
+            continue;
+        }
+        by_id_->Insert(change.index);
+        by_path_->Insert(change.index);
+    }
+    for (uint32_t index : freed) {
+        if (!(slots_[index].flags & kSlotUsed)) {
+            free_slots_.push_back(index);
+        }
+    }
+    if (!status.ok()) {
+        return status;
+    }
+
+    if (wal_size_ >= options_.checkpoint_wal_bytes ||
+        std::chrono::steady_clock::now() - last_checkpoint_ >= options_.checkpoint_interval) {
+        auto checkpoint = CheckpointLocked();
+        if (!checkpoint.ok()) {
+            std::cerr << "Failed to checkpoint metadata store: " << checkpoint.message() << std::endl;
+        }
+    }
+    return absl::OkStatus();
+}
+
+absl::Status MetadataStore::AppendLog(const std::string& entry) {
+    size_t written = 0;
+    while (written < entry.size()) {
+        ssize_t n = write(wal_fd_, entry.data() + written, entry.size() - written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            auto status = ErrnoError("Failed to write", path_ / "wal");
+            // Drop the partial entry so the next batch does not follow garbage
+            if (ftruncate(wal_fd_, static_cast<off_t>(wal_size_)) != 0) {
+                std::cerr << "Failed to truncate metadata log" << std::endl;
+            }
+            return status;
+        }
+        written += static_cast<size_t>(n);
+    }
+
+    if (options_.sync_wal && fdatasync(wal_fd_) != 0) {
+        return ErrnoError("Failed to sync", path_ / "wal");
+    }
+    return absl::OkStatus();
+}
+
+absl::Status MetadataStore::ApplyVersionIncreased(const VersionIncreased& message) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    return ApplyServerFiles(message.files(), true);
+}
+
+absl::Status MetadataStore::ApplyCheckVersion(const CheckVersion& message) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    return ApplyServerFiles(message.files(), false);
+}
+
+absl::Status MetadataStore::ApplyServerFiles(
+    const google::protobuf::RepeatedPtrField<FileMetadata>& files, bool accepted) {
+    Batch batch;
+    for (const auto& metadata : files) {
+        if (metadata.directory_id() != directory_id_ || !metadata.has_id()) {
+            continue;
+        }
+
+        auto index = FindSlotById(metadata.id());
+        if (!index) {
+            auto by_path = FindSlotByPath(metadata.current_path());
+            if (by_path && slots_[*by_path].id_length == 0) {
+                index = by_path;
+            }
+        }
+
+        if (metadata.deleted()) {
+            if (index) {
+                batch.RemoveByPath(ReadSlot(*index).current_path);
+            }
+            continue;
+        }
+
+        FileRecord record = index ? ReadSlot(*index) : FileRecord{};
+        if (record.content_changed_version != metadata.content_changed_version()) {
+            // The known hash describes an older content
+            record.content_hash = 0;
+        }
+        record.id = metadata.id();
+        record.version = metadata.version();
+        record.content_changed_version = metadata.content_changed_version();
+        record.type = metadata.type();
+        record.current_path = metadata.current_path();
+        if (accepted) {
+            record.first_try_time = 0;
+        }
+        batch.Put(std::move(record));
+    }
+    return ApplyLocked(batch);
+}
+
+absl::Status MetadataStore::Checkpoint() {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    return CheckpointLocked();
+}
+
+absl::Status MetadataStore::CheckpointLocked() {
+    if (wal_size_ == 0 && header_->checkpoint_lsn + 1 == next_lsn_) {
+        last_checkpoint_ = std::chrono::steady_clock::now();
+        return absl::OkStatus();
+    }
+
+    // Slots and long paths first, then the header that makes the log redundant
+    if (fdatasync(paths_fd_) != 0) {
+        return ErrnoError("Failed to sync", path_ / "paths");
+    }
+    if (msync(mapping_, mapping_size_, MS_SYNC) != 0) {
+        return ErrnoError("Failed to sync", path_ / "records");
+    }
+    header_->checkpoint_lsn = next_lsn_ - 1;
+    header_->paths_size = paths_size_;
+    if (msync(mapping_, kHeaderBytes, MS_SYNC) != 0) {
+        return ErrnoError("Failed to sync", path_ / "records");
+    }
+
+    // Entries up to checkpoint_lsn are skipped on replay, so a crash before
+    // the truncation is harmless
+    if (ftruncate(wal_fd_, 0) != 0) {
+        return ErrnoError("Failed to truncate", path_ / "wal");
+    }
+    wal_size_ = 0;
+    last_checkpoint_ = std::chrono::steady_clock::now();
+    ++stats_.checkpoints;
+    return absl::OkStatus();
+}
+
+MetadataStoreStats MetadataStore::GetStats() const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    MetadataStoreStats stats = stats_;
+    stats.capacity = Capacity();
+    stats.records = Capacity() - free_slots_.size();
+    stats.wal_bytes = wal_size_;
+    return stats;
+}
+
+}  // namespace synxpo
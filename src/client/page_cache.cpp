@@ -0,0 +1,42 @@
+#include "synxpo/client/page_cache.h"
+
+#include <fcntl.h>
+
+namespace synxpo {
+
+namespace {
+
+// One fadvise per this much data; the kernel's readahead stays well ahead
+constexpr uint64_t kDropStep = 8 * 1024 * 1024;
+
+}  // namespace
+
+CacheTrimmer::CacheTrimmer(int fd, uint64_t file_size, uint64_t min_bytes)
+    : fd_(fd), enabled_(min_bytes > 0 && file_size >= min_bytes) {}
+
+void CacheTrimmer::Advance(uint64_t offset) {
+    if (!enabled_ || offset <= cursor_) {
+        return;
+    }
+    cursor_ = offset;
+    if (cursor_ - dropped_ >= kDropStep) {
+        Drop(cursor_);
+    }
+}
+
+void CacheTrimmer::Finish() {
+    if (enabled_ && cursor_ > dropped_) {
+        Drop(cursor_);
+    }
+}
+
+void CacheTrimmer::Drop(uint64_t end) {
+    // Dirty pages are only queued for writeback and stay cached, so every
+    // step covers the previous one again to catch them once they are clean
+    ::posix_fadvise(fd_, static_cast<off_t>(retry_from_), static_cast<off_t>(end - retry_from_),
+                    POSIX_FADV_DONTNEED);
+    retry_from_ = dropped_;
+    dropped_ = end;
+}
+
+}  // namespace synxpo
@@ -0,0 +1,150 @@
+#include "synxpo/client/rate_limiter.h"
+
+#include <algorithm>
+
+namespace synxpo {
+
+namespace {
+
+// At very low rates a bucket of `burst` would make every small write wait
+constexpr double kMinBurstBytes = 64 * 1024;
+
+}  // namespace
+
+RateLimiter::RateLimiter(uint64_t bytes_per_second, std::chrono::milliseconds burst)
+    : burst_(std::max(burst, std::chrono::milliseconds(1))),
+      rate_(bytes_per_second),
+      refilled_(std::chrono::steady_clock::now()) {
+    tokens_ = BurstBytes();
+}
+
+bool RateLimiter::Acquire(const std::string& directory_id, size_t bytes) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (closed_) {
+        return false;
+    }
+
+    auto& directory = directories_[directory_id];
+
+    // A directory that was idle starts at the current virtual time, so the
+    // time it sent nothing is not saved up against the others
+    double start = std::max(virtual_time_, directory.finish);
+    directory.finish = start + static_cast<double>(bytes) / directory.weight;
+    auto waiter = waiters_.insert(waiters_.end(), Waiter{&directory, bytes, start});
+    Dispatch();
+    if (waiter->granted) {
+        waiters_.erase(waiter);
+        return true;
+    }
+
+    auto wait_start = std::chrono::steady_clock::now();
+    while (!waiter->granted) {
+        if (closed_) {
+            waiters_.erase(waiter);
+            return false;
+        }
+        if (rate_ == 0) {
+            cv_.wait(lock);
+        } else {
+            // Until the bucket is back above zero
+            auto deficit = std::max(-tokens_, 0.0) / static_cast<double>(rate_);
+            cv_.wait_for(lock, std::chrono::duration<double>(deficit) +
+                                   std::chrono::microseconds(100));
+        }
+        Dispatch();
+    }
+    waiters_.erase(waiter);
+    ++throttled_;
+    throttled_time_ += std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - wait_start);
+    return true;
+}
+
+void RateLimiter::SetRate(uint64_t bytes_per_second) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Refill(std::chrono::steady_clock::now());
+        rate_ = bytes_per_second;
+        tokens_ = std::min(tokens_, BurstBytes());
+        Dispatch();
+    }
+    cv_.notify_all();
+}
+
+void RateLimiter::SetWeight(const std::string& directory_id, uint32_t weight) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Chunks already queued keep their place
+    directories_[directory_id].weight = std::max<uint32_t>(weight, 1);
+}
+
+void RateLimiter::Refill(std::chrono::steady_clock::time_point now) {
+    double elapsed = std::chrono::duration<double>(now - refilled_).count();
+    refilled_ = now;
+    tokens_ = std::min(tokens_ + elapsed * static_cast<double>(rate_), BurstBytes());
+}
+
+double RateLimiter::BurstBytes() const {
+    return std::max(static_cast<double>(rate_) * std::chrono::duration<double>(burst_).count(),
+                    kMinBurstBytes);
+}
+
+void RateLimiter::Dispatch() {
+    Refill(std::chrono::steady_clock::now());
+    bool granted = false;
+    while (rate_ == 0 || tokens_ > 0) {
+        // The smallest start tag, the earliest arrival among equal ones
+        auto best = waiters_.end();
+        for (auto it = waiters_.begin(); it != waiters_.end(); ++it) {
+            if (!it->granted && (best == waiters_.end() || it->start < best->start)) {
+                best = it;
+            }
+        }
+        if (best == waiters_.end()) {
+            break;
+        }
+        best->granted = true;
+        granted = true;
+        virtual_time_ = best->start;
+        best->directory->bytes += best->bytes;
+        best->directory->meter.Record(best->bytes);
+        bytes_ += best->bytes;
+        meter_.Record(best->bytes);
+        if (rate_ != 0) {
+            tokens_ -= static_cast<double>(best->bytes);
+        }
+    }
+    if (granted) {
+        cv_.notify_all();
+    }
+}
+
+void RateLimiter::Close() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+    }
+    cv_.notify_all();
+}
+
+void RateLimiter::Reopen() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = false;
+}
+
+RateLimiterStats RateLimiter::GetStats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    RateLimiterStats stats;
+    stats.target_bytes_per_second = rate_;
+    stats.bytes_per_second = meter_.BytesPerSecond();
+    stats.bytes = bytes_;
+    stats.throttled = throttled_;
+    stats.throttled_time = throttled_time_;
+    stats.waiting = waiters_.size();
+    for (const auto& [id, directory] : directories_) {
+        stats.directories.push_back(
+            {id, directory.weight, directory.bytes, directory.meter.BytesPerSecond()});
+    }
+    return stats;
+}
+
+}  // namespace synxpo
@@ -0,0 +1,512 @@
+#include "synxpo/client/reconciler.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+
+#include <absl/strings/str_cat.h>
+
+namespace synxpo {
+
+namespace {
+
+// Download temporaries and other files of the client itself
+constexpr std::string_view kInternalPrefix = ".synxpo-";
+
+struct LocalEntry {
+    std::string path;
+    FileType type;
+};
+
+// A file as known to the server and to the metadata store, joined by id
+struct Unit {
+    const FileMetadata* server = nullptr;
+    const FileRecord* record = nullptr;
+
+    const std::string& Path() const {
+        return record ? record->current_path : server->current_path();
+    }
+};
+
+std::chrono::microseconds Since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start);
+}
+
+// Runs work(i) for every i below `count` on up to `threads` threads
+void ParallelFor(size_t count, size_t threads, const std::function<void(size_t)>& work) {
+    std::atomic<size_t> next{0};
+    auto loop = [&]() {
+        for (size_t i = next++; i < count; i = next++) {
+            work(i);
+        }
+    };
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < std::min(threads, count); ++i) {
+        workers.emplace_back(loop);
+    }
+    loop();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+// Files of one folder always land in the same partition, so a file and the
+// records naming its path meet there
+size_t PartitionOf(std::string_view path, size_t partitions) {
+    auto slash = path.rfind('/');
+    auto parent = slash == std::string_view::npos ? std::string_view() : path.substr(0, slash);
+    return std::hash<std::string_view>{}(parent) % partitions;
+}
+
+size_t PartitionOfId(std::string_view id, size_t partitions) {
+    return std::hash<std::string_view>{}(id) % partitions;
+}
+
+// Lists one directory of the tree; `relative` is empty for the root
+absl::Status ReadDirectory(const std::filesystem::path& root, const std::string& relative,
+                           std::vector<LocalEntry>& entries, std::vector<std::string>& folders) {
+    auto path = relative.empty() ? root : root / relative;
+    int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR* dir = fd < 0 ? nullptr : ::fdopendir(fd);
+    if (!dir) {
+        auto status = absl::InternalError(
+            absl::StrCat("Failed to read ", path.string(), ": ", std::strerror(errno)));
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return status;
+    }
+
+    while (auto* item = ::readdir(dir)) {
+        std::string_view name(item->d_name);
+        if (name == "." || name == ".." ||
+            name.substr(0, kInternalPrefix.size()) == kInternalPrefix) {
+            continue;
+        }
+        unsigned char type = item->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (::fstatat(fd, item->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                continue;
+            }
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        // Symlinks and special files are not synchronized
+        if (type != DT_DIR && type != DT_REG) {
+            continue;
+        }
+        std::string child = relative.empty() ? std::string(name) : relative + "/" + item->d_name;
+        if (type == DT_DIR) {
+            folders.push_back(child);
+        }
+        entries.push_back({std::move(child), type == DT_DIR ? FileType::FOLDER : FileType::FILE});
+    }
+    ::closedir(dir);
+    return absl::OkStatus();
+}
+
+// Walks the tree with `threads` workers sharing a queue of folders, so one
+// huge folder does not leave the others idle. Any unreadable folder fails the
+// scan: its files would otherwise look deleted.
+absl::StatusOr<std::vector<LocalEntry>> ScanTree(const std::filesystem::path& root,
+                                                 size_t threads) {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<std::string> queue{std::string()};
+    size_t busy = 0;
+    absl::Status error;
+    std::vector<std::vector<LocalEntry>> found(threads);
+
+    auto worker = [&](size_t index) {
+        std::vector<std::string> folders;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv.wait(lock, [&]() { return !queue.empty() || busy == 0 || !error.ok(); });
+            if (queue.empty() || !error.ok()) {
+                return;
+            }
+            auto relative = std::move(queue.back());
+            queue.pop_back();
+            ++busy;
+            lock.unlock();
+
+            folders.clear();
+            auto status = ReadDirectory(root, relative, found[index], folders);
+
+            lock.lock();
+            --busy;
+            if (!status.ok() && error.ok()) {
+                error = status;
+            }
+            for (auto& folder : folders) {
+                queue.push_back(std::move(folder));
+            }
+            cv.notify_all();
+        }
+    };
+    ParallelFor(threads, threads, worker);
+    if (!error.ok()) {
+        return error;
+    }
+
+    std::vector<LocalEntry> entries;
+    size_t total = 0;
+    for (const auto& part : found) {
+        total += part.size();
+    }
+    entries.reserve(total);
+    for (auto& part : found) {
+        std::move(part.begin(), part.end(), std::back_inserter(entries));
+    }
+    return entries;
+}
+
+ReconcileAction MakeAction(ReconcileActionType type, std::string id, FileType file_type,
+                           std::string path) {
+    ReconcileAction action;
+    action.type = type;
+    action.id = std::move(id);
+    action.file_type = file_type;
+    action.path = std::move(path);
+    return action;
+}
+
+}  // namespace
+
+std::string ReconcileStats::ToString() const {
+    auto ms = [](std::chrono::microseconds time) { return time.count() / 1000.0; };
+    std::ostringstream out;
+    out.precision(1);
+    out << std::fixed << server_files << " server files, " << local_records << " records, "
+        << local_entries << " local entries in " << partitions << " partitions: " << uploads
+        << " uploads (" << paired_renames << " renames), " << downloads << " downloads, "
+        << renames << " renames, " << deletes << " deletes; scan " << ms(scan_time) << " ms, load "
+        << ms(load_time) << " ms, join " << ms(join_time) << " ms, diff " << ms(diff_time)
+        << " ms, pair " << ms(pair_time) << " ms, total " << ms(total_time) << " ms";
+    return out.str();
+}
+
+Reconciler::Reconciler(MetadataStore& store, std::filesystem::path root,
+                       std::string directory_id, ReconcilerOptions options)
+    : store_(store),
+      root_(std::move(root)),
+      directory_id_(std::move(directory_id)),
+      options_(options) {
+    if (options_.threads == 0) {
+        options_.threads = std::max(std::thread::hardware_concurrency(), 1U);
+    }
+    options_.partitions_per_thread = std::max<size_t>(options_.partitions_per_thread, 1);
+}
+
+void Reconciler::SetHashService(HashService* hashes) {
+    hashes_ = hashes;
+}
+
+absl::StatusOr<ReconcilePlan> Reconciler::Reconcile(const std::vector<CheckVersion>& listing) {
+    auto start = std::chrono::steady_clock::now();
+    ReconcilePlan plan;
+    auto& stats = plan.stats;
+    const size_t threads = options_.threads;
+    const size_t partitions = threads * options_.partitions_per_thread;
+    stats.partitions = partitions;
+
+    auto phase = std::chrono::steady_clock::now();
+    auto scanned = ScanTree(root_, threads);
+    if (!scanned.ok()) {
+        return scanned.status();
+    }
+    const auto& entries = *scanned;
+    stats.local_entries = entries.size();
+    stats.scan_time = Since(phase);
+
+    phase = std::chrono::steady_clock::now();
+    std::vector<const FileMetadata*> server_files;
+    for (const auto& message : listing) {
+        for (const auto& file : message.files()) {
+            if (file.directory_id() == directory_id_ && file.has_id()) {
+                server_files.push_back(&file);
+            }
+        }
+    }
+    std::vector<FileRecord> records;
+    records.reserve(store_.Size());
+    store_.ForEach([&records](const FileRecord& record) { records.push_back(record); });
+    stats.server_files = server_files.size();
+    stats.local_records = records.size();
+    stats.load_time = Since(phase);
+
+    // Join server files and records by id, each partition of ids on its own
+    phase = std::chrono::steady_clock::now();
+    std::vector<std::vector<const FileMetadata*>> server_by_id(partitions);
+    std::vector<std::vector<const FileRecord*>> records_by_id(partitions);
+    std::vector<Unit> unnamed;
+    for (const auto* file : server_files) {
+        server_by_id[PartitionOfId(file->id(), partitions)].push_back(file);
+    }
+    for (const auto& record : records) {
+        if (record.id.empty()) {
+            unnamed.push_back({nullptr, &record});
+        } else {
+            records_by_id[PartitionOfId(record.id, partitions)].push_back(&record);
+        }
+    }
+    std::vector<std::vector<Unit>> joined(partitions);
+    ParallelFor(partitions, threads, [&](size_t index) {
+        std::unordered_map<std::string_view, const FileRecord*> by_id;
+        by_id.reserve(records_by_id[index].size());
+        for (const auto* record : records_by_id[index]) {
+            by_id.emplace(record->id, record);
+        }
+        auto& units = joined[index];
+        units.reserve(server_by_id[index].size() + by_id.size());
+        for (const auto* file : server_by_id[index]) {
+            auto it = by_id.find(file->id());
+            if (it == by_id.end()) {
+                units.push_back({file, nullptr});
+            } else {
+                units.push_back({file, it->second});
+                by_id.erase(it);
+            }
+        }
+        for (const auto& [id, record] : by_id) {
+            units.push_back({nullptr, record});
+        }
+    });
+
+    // Regroup by path prefix for the comparison with the local tree
+    std::vector<std::vector<Unit>> units_by_path(partitions);
+    std::vector<std::vector<const LocalEntry*>> entries_by_path(partitions);
+    joined.push_back(std::move(unnamed));
+    for (const auto& units : joined) {
+        for (const auto& unit : units) {
+            units_by_path[PartitionOf(unit.Path(), partitions)].push_back(unit);
+        }
+    }
+    for (const auto& entry : entries) {
+        entries_by_path[PartitionOf(entry.path, partitions)].push_back(&entry);
+    }
+    joined.clear();
+    stats.join_time = Since(phase);
+
+    // Compare each partition with its part of the tree. Files that vanished
+    // and files nobody knows are set aside: they may be the two ends of a
+    // local rename across partitions.
+    phase = std::chrono::steady_clock::now();
+    std::vector<std::vector<ReconcileAction>> actions(partitions);
+    std::vector<std::vector<const FileRecord*>> vanished(partitions);
+    std::vector<std::vector<const LocalEntry*>> unknown(partitions);
+    ParallelFor(partitions, threads, [&](size_t index) {
+        auto& out = actions[index];
+        std::unordered_map<std::string_view, const LocalEntry*> by_path;
+        by_path.reserve(entries_by_path[index].size());
+        for (const auto* entry : entries_by_path[index]) {
+            by_path.emplace(entry->path, entry);
+        }
+        auto take = [&by_path](const std::string& path) -> const LocalEntry* {
+            auto it = by_path.find(path);
+            if (it == by_path.end()) {
+                return nullptr;
+            }
+            auto* entry = it->second;
+            by_path.erase(it);
+            return entry;
+        };
+
+        // Files whose content may have been edited while the client was off
+        std::vector<const FileRecord*> to_hash;
+        for (const auto& unit : units_by_path[index]) {
+            const auto* server = unit.server;
+            const auto* record = unit.record;
+            const auto* local = take(unit.Path());
+
+            if (server && !record) {
+                if (!server->deleted()) {
+                    out.push_back(MakeAction(ReconcileActionType::kDownload, server->id(),
+                                             server->type(), server->current_path()));
+                }
+                continue;
+            }
+            if (!server) {
+                // The spec deletes files with a version the server no longer
+                // lists; files without one were never accepted and go up
+                if (!record->id.empty() && record->version > 0) {
+                    if (local) {
+                        out.push_back(MakeAction(ReconcileActionType::kDelete, record->id,
+                                                 record->type, record->current_path));
+                    }
+                } else if (local) {
+                    auto action = MakeAction(ReconcileActionType::kUpload, record->id,
+                                             local->type, local->path);
+                    action.content_changed = local->type == FileType::FILE;
+                    out.push_back(std::move(action));
+                }
+                continue;
+            }
+
+            if (server->deleted()) {
+                if (local) {
+                    out.push_back(MakeAction(ReconcileActionType::kDelete, record->id,
+                                             record->type, record->current_path));
+                }
+                continue;
+            }
+            bool newer_content = server->content_changed_version() > record->content_changed_version;
+            bool moved = server->current_path() != record->current_path &&
+                         server->version() > record->version;
+            if (!local) {
+                if (newer_content || moved) {
+                    out.push_back(MakeAction(ReconcileActionType::kDownload, server->id(),
+                                             server->type(), server->current_path()));
+                } else {
+                    vanished[index].push_back(record);
+                }
+                continue;
+            }
+            if (moved) {
+                auto action = MakeAction(ReconcileActionType::kRename, record->id, record->type,
+                                         record->current_path);
+                action.new_path = server->current_path();
+                out.push_back(std::move(action));
+            }
+            if (newer_content) {
+                // The server's content wins; the download keeps the local
+                // copy in the safe place
+                out.push_back(MakeAction(ReconcileActionType::kDownload, server->id(),
+                                         server->type(), server->current_path()));
+            } else if (record->first_try_time != 0) {
+                // A change the server has not accepted yet
+                auto action = MakeAction(ReconcileActionType::kUpload, record->id, record->type,
+                                         record->current_path);
+                action.content_changed = record->type == FileType::FILE;
+                out.push_back(std::move(action));
+            } else if (hashes_ && record->type == FileType::FILE &&
+                       local->type == FileType::FILE && record->content_hash != 0) {
+                to_hash.push_back(record);
+            }
+        }
+
+        // Partitions already run in parallel, so hash here rather than on
+        // the service's pool; unchanged files are only a stat and a lookup
+        for (const auto* record : to_hash) {
+            auto hash = hashes_->Hash(root_ / record->current_path);
+            if (hash.ok() && hash->hash != record->content_hash) {
+                auto action = MakeAction(ReconcileActionType::kUpload, record->id,
+                                         FileType::FILE, record->current_path);
+                action.content_changed = true;
+                out.push_back(std::move(action));
+            }
+        }
+
+        for (const auto& [path, entry] : by_path) {
+            unknown[index].push_back(entry);
+        }
+    });
+    stats.diff_time = Since(phase);
+
+    // A vanished file whose content turns up under an unknown path was
+    // renamed locally; everything else vanished was deleted, and everything
+    // else unknown is new
+    phase = std::chrono::steady_clock::now();
+    std::unordered_multimap<uint64_t, const FileRecord*> vanished_by_hash;
+    std::vector<const FileRecord*> deleted;
+    for (const auto& part : vanished) {
+        for (const auto* record : part) {
+            if (hashes_ && record->type == FileType::FILE && record->content_hash != 0) {
+                vanished_by_hash.emplace(record->content_hash, record);
+            } else {
+                deleted.push_back(record);
+            }
+        }
+    }
+    std::vector<const LocalEntry*> unknown_files;
+    std::vector<const LocalEntry*> created;
+    for (const auto& part : unknown) {
+        for (const auto* entry : part) {
+            if (!vanished_by_hash.empty() && entry->type == FileType::FILE) {
+                unknown_files.push_back(entry);
+            } else {
+                created.push_back(entry);
+            }
+        }
+    }
+    auto& out = plan.actions;
+    if (!unknown_files.empty()) {
+        std::vector<std::filesystem::path> paths;
+        paths.reserve(unknown_files.size());
+        for (const auto* entry : unknown_files) {
+            paths.push_back(root_ / entry->path);
+        }
+        auto results = hashes_->HashAll(paths);
+        for (size_t i = 0; i < unknown_files.size(); ++i) {
+            auto match = results[i].ok() ? vanished_by_hash.find(results[i]->hash)
+                                         : vanished_by_hash.end();
+            if (match == vanished_by_hash.end()) {
+                created.push_back(unknown_files[i]);
+                continue;
+            }
+            const auto* record = match->second;
+            vanished_by_hash.erase(match);
+            auto action = MakeAction(ReconcileActionType::kUpload, record->id, FileType::FILE,
+                                     record->current_path);
+            action.new_path = unknown_files[i]->path;
+            out.push_back(std::move(action));
+            ++stats.paired_renames;
+        }
+    }
+    for (const auto& [hash, record] : vanished_by_hash) {
+        deleted.push_back(record);
+    }
+    for (const auto* record : deleted) {
+        auto action = MakeAction(ReconcileActionType::kUpload, record->id, record->type,
+                                 record->current_path);
+        action.deleted = true;
+        out.push_back(std::move(action));
+    }
+    for (const auto* entry : created) {
+        auto action = MakeAction(ReconcileActionType::kUpload, "", entry->type, entry->path);
+        action.content_changed = entry->type == FileType::FILE;
+        out.push_back(std::move(action));
+    }
+    stats.pair_time = Since(phase);
+
+    for (auto& part : actions) {
+        std::move(part.begin(), part.end(), std::back_inserter(out));
+    }
+    std::sort(out.begin(), out.end(), [](const ReconcileAction& a, const ReconcileAction& b) {
+        return a.type != b.type ? a.type < b.type : a.path < b.path;
+    });
+    for (const auto& action : out) {
+        switch (action.type) {
+            case ReconcileActionType::kRename:
+                ++stats.renames;
+                break;
+            case ReconcileActionType::kDelete:
+                ++stats.deletes;
+                break;
+            case ReconcileActionType::kDownload:
+                ++stats.downloads;
+                break;
+            case ReconcileActionType::kUpload:
+                ++stats.uploads;
+                break;
+        }
+    }
+    stats.total_time = Since(start);
+    return plan;
+}
+
+}  // namespace synxpo
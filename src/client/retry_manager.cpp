@@ -0,0 +1,24 @@
+#include "synxpo/client/retry_manager.h"
+
+#include <algorithm>
+
+namespace synxpo {
+
+RetryBackoff::RetryBackoff(RetryOptions options)
+    : options_(options), random_(std::random_device{}()) {
+    options_.base_delay = std::max(options_.base_delay, std::chrono::milliseconds(1));
+    options_.max_delay = std::max(options_.max_delay, options_.base_delay);
+}
+
+std::chrono::microseconds RetryBackoff::Delay(uint32_t attempt) {
+    std::chrono::microseconds ceiling = options_.max_delay;
+    // Past 2^20 times the base the doubling has long reached max_delay
+    uint32_t doublings = std::min<uint32_t>(attempt > 0 ? attempt - 1 : 0, 20);
+    std::chrono::microseconds base = options_.base_delay;
+    auto delay = std::min(base * (int64_t{1} << doublings), ceiling);
+
+    std::uniform_int_distribution<int64_t> jitter(delay.count() / 2, delay.count());
+    return std::chrono::microseconds(jitter(random_));
+}
+
+}  // namespace synxpo
@@ -0,0 +1,45 @@
+#include "synxpo/client/throughput_meter.h"
+
+namespace synxpo {
+
+namespace {
+
+constexpr auto kSampleInterval = std::chrono::milliseconds(250);
+constexpr double kSmoothing = 0.3;
+
+}  // namespace
+
+ThroughputMeter::ThroughputMeter()
+    : interval_start_(std::chrono::steady_clock::now()) {}
+
+void ThroughputMeter::Record(uint64_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Roll(std::chrono::steady_clock::now());
+    total_bytes_ += bytes;
+    interval_bytes_ += bytes;
+}
+
+uint64_t ThroughputMeter::TotalBytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return total_bytes_;
+}
+
+double ThroughputMeter::BytesPerSecond() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Roll(std::chrono::steady_clock::now());
+    return rate_;
+}
+
+void ThroughputMeter::Roll(std::chrono::steady_clock::time_point now) const {
+    auto elapsed = std::chrono::duration<double>(now - interval_start_);
+    if (elapsed < kSampleInterval) {
+        return;
+    }
+
+    double sample = interval_bytes_ / elapsed.count();
+    rate_ = kSmoothing * sample + (1.0 - kSmoothing) * rate_;
+    interval_bytes_ = 0;
+    interval_start_ = now;
+}
+
+}  // namespace synxpo
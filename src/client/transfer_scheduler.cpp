@@ -0,0 +1,187 @@
+#include "synxpo/client/transfer_scheduler.h"
+
+#include <algorithm>
+
+namespace synxpo {
+
+namespace {
+
+TransferSchedulerOptions Sanitize(TransferSchedulerOptions options) {
+    options.max_active = std::max<size_t>(options.max_active, 1);
+    // At least one slot stays open to every class
+    options.reserved_interactive = std::min(options.reserved_interactive, options.max_active - 1);
+    options.aging_interval = std::max(options.aging_interval, std::chrono::milliseconds(1));
+    return options;
+}
+
+}  // namespace
+
+TransferScheduler::Ticket::Ticket(Ticket&& other) noexcept
+    : scheduler_(other.scheduler_), reserved_(other.reserved_) {
+    other.scheduler_ = nullptr;
+}
+
+TransferScheduler::Ticket& TransferScheduler::Ticket::operator=(Ticket&& other) noexcept {
+    if (this != &other) {
+        Release();
+        scheduler_ = other.scheduler_;
+        reserved_ = other.reserved_;
+        other.scheduler_ = nullptr;
+    }
+    return *this;
+}
+
+TransferScheduler::Ticket::~Ticket() {
+    Release();
+}
+
+void TransferScheduler::Ticket::Release() {
+    if (scheduler_) {
+        scheduler_->Release(reserved_);
+        scheduler_ = nullptr;
+    }
+}
+
+TransferScheduler::TransferScheduler(TransferSchedulerOptions options)
+    : options_(Sanitize(options)) {}
+
+TransferClass TransferScheduler::Classify(
+    uint64_t bytes, std::optional<std::chrono::system_clock::time_point> modified) const {
+    if (bytes >= options_.bulk_bytes) {
+        return TransferClass::kBulk;
+    }
+    bool recent = modified && std::chrono::system_clock::now() - *modified < options_.recent_age;
+    if (bytes <= options_.small_bytes || recent) {
+        return TransferClass::kInteractive;
+    }
+    return TransferClass::kNormal;
+}
+
+TransferClass TransferScheduler::Effective(TransferClass priority,
+                                           std::chrono::steady_clock::time_point queued_at) const {
+    auto waited = std::chrono::steady_clock::now() - queued_at;
+    auto steps = waited / options_.aging_interval;
+    auto level = static_cast<int64_t>(priority) - static_cast<int64_t>(std::max<int64_t>(steps, 0));
+    return static_cast<TransferClass>(std::max<int64_t>(level, 0));
+}
+
+TransferScheduler::Ticket TransferScheduler::Acquire(
+    TransferClass priority, std::chrono::steady_clock::time_point queued_at,
+    const std::function<bool()>& cancelled) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (closed_) {
+        return {};
+    }
+
+    auto waiter = waiters_.insert(waiters_.end(), Waiter{priority, queued_at});
+    Dispatch();
+    while (!waiter->granted) {
+        if (closed_ || (cancelled && cancelled())) {
+            waiters_.erase(waiter);
+            return {};
+        }
+        // Aging may let a waiter through without any slot being released
+        cv_.wait_for(lock, options_.aging_interval);
+        Dispatch();
+    }
+
+    bool reserved = waiter->reserved;
+    waiters_.erase(waiter);
+    return Ticket(this, reserved);
+}
+
+void TransferScheduler::Dispatch() {
+    bool granted = false;
+    while (active_ < options_.max_active) {
+        // The most urgent class after aging, the earliest arrival within it
+        auto best = waiters_.end();
+        TransferClass best_class = TransferClass::kBulk;
+        for (auto it = waiters_.begin(); it != waiters_.end(); ++it) {
+            if (it->granted) {
+                continue;
+            }
+            auto effective = Effective(it->priority, it->queued_at);
+            if (best == waiters_.end() || effective < best_class) {
+                best = it;
+                best_class = effective;
+            }
+        }
+        if (best == waiters_.end()) {
+            break;
+        }
+
+        // Nothing behind the best waiter may overtake it, so stop here if it
+        // has to wait
+        size_t shared = options_.max_active - options_.reserved_interactive;
+        if (active_ - active_reserved_ < shared) {
+            best->reserved = false;
+        } else if (best_class == TransferClass::kInteractive &&
+                   active_reserved_ < options_.reserved_interactive) {
+            best->reserved = true;
+            ++active_reserved_;
+        } else {
+            break;
+        }
+        best->granted = true;
+        ++active_;
+        granted = true;
+
+        switch (best->priority) {
+            case TransferClass::kInteractive:
+                ++stats_.granted_interactive;
+                break;
+            case TransferClass::kNormal:
+                ++stats_.granted_normal;
+                break;
+            case TransferClass::kBulk:
+                ++stats_.granted_bulk;
+                break;
+        }
+        if (best_class < best->priority) {
+            ++stats_.promoted;
+        }
+        auto waited = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - best->queued_at);
+        stats_.max_wait = std::max(stats_.max_wait, waited);
+    }
+    if (granted) {
+        cv_.notify_all();
+    }
+}
+
+void TransferScheduler::Release(bool reserved) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    --active_;
+    if (reserved) {
+        --active_reserved_;
+    }
+    Dispatch();
+}
+
+void TransferScheduler::Wake() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cv_.notify_all();
+}
+
+void TransferScheduler::Close() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+    }
+    cv_.notify_all();
+}
+
+void TransferScheduler::Reopen() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = false;
+}
+
+TransferSchedulerStats TransferScheduler::GetStats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto stats = stats_;
+    stats.active = active_;
+    stats.waiting = waiters_.size();
+    return stats;
+}
+
+}  // namespace synxpo
@@ -0,0 +1,1624 @@
+#include "synxpo/client/upload_engine.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <set>
+
+#include <absl/strings/str_cat.h>
+
+#include "synxpo/common/chunking.h"
+#include "synxpo/common/content_hash.h"
+#include "synxpo/common/delta.h"
+
+namespace synxpo {
+
+namespace {
+
+// Block references are tiny; this keeps a FILE_DELTA of an unchanged file
+// with scattered matches from growing without bound
+constexpr int kMaxDeltaOps = 4096;
+
+// Keeps an OFFER_CHUNKS message well under 1 MB
+constexpr size_t kMaxOfferChunks = 65536;
+
+// Field tag and length prefix of a repeated message entry
+constexpr size_t kEntryOverhead = 6;
+// An ASK_VERSION_INCREASE always fits a file with a long path
+constexpr size_t kMinAskBytes = 64 * 1024;
+
+uint64_t NowMicros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+std::chrono::microseconds Since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start);
+}
+
+}  // namespace
+
+UploadEngine::UploadEngine(GRPCClient& client, MetadataStore& store, std::filesystem::path root,
+                           std::string directory_id, UploadEngineOptions options)
+    : client_(client),
+      store_(store),
+      root_(std::move(root)),
+      directory_id_(std::move(directory_id)),
+      options_(options),
+      retries_(options.retry) {
+    options_.chunk_bytes = std::clamp<size_t>(options_.chunk_bytes, 1, 1024 * 1024);
+    options_.read_threads = std::max<size_t>(options_.read_threads, 1);
+    options_.read_buffers = std::max(options_.read_buffers, options_.read_threads);
+    options_.max_batch_files = std::max<size_t>(options_.max_batch_files, 1);
+    options_.max_batch_bytes = std::max<uint64_t>(options_.max_batch_bytes, 1);
+    options_.max_ask_bytes = std::max(options_.max_ask_bytes, kMinAskBytes);
+}
+
+UploadEngine::~UploadEngine() {
+    Stop();
+}
+
+void UploadEngine::Start() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (running_) {
+        return;
+    }
+    running_ = true;
+    RestoreJournal();
+
+    {
+        std::lock_guard<std::mutex> read_lock(read_mutex_);
+        readers_stop_ = false;
+        free_buffers_.resize(options_.read_buffers);
+    }
+    for (size_t i = 0; i < options_.read_threads; ++i) {
+        readers_.emplace_back(&UploadEngine::ReaderLoop, this);
+    }
+    worker_ = std::thread(&UploadEngine::Run, this);
+}
+
+void UploadEngine::Stop() {
+    TransferScheduler* scheduler;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!running_) {
+            return;
+        }
+        running_ = false;
+        interrupt_acquire_ = true;
+        scheduler = scheduler_;
+    }
+    cv_.notify_all();
+    if (scheduler) {
+        scheduler->Wake();
+    }
+
+    // Readers stop first so a sender waiting for a chunk gives up
+    {
+        std::lock_guard<std::mutex> lock(read_mutex_);
+        readers_stop_ = true;
+    }
+    read_cv_.notify_all();
+    ready_cv_.notify_all();
+
+    for (auto& reader : readers_) {
+        reader.join();
+    }
+    readers_.clear();
+    if (worker_.joinable()) {
+        worker_.join();
+    }
+
+    if (journal_) {
+        FlushJournal();
+        auto status = journal_->Sync();
+        if (!status.ok()) {
+            std::cerr << "Failed to sync change journal: " << status.message() << std::endl;
+        }
+    }
+}
+
+void UploadEngine::OnFileEvent(const FileEvent& event) {
+    auto path = RelativePath(event.path);
+    if (!path) {
+        return;
+    }
+
+    // Only used to cut and order batches, so a stale size does no harm
+    uint64_t size = 0;
+    std::optional<std::chrono::system_clock::time_point> modified;
+    struct stat st;
+    if (event.entry_type == FSEntryType::File && event.type != FileEventType::Deleted &&
+        ::stat(event.path.c_str(), &st) == 0) {
+        size = static_cast<uint64_t>(st.st_size);
+        modified = std::chrono::system_clock::from_time_t(st.st_mtime);
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    Change change;
+    auto previous = pending_.find(*path);
+    if (previous != pending_.end()) {
+        change = previous->second;
+    } else {
+        change.path = *path;
+        change.queued_at = std::chrono::steady_clock::now();
+        // A rename carries the id of the file at its old path
+        std::string lookup = *path;
+        if (event.type == FileEventType::Renamed && event.old_path) {
+            if (auto old_path = RelativePath(*event.old_path)) {
+                lookup = *old_path;
+            }
+        }
+        if (auto record = store_.FindByPath(lookup)) {
+            change.id = record->id;
+            change.type = record->type;
+        }
+    }
+
+    if (event.entry_type == FSEntryType::Directory) {
+        change.type = FileType::FOLDER;
+    } else if (event.entry_type == FSEntryType::File) {
+        change.type = FileType::FILE;
+    }
+
+    switch (event.type) {
+        case FileEventType::Created:
+        case FileEventType::Modified:
+            if (change.type == FileType::FOLDER && event.type == FileEventType::Modified) {
+                // Folders have no content; their mtime changes with every entry
+                if (previous == pending_.end()) {
+                    return;
+                }
+                break;
+            }
+            change.deleted = false;
+            change.content_changed = change.type == FileType::FILE;
+            break;
+        case FileEventType::Deleted:
+            if (change.id.empty()) {
+                // Never reached the server, nothing to tell it
+                if (previous != pending_.end()) {
+                    Unjournal(TakePending(previous));
+                    lock.unlock();
+                    FlushJournal();
+                }
+                return;
+            }
+            change.deleted = true;
+            change.content_changed = false;
+            break;
+        case FileEventType::Renamed:
+            if (event.old_path) {
+                if (auto old_path = RelativePath(*event.old_path)) {
+                    auto moved = pending_.find(*old_path);
+                    if (moved != pending_.end()) {
+                        // The change waiting under the old path now lives here
+                        change = TakePending(moved);
+                        Unjournal(change);
+                        change.path = *path;
+                    }
+                }
+            }
+            change.deleted = false;
+            break;
+    }
+
+    // The spec keeps FIRST_TRY_TIME until the file is modified again
+    change.first_try_time = NowMicros();
+    change.size = change.content_changed ? size : 0;
+    change.modified = modified;
+    retries_.Cancel(WireId(change));
+    Journal(change);
+    PutPending(std::move(change), true);
+    cv_.notify_all();
+    lock.unlock();
+    FlushJournal();
+}
+
+void UploadEngine::OnCheckVersion(const CheckVersion& message) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    bool woken = false;
+    for (const auto& file : message.files()) {
+        if (file.directory_id() != directory_id_) {
+            continue;
+        }
+        if (auto change = retries_.Wake(file.id())) {
+            PutPending(std::move(*change), false);
+            woken = true;
+        }
+    }
+    if (woken) {
+        cv_.notify_all();
+    }
+}
+
+void UploadEngine::SetDeniedCallback(DeniedCallback callback) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    denied_callback_ = std::move(callback);
+}
+
+void UploadEngine::SetHashService(HashService* hashes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    hashes_ = hashes;
+}
+
+void UploadEngine::SetScheduler(TransferScheduler* scheduler) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    scheduler_ = scheduler;
+}
+
+void UploadEngine::SetJournal(ChangeJournal* journal) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    journal_ = journal;
+}
+
+bool UploadEngine::WaitIdle(std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return cv_.wait_for(lock, timeout, [this]() {
+        return pending_.empty() && !busy_ && !retries_.HasScheduled();
+    });
+}
+
+UploadEngineStats UploadEngine::GetStats() const {
+    RetryStats retries;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        retries = retries_.GetStats();
+    }
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    auto stats = stats_;
+    stats.retries = retries;
+    stats.bytes_per_second = throughput_.BytesPerSecond();
+    return stats;
+}
+
+void UploadEngine::Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        ReleaseRetries();
+        if (!running_) {
+            return;
+        }
+        if (pending_.empty()) {
+            // Idle, or only FREE retries waiting out their backoff
+            auto ready = [this]() { return !running_ || !pending_.empty(); };
+            if (auto due = retries_.NextDue()) {
+                cv_.wait_until(lock, *due, ready);
+            } else {
+                cv_.wait(lock, ready);
+            }
+            continue;
+        }
+
+        if (offline_) {
+            // Changes keep coalescing in pending_ and the journal until the
+            // client is back
+            if (!client_.IsConnected()) {
+                cv_.wait_for(lock, options_.offline_poll, [this]() { return !running_; });
+                continue;
+            }
+            offline_ = false;
+            draining_ = true;
+        }
+
+        // Let a burst of events settle so it goes out as one request. The
+        // deadline counts from the oldest waiting change, so changes that
+        // piled up during the previous upload go out right after it.
+        cv_.wait_until(lock, pending_deadline_, [this]() {
+            return !running_ || pending_.size() >= BatchFiles() ||
+                   pending_bytes_ >= options_.max_batch_bytes;
+        });
+        if (!running_) {
+            return;
+        }
+
+        auto batch = TakeBatch();
+        if (batch.empty()) {
+            continue;
+        }
+
+        busy_ = true;
+
+        // The batch waits as the least urgent of its files, for as long as
+        // the oldest of them has been queued
+        TransferScheduler::Ticket ticket;
+        if (auto* scheduler = scheduler_) {
+            auto priority = TransferClass::kInteractive;
+            auto queued_at = batch.front().queued_at;
+            for (const auto& change : batch) {
+                priority = std::max(priority, scheduler->Classify(change.size, change.modified));
+                queued_at = std::min(queued_at, change.queued_at);
+            }
+            acquiring_ = scheduler->Effective(priority, queued_at);
+            interrupt_acquire_ = false;
+            lock.unlock();
+            ticket = scheduler->Acquire(priority, queued_at,
+                                        [this]() { return interrupt_acquire_.load(); });
+            lock.lock();
+            acquiring_.reset();
+            if (!ticket && interrupt_acquire_) {
+                // Stopping, or something more urgent came up meanwhile
+                for (auto& change : batch) {
+                    PutPending(std::move(change), false);
+                }
+                busy_ = false;
+                cv_.notify_all();
+                continue;
+            }
+        }
+        lock.unlock();
+
+        // Without a ticket here the scheduler was closed and no longer
+        // orders anything
+        ProcessBatch(std::move(batch));
+        ticket.Release();
+        lock.lock();
+        busy_ = false;
+        cv_.notify_all();
+    }
+}
+
+void UploadEngine::ProcessBatch(std::vector<Change> batch) {
+    batch = DropUnchanged(std::move(batch));
+    if (batch.empty()) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        ++stats_.batches;
+        stats_.files_asked += batch.size();
+    }
+
+    auto status = RememberFirstTry(batch);
+    if (!status.ok()) {
+        std::cerr << "Failed to store FIRST_TRY_TIME: " << status.message() << std::endl;
+    }
+
+    ContentHashes hashes;
+    auto reply = Ask(batch);
+    if (reply.ok() && reply->has_version_increase_allow()) {
+        reply = Upload(batch, reply->version_increase_allow().transfer_id(), hashes);
+    }
+
+    if (reply.ok() && reply->has_version_increase_deny()) {
+        HandleDeny(std::move(batch), reply->version_increase_deny());
+        return;
+    }
+
+    if (reply.ok() && reply->has_version_increased()) {
+        status = store_.ApplyVersionIncreased(reply->version_increased());
+        if (status.ok()) {
+            status = RememberHashes(reply->version_increased(), hashes);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (const auto& change : batch) {
+                retries_.Succeeded(WireId(change));
+                Unjournal(change);
+            }
+        }
+        FlushJournal();
+        if (!status.ok()) {
+            std::cerr << "Failed to store new versions: " << status.message() << std::endl;
+        }
+        return;
+    }
+
+    if (reply.ok()) {
+        status = reply->has_error()
+            ? absl::InternalError(absl::StrCat("Server error: ", reply->error().message()))
+            : absl::InternalError("Unexpected reply to ASK_VERSION_INCREASE");
+    } else {
+        status = reply.status();
+    }
+
+    // The spec restarts the algorithm on any failure; the next attempt keeps
+    // FIRST_TRY_TIME so the server recognizes the retry
+    std::cerr << "Upload of " << batch.size() << " files in " << directory_id_
+              << " failed: " << status.message() << std::endl;
+    bool offline = !client_.IsConnected();
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        ++stats_.failed_batches;
+        stats_.offline_failures += offline ? 1 : 0;
+    }
+    if (offline) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        offline_ = true;
+    }
+    Requeue(std::move(batch));
+}
+
+std::vector<UploadEngine::Change> UploadEngine::DropUnchanged(std::vector<Change> batch) {
+    HashService* hashes;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        hashes = hashes_;
+    }
+    if (!hashes) {
+        return batch;
+    }
+
+    // Only files with a known hash of their uploaded content can be compared
+    std::vector<size_t> candidates;
+    std::vector<uint64_t> known;
+    std::vector<std::filesystem::path> paths;
+    for (size_t i = 0; i < batch.size(); ++i) {
+        const auto& change = batch[i];
+        if (!change.content_changed || change.deleted || change.id.empty()) {
+            continue;
+        }
+        auto record = store_.FindById(change.id);
+        if (!record || record->content_hash == 0) {
+            continue;
+        }
+        candidates.push_back(i);
+        known.push_back(record->content_hash);
+        paths.push_back(root_ / change.path);
+    }
+    if (candidates.empty()) {
+        return batch;
+    }
+
+    auto results = hashes->HashAll(paths);
+    std::vector<bool> drop(batch.size(), false);
+    uint64_t unchanged = 0;
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        if (!results[i].ok() || results[i]->hash != known[i]) {
+            continue;
+        }
+        auto& change = batch[candidates[i]];
+        change.content_changed = false;
+        change.size = 0;
+        ++unchanged;
+        // A touch or an identical rewrite; a rename still has to be reported
+        auto record = store_.FindById(change.id);
+        drop[candidates[i]] = record && record->current_path == change.path;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        stats_.files_unchanged += unchanged;
+    }
+
+    std::vector<Change> kept;
+    kept.reserve(batch.size());
+    for (size_t i = 0; i < batch.size(); ++i) {
+        if (!drop[i]) {
+            kept.push_back(std::move(batch[i]));
+        }
+    }
+    return kept;
+}
+
+absl::Status UploadEngine::RememberHashes(const VersionIncreased& message,
+                                          const ContentHashes& hashes) {
+    if (hashes.empty()) {
+        return absl::OkStatus();
+    }
+    MetadataStore::Batch updates;
+    for (const auto& file : message.files()) {
+        auto hash = hashes.find(file.current_path());
+        if (file.directory_id() != directory_id_ || !file.has_id() || file.deleted() ||
+            hash == hashes.end()) {
+            continue;
+        }
+        auto record = store_.FindById(file.id());
+        if (record) {
+            record->content_hash = hash->second;
+            updates.Put(std::move(*record));
+        }
+    }
+    if (updates.Empty()) {
+        return absl::OkStatus();
+    }
+    return store_.Apply(updates);
+}
+
+absl::Status UploadEngine::RememberFirstTry(const std::vector<Change>& batch) {
+    MetadataStore::Batch updates;
+    for (const auto& change : batch) {
+        auto record = change.id.empty() ? store_.FindByPath(change.path)
+                                        : store_.FindById(change.id);
+        if (!record) {
+            record.emplace();
+            record->current_path = change.path;
+            record->type = change.type;
+        }
+        if (record->first_try_time != change.first_try_time) {
+            record->first_try_time = change.first_try_time;
+            updates.Put(std::move(*record));
+        }
+    }
+    if (updates.Empty()) {
+        return absl::OkStatus();
+    }
+    return store_.Apply(updates);
+}
+
+absl::StatusOr<ServerMessage> UploadEngine::Ask(const std::vector<Change>& batch) {
+    ClientMessage message;
+    auto* ask = message.mutable_ask_version_increase();
+    std::set<std::string> ids;
+    for (const auto& change : batch) {
+        FillFileInfo(change, ask->add_files());
+        if (!change.id.empty()) {
+            ids.insert(change.id);
+        }
+    }
+
+    // Engines of other directories may be waiting on the same client, so
+    // every reply has to name our directory
+    auto predicate = [this, ids = std::move(ids)](const ServerMessage& reply) {
+        switch (reply.message_case()) {
+            case ServerMessage::kVersionIncreaseAllow:
+                return reply.version_increase_allow().directory_id() == directory_id_;
+            case ServerMessage::kVersionIncreaseDeny:
+                return reply.version_increase_deny().directory_id() == directory_id_;
+            case ServerMessage::kVersionIncreased:
+                return IsOurs(reply.version_increased().files());
+            case ServerMessage::kError: {
+                // Other requests of the directory name the files they fail
+                const auto& error = reply.error();
+                return error.directory_id() == directory_id_ &&
+                       (error.file_ids().empty() ||
+                        std::any_of(error.file_ids().begin(), error.file_ids().end(),
+                                    [&ids](const std::string& id) { return ids.count(id) > 0; }));
+            }
+            default:
+                return false;
+        }
+    };
+    return client_.SendAndWait(message, predicate, options_.reply_timeout);
+}
+
+absl::StatusOr<ServerMessage> UploadEngine::Upload(const std::vector<Change>& batch,
+                                                   const std::string& transfer_id,
+                                                   ContentHashes& hashes) {
+    std::unique_ptr<BulkTransfer> transfer;
+    if (!transfer_id.empty()) {
+        auto opened = client_.OpenBulkTransfer(transfer_id, directory_id_);
+        if (!opened.ok()) {
+            return opened.status();
+        }
+        transfer = std::move(*opened);
+    }
+
+    // The server's versions are locked from VERSION_INCREASE_ALLOW on, so
+    // their signatures stay valid until FILE_WRITE_END
+    auto bases = RequestSignatures(batch);
+    if (!bases.ok()) {
+        if (transfer) {
+            transfer->Cancel();
+        }
+        return bases.status();
+    }
+
+    std::vector<const Change*> full;
+    for (const auto& change : batch) {
+        if (!bases->count(change.id)) {
+            full.push_back(&change);
+        }
+    }
+    auto plans = PlanChunks(full);
+    if (!plans.ok()) {
+        if (transfer) {
+            transfer->Cancel();
+        }
+        return plans.status();
+    }
+
+    auto status = StreamContent(full, *plans, [&](FileChunk chunk, std::string* reclaim) {
+        return transfer ? transfer->WriteFileChunk(std::move(chunk), reclaim)
+                        : client_.WriteFileChunk(std::move(chunk), reclaim);
+    }, hashes);
+    for (const auto& change : batch) {
+        auto base = bases->find(change.id);
+        if (!status.ok() || base == bases->end()) {
+            continue;
+        }
+        status = StreamDelta(change, base->second, [&](FileDelta delta) {
+            return transfer ? transfer->WriteFileDelta(std::move(delta))
+                            : client_.WriteFileDelta(std::move(delta));
+        }, hashes);
+    }
+    if (!status.ok()) {
+        if (transfer) {
+            transfer->Cancel();
+        }
+        return status;
+    }
+
+    // VERSION_INCREASED always comes over the control stream. A delta or an
+    // offered file that does not reproduce the content hash fails with an
+    // error naming the file.
+    auto end = [&]() {
+        return transfer ? transfer->WriteFileEnd() : client_.WriteFileEnd(directory_id_);
+    };
+    auto negotiated = [&](const std::string& id) {
+        return bases->count(id) > 0 || plans->count(id) > 0;
+    };
+    auto predicate = [this, &negotiated](const ServerMessage& reply) {
+        if (reply.has_version_increased()) {
+            return IsOurs(reply.version_increased().files());
+        }
+        if (!reply.has_error() || reply.error().directory_id() != directory_id_) {
+            return false;
+        }
+        const auto& ids = reply.error().file_ids();
+        return ids.empty() || std::any_of(ids.begin(), ids.end(), negotiated);
+    };
+    auto reply = client_.SendAndWait(end, predicate, options_.reply_timeout);
+
+    if (reply.ok() && reply->has_error()) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& id : reply->error().file_ids()) {
+            if (negotiated(id)) {
+                send_full_.insert(id);
+            }
+        }
+    } else if (reply.ok()) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto* change : full) {
+            if (!plans->count(WireId(*change))) {
+                send_full_.erase(WireId(*change));
+            }
+        }
+    }
+
+    if (transfer) {
+        auto finished = transfer->Finish();
+        if (!finished.ok() && reply.ok()) {
+            std::cerr << "Bulk transfer " << transfer_id << " ended with: "
+                      << finished.message() << std::endl;
+        }
+    }
+    return reply;
+}
+
+absl::StatusOr<std::unordered_map<std::string, BlockSignatures>>
+UploadEngine::RequestSignatures(const std::vector<Change>& batch) {
+    std::unordered_map<std::string, BlockSignatures> bases;
+    if (options_.delta_min_bytes == 0) {
+        return bases;
+    }
+
+    // One request for every file; the server answers each one separately
+    ClientMessage message;
+    auto* request = message.mutable_request_block_signatures();
+    std::unordered_map<std::string, const Change*> outstanding;
+    for (const auto& change : batch) {
+        if (!change.content_changed || change.deleted || change.type != FileType::FILE ||
+            change.id.empty()) {
+            continue;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (send_full_.count(change.id)) {
+                continue;
+            }
+        }
+        struct stat st;
+        auto path = root_ / change.path;
+        if (::stat(path.c_str(), &st) != 0 ||
+            static_cast<uint64_t>(st.st_size) < options_.delta_min_bytes) {
+            continue;
+        }
+        auto* file = request->add_files();
+        file->set_id(change.id);
+        file->set_directory_id(directory_id_);
+        outstanding.emplace(change.id, &change);
+    }
+    if (outstanding.empty()) {
+        return bases;
+    }
+
+    // Filled on the receive thread until every file is answered
+    std::vector<std::pair<const Change*, std::string>> refused;
+    auto collect = [&](ServerMessage& reply) {
+        using Collect = GRPCClient::Collect;
+        if (reply.has_block_signatures()) {
+            auto& signatures = *reply.mutable_block_signatures();
+            auto it = outstanding.find(signatures.id());
+            if (signatures.directory_id() != directory_id_ || it == outstanding.end()) {
+                return Collect::kSkip;
+            }
+            outstanding.erase(it);
+            bases.emplace(signatures.id(), std::move(signatures));
+        } else if (reply.has_error() && reply.error().directory_id() == directory_id_) {
+            bool ours = false;
+            for (const auto& id : reply.error().file_ids()) {
+                auto it = outstanding.find(id);
+                if (it != outstanding.end()) {
+                    refused.emplace_back(it->second, reply.error().message());
+                    outstanding.erase(it);
+                    ours = true;
+                }
+            }
+            if (!ours) {
+                return Collect::kSkip;
+            }
+        } else {
+            return Collect::kSkip;
+        }
+        return outstanding.empty() ? Collect::kDone : Collect::kTake;
+    };
+    auto status = client_.SendAndCollect(message, collect, options_.reply_timeout);
+    if (!status.ok()) {
+        return status;
+    }
+
+    // The server cannot give signatures for these; they go in full
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& [change, error] : refused) {
+        std::cerr << "No block signatures for " << change->path << ": " << error << std::endl;
+        send_full_.insert(change->id);
+    }
+    return bases;
+}
+
+absl::Status UploadEngine::StreamDelta(const Change& change, const BlockSignatures& base,
+                                       const std::function<absl::Status(FileDelta)>& write,
+                                       ContentHashes& hashes) {
+    auto path = root_ / change.path;
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        // The server expects new content; the batch is retried once the
+        // event that removed the file replaces the change
+        return absl::InternalError(
+            absl::StrCat("Failed to open ", path.string(), ": ", std::strerror(errno)));
+    }
+    struct stat st;
+    uint64_t size = ::fstat(fd, &st) == 0 ? static_cast<uint64_t>(st.st_size) : change.size;
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    CacheTrimmer trimmer(fd, size, options_.drop_cache_min_bytes);
+
+    std::vector<BlockSignature> signatures;
+    if (base.weak_size() == base.strong_size()) {
+        signatures.reserve(base.weak_size());
+        for (int i = 0; i < base.weak_size(); ++i) {
+            signatures.push_back({base.weak(i), base.strong(i)});
+        }
+    }
+    DeltaEncoder encoder(base.block_size(), base.file_size(), std::move(signatures),
+                         options_.chunk_bytes);
+
+    auto start_message = [&](uint64_t offset) {
+        FileDelta message;
+        message.set_id(change.id);
+        message.set_directory_id(directory_id_);
+        message.set_offset(offset);
+        return message;
+    };
+
+    // Ops go out in messages of at most chunk_bytes of literal data
+    absl::Status status;
+    uint64_t offset = 0;
+    uint64_t literal_bytes = 0;
+    FileDelta message = start_message(0);
+    size_t message_literal = 0;
+    auto send = [&]() {
+        status = write(std::move(message));
+        message = start_message(offset);
+        message_literal = 0;
+    };
+    auto emit = [&](DeltaOp op) {
+        if (!status.ok()) {
+            return;
+        }
+        uint64_t length = op.literal.size();
+        if (op.literal.empty()) {
+            uint64_t begin = op.first_block * base.block_size();
+            uint64_t end = (op.first_block + op.block_count) * base.block_size();
+            length = std::min<uint64_t>(end, base.file_size()) - begin;
+        }
+        if (message.ops_size() > 0 &&
+            (message_literal + op.literal.size() > options_.chunk_bytes ||
+             message.ops_size() >= kMaxDeltaOps)) {
+            send();
+            if (!status.ok()) {
+                return;
+            }
+        }
+        message_literal += op.literal.size();
+        literal_bytes += op.literal.size();
+        AddDeltaOp(std::move(op), &message);
+        offset += length;
+    };
+
+    ContentHasher hasher;
+    std::string buffer(options_.chunk_bytes, '\0');
+    uint64_t read_bytes = 0;
+    while (status.ok()) {
+        ssize_t n = ::read(fd, buffer.data(), buffer.size());
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            status = absl::InternalError(
+                absl::StrCat("Failed to read ", path.string(), ": ", std::strerror(errno)));
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        hasher.Update(buffer.data(), static_cast<size_t>(n));
+        encoder.Update(buffer.data(), static_cast<size_t>(n), emit);
+        read_bytes += static_cast<uint64_t>(n);
+        trimmer.Advance(read_bytes);
+    }
+    trimmer.Finish();
+    RecordDropped(trimmer);
+    ::close(fd);
+    if (!status.ok()) {
+        return status;
+    }
+    encoder.Finish(emit);
+    if (!status.ok()) {
+        return status;
+    }
+
+    message.set_last(true);
+    message.set_size(offset);
+    message.set_content_hash(hasher.Digest());
+    status = write(std::move(message));
+    if (!status.ok()) {
+        return status;
+    }
+
+    throughput_.Record(literal_bytes);
+    hashes[change.path] = hasher.Digest();
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    ++stats_.files_uploaded;
+    ++stats_.delta_files;
+    stats_.bytes_uploaded += literal_bytes;
+    stats_.delta_matched_bytes += encoder.GetMatchedBytes();
+    return absl::OkStatus();
+}
+
+absl::StatusOr<UploadEngine::ChunkPlans> UploadEngine::PlanChunks(
+    const std::vector<const Change*>& files) {
+    ChunkPlans plans;
+    if (options_.dedup_min_bytes == 0) {
+        return plans;
+    }
+
+    struct Offered {
+        const Change* change = nullptr;
+        std::vector<ContentChunk> chunks;
+        uint64_t content_hash = 0;
+        std::vector<bool> missing;
+        bool rejected = false;
+    };
+
+    // Chunk every file first; the reads are sequential and mostly leave the
+    // data in the page cache for sending the missing chunks
+    std::vector<Offered> offered;
+    std::string buffer(options_.chunk_bytes, '\0');
+    for (const auto* file : files) {
+        const auto& change = *file;
+        if (!change.content_changed || change.deleted || change.type != FileType::FILE) {
+            continue;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (send_full_.count(WireId(change))) {
+                continue;
+            }
+        }
+        // Files that are gone are reported by StreamContent
+        auto path = root_ / change.path;
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || ::fstat(fd, &st) != 0 ||
+            static_cast<uint64_t>(st.st_size) < options_.dedup_min_bytes) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            continue;
+        }
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        CacheTrimmer trimmer(fd, static_cast<uint64_t>(st.st_size),
+                             options_.drop_cache_min_bytes);
+
+        Offered entry;
+        entry.change = &change;
+        Chunker chunker;
+        ContentHasher hasher;
+        auto emit = [&entry](const ContentChunk& chunk) { entry.chunks.push_back(chunk); };
+        absl::Status status;
+        uint64_t read_bytes = 0;
+        while (true) {
+            ssize_t n = ::read(fd, buffer.data(), buffer.size());
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                status = absl::InternalError(
+                    absl::StrCat("Failed to read ", path.string(), ": ", std::strerror(errno)));
+                break;
+            }
+            if (n == 0) {
+                break;
+            }
+            hasher.Update(buffer.data(), static_cast<size_t>(n));
+            chunker.Update(buffer.data(), static_cast<size_t>(n), emit);
+            read_bytes += static_cast<uint64_t>(n);
+            trimmer.Advance(read_bytes);
+        }
+        trimmer.Finish();
+        RecordDropped(trimmer);
+        ::close(fd);
+        if (!status.ok()) {
+            return status;
+        }
+        chunker.Finish(emit);
+        if (entry.chunks.empty()) {
+            continue;  // truncated since
+        }
+        entry.content_hash = hasher.Digest();
+        entry.missing.assign(entry.chunks.size(), false);
+        offered.push_back(std::move(entry));
+    }
+
+    // Files go out in parts, packed into messages of at most kMaxOfferChunks
+    size_t next_file = 0;
+    size_t next_chunk = 0;
+    while (next_file < offered.size()) {
+        struct Part {
+            size_t file;
+            size_t first;
+        };
+        std::vector<Part> parts;
+        ClientMessage message;
+        auto* offer = message.mutable_offer_chunks();
+        size_t count = 0;
+        while (next_file < offered.size() && count < kMaxOfferChunks) {
+            const auto& entry = offered[next_file];
+            if (entry.rejected) {
+                ++next_file;
+                next_chunk = 0;
+                continue;
+            }
+            size_t end = std::min(entry.chunks.size(), next_chunk + kMaxOfferChunks - count);
+            auto* part = offer->add_files();
+            part->set_id(WireId(*entry.change));
+            part->set_directory_id(directory_id_);
+            part->set_offset(entry.chunks[next_chunk].offset);
+            for (size_t i = next_chunk; i < end; ++i) {
+                part->add_hashes(entry.chunks[i].hash);
+                part->add_sizes(entry.chunks[i].size);
+            }
+            parts.push_back({next_file, next_chunk});
+            count += end - next_chunk;
+            if (end == entry.chunks.size()) {
+                part->set_last(true);
+                part->set_content_hash(entry.content_hash);
+                ++next_file;
+                next_chunk = 0;
+            } else {
+                next_chunk = end;
+            }
+        }
+
+        if (parts.empty()) {
+            break;
+        }
+        auto predicate = [this, offer](const ServerMessage& reply) {
+            const auto& first = offer->files(0);
+            if (reply.has_missing_chunks()) {
+                const auto& files = reply.missing_chunks().files();
+                return !files.empty() && files[0].id() == first.id() &&
+                       files[0].directory_id() == directory_id_ &&
+                       files[0].offset() == first.offset();
+            }
+            if (reply.has_error()) {
+                for (const auto& id : reply.error().file_ids()) {
+                    for (const auto& part : offer->files()) {
+                        if (part.id() == id) {
+                            return true;
+                        }
+                    }
+                }
+            }
+            return false;
+        };
+        auto reply = client_.SendAndWait(message, predicate, options_.reply_timeout);
+        if (!reply.ok()) {
+            return reply.status();
+        }
+
+        if (reply->has_error()) {
+            // The server forgets every part of the files it names; they go
+            // whole. The other parts of the message were not answered, so
+            // they are offered again.
+            std::cerr << "Chunk offer in " << directory_id_ << " rejected: "
+                      << reply->error().message() << std::endl;
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (const auto& id : reply->error().file_ids()) {
+                for (auto& entry : offered) {
+                    if (WireId(*entry.change) == id) {
+                        entry.rejected = true;
+                        send_full_.insert(id);
+                    }
+                }
+            }
+            next_file = parts.front().file;
+            next_chunk = parts.front().first;
+            continue;
+        }
+
+        const auto& answer = reply->missing_chunks();
+        for (size_t i = 0; i < parts.size(); ++i) {
+            auto& entry = offered[parts[i].file];
+            if (static_cast<int>(i) >= answer.files_size() ||
+                answer.files(i).id() != offer->files(i).id()) {
+                // A malformed answer; send the whole part rather than guess
+                std::fill_n(entry.missing.begin() + parts[i].first,
+                            offer->files(i).hashes_size(), true);
+                continue;
+            }
+            for (uint32_t index : answer.files(i).indices()) {
+                if (static_cast<int>(index) < offer->files(i).hashes_size()) {
+                    entry.missing[parts[i].first + index] = true;
+                }
+            }
+        }
+    }
+
+    for (const auto& entry : offered) {
+        if (entry.rejected) {
+            continue;
+        }
+        ChunkPlan plan;
+        plan.content_hash = entry.content_hash;
+        for (size_t i = 0; i < entry.chunks.size(); ++i) {
+            const auto& chunk = entry.chunks[i];
+            if (!entry.missing[i]) {
+                plan.skipped_bytes += chunk.size;
+                continue;
+            }
+            // A FileWrite carries whole chunks, so a run is cut between them
+            auto* last = plan.ranges.empty() ? nullptr : &plan.ranges.back();
+            if (last && last->offset + last->length == chunk.offset &&
+                last->length + chunk.size <= options_.chunk_bytes) {
+                last->length += chunk.size;
+            } else {
+                plan.ranges.push_back({chunk.offset, chunk.size});
+            }
+        }
+        plans.emplace(WireId(*entry.change), std::move(plan));
+    }
+    return plans;
+}
+
+absl::Status UploadEngine::StreamContent(
+    const std::vector<const Change*>& files, const ChunkPlans& plans,
+    const std::function<absl::Status(FileChunk, std::string*)>& write,
+    ContentHashes& hashes) {
+
+    struct Source {
+        const Change* change;
+        int fd;
+        // Parts sent as FileWrite: the whole file in chunk_bytes steps, or
+        // the missing chunks of an offered file
+        std::vector<ChunkPlan::Range> pieces;
+        const ChunkPlan* plan;
+        // Behind the sender: readers ahead of it hold their pieces in buffers
+        std::unique_ptr<CacheTrimmer> trimmer;
+    };
+
+    // Sizes are taken once; bytes appended while uploading go with the next change
+    std::vector<Source> sources;
+    absl::Status status;
+    for (const auto* file : files) {
+        const auto& change = *file;
+        if (!change.content_changed || change.deleted || change.type != FileType::FILE) {
+            continue;
+        }
+        auto path = root_ / change.path;
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || ::fstat(fd, &st) != 0) {
+            // Removed since it changed. The server expects new content, so
+            // the batch fails and is retried once the Deleted event replaces
+            // the change.
+            status = absl::InternalError(
+                absl::StrCat("Failed to open ", path.string(), ": ", std::strerror(errno)));
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            break;
+        }
+        Source source{&change, fd, {}, nullptr,
+                      std::make_unique<CacheTrimmer>(fd, static_cast<uint64_t>(st.st_size),
+                                                     options_.drop_cache_min_bytes)};
+        auto plan = plans.find(WireId(change));
+        if (plan != plans.end()) {
+            source.plan = &plan->second;
+            source.pieces = plan->second.ranges;
+        } else {
+            auto size = static_cast<uint64_t>(st.st_size);
+            uint64_t offset = 0;
+            do {
+                size_t length = std::min<uint64_t>(options_.chunk_bytes, size - offset);
+                source.pieces.push_back({offset, length});
+                offset += length;
+            } while (offset < size);
+            ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+        sources.push_back(std::move(source));
+    }
+    if (!status.ok()) {
+        for (const auto& source : sources) {
+            ::close(source.fd);
+        }
+        return status;
+    }
+
+    // Queue every piece up front; readers are throttled by the buffer pool
+    uint64_t sequence = 0;
+    {
+        std::lock_guard<std::mutex> lock(read_mutex_);
+        for (const auto& source : sources) {
+            for (const auto& piece : source.pieces) {
+                read_tasks_.push_back({sequence++, source.fd, piece.offset, piece.length});
+            }
+        }
+    }
+    read_cv_.notify_all();
+
+    sequence = 0;
+    for (const auto& source : sources) {
+        // Hashed from the very bytes sent, so the stored hash matches the
+        // server; an offered file was hashed whole while it was chunked
+        ContentHasher hasher;
+        for (const auto& piece : source.pieces) {
+            ReadResult result;
+            {
+                std::unique_lock<std::mutex> lock(read_mutex_);
+                if (!ready_.count(sequence)) {
+                    auto start = std::chrono::steady_clock::now();
+                    ready_cv_.wait(lock, [this, sequence]() {
+                        return readers_stop_ || ready_.count(sequence);
+                    });
+                    std::lock_guard<std::mutex> stats_lock(stats_mutex_);
+                    stats_.send_stall += Since(start);
+                }
+                auto it = ready_.find(sequence);
+                if (it == ready_.end()) {
+                    status = absl::CancelledError("Upload engine is stopping");
+                    break;
+                }
+                result = std::move(it->second);
+                ready_.erase(it);
+            }
+            ++sequence;
+
+            size_t bytes = result.buffer.size();
+            if (result.status.ok() && (bytes > 0 || piece.offset == 0)) {
+                hasher.Update(result.buffer);
+                FileChunk chunk;
+                chunk.set_id(WireId(*source.change));
+                chunk.set_directory_id(directory_id_);
+                chunk.set_offset(piece.offset);
+                chunk.mutable_data()->swap(result.buffer);
+                status = write(std::move(chunk), &result.buffer);
+            } else {
+                status = result.status;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(read_mutex_);
+                free_buffers_.push_back(std::move(result.buffer));
+            }
+            read_cv_.notify_one();
+
+            if (!status.ok()) {
+                break;
+            }
+            source.trimmer->Advance(piece.offset + bytes);
+            throughput_.Record(bytes);
+            {
+                std::lock_guard<std::mutex> lock(stats_mutex_);
+                stats_.bytes_uploaded += bytes;
+            }
+        }
+
+        if (!status.ok()) {
+            break;
+        }
+        hashes[source.change->path] = source.plan ? source.plan->content_hash : hasher.Digest();
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        ++stats_.files_uploaded;
+        if (source.plan) {
+            ++stats_.dedup_files;
+            stats_.dedup_skipped_bytes += source.plan->skipped_bytes;
+        }
+    }
+
+    DrainReads();
+    for (const auto& source : sources) {
+        source.trimmer->Finish();
+        RecordDropped(*source.trimmer);
+        ::close(source.fd);
+    }
+    return status;
+}
+
+void UploadEngine::HandleDeny(std::vector<Change> batch, const VersionIncreaseDeny& deny) {
+    std::map<std::string, FileStatus> statuses;
+    for (const auto& file : deny.files()) {
+        statuses[file.id()] = file.status();
+    }
+
+    std::vector<Change> retry;
+    std::vector<Change> blocked;
+    std::vector<std::string> denied;
+    for (auto& change : batch) {
+        // Files without an id cannot be named by the server; treat them as FREE
+        auto it = statuses.find(change.id);
+        FileStatus status = it == statuses.end() ? FileStatus::FREE : it->second;
+        if (status == FileStatus::BLOCKED) {
+            blocked.push_back(std::move(change));
+        } else if (status == FileStatus::DENIED) {
+            denied.push_back(change.id);
+            std::lock_guard<std::mutex> lock(mutex_);
+            Unjournal(change);
+        } else {
+            retry.push_back(std::move(change));
+        }
+    }
+
+    FlushJournal();
+
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        stats_.denied_free += retry.size();
+        stats_.denied_blocked += blocked.size();
+        stats_.denied += denied.size();
+    }
+
+    DeniedCallback callback;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& change : retry) {
+            auto key = WireId(change);
+            retries_.Retry(key, std::move(change));
+        }
+        for (auto& change : blocked) {
+            auto key = WireId(change);
+            retries_.Park(key, std::move(change));
+        }
+        for (const auto& id : denied) {
+            retries_.Denied(id);
+        }
+        callback = denied_callback_;
+    }
+
+    // DENIED files are brought up to date once this algorithm is done
+    if (!denied.empty() && callback) {
+        callback(denied);
+    }
+}
+
+void UploadEngine::Requeue(std::vector<Change> changes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& change : changes) {
+        // A newer event for the same path already supersedes this change
+        PutPending(std::move(change), false);
+    }
+    cv_.notify_all();
+}
+
+void UploadEngine::Journal(Change& change) {
+    if (!journal_) {
+        return;
+    }
+    change.journal_sequence = journal_->Reserve();
+    JournalWrite write;
+    write.entry.path = change.path;
+    write.entry.id = change.id;
+    write.entry.type = change.type;
+    write.entry.deleted = change.deleted;
+    write.entry.content_changed = change.content_changed;
+    write.entry.first_try_time = change.first_try_time;
+    write.entry.sequence = change.journal_sequence;
+    journal_writes_.push_back(std::move(write));
+}
+
+void UploadEngine::Unjournal(const Change& change) {
+    if (!journal_ || change.journal_sequence == 0) {
+        return;
+    }
+    JournalWrite write;
+    write.entry.path = change.path;
+    write.entry.sequence = change.journal_sequence;
+    write.remove = true;
+    journal_writes_.push_back(std::move(write));
+}
+
+void UploadEngine::FlushJournal() {
+    std::vector<JournalWrite> writes;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        // Whoever is flushing also takes what was queued meanwhile
+        if (journal_flushing_ || journal_writes_.empty()) {
+            return;
+        }
+        journal_flushing_ = true;
+        writes.swap(journal_writes_);
+    }
+
+    while (!writes.empty()) {
+        for (auto& write : writes) {
+            if (write.remove) {
+                auto status = journal_->Remove(write.entry.path, write.entry.sequence);
+                if (!status.ok()) {
+                    std::cerr << "Failed to update change journal: " << status.message()
+                              << std::endl;
+                }
+                continue;
+            }
+            auto path = write.entry.path;
+            auto sequence = journal_->Put(std::move(write.entry));
+            if (!sequence.ok()) {
+                // Still uploaded, just not remembered across a restart
+                std::cerr << "Failed to journal " << path << ": "
+                          << sequence.status().message() << std::endl;
+            }
+        }
+        writes.clear();
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        writes.swap(journal_writes_);
+        if (writes.empty()) {
+            journal_flushing_ = false;
+        }
+    }
+}
+
+void UploadEngine::RestoreJournal() {
+    if (!journal_ || journal_restored_) {
+        return;
+    }
+    journal_restored_ = true;
+
+    auto entries = journal_->Entries();
+    auto now = std::chrono::steady_clock::now();
+    for (auto& entry : entries) {
+        Change change;
+        change.path = std::move(entry.path);
+        change.id = std::move(entry.id);
+        change.type = entry.type;
+        change.deleted = entry.deleted;
+        change.content_changed = entry.content_changed;
+        change.first_try_time = entry.first_try_time;
+        change.queued_at = now;
+        change.journal_sequence = entry.sequence;
+        struct stat st;
+        if (change.content_changed && ::stat((root_ / change.path).c_str(), &st) == 0) {
+            change.size = static_cast<uint64_t>(st.st_size);
+            change.modified = std::chrono::system_clock::from_time_t(st.st_mtime);
+        }
+        PutPending(std::move(change), false);
+    }
+    if (!entries.empty()) {
+        // The backlog of an earlier run goes in large batches
+        draining_ = true;
+    }
+}
+
+void UploadEngine::ReleaseRetries() {
+    for (auto& change : retries_.TakeDue()) {
+        // A newer event for the same path already supersedes this change
+        PutPending(std::move(change), false);
+    }
+}
+
+void UploadEngine::PutPending(Change change, bool replace) {
+    auto [it, inserted] = pending_.try_emplace(change.path);
+    if (!inserted && !replace) {
+        return;
+    }
+    if (inserted && pending_.size() == 1) {
+        pending_deadline_ = std::chrono::steady_clock::now() + options_.batch_delay;
+    }
+    if (!inserted) {
+        pending_bytes_ -= it->second.size;
+    }
+    pending_bytes_ += change.size;
+    it->second = std::move(change);
+
+    if (acquiring_ && scheduler_ &&
+        scheduler_->Effective(scheduler_->Classify(it->second.size, it->second.modified),
+                              it->second.queued_at) < *acquiring_) {
+        interrupt_acquire_ = true;
+        scheduler_->Wake();
+    }
+}
+
+UploadEngine::Change UploadEngine::TakePending(std::map<std::string, Change>::iterator it) {
+    pending_bytes_ -= it->second.size;
+    Change change = std::move(it->second);
+    pending_.erase(it);
+    return change;
+}
+
+size_t UploadEngine::BatchFiles() const {
+    return draining_ ? std::max(options_.max_batch_files, options_.drain_batch_files)
+                     : options_.max_batch_files;
+}
+
+std::vector<UploadEngine::Change> UploadEngine::TakeBatch() {
+    size_t max_files = BatchFiles();
+    bool draining = draining_;
+    bool full_count = pending_.size() >= max_files;
+    bool full_bytes = pending_bytes_ >= options_.max_batch_bytes;
+
+    // With a scheduler only the most urgent class after aging goes.
+    // Folders, renames and deletions carry no content and are always
+    // interactive, so a folder still goes no later than its files.
+    std::optional<TransferClass> urgent;
+    auto effective = [this](const Change& change) {
+        return scheduler_->Effective(scheduler_->Classify(change.size, change.modified),
+                                     change.queued_at);
+    };
+    if (scheduler_) {
+        for (const auto& [path, change] : pending_) {
+            auto level = effective(change);
+            if (!urgent || level < *urgent) {
+                urgent = level;
+            }
+        }
+    }
+
+    // Paths are sorted, so folders are asked for before their contents. A
+    // file too large for max_batch_bytes on its own still goes, alone.
+    std::vector<Change> batch;
+    uint64_t batch_bytes = 0;
+    size_t ask_bytes = 0;
+    AskVersionIncrease::FileInfo file;
+    for (auto it = pending_.begin();
+         it != pending_.end() && batch.size() < max_files;) {
+        if (urgent && effective(it->second) != *urgent) {
+            ++it;
+            continue;
+        }
+        file.Clear();
+        FillFileInfo(it->second, &file);
+        size_t entry_bytes = file.ByteSizeLong() + kEntryOverhead;
+        if (!batch.empty() && (batch_bytes + it->second.size > options_.max_batch_bytes ||
+                               ask_bytes + entry_bytes > options_.max_ask_bytes)) {
+            full_bytes = true;
+            break;
+        }
+        batch_bytes += it->second.size;
+        ask_bytes += entry_bytes;
+        batch.push_back(TakePending(it++));
+    }
+
+    if (!batch.empty()) {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        if (full_count) {
+            ++stats_.batches_full_count;
+        } else if (full_bytes) {
+            ++stats_.batches_full_bytes;
+        } else {
+            ++stats_.batches_delayed;
+        }
+        stats_.drain_batches += draining ? 1 : 0;
+    }
+    if (pending_.empty()) {
+        draining_ = false;
+    }
+    return batch;
+}
+
+void UploadEngine::FillFileInfo(const Change& change, AskVersionIncrease::FileInfo* file) const {
+    if (!change.id.empty()) {
+        file->set_id(change.id);
+    }
+    file->set_directory_id(directory_id_);
+    file->mutable_first_try_time()->set_time(change.first_try_time);
+    file->set_current_path(change.path);
+    file->set_deleted(change.deleted);
+    file->set_content_changed(change.content_changed);
+    file->set_type(change.type);
+}
+
+void UploadEngine::RecordDropped(const CacheTrimmer& trimmer) {
+    if (trimmer.dropped_bytes() > 0) {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        stats_.cache_dropped_bytes += trimmer.dropped_bytes();
+    }
+}
+
+void UploadEngine::ReaderLoop() {
+    while (true) {
+        ReadTask task;
+        std::string buffer;
+        {
+            std::unique_lock<std::mutex> lock(read_mutex_);
+            bool starved = !read_tasks_.empty() && free_buffers_.empty();
+            auto start = std::chrono::steady_clock::now();
+            read_cv_.wait(lock, [this]() {
+                return readers_stop_ || (!read_tasks_.empty() && !free_buffers_.empty());
+            });
+            if (readers_stop_) {
+                return;
+            }
+            if (starved) {
+                std::lock_guard<std::mutex> stats_lock(stats_mutex_);
+                stats_.read_stall += Since(start);
+            }
+            task = read_tasks_.front();
+            read_tasks_.pop_front();
+            buffer = std::move(free_buffers_.back());
+            free_buffers_.pop_back();
+            ++reads_in_flight_;
+        }
+
+        ReadResult result;
+        buffer.resize(task.length);
+        size_t done = 0;
+        while (done < task.length) {
+            ssize_t n = ::pread(task.fd, buffer.data() + done, task.length - done,
+                                static_cast<off_t>(task.offset + done));
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                result.status = absl::InternalError(
+                    absl::StrCat("Failed to read file chunk: ", std::strerror(errno)));
+                break;
+            }
+            if (n == 0) {
+                break;  // the file shrank
+            }
+            done += static_cast<size_t>(n);
+        }
+        buffer.resize(done);
+        result.buffer = std::move(buffer);
+
+        {
+            std::lock_guard<std::mutex> lock(read_mutex_);
+            ready_.emplace(task.sequence, std::move(result));
+            --reads_in_flight_;
+        }
+        ready_cv_.notify_all();
+    }
+}
+
+void UploadEngine::DrainReads() {
+    std::unique_lock<std::mutex> lock(read_mutex_);
+    read_tasks_.clear();
+    ready_cv_.wait(lock, [this]() { return reads_in_flight_ == 0; });
+    for (auto& [sequence, result] : ready_) {
+        free_buffers_.push_back(std::move(result.buffer));
+    }
+    ready_.clear();
+}
+
+bool UploadEngine::IsOurs(const google::protobuf::RepeatedPtrField<FileMetadata>& files) const {
+    return files.empty() || files[0].directory_id() == directory_id_;
+}
+
+std::optional<std::string> UploadEngine::RelativePath(const std::filesystem::path& path) const {
+    auto relative = path.lexically_normal().lexically_relative(root_.lexically_normal());
+    if (relative.empty() || relative == "." || *relative.begin() == "..") {
+        return std::nullopt;
+    }
+    return relative.generic_string();
+}
+
+}  // namespace synxpo
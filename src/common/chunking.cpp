@@ -0,0 +1,219 @@
+#include "synxpo/common/chunking.h"
+
+#include <algorithm>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace synxpo {
+
+namespace {
+
+// Bytes covered by the 32-bit gear hash
+constexpr size_t kWindow = 32;
+constexpr uint32_t kStrictMask = 0xFFFE0000U;  // top 15 bits
+constexpr uint32_t kLooseMask = 0xFFE00000U;   // top 11 bits
+
+// GEAR[x] = LOW[x & 15] ^ HIGH[x >> 4], so a vector of bytes is looked up
+// with two 16-entry permutes instead of a gather
+struct GearTables {
+    uint32_t low[16];
+    uint32_t high[16];
+    uint32_t gear[256];
+};
+
+constexpr uint64_t SplitMix64(uint64_t& state) {
+    uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+constexpr GearTables MakeGearTables() {
+    GearTables tables{};
+    uint64_t state = 0x53594E58504F4344ULL;  // "SYNXPOCD"
+    for (int i = 0; i < 16; ++i) {
+        tables.low[i] = static_cast<uint32_t>(SplitMix64(state) >> 32);
+        tables.high[i] = static_cast<uint32_t>(SplitMix64(state) >> 32);
+    }
+    for (int x = 0; x < 256; ++x) {
+        tables.gear[x] = tables.low[x & 15] ^ tables.high[x >> 4];
+    }
+    return tables;
+}
+
+alignas(64) constexpr GearTables kGear = MakeGearTables();
+
+// Candidates are kept as position << 1, with the low bit set where the
+// strict mask passes as well
+inline uint64_t Tag(uint64_t position, uint32_t gear) {
+    return position << 1 | ((gear & kStrictMask) == 0 ? 1 : 0);
+}
+
+// Appends the candidates in [begin, end) of `data`, which starts at stream
+// position `base`. `gear` is the hash at begin - 1 and is left at end - 1.
+void ScanScalar(const uint8_t* data, size_t begin, size_t end, uint64_t base, uint32_t& gear,
+                std::vector<uint64_t>& out) {
+    uint32_t h = gear;
+    for (size_t i = begin; i < end; ++i) {
+        h = (h << 1) + kGear.gear[data[i]];
+        if ((h & kLooseMask) == 0) {
+            out.push_back(Tag(base + i, h));
+        }
+    }
+    gear = h;
+}
+
+// Hash at the last of the kWindow bytes at `data`; older bytes have been
+// shifted out of it
+uint32_t GearOf(const uint8_t* data) {
+    uint32_t h = 0;
+    for (size_t i = 0; i < kWindow; ++i) {
+        h = (h << 1) + kGear.gear[data[i]];
+    }
+    return h;
+}
+
+#if defined(__x86_64__)
+
+// GCC 12 warns about _mm512_undefined_epi32() inside its own intrinsics
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+// Same as ScanScalar for whole groups of 16 positions from `begin`, which
+// needs kWindow bytes before it; returns where it stopped. The hash at i is
+// the sum of GEAR[x[i - k]] << k for k < 32, which is built for 16
+// positions at once by doubling the window: S2(i) = S1(i) + (S1(i - 1) << 1),
+// S4(i) = S2(i) + (S2(i - 2) << 2) and so on, where the shifted-in terms
+// come from the previous group. Two groups before `begin` warm that up.
+__attribute__((target("avx512f")))
+size_t ScanAvx512(const uint8_t* data, size_t begin, size_t end, uint64_t base,
+                  std::vector<uint64_t>& out) {
+    const __m512i low = _mm512_load_si512(kGear.low);
+    const __m512i high = _mm512_load_si512(kGear.high);
+    const __m512i loose = _mm512_set1_epi32(static_cast<int>(kLooseMask));
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i prev1 = zero;
+    __m512i prev2 = zero;
+    __m512i prev4 = zero;
+    __m512i prev8 = zero;
+    __m512i prev16 = zero;
+
+    size_t i = begin - kWindow;
+    for (; i + 16 <= end; i += 16) {
+        // vpermd only looks at the low 4 bits of each index
+        __m512i bytes = _mm512_cvtepu8_epi32(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i)));
+        __m512i s1 = _mm512_xor_si512(_mm512_permutexvar_epi32(bytes, low),
+                                      _mm512_permutexvar_epi32(_mm512_srli_epi32(bytes, 4), high));
+        __m512i s2 = _mm512_add_epi32(s1, _mm512_slli_epi32(_mm512_alignr_epi32(s1, prev1, 15), 1));
+        __m512i s4 = _mm512_add_epi32(s2, _mm512_slli_epi32(_mm512_alignr_epi32(s2, prev2, 14), 2));
+        __m512i s8 = _mm512_add_epi32(s4, _mm512_slli_epi32(_mm512_alignr_epi32(s4, prev4, 12), 4));
+        __m512i s16 = _mm512_add_epi32(s8, _mm512_slli_epi32(_mm512_alignr_epi32(s8, prev8, 8), 8));
+        __m512i gear = _mm512_add_epi32(s16, _mm512_slli_epi32(prev16, 16));
+        prev1 = s1;
+        prev2 = s2;
+        prev4 = s4;
+        prev8 = s8;
+        prev16 = s16;
+
+        __mmask16 found = _mm512_testn_epi32_mask(gear, loose);
+        if (found != 0 && i >= begin) {
+            alignas(64) uint32_t values[16];
+            _mm512_store_si512(values, gear);
+            do {
+                int lane = __builtin_ctz(found);
+                found &= found - 1;
+                out.push_back(Tag(base + i + lane, values[lane]));
+            } while (found != 0);
+        }
+    }
+    return std::max(i, begin);
+}
+
+#pragma GCC diagnostic pop
+
+bool UseAvx512() {
+    static const bool supported = __builtin_cpu_supports("avx512f");
+    return supported;
+}
+
+#else
+
+bool UseAvx512() {
+    return false;
+}
+
+#endif
+
+}  // namespace
+
+void Chunker::Update(const void* data, size_t size, const Emit& emit) {
+    if (size == 0) {
+        return;
+    }
+    const auto* bytes = static_cast<const uint8_t*>(data);
+
+    // The first bytes continue the hash of the previous piece
+    candidates_.clear();
+    size_t head = std::min(size, kWindow);
+    ScanScalar(bytes, 0, head, offset_, gear_, candidates_);
+    size_t done = head;
+#if defined(__x86_64__)
+    if (UseAvx512() && size > head) {
+        done = ScanAvx512(bytes, head, size, offset_, candidates_);
+        if (done > head) {
+            gear_ = GearOf(bytes + done - kWindow);
+        }
+    }
+#endif
+    ScanScalar(bytes, done, size, offset_, gear_, candidates_);
+
+    for (uint64_t candidate : candidates_) {
+        uint64_t position = candidate >> 1;
+        while (position + 1 - chunk_start_ > kMaxSize) {
+            Cut(chunk_start_ + kMaxSize, bytes, emit);
+        }
+        uint64_t length = position + 1 - chunk_start_;
+        if (length < kMinSize || (length < kNormalSize && (candidate & 1) == 0)) {
+            continue;
+        }
+        Cut(position + 1, bytes, emit);
+    }
+
+    uint64_t end = offset_ + size;
+    while (end - chunk_start_ >= kMaxSize) {
+        Cut(chunk_start_ + kMaxSize, bytes, emit);
+    }
+    hasher_.Update(bytes + (hashed_ - offset_), end - hashed_);
+    hashed_ = end;
+    offset_ = end;
+}
+
+void Chunker::Finish(const Emit& emit) {
+    if (offset_ > chunk_start_) {
+        Cut(offset_, nullptr, emit);
+    }
+    gear_ = 0;
+    offset_ = 0;
+    chunk_start_ = 0;
+    hashed_ = 0;
+}
+
+void Chunker::Cut(uint64_t end, const uint8_t* data, const Emit& emit) {
+    if (end > hashed_) {
+        hasher_.Update(data + (hashed_ - offset_), end - hashed_);
+        hashed_ = end;
+    }
+    emit({chunk_start_, static_cast<uint32_t>(end - chunk_start_), hasher_.Digest()});
+    hasher_.Reset();
+    chunk_start_ = end;
+}
+
+const char* ChunkerImplementation() {
+    return UseAvx512() ? "avx512" : "scalar";
+}
+
+}  // namespace synxpo
@@ -0,0 +1,180 @@
+#include "synxpo/common/compression.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+#include <grpc/slice.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_format.h>
+#include <zlib.h>
+
+namespace synxpo {
+
+namespace {
+
+// Number of evenly spaced blocks the entropy sample is split into, so a file
+// header alone does not decide for the whole chunk
+constexpr size_t kSampleBlocks = 4;
+
+}  // namespace
+
+std::string CompressionStats::ToString() const {
+    return absl::StrCat("compressed=", compressed_messages, " (", compressed_bytes, " bytes)",
+                        " raw=", raw_messages, " (", raw_bytes, " bytes)",
+                        " incompressible=", incompressible_payloads,
+                        " ratio=", absl::StrFormat("%.2f", MeasuredRatio()),
+                        " (", measured_payloads, " payloads measured)");
+}
+
+size_t CompressedSize(std::string_view data, grpc_compression_algorithm algorithm) {
+    if (algorithm != GRPC_COMPRESS_DEFLATE && algorithm != GRPC_COMPRESS_GZIP) {
+        return data.size();
+    }
+
+    // The settings of gRPC's own message compression
+    z_stream stream{};
+    int window_bits = algorithm == GRPC_COMPRESS_GZIP ? 15 | 16 : 15;
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window_bits, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        return data.size();
+    }
+
+    std::array<Bytef, 16 * 1024> out;
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    stream.avail_in = static_cast<uInt>(data.size());
+    size_t total = 0;
+    int result;
+    do {
+        stream.next_out = out.data();
+        stream.avail_out = static_cast<uInt>(out.size());
+        result = deflate(&stream, Z_FINISH);
+        total += out.size() - stream.avail_out;
+    } while (result == Z_OK);
+    deflateEnd(&stream);
+
+    return result == Z_STREAM_END ? std::min(total, data.size()) : data.size();
+}
+
+double SampleEntropy(std::string_view data, size_t sample_bytes) {
+    if (data.empty() || sample_bytes == 0) {
+        return 0.0;
+    }
+
+    std::array<uint32_t, 256> counts{};
+    size_t total = 0;
+    if (data.size() <= sample_bytes) {
+        for (unsigned char byte : data) {
+            ++counts[byte];
+        }
+        total = data.size();
+    } else {
+        size_t block = std::max<size_t>(sample_bytes / kSampleBlocks, 1);
+        size_t stride = data.size() / kSampleBlocks;
+        for (size_t i = 0; i < kSampleBlocks; ++i) {
+            size_t start = std::min(i * stride, data.size() - block);
+            for (unsigned char byte : data.substr(start, block)) {
+                ++counts[byte];
+            }
+            total += block;
+        }
+    }
+
+    double entropy = 0.0;
+    for (uint32_t count : counts) {
+        if (count != 0) {
+            double p = static_cast<double>(count) / total;
+            entropy -= p * std::log2(p);
+        }
+    }
+    return entropy;
+}
+
+std::string CompressionAlgorithmName(grpc_compression_algorithm algorithm) {
+    const char* name = nullptr;
+    if (!grpc_compression_algorithm_name(algorithm, &name)) {
+        return "unknown";
+    }
+    return name;
+}
+
+std::optional<grpc_compression_algorithm> ParseCompressionAlgorithm(std::string_view name) {
+    grpc_compression_algorithm algorithm;
+    grpc_slice slice = grpc_slice_from_copied_buffer(name.data(), name.size());
+    int parsed = grpc_compression_algorithm_parse(slice, &algorithm);
+    grpc_slice_unref(slice);
+    if (!parsed) {
+        return std::nullopt;
+    }
+    return algorithm;
+}
+
+CompressionPolicy::CompressionPolicy(CompressionOptions options)
+    : options_(std::move(options)) {}
+
+bool CompressionPolicy::ShouldCompress(size_t message_bytes, std::string_view payload) {
+    bool compress = options_.algorithm != GRPC_COMPRESS_NONE &&
+                    message_bytes >= options_.min_message_bytes;
+
+    if (compress && !payload.empty()) {
+        double entropy = SampleEntropy(payload, options_.entropy_sample_bytes);
+        if (entropy > options_.max_entropy_bits_per_byte) {
+            incompressible_payloads_.fetch_add(1, std::memory_order_relaxed);
+            compress = false;
+        }
+    }
+
+    if (!compress) {
+        raw_messages_.fetch_add(1, std::memory_order_relaxed);
+        raw_bytes_.fetch_add(message_bytes, std::memory_order_relaxed);
+        return false;
+    }
+
+    compressed_messages_.fetch_add(1, std::memory_order_relaxed);
+    compressed_bytes_.fetch_add(message_bytes, std::memory_order_relaxed);
+    if (!payload.empty() && options_.measure_every != 0 &&
+        compressed_payloads_.fetch_add(1, std::memory_order_relaxed) % options_.measure_every ==
+            0) {
+        measured_payloads_.fetch_add(1, std::memory_order_relaxed);
+        measured_bytes_.fetch_add(payload.size(), std::memory_order_relaxed);
+        measured_compressed_bytes_.fetch_add(CompressedSize(payload, options_.algorithm),
+                                             std::memory_order_relaxed);
+    }
+    return true;
+}
+
+grpc::WriteOptions CompressionPolicy::WriteOptionsFor(size_t message_bytes,
+                                                      std::string_view payload) {
+    grpc::WriteOptions write_options;
+    if (!ShouldCompress(message_bytes, payload)) {
+        write_options.set_no_compression();
+    }
+    return write_options;
+}
+
+CompressionStats CompressionPolicy::GetStats() const {
+    CompressionStats stats;
+    stats.compressed_messages = compressed_messages_.load(std::memory_order_relaxed);
+    stats.compressed_bytes = compressed_bytes_.load(std::memory_order_relaxed);
+    stats.raw_messages = raw_messages_.load(std::memory_order_relaxed);
+    stats.raw_bytes = raw_bytes_.load(std::memory_order_relaxed);
+    stats.incompressible_payloads = incompressible_payloads_.load(std::memory_order_relaxed);
+    stats.measured_payloads = measured_payloads_.load(std::memory_order_relaxed);
+    stats.measured_bytes = measured_bytes_.load(std::memory_order_relaxed);
+    stats.measured_compressed_bytes = measured_compressed_bytes_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+void CompressionPolicy::ResetStats() {
+    compressed_messages_ = 0;
+    compressed_bytes_ = 0;
+    raw_messages_ = 0;
+    raw_bytes_ = 0;
+    incompressible_payloads_ = 0;
+    compressed_payloads_ = 0;
+    measured_payloads_ = 0;
+    measured_bytes_ = 0;
+    measured_compressed_bytes_ = 0;
+}
+
+}  // namespace synxpo
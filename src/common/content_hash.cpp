@@ -0,0 +1,377 @@
+#include "synxpo/common/content_hash.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace synxpo {
+
+namespace {
+
+constexpr uint64_t kPrime32_1 = 0x9E3779B1U;
+constexpr uint64_t kPrime32_2 = 0x85EBCA77U;
+constexpr uint64_t kPrime32_3 = 0xC2B2AE3DU;
+constexpr uint64_t kPrime64_1 = 0x9E3779B185EBCA87ULL;
+constexpr uint64_t kPrime64_2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr uint64_t kPrime64_3 = 0x165667B19E3779F9ULL;
+constexpr uint64_t kPrime64_4 = 0x85EBCA77C2B2AE63ULL;
+constexpr uint64_t kPrime64_5 = 0x27D4EB2F165667C5ULL;
+constexpr uint64_t kPrimeMx1 = 0x165667919E3779F9ULL;
+constexpr uint64_t kPrimeMx2 = 0x9FB21C651E98DF25ULL;
+
+constexpr size_t kSecretBytes = 192;
+constexpr size_t kStripeBytes = 64;
+constexpr size_t kStripesPerBlock = (kSecretBytes - kStripeBytes) / 8;
+
+alignas(64) constexpr uint8_t kSecret[kSecretBytes] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+// Little-endian loads; x86 and ARM Linux builds are little-endian
+inline uint32_t Read32(const uint8_t* p) {
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+inline uint64_t Read64(const uint8_t* p) {
+    uint64_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+inline uint64_t Rotl64(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+inline uint64_t MulFold64(uint64_t lhs, uint64_t rhs) {
+    unsigned __int128 product = static_cast<unsigned __int128>(lhs) * rhs;
+    return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+}
+
+inline uint64_t Xxh64Avalanche(uint64_t h) {
+    h ^= h >> 33;
+    h *= kPrime64_2;
+    h ^= h >> 29;
+    h *= kPrime64_3;
+    return h ^ (h >> 32);
+}
+
+inline uint64_t Avalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= kPrimeMx1;
+    return h ^ (h >> 32);
+}
+
+inline uint64_t Rrmxmx(uint64_t h, uint64_t length) {
+    h ^= Rotl64(h, 49) ^ Rotl64(h, 24);
+    h *= kPrimeMx2;
+    h ^= (h >> 35) + length;
+    h *= kPrimeMx2;
+    return h ^ (h >> 28);
+}
+
+inline uint64_t Mix16(const uint8_t* input, const uint8_t* secret) {
+    return MulFold64(Read64(input) ^ Read64(secret), Read64(input + 8) ^ Read64(secret + 8));
+}
+
+uint64_t HashShort(const uint8_t* input, size_t length) {
+    if (length == 0) {
+        return Xxh64Avalanche(Read64(kSecret + 56) ^ Read64(kSecret + 64));
+    }
+    if (length <= 3) {
+        uint32_t combined = (static_cast<uint32_t>(input[0]) << 16) |
+                            (static_cast<uint32_t>(input[length >> 1]) << 24) |
+                            static_cast<uint32_t>(input[length - 1]) |
+                            (static_cast<uint32_t>(length) << 8);
+        uint64_t bitflip = Read32(kSecret) ^ Read32(kSecret + 4);
+        return Xxh64Avalanche(combined ^ bitflip);
+    }
+    if (length <= 8) {
+        uint64_t bitflip = Read64(kSecret + 8) ^ Read64(kSecret + 16);
+        uint64_t combined = Read32(input + length - 4) +
+                            (static_cast<uint64_t>(Read32(input)) << 32);
+        return Rrmxmx(combined ^ bitflip, length);
+    }
+    if (length <= 16) {
+        uint64_t low = Read64(input) ^ (Read64(kSecret + 24) ^ Read64(kSecret + 32));
+        uint64_t high = Read64(input + length - 8) ^ (Read64(kSecret + 40) ^ Read64(kSecret + 48));
+        uint64_t acc = length + __builtin_bswap64(low) + high + MulFold64(low, high);
+        return Avalanche(acc);
+    }
+
+    uint64_t acc = length * kPrime64_1;
+    if (length <= 128) {
+        if (length > 32) {
+            if (length > 64) {
+                if (length > 96) {
+                    acc += Mix16(input + 48, kSecret + 96);
+                    acc += Mix16(input + length - 64, kSecret + 112);
+                }
+                acc += Mix16(input + 32, kSecret + 64);
+                acc += Mix16(input + length - 48, kSecret + 80);
+            }
+            acc += Mix16(input + 16, kSecret + 32);
+            acc += Mix16(input + length - 32, kSecret + 48);
+        }
+        acc += Mix16(input, kSecret);
+        acc += Mix16(input + length - 16, kSecret + 16);
+        return Avalanche(acc);
+    }
+
+    // 129..240 bytes
+    size_t rounds = length / 16;
+    for (size_t i = 0; i < 8; ++i) {
+        acc += Mix16(input + 16 * i, kSecret + 16 * i);
+    }
+    acc = Avalanche(acc);
+    for (size_t i = 8; i < rounds; ++i) {
+        acc += Mix16(input + 16 * i, kSecret + 16 * (i - 8) + 3);
+    }
+    acc += Mix16(input + length - 16, kSecret + 136 - 17);
+    return Avalanche(acc);
+}
+
+// Stripe kernels. `secret` advances by 8 bytes per stripe.
+using AccumulateFn = void (*)(uint64_t* acc, const uint8_t* input, const uint8_t* secret,
+                              size_t stripes);
+using ScrambleFn = void (*)(uint64_t* acc, const uint8_t* secret);
+
+void AccumulateScalar(uint64_t* acc, const uint8_t* input, const uint8_t* secret,
+                      size_t stripes) {
+    for (size_t s = 0; s < stripes; ++s) {
+        const uint8_t* in = input + s * kStripeBytes;
+        const uint8_t* key = secret + s * 8;
+        for (size_t i = 0; i < 8; ++i) {
+            uint64_t value = Read64(in + 8 * i);
+            uint64_t keyed = value ^ Read64(key + 8 * i);
+            acc[i ^ 1] += value;
+            acc[i] += (keyed & 0xFFFFFFFFULL) * (keyed >> 32);
+        }
+    }
+}
+
+void ScrambleScalar(uint64_t* acc, const uint8_t* secret) {
+    for (size_t i = 0; i < 8; ++i) {
+        uint64_t value = acc[i];
+        value ^= value >> 47;
+        value ^= Read64(secret + 8 * i);
+        acc[i] = value * kPrime32_1;
+    }
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("avx2")))
+void AccumulateAvx2(uint64_t* acc, const uint8_t* input, const uint8_t* secret,
+                    size_t stripes) {
+    auto* lanes = reinterpret_cast<__m256i*>(acc);
+    __m256i acc0 = _mm256_load_si256(lanes);
+    __m256i acc1 = _mm256_load_si256(lanes + 1);
+    for (size_t s = 0; s < stripes; ++s) {
+        const auto* in = reinterpret_cast<const __m256i*>(input + s * kStripeBytes);
+        const auto* key = reinterpret_cast<const __m256i*>(secret + s * 8);
+        for (int half = 0; half < 2; ++half) {
+            __m256i value = _mm256_loadu_si256(in + half);
+            __m256i keyed = _mm256_xor_si256(value, _mm256_loadu_si256(key + half));
+            __m256i product = _mm256_mul_epu32(keyed, _mm256_srli_epi64(keyed, 32));
+            __m256i swapped = _mm256_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2));
+            __m256i& target = half == 0 ? acc0 : acc1;
+            target = _mm256_add_epi64(target, _mm256_add_epi64(product, swapped));
+        }
+    }
+    _mm256_store_si256(lanes, acc0);
+    _mm256_store_si256(lanes + 1, acc1);
+}
+
+__attribute__((target("avx2")))
+void ScrambleAvx2(uint64_t* acc, const uint8_t* secret) {
+    auto* lanes = reinterpret_cast<__m256i*>(acc);
+    const __m256i prime = _mm256_set1_epi32(static_cast<int>(kPrime32_1));
+    for (int half = 0; half < 2; ++half) {
+        __m256i value = _mm256_load_si256(lanes + half);
+        value = _mm256_xor_si256(value, _mm256_srli_epi64(value, 47));
+        value = _mm256_xor_si256(
+            value, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(secret) + half));
+        __m256i low = _mm256_mul_epu32(value, prime);
+        __m256i high = _mm256_mul_epu32(_mm256_srli_epi64(value, 32), prime);
+        _mm256_store_si256(lanes + half, _mm256_add_epi64(low, _mm256_slli_epi64(high, 32)));
+    }
+}
+
+// GCC 12 warns about _mm512_undefined_epi32() inside its own intrinsics
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+__attribute__((target("avx512f")))
+void AccumulateAvx512(uint64_t* acc, const uint8_t* input, const uint8_t* secret,
+                      size_t stripes) {
+    __m512i lanes = _mm512_load_si512(acc);
+    for (size_t s = 0; s < stripes; ++s) {
+        __m512i value = _mm512_loadu_si512(input + s * kStripeBytes);
+        __m512i keyed = _mm512_xor_si512(value, _mm512_loadu_si512(secret + s * 8));
+        __m512i product = _mm512_mul_epu32(keyed, _mm512_srli_epi64(keyed, 32));
+        __m512i swapped =
+            _mm512_shuffle_epi32(value, static_cast<_MM_PERM_ENUM>(_MM_SHUFFLE(1, 0, 3, 2)));
+        lanes = _mm512_add_epi64(lanes, _mm512_add_epi64(product, swapped));
+    }
+    _mm512_store_si512(acc, lanes);
+}
+
+__attribute__((target("avx512f")))
+void ScrambleAvx512(uint64_t* acc, const uint8_t* secret) {
+    const __m512i prime = _mm512_set1_epi32(static_cast<int>(kPrime32_1));
+    __m512i value = _mm512_load_si512(acc);
+    value = _mm512_xor_si512(value, _mm512_srli_epi64(value, 47));
+    value = _mm512_xor_si512(value, _mm512_loadu_si512(secret));
+    __m512i low = _mm512_mul_epu32(value, prime);
+    __m512i high = _mm512_mul_epu32(_mm512_srli_epi64(value, 32), prime);
+    _mm512_store_si512(acc, _mm512_add_epi64(low, _mm512_slli_epi64(high, 32)));
+}
+
+#pragma GCC diagnostic pop
+
+#endif
+
+struct Kernels {
+    AccumulateFn accumulate;
+    ScrambleFn scramble;
+    const char* name;
+};
+
+const Kernels& SelectedKernels() {
+    static const Kernels kernels = []() -> Kernels {
+#if defined(__x86_64__)
+        if (__builtin_cpu_supports("avx512f")) {
+            return {AccumulateAvx512, ScrambleAvx512, "avx512"};
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            return {AccumulateAvx2, ScrambleAvx2, "avx2"};
+        }
+#endif
+        return {AccumulateScalar, ScrambleScalar, "scalar"};
+    }();
+    return kernels;
+}
+
+}  // namespace
+
+ContentHasher::ContentHasher() {
+    Reset();
+}
+
+void ContentHasher::Reset() {
+    acc_ = {kPrime32_3, kPrime64_1, kPrime64_2, kPrime64_3,
+            kPrime64_4, kPrime32_2, kPrime64_5, kPrime32_1};
+    total_ = 0;
+    stripes_in_block_ = 0;
+    long_ = false;
+    pending_size_ = 0;
+}
+
+void ContentHasher::Update(const void* data, size_t size) {
+    const auto* bytes = static_cast<const uint8_t*>(data);
+    if (!long_) {
+        if (total_ + size <= kShortInputBytes) {
+            std::memcpy(short_.data() + total_, bytes, size);
+            total_ += size;
+            return;
+        }
+        SwitchToLong();
+    }
+    total_ += size;
+    Consume(bytes, size);
+}
+
+void ContentHasher::SwitchToLong() {
+    long_ = true;
+    Consume(short_.data(), total_);
+}
+
+void ContentHasher::Consume(const uint8_t* data, size_t size) {
+    const auto& kernels = SelectedKernels();
+    auto consume_stripes = [&](const uint8_t* input, size_t stripes) {
+        while (stripes > 0) {
+            size_t take = std::min(stripes, kStripesPerBlock - stripes_in_block_);
+            kernels.accumulate(acc_.data(), input, kSecret + stripes_in_block_ * 8, take);
+            input += take * kStripeBytes;
+            stripes -= take;
+            stripes_in_block_ += take;
+            if (stripes_in_block_ == kStripesPerBlock) {
+                kernels.scramble(acc_.data(), kSecret + kSecretBytes - kStripeBytes);
+                stripes_in_block_ = 0;
+            }
+        }
+    };
+
+    while (size > 0) {
+        if (pending_size_ == kStripeBytes) {
+            consume_stripes(pending_.data(), 1);
+            previous_ = pending_;
+            pending_size_ = 0;
+        }
+        if (pending_size_ == 0 && size > kStripeBytes) {
+            size_t stripes = (size - 1) / kStripeBytes;
+            consume_stripes(data, stripes);
+            std::memcpy(previous_.data(), data + (stripes - 1) * kStripeBytes, kStripeBytes);
+            data += stripes * kStripeBytes;
+            size -= stripes * kStripeBytes;
+            continue;
+        }
+        size_t take = std::min(size, kStripeBytes - pending_size_);
+        std::memcpy(pending_.data() + pending_size_, data, take);
+        pending_size_ += take;
+        data += take;
+        size -= take;
+    }
+}
+
+uint64_t ContentHasher::Digest() const {
+    if (!long_) {
+        return HashShort(short_.data(), total_);
+    }
+
+    // The last stripe is the final 64 bytes of input, which may begin inside
+    // the previously consumed stripe
+    alignas(64) std::array<uint8_t, kStripeBytes> last;
+    size_t from_previous = kStripeBytes - pending_size_;
+    std::memcpy(last.data(), previous_.data() + pending_size_, from_previous);
+    std::memcpy(last.data() + from_previous, pending_.data(), pending_size_);
+
+    alignas(64) std::array<uint64_t, 8> acc = acc_;
+    AccumulateScalar(acc.data(), last.data(), kSecret + kSecretBytes - kStripeBytes - 7, 1);
+
+    uint64_t result = total_ * kPrime64_1;
+    for (size_t i = 0; i < 4; ++i) {
+        const uint8_t* secret = kSecret + 11 + 16 * i;
+        result += MulFold64(acc[2 * i] ^ Read64(secret), acc[2 * i + 1] ^ Read64(secret + 8));
+    }
+    return Avalanche(result);
+}
+
+uint64_t HashContent(const void* data, size_t size) {
+    ContentHasher hasher;
+    hasher.Update(data, size);
+    return hasher.Digest();
+}
+
+const char* ContentHashImplementation() {
+    return SelectedKernels().name;
+}
+
+}  // namespace synxpo
@@ -0,0 +1,374 @@
+#include "synxpo/common/delta.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "synxpo/common/content_hash.h"
+
+namespace synxpo {
+
+namespace {
+
+constexpr uint64_t kMinBlockBytes = 2048;
+constexpr uint64_t kMaxBlocks = 1 << 17;
+constexpr size_t kRollBatch = 256;
+
+inline uint32_t Pack(uint32_t a, uint32_t b) {
+    return (a & 0xFFFF) | (b << 16);
+}
+
+#if defined(__SSE2__)
+// Inclusive prefix sum of eight 16-bit lanes
+inline __m128i PrefixSum(__m128i v) {
+    v = _mm_add_epi16(v, _mm_slli_si128(v, 2));
+    v = _mm_add_epi16(v, _mm_slli_si128(v, 4));
+    return _mm_add_epi16(v, _mm_slli_si128(v, 8));
+}
+
+inline __m128i BroadcastLast(__m128i v) {
+    return _mm_shuffle_epi32(_mm_shufflehi_epi16(v, 0xFF), 0xFF);
+}
+#endif
+
+// Checksums of the `count` windows of `n` bytes that follow the window at
+// `data`, whose sums are (a, b); leaves (a, b) at the last of them. Needs
+// `count + n` bytes at `data`. Since everything is mod 2^16, eight steps of
+// the roll are two prefix sums over 16-bit lanes.
+void Roll(const uint8_t* data, size_t n, size_t count, uint32_t& a, uint32_t& b,
+          uint32_t* out) {
+    size_t j = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i weight = _mm_set1_epi16(static_cast<int16_t>(n));
+    __m128i va = _mm_set1_epi16(static_cast<int16_t>(a));
+    __m128i vb = _mm_set1_epi16(static_cast<int16_t>(b));
+    for (; j + 8 <= count; j += 8) {
+        __m128i leaving = _mm_unpacklo_epi8(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(data + j)), zero);
+        __m128i entering = _mm_unpacklo_epi8(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(data + j + n)), zero);
+        // a' = a + in - out, then b' = b + a' - n * out
+        va = _mm_add_epi16(va, PrefixSum(_mm_sub_epi16(entering, leaving)));
+        __m128i steps = _mm_sub_epi16(va, _mm_mullo_epi16(leaving, weight));
+        vb = _mm_add_epi16(vb, PrefixSum(steps));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + j), _mm_unpacklo_epi16(va, vb));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + j + 4), _mm_unpackhi_epi16(va, vb));
+        va = BroadcastLast(va);
+        vb = BroadcastLast(vb);
+    }
+    a = static_cast<uint16_t>(_mm_cvtsi128_si32(va));
+    b = static_cast<uint16_t>(_mm_cvtsi128_si32(vb));
+#endif
+    for (; j < count; ++j) {
+        uint32_t leaving = data[j];
+        a += data[j + n] - leaving;
+        b += a - static_cast<uint32_t>(n) * leaving;
+        out[j] = Pack(a, b);
+    }
+    a &= 0xFFFF;
+    b &= 0xFFFF;
+}
+
+}  // namespace
+
+uint32_t DeltaBlockSize(uint64_t file_size) {
+    auto root = static_cast<uint64_t>(std::sqrt(static_cast<double>(file_size)));
+    uint64_t size = std::max({kMinBlockBytes, root, (file_size + kMaxBlocks - 1) / kMaxBlocks});
+    size = (size + 1023) / 1024 * 1024;
+    return static_cast<uint32_t>(std::min<uint64_t>(size, std::numeric_limits<uint32_t>::max() / 2));
+}
+
+uint32_t WeakChecksum(const void* data, size_t size) {
+    const auto* bytes = static_cast<const uint8_t*>(data);
+    uint32_t a = 0;
+    uint32_t b = 0;
+    size_t i = 0;
+#if defined(__SSE2__)
+    // As in SIMD Adler-32: per 16 bytes, b gains 16 * a of everything before
+    // and the bytes weighted 16..1, a gains their sum. Lanes wrap mod 2^32,
+    // which keeps the low 16 bits exact.
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i weights_low = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+    const __m128i weights_high = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+    __m128i va = zero;
+    __m128i vb = zero;
+    for (; i + 16 <= size; i += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + i));
+        vb = _mm_add_epi32(vb, _mm_slli_epi32(va, 4));
+        vb = _mm_add_epi32(vb, _mm_madd_epi16(_mm_unpacklo_epi8(chunk, zero), weights_low));
+        vb = _mm_add_epi32(vb, _mm_madd_epi16(_mm_unpackhi_epi8(chunk, zero), weights_high));
+        va = _mm_add_epi32(va, _mm_sad_epu8(chunk, zero));
+    }
+    uint32_t lanes[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), va);
+    a = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), vb);
+    b = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+    for (; i < size; ++i) {
+        a += bytes[i];
+        b += a;
+    }
+    return Pack(a, b);
+}
+
+SignatureBuilder::SignatureBuilder(uint32_t block_size)
+    : block_size_(std::max<uint32_t>(block_size, 1)) {}
+
+void SignatureBuilder::Update(const void* data, size_t size) {
+    const auto* bytes = static_cast<const uint8_t*>(data);
+    while (size > 0) {
+        // Whole blocks are signed in place
+        if (block_.empty() && size >= block_size_) {
+            signatures_.push_back({WeakChecksum(bytes, block_size_), HashContent(bytes, block_size_)});
+            bytes += block_size_;
+            size -= block_size_;
+            continue;
+        }
+        size_t take = std::min<size_t>(block_size_ - block_.size(), size);
+        block_.append(reinterpret_cast<const char*>(bytes), take);
+        bytes += take;
+        size -= take;
+        if (block_.size() == block_size_) {
+            signatures_.push_back(
+                {WeakChecksum(block_.data(), block_.size()), HashContent(block_.data(), block_.size())});
+            block_.clear();
+        }
+    }
+}
+
+std::vector<BlockSignature> SignatureBuilder::Finish() {
+    if (!block_.empty()) {
+        signatures_.push_back(
+            {WeakChecksum(block_.data(), block_.size()), HashContent(block_.data(), block_.size())});
+        block_.clear();
+    }
+    return std::move(signatures_);
+}
+
+DeltaEncoder::DeltaEncoder(uint32_t block_size, uint64_t base_size,
+                           std::vector<BlockSignature> signatures, size_t max_literal)
+    : block_size_(std::max<uint32_t>(block_size, 1)),
+      max_literal_(std::max<size_t>(max_literal, 1)),
+      signatures_(std::move(signatures)) {
+    uint64_t full_blocks = base_size / block_size_;
+    tail_size_ = base_size % block_size_;
+    // Signatures that do not describe `base_size` bytes are useless; the
+    // content then goes out as literals only
+    if (signatures_.size() != full_blocks + (tail_size_ > 0 ? 1 : 0) ||
+        signatures_.size() > std::numeric_limits<uint32_t>::max()) {
+        signatures_.clear();
+        full_blocks = 0;
+        tail_size_ = 0;
+    }
+
+    // About four buckets per block
+    int bits = 8;
+    while (bits < 24 && (uint64_t{1} << bits) < full_blocks * 4) {
+        ++bits;
+    }
+    bucket_shift_ = 32 - bits;
+    // Eight times as many bits as buckets, in 64-bit words
+    filter_shift_ = 32 - (bits + 3 - 6);
+    bucket_start_.assign((size_t{1} << bits) + 1, 0);
+    filter_.assign(size_t{1} << (bits + 3 - 6), 0);
+    for (uint64_t block = 0; block < full_blocks; ++block) {
+        uint32_t weak = signatures_[block].weak;
+        ++bucket_start_[Bucket(weak) + 1];
+        filter_[FilterWord(weak)] |= FilterMask(weak);
+    }
+    for (size_t i = 1; i < bucket_start_.size(); ++i) {
+        bucket_start_[i] += bucket_start_[i - 1];
+    }
+    entries_.resize(full_blocks);
+    std::vector<uint32_t> next(bucket_start_.begin(), bucket_start_.end() - 1);
+    for (uint64_t block = 0; block < full_blocks; ++block) {
+        uint32_t weak = signatures_[block].weak;
+        entries_[next[Bucket(weak)]++] = {weak, static_cast<uint32_t>(block)};
+    }
+}
+
+int64_t DeltaEncoder::Find(uint32_t weak, const uint8_t* window, size_t length) const {
+    size_t bucket = Bucket(weak);
+    bool hashed = false;
+    uint64_t strong = 0;
+    int64_t found = -1;
+    for (uint32_t i = bucket_start_[bucket]; i < bucket_start_[bucket + 1]; ++i) {
+        const auto& entry = entries_[i];
+        if (entry.weak != weak) {
+            continue;
+        }
+        if (!hashed) {
+            strong = HashContent(window, length);
+            hashed = true;
+        }
+        if (signatures_[entry.block].strong != strong) {
+            continue;
+        }
+        // Repeated blocks (runs of zeros) should continue the current run
+        if (run_count_ > 0 && entry.block == run_first_ + run_count_) {
+            return entry.block;
+        }
+        if (found < 0) {
+            found = entry.block;
+        }
+    }
+    return found;
+}
+
+void DeltaEncoder::Update(const void* data, size_t size, const Emit& emit) {
+    const auto* bytes = static_cast<const uint8_t*>(data);
+    buffer_.insert(buffer_.end(), bytes, bytes + size);
+    Scan(emit);
+
+    // Keep only the bytes still needed: the window and what follows it
+    EmitLiteral(position_, emit);
+    buffer_.erase(buffer_.begin(), buffer_.begin() + static_cast<std::ptrdiff_t>(position_));
+    position_ = 0;
+    literal_start_ = 0;
+}
+
+void DeltaEncoder::Scan(const Emit& emit) {
+    const size_t n = block_size_;
+    uint32_t weaks[kRollBatch];
+    while (position_ + n <= buffer_.size()) {
+        const uint8_t* data = buffer_.data();
+        int64_t block = -1;
+        size_t skip = 0;
+
+        if (!rolling_) {
+            uint32_t weak = WeakChecksum(data + position_, n);
+            a_ = weak & 0xFFFF;
+            b_ = weak >> 16;
+            rolling_ = true;
+            if (MayMatch(weak)) {
+                block = Find(weak, data + position_, n);
+            }
+        }
+
+        if (block < 0) {
+            size_t count = std::min(kRollBatch, buffer_.size() - n - position_);
+            if (count == 0) {
+                break;
+            }
+            Roll(data + position_, n, count, a_, b_, weaks);
+            for (skip = 1; skip <= count; ++skip) {
+                uint32_t weak = weaks[skip - 1];
+                if (MayMatch(weak)) {
+                    block = Find(weak, data + position_ + skip, n);
+                    if (block >= 0) {
+                        break;
+                    }
+                }
+            }
+            if (block < 0) {
+                position_ += count;
+                while (position_ - literal_start_ >= max_literal_) {
+                    EmitLiteral(literal_start_ + max_literal_, emit);
+                }
+                continue;
+            }
+        }
+
+        position_ += skip;
+        EmitLiteral(position_, emit);
+        EmitBlock(static_cast<uint64_t>(block), emit);
+        matched_bytes_ += n;
+        position_ += n;
+        literal_start_ = position_;
+        rolling_ = false;
+    }
+}
+
+void DeltaEncoder::Finish(const Emit& emit) {
+    // A short last block of the old version can only match at the very end
+    if (tail_size_ > 0 && buffer_.size() - literal_start_ >= tail_size_) {
+        size_t start = buffer_.size() - tail_size_;
+        const uint8_t* window = buffer_.data() + start;
+        const auto& last = signatures_.back();
+        if (WeakChecksum(window, tail_size_) == last.weak &&
+            HashContent(window, tail_size_) == last.strong) {
+            EmitLiteral(start, emit);
+            EmitBlock(signatures_.size() - 1, emit);
+            matched_bytes_ += tail_size_;
+            literal_start_ = buffer_.size();
+        }
+    }
+    EmitLiteral(buffer_.size(), emit);
+    FlushBlocks(emit);
+
+    buffer_.clear();
+    position_ = 0;
+    literal_start_ = 0;
+    rolling_ = false;
+}
+
+void DeltaEncoder::EmitLiteral(size_t end, const Emit& emit) {
+    if (end <= literal_start_) {
+        return;
+    }
+    FlushBlocks(emit);
+    while (literal_start_ < end) {
+        size_t length = std::min(end - literal_start_, max_literal_);
+        DeltaOp op;
+        op.literal.assign(reinterpret_cast<const char*>(buffer_.data() + literal_start_), length);
+        literal_bytes_ += length;
+        literal_start_ += length;
+        emit(std::move(op));
+    }
+}
+
+void DeltaEncoder::EmitBlock(uint64_t block, const Emit& emit) {
+    if (run_count_ > 0 && block == run_first_ + run_count_) {
+        ++run_count_;
+        return;
+    }
+    FlushBlocks(emit);
+    run_first_ = block;
+    run_count_ = 1;
+}
+
+void DeltaEncoder::FlushBlocks(const Emit& emit) {
+    if (run_count_ == 0) {
+        return;
+    }
+    DeltaOp op;
+    op.first_block = run_first_;
+    op.block_count = run_count_;
+    run_count_ = 0;
+    emit(std::move(op));
+}
+
+void AddDeltaOp(DeltaOp op, FileDelta* delta) {
+    auto* added = delta->add_ops();
+    if (!op.literal.empty()) {
+        added->set_literal(std::move(op.literal));
+    } else {
+        added->mutable_blocks()->set_first(op.first_block);
+        added->mutable_blocks()->set_count(op.block_count);
+    }
+}
+
+size_t DeltaLiteralBytes(const FileDelta& delta) {
+    size_t bytes = 0;
+    for (const auto& op : delta.ops()) {
+        bytes += op.literal().size();
+    }
+    return bytes;
+}
+
+std::string_view DeltaPayload(const FileDelta& delta) {
+    for (const auto& op : delta.ops()) {
+        if (op.has_literal()) {
+            return op.literal();
+        }
+    }
+    return {};
+}
+
+}  // namespace synxpo
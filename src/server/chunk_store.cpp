@@ -0,0 +1,511 @@
+#include "synxpo/server/chunk_store.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <iostream>
+#include <unordered_set>
+
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_format.h>
+
+#include "synxpo/common/content_hash.h"
+
+namespace synxpo {
+
+namespace {
+
+constexpr char kMagic[8] = {'S', 'X', 'P', 'O', 'M', 'N', 'F', 'T'};
+constexpr uint32_t kFormatVersion = 1;
+constexpr size_t kMaxKeyBytes = 128;
+constexpr const char* kTempSuffix = ".tmp";
+
+// Manifests are only read back by the server that wrote them, so integers
+// are stored in host byte order
+struct StoredHeader {
+    char magic[8];
+    uint32_t format_version;
+    uint32_t reserved;
+    uint64_t count;
+};
+
+struct StoredRef {
+    uint64_t hash;
+    uint32_t size;
+    uint32_t reserved;
+};
+
+absl::Status ErrnoError(const char* what, const std::filesystem::path& path) {
+    return absl::InternalError(
+        absl::StrCat(what, " ", path.string(), ": ", std::strerror(errno)));
+}
+
+// Makes entries created, renamed or removed in `dir` survive a power loss
+absl::Status SyncDirectory(const std::filesystem::path& dir) {
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return ErrnoError("Failed to open", dir);
+    }
+    auto status = ::fsync(fd) == 0 ? absl::OkStatus() : ErrnoError("Failed to sync", dir);
+    ::close(fd);
+    return status;
+}
+
+// Writes `data` to a temporary file next to `target`, syncs it and renames it
+// into place, so a crash leaves either the old content or the new one. The
+// rename itself is durable once this returns.
+absl::Status WriteDurably(const std::filesystem::path& target, std::string_view data) {
+    static std::atomic<uint64_t> next_temp{0};
+    auto temp = target;
+    temp += absl::StrCat(".", ::getpid(), "-", next_temp++, kTempSuffix);
+    int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return ErrnoError("Failed to create", temp);
+    }
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            auto status = ErrnoError("Failed to write", temp);
+            ::close(fd);
+            ::unlink(temp.c_str());
+            return status;
+        }
+        done += static_cast<size_t>(n);
+    }
+    if (::fdatasync(fd) != 0) {
+        auto status = ErrnoError("Failed to sync", temp);
+        ::close(fd);
+        ::unlink(temp.c_str());
+        return status;
+    }
+    ::close(fd);
+    if (::rename(temp.c_str(), target.c_str()) != 0) {
+        auto status = ErrnoError("Failed to rename", temp);
+        ::unlink(temp.c_str());
+        return status;
+    }
+    return SyncDirectory(target.parent_path());
+}
+
+absl::Status ReadWhole(const std::filesystem::path& path, std::string* data) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return errno == ENOENT ? absl::NotFoundError(absl::StrCat(path.string(), " not found"))
+                               : ErrnoError("Failed to open", path);
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        auto status = ErrnoError("Failed to stat", path);
+        ::close(fd);
+        return status;
+    }
+    data->resize(static_cast<size_t>(st.st_size));
+    size_t done = 0;
+    while (done < data->size()) {
+        ssize_t n = ::pread(fd, data->data() + done, data->size() - done,
+                            static_cast<off_t>(done));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            auto status = n < 0 ? ErrnoError("Failed to read", path)
+                                : absl::DataLossError(absl::StrCat(path.string(), " is truncated"));
+            ::close(fd);
+            return status;
+        }
+        done += static_cast<size_t>(n);
+    }
+    ::close(fd);
+    return absl::OkStatus();
+}
+
+// Chunk files are named <hash as 16 hex digits>-<size>
+bool ParseChunkName(const std::string& name, ChunkRef* ref) {
+    if (name.size() < 18 || name[16] != '-') {
+        return false;
+    }
+    const char* end = name.data() + name.size();
+    auto hash = std::from_chars(name.data(), name.data() + 16, ref->hash, 16);
+    auto size = std::from_chars(name.data() + 17, end, ref->size);
+    return hash.ec == std::errc() && hash.ptr == name.data() + 16 &&
+           size.ec == std::errc() && size.ptr == end;
+}
+
+bool EndsWith(const std::string& name, std::string_view suffix) {
+    return name.size() >= suffix.size() &&
+           name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+}  // namespace
+
+absl::StatusOr<std::unique_ptr<ChunkStore>> ChunkStore::Open(const std::filesystem::path& path) {
+    std::error_code error;
+    std::filesystem::create_directories(path / "chunks", error);
+    if (!error) {
+        std::filesystem::create_directories(path / "manifests", error);
+    }
+    if (error) {
+        return absl::InternalError(
+            absl::StrCat("Failed to create ", path.string(), ": ", error.message()));
+    }
+    auto synced = SyncDirectory(path);
+    if (!synced.ok()) {
+        return synced;
+    }
+
+    std::unique_ptr<ChunkStore> store(new ChunkStore(path));
+    auto status = store->Load();
+    if (!status.ok()) {
+        return status;
+    }
+    return store;
+}
+
+ChunkStore::ChunkStore(std::filesystem::path path) : path_(std::move(path)) {}
+
+absl::Status ChunkStore::Load() {
+    std::error_code error;
+    for (const auto& item : std::filesystem::directory_iterator(path_ / "manifests", error)) {
+        auto name = item.path().filename().string();
+        if (EndsWith(name, kTempSuffix)) {
+            std::filesystem::remove(item.path(), error);
+            continue;
+        }
+        auto refs = ReadManifest(item.path());
+        if (!refs.ok()) {
+            // Dropping it would free chunks other files may still need
+            return refs.status();
+        }
+        for (const auto& ref : *refs) {
+            ++chunks_[ref].references;
+            stats_.referenced_bytes += ref.size;
+        }
+        ++stats_.manifests;
+    }
+    if (error) {
+        return absl::InternalError(absl::StrCat("Failed to list manifests in ", path_.string(),
+                                                ": ", error.message()));
+    }
+
+    uint64_t orphans = 0;
+    for (const auto& item :
+         std::filesystem::recursive_directory_iterator(path_ / "chunks", error)) {
+        if (!item.is_regular_file()) {
+            continue;
+        }
+        ChunkRef ref;
+        auto name = item.path().filename().string();
+        auto entry = ParseChunkName(name, &ref) ? chunks_.find(ref) : chunks_.end();
+        if (entry == chunks_.end()) {
+            // A temporary file or a chunk of an upload that never finished
+            std::filesystem::remove(item.path(), error);
+            ++orphans;
+            continue;
+        }
+        entry->second.stored = true;
+        ++stats_.chunks;
+        stats_.stored_bytes += ref.size;
+    }
+    if (error) {
+        return absl::InternalError(absl::StrCat("Failed to list chunks in ", path_.string(),
+                                                ": ", error.message()));
+    }
+
+    uint64_t lost = 0;
+    for (const auto& [ref, entry] : chunks_) {
+        lost += entry.stored ? 0 : 1;
+    }
+    if (orphans > 0 || lost > 0) {
+        std::cerr << "Chunk store " << path_ << ": removed " << orphans
+                  << " unreferenced chunks, " << lost << " referenced chunks are missing"
+                  << std::endl;
+    }
+    return absl::OkStatus();
+}
+
+std::vector<uint32_t> ChunkStore::Acquire(const std::vector<ChunkRef>& refs) {
+    std::vector<uint32_t> missing;
+    std::unordered_set<ChunkRef, ChunkRefHash> asked;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < refs.size(); ++i) {
+        auto& entry = chunks_[refs[i]];
+        ++entry.pins;
+        if (!entry.stored && asked.insert(refs[i]).second) {
+            missing.push_back(static_cast<uint32_t>(i));
+        }
+    }
+    stats_.chunks_offered += refs.size();
+    stats_.chunks_found += refs.size() - asked.size();
+    return missing;
+}
+
+absl::Status ChunkStore::Put(const ChunkRef& ref, std::string_view data) {
+    if (data.size() != ref.size || HashContent(data.data(), data.size()) != ref.hash) {
+        return absl::InvalidArgumentError(
+            absl::StrFormat("Chunk %016x-%u does not match its content", ref.hash, ref.size));
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto entry = chunks_.find(ref);
+        if (entry == chunks_.end() || entry->second.pins == 0) {
+            return absl::FailedPreconditionError(
+                absl::StrFormat("Chunk %016x-%u is not pinned", ref.hash, ref.size));
+        }
+        if (entry->second.stored) {
+            return absl::OkStatus();
+        }
+    }
+
+    // Two uploads may write the same chunk; both write the same bytes
+    auto path = ChunkPath(ref);
+    std::error_code error;
+    bool created = std::filesystem::create_directories(path.parent_path(), error);
+    if (error) {
+        return absl::InternalError(
+            absl::StrCat("Failed to create ", path.parent_path().string(), ": ", error.message()));
+    }
+    if (created) {
+        auto status = SyncDirectory(path.parent_path().parent_path());
+        if (!status.ok()) {
+            return status;
+        }
+    }
+    auto status = WriteDurably(path, data);
+    if (!status.ok()) {
+        return status;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto entry = chunks_.find(ref);
+    if (entry == chunks_.end()) {
+        // Released while it was written. Nobody else holds a pin, so nobody
+        // else can be writing it either.
+        ::unlink(path.c_str());
+        return absl::FailedPreconditionError(
+            absl::StrFormat("Chunk %016x-%u was released while being stored", ref.hash, ref.size));
+    }
+    if (!entry->second.stored) {
+        entry->second.stored = true;
+        ++stats_.chunks;
+        stats_.stored_bytes += ref.size;
+    }
+    return absl::OkStatus();
+}
+
+void ChunkStore::Release(const std::vector<ChunkRef>& refs) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& ref : refs) {
+        auto entry = chunks_.find(ref);
+        if (entry != chunks_.end() && entry->second.pins > 0) {
+            --entry->second.pins;
+            RemoveIfUnused(ref);
+        }
+    }
+}
+
+absl::Status ChunkStore::Read(const ChunkRef& ref, std::string* data) const {
+    auto status = ReadWhole(ChunkPath(ref), data);
+    if (!status.ok()) {
+        return status;
+    }
+    if (data->size() != ref.size || HashContent(data->data(), data->size()) != ref.hash) {
+        return absl::DataLossError(
+            absl::StrFormat("Chunk %016x-%u is corrupted", ref.hash, ref.size));
+    }
+    return absl::OkStatus();
+}
+
+absl::Status ChunkStore::PutManifest(const std::string& key, const std::vector<ChunkRef>& refs) {
+    auto path = ManifestPath(key);
+    if (!path.ok()) {
+        return path.status();
+    }
+
+    std::lock_guard<std::mutex> writer(manifest_mutex_);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& ref : refs) {
+            auto entry = chunks_.find(ref);
+            if (entry == chunks_.end() || !entry->second.stored) {
+                return absl::FailedPreconditionError(
+                    absl::StrFormat("Chunk %016x-%u is not stored", ref.hash, ref.size));
+            }
+        }
+    }
+
+    std::vector<ChunkRef> previous;
+    auto old = ReadManifest(*path);
+    if (old.ok()) {
+        previous = std::move(*old);
+    } else if (!absl::IsNotFound(old.status())) {
+        return old.status();
+    }
+
+    std::string data(sizeof(StoredHeader) + refs.size() * sizeof(StoredRef) + sizeof(uint64_t),
+                     '\0');
+    StoredHeader header{};
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.format_version = kFormatVersion;
+    header.count = refs.size();
+    std::memcpy(data.data(), &header, sizeof(header));
+    for (size_t i = 0; i < refs.size(); ++i) {
+        StoredRef stored{refs[i].hash, refs[i].size, 0};
+        std::memcpy(data.data() + sizeof(header) + i * sizeof(StoredRef), &stored, sizeof(stored));
+    }
+    // Checksum of everything before it
+    uint64_t checksum = HashContent(data.data(), data.size() - sizeof(uint64_t));
+    std::memcpy(data.data() + data.size() - sizeof(uint64_t), &checksum, sizeof(checksum));
+
+    // Referenced before the manifest exists, so no chunk of it can go away
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& ref : refs) {
+            ++chunks_[ref].references;
+            stats_.referenced_bytes += ref.size;
+        }
+    }
+    auto status = WriteDurably(*path, data);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!status.ok()) {
+        Unreference(refs);
+        return status;
+    }
+    Unreference(previous);
+    if (!old.ok()) {
+        ++stats_.manifests;
+    }
+    return absl::OkStatus();
+}
+
+absl::StatusOr<std::vector<ChunkRef>> ChunkStore::GetManifest(const std::string& key) const {
+    auto path = ManifestPath(key);
+    if (!path.ok()) {
+        return path.status();
+    }
+    return ReadManifest(*path);
+}
+
+absl::Status ChunkStore::RemoveManifest(const std::string& key) {
+    auto path = ManifestPath(key);
+    if (!path.ok()) {
+        return path.status();
+    }
+
+    std::lock_guard<std::mutex> writer(manifest_mutex_);
+    auto refs = ReadManifest(*path);
+    if (!refs.ok()) {
+        return refs.status();
+    }
+    if (::unlink(path->c_str()) != 0) {
+        return ErrnoError("Failed to remove", *path);
+    }
+    // Otherwise the manifest could come back after a crash without the
+    // chunks removed below
+    auto status = SyncDirectory(path->parent_path());
+    if (!status.ok()) {
+        return status;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    Unreference(*refs);
+    --stats_.manifests;
+    return absl::OkStatus();
+}
+
+ChunkStoreStats ChunkStore::GetStats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+std::filesystem::path ChunkStore::ChunkPath(const ChunkRef& ref) const {
+    // 256 subdirectories by the top byte keep directories small
+    return path_ / "chunks" / absl::StrFormat("%02x", ref.hash >> 56) /
+           absl::StrFormat("%016x-%u", ref.hash, ref.size);
+}
+
+absl::StatusOr<std::filesystem::path> ChunkStore::ManifestPath(const std::string& key) const {
+    bool valid = !key.empty() && key.size() <= kMaxKeyBytes && key[0] != '.';
+    for (char c : key) {
+        valid = valid && (std::isalnum(static_cast<unsigned char>(c)) || c == '-' || c == '_' ||
+                          c == '.');
+    }
+    if (!valid || EndsWith(key, kTempSuffix)) {
+        return absl::InvalidArgumentError(absl::StrCat("Invalid manifest key: ", key));
+    }
+    return path_ / "manifests" / key;
+}
+
+absl::StatusOr<std::vector<ChunkRef>> ChunkStore::ReadManifest(
+    const std::filesystem::path& path) const {
+    std::string data;
+    auto status = ReadWhole(path, &data);
+    if (!status.ok()) {
+        return status;
+    }
+
+    StoredHeader header;
+    if (data.size() < sizeof(header) + sizeof(uint64_t)) {
+        return absl::DataLossError(absl::StrCat(path.string(), " is truncated"));
+    }
+    std::memcpy(&header, data.data(), sizeof(header));
+    uint64_t checksum;
+    std::memcpy(&checksum, data.data() + data.size() - sizeof(checksum), sizeof(checksum));
+    if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+        header.format_version != kFormatVersion ||
+        data.size() != sizeof(header) + header.count * sizeof(StoredRef) + sizeof(checksum) ||
+        HashContent(data.data(), data.size() - sizeof(checksum)) != checksum) {
+        return absl::DataLossError(absl::StrCat(path.string(), " is not a valid manifest"));
+    }
+
+    std::vector<ChunkRef> refs(header.count);
+    for (size_t i = 0; i < refs.size(); ++i) {
+        StoredRef stored;
+        std::memcpy(&stored, data.data() + sizeof(header) + i * sizeof(StoredRef), sizeof(stored));
+        refs[i] = {stored.hash, stored.size};
+    }
+    return refs;
+}
+
+void ChunkStore::Unreference(const std::vector<ChunkRef>& refs) {
+    for (const auto& ref : refs) {
+        auto entry = chunks_.find(ref);
+        if (entry == chunks_.end() || entry->second.references == 0) {
+            continue;
+        }
+        --entry->second.references;
+        stats_.referenced_bytes -= ref.size;
+        RemoveIfUnused(ref);
+    }
+}
+
+void ChunkStore::RemoveIfUnused(const ChunkRef& ref) {
+    auto entry = chunks_.find(ref);
+    if (entry == chunks_.end() || entry->second.references > 0 || entry->second.pins > 0) {
+        return;
+    }
+    if (entry->second.stored) {
+        // Under mutex_, so a concurrent Acquire cannot see it as stored
+        // while it is being removed
+        std::error_code error;
+        std::filesystem::remove(ChunkPath(ref), error);
+        if (error) {
+            std::cerr << "Failed to remove chunk " << ChunkPath(ref) << ": " << error.message()
+                      << std::endl;
+        }
+        --stats_.chunks;
+        stats_.stored_bytes -= ref.size;
+    }
+    chunks_.erase(entry);
+}
+
+}  // namespace synxpo
@@ -1,30 +1,109 @@
+#include <chrono>
+#include <condition_variable>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <thread>
 
 #include <grpcpp/grpcpp.h>
 #include "synxpo.grpc.pb.h"
+#include "synxpo/common/compression.h"
+#include "synxpo/common/delta.h"
 
 using grpc::Server;
 using grpc::ServerBuilder;
 using grpc::ServerContext;
 using grpc::Status;
 
+namespace {
+
+// How often the compression stats are printed, when anything was sent
+constexpr std::chrono::seconds kStatsInterval{60};
+
+}  // namespace
+
 class SyncServiceImpl final : public synxpo::SyncService::Service {
+public:
+    explicit SyncServiceImpl(const synxpo::CompressionOptions& compression)
+        : compression_policy_(compression) {}
+
+    synxpo::CompressionStats GetCompressionStats() const {
+        return compression_policy_.GetStats();
+    }
+
     // Service implementation will be added here
+
+private:
+    // Handlers call this on their context before the first write; every
+    // write then asks WriteOptionsFor whether its message is compressed
+    void EnableCompression(ServerContext* context) const {
+        if (compression_policy_.GetOptions().algorithm != GRPC_COMPRESS_NONE) {
+            context->set_compression_algorithm(compression_policy_.GetOptions().algorithm);
+        }
+    }
+
+    // Downloads of already compressed files go raw, like the client's uploads
+    grpc::WriteOptions WriteOptionsFor(const synxpo::ServerMessage& message) {
+        std::string_view payload;
+        if (message.has_file_write()) {
+            payload = message.file_write().chunk().data();
+        }
+        return compression_policy_.WriteOptionsFor(message.ByteSizeLong(), payload);
+    }
+
+    grpc::WriteOptions WriteOptionsFor(const synxpo::BulkMessage& message) {
+        std::string_view payload;
+        if (message.has_file_write()) {
+            payload = message.file_write().chunk().data();
+        } else if (message.has_file_delta()) {
+            payload = synxpo::DeltaPayload(message.file_delta());
+        }
+        return compression_policy_.WriteOptionsFor(message.ByteSizeLong(), payload);
+    }
+
+    synxpo::CompressionPolicy compression_policy_;
 };
 
-void RunServer(const std::string& server_address) {
-    SyncServiceImpl service;
+void RunServer(const std::string& server_address, const synxpo::CompressionOptions& compression) {
+    SyncServiceImpl service(compression);
 
+    // No default algorithm: a server default would compress every reply,
+    // including high-entropy file content the policy sends raw
     ServerBuilder builder;
     builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
     builder.RegisterService(&service);
 
     std::unique_ptr<Server> server(builder.BuildAndStart());
     std::cout << "Server listening on " << server_address << std::endl;
+    std::cout << "Compression: " << synxpo::CompressionAlgorithmName(compression.algorithm)
+              << std::endl;
+
+    std::mutex stats_mutex;
+    std::condition_variable stats_cv;
+    bool stopping = false;
+    std::thread stats_reporter([&]() {
+        uint64_t reported = 0;
+        std::unique_lock<std::mutex> lock(stats_mutex);
+        while (!stats_cv.wait_for(lock, kStatsInterval, [&]() { return stopping; })) {
+            auto stats = service.GetCompressionStats();
+            uint64_t messages = stats.compressed_messages + stats.raw_messages;
+            if (messages != reported) {
+                reported = messages;
+                std::cout << "Compression: " << stats.ToString() << std::endl;
+            }
+        }
+    });
 
     server->Wait();
+
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        stopping = true;
+    }
+    stats_cv.notify_all();
+    stats_reporter.join();
 }
 
 int main(int argc, char** argv) {
@@ -34,7 +113,18 @@ int main(int argc, char** argv) {
         server_address = argv[1];
     }
 
-    RunServer(server_address);
+    synxpo::CompressionOptions compression;
+    if (argc > 2) {
+        auto algorithm = synxpo::ParseCompressionAlgorithm(argv[2]);
+        if (!algorithm) {
+            std::cerr << "Unknown compression algorithm: " << argv[2]
+                      << " (expected identity, deflate or gzip)" << std::endl;
+            return 1;
+        }
+        compression.algorithm = *algorithm;
+    }
+
+    RunServer(server_address, compression);
 
     return 0;
 }